@@ -2,13 +2,17 @@
 #include <lwip/netdb.h>
 #include <stdio.h>
 
+#include "argtable3/argtable3.h"
 #include "esp_console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #include "cli_client.h"
+#include "cli_protocol.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
@@ -16,10 +20,51 @@
 static const char *TAG = "cli_client";
 static cli_client_config_t config;
 
-int cli_client(const char *payload)
-{
-    char rx_buffer[128];
+/**
+ * Commands go over one connection to cli_server that stays open, as framed
+ * requests with an id, see cli_protocol.h. The connection is made by the first
+ * command and again by the next one after it broke. A receive task hands the
+ * output of each request to the stream of the task that sent it, so commands
+ * from several tasks, or several from one with cli_client_submit(), can be in
+ * flight at once and nothing waits for a handshake.
+ */
+
+struct cli_client_request_s {
+    bool used;
+    bool done;
+    bool abandoned; // The sender stopped waiting, the receive task frees it
+    uint16_t id;
+    int32_t ret;
+    FILE *out;
+    int64_t sent_us;
+    int64_t done_us;
+    SemaphoreHandle_t done_sem;
+    StaticSemaphore_t done_sem_buffer;
+};
+
+static struct {
+    int sock;
+    uint16_t next_id;
+    SemaphoreHandle_t lock; // The socket, the requests and frames being sent
+    StaticSemaphore_t lock_buffer;
+    TaskHandle_t rx_task;
+    cli_client_request_t requests[CLI_CLIENT_MAX_IN_FLIGHT];
+} s_session = {.sock = -1};
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+static StackType_t rx_task_stack[CLI_CLIENT_RX_TASK_STACK];
+static StaticTask_t rx_task;
+#endif
+
+static struct {
+    struct arg_int *count;
+    struct arg_int *in_flight;
+    struct arg_str *command;
+    struct arg_end *end;
+} bench_args;
 
+static int connect_server(void)
+{
     struct sockaddr_in dest_addr;
     inet_pton(AF_INET, config.server.host, &dest_addr.sin_addr);
     dest_addr.sin_family = AF_INET;
@@ -28,20 +73,34 @@ int cli_client(const char *payload)
     int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
     if (sock < 0) {
         printf("Unable to create socket: errno %d\n", errno);
-        return 1;
+        return -1;
     }
     ESP_LOGI(TAG, "Socket created, connecting to %s:%d", config.server.host, config.server.port);
 
     int err = connect(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
     if (err != 0) {
         printf("Socket unable to connect: errno %d\n", errno);
-        return 2;
+        close(sock);
+        return -1;
     }
     ESP_LOGI(TAG, "Successfully connected");
+    return sock;
+}
+
+// A connection per command, what servers without sessions understand
+static int cli_client_oneshot(const char *payload, FILE *out)
+{
+    char rx_buffer[128];
 
-    err = send(sock, payload, strlen(payload), 0);
+    int sock = connect_server();
+    if (sock < 0) {
+        return 2;
+    }
+
+    int err = send(sock, payload, strlen(payload), 0);
     if (err < 0) {
         printf("Error occurred during sending: errno %d\n", errno);
+        close(sock);
         return 3;
     }
 
@@ -58,16 +117,209 @@ int cli_client(const char *payload)
             res = 4;
             break;
         }
-        fwrite(rx_buffer, len, 1, stdout);
+        if (len == 0) {
+            break;
+        }
+        fwrite(rx_buffer, len, 1, out);
     }
 
-    if (sock != -1) {
-        shutdown(sock, 0);
-        close(sock);
-    }
+    shutdown(sock, 0);
+    close(sock);
     return res;
 }
 
+// Called with the lock held
+static cli_client_request_t *find_request(uint16_t id)
+{
+    for (int i = 0; i < CLI_CLIENT_MAX_IN_FLIGHT; i++) {
+        cli_client_request_t *request = &s_session.requests[i];
+        if (request->used && !request->done && request->id == id) {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+// Called with the lock held
+static void finish_request(cli_client_request_t *request, int32_t ret)
+{
+    request->ret = ret;
+    request->done = true;
+    request->done_us = esp_timer_get_time();
+    if (request->abandoned) {
+        request->used = false;
+    } else {
+        xSemaphoreGive(request->done_sem);
+    }
+}
+
+// Ends every request in flight when the connection broke, the next command connects again
+static void close_session(void)
+{
+    xSemaphoreTake(s_session.lock, portMAX_DELAY);
+    if (s_session.sock >= 0) {
+        shutdown(s_session.sock, 0);
+        close(s_session.sock);
+        s_session.sock = -1;
+    }
+    for (int i = 0; i < CLI_CLIENT_MAX_IN_FLIGHT; i++) {
+        cli_client_request_t *request = &s_session.requests[i];
+        if (request->used && !request->done) {
+            finish_request(request, 4);
+        }
+    }
+    xSemaphoreGive(s_session.lock);
+}
+
+static void rx_task_thread(void *param)
+{
+    char rx_buffer[128];
+    cli_frame_t frame;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int sock = s_session.sock;
+
+        while (cli_recv_all(sock, &frame, sizeof(frame)) == 0 && frame.magic == CLI_FRAME_MAGIC) {
+            uint16_t id = ntohs(frame.id);
+            uint16_t len = ntohs(frame.len);
+
+            if (frame.type == CLI_FRAME_DONE) {
+                int32_t ret = 4;
+                if (len != sizeof(ret) || cli_recv_all(sock, &ret, sizeof(ret)) != 0) {
+                    break;
+                }
+                xSemaphoreTake(s_session.lock, portMAX_DELAY);
+                cli_client_request_t *request = find_request(id);
+                if (request) {
+                    finish_request(request, ntohl(ret));
+                }
+                xSemaphoreGive(s_session.lock);
+                continue;
+            }
+            // Output, passed on in pieces, it can be longer than the buffer. The
+            // lock keeps the stream open while it is written to.
+            while (len > 0) {
+                int n = len < sizeof(rx_buffer) ? len : sizeof(rx_buffer);
+                if (cli_recv_all(sock, rx_buffer, n) != 0) {
+                    break;
+                }
+                xSemaphoreTake(s_session.lock, portMAX_DELAY);
+                cli_client_request_t *request = find_request(id);
+                if (request && request->out) {
+                    fwrite(rx_buffer, n, 1, request->out);
+                }
+                xSemaphoreGive(s_session.lock);
+                len -= n;
+            }
+            if (len > 0) {
+                break;
+            }
+        }
+        ESP_LOGW(TAG, "Session closed");
+        close_session();
+    }
+}
+
+// Called with the lock held
+static esp_err_t open_session(void)
+{
+    if (s_session.sock >= 0) {
+        return ESP_OK;
+    }
+    int sock = connect_server();
+    if (sock < 0) {
+        return ESP_FAIL;
+    }
+    // Requests are small and answered right away, do not hold them back for an ack
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    s_session.sock = sock;
+    xTaskNotifyGive(s_session.rx_task);
+    return ESP_OK;
+}
+
+esp_err_t cli_client_submit(const char *payload, FILE *out, cli_client_request_t **request)
+{
+    size_t len = strlen(payload);
+    cli_client_request_t *free_request = NULL;
+
+    if (len >= CLI_FRAME_MAX_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreTake(s_session.lock, portMAX_DELAY);
+    for (int i = 0; i < CLI_CLIENT_MAX_IN_FLIGHT && !free_request; i++) {
+        if (!s_session.requests[i].used) {
+            free_request = &s_session.requests[i];
+        }
+    }
+    if (!free_request) {
+        xSemaphoreGive(s_session.lock);
+        return ESP_ERR_NO_MEM;
+    }
+    if (open_session() != ESP_OK) {
+        xSemaphoreGive(s_session.lock);
+        return ESP_FAIL;
+    }
+    // 0 is never used, a stale id from a broken session does not match a new request
+    if (++s_session.next_id == 0) {
+        s_session.next_id = 1;
+    }
+    free_request->used = true;
+    free_request->done = false;
+    free_request->abandoned = false;
+    free_request->id = s_session.next_id;
+    free_request->out = out;
+    free_request->sent_us = esp_timer_get_time();
+    xSemaphoreTake(free_request->done_sem, 0);
+    if (cli_send_frame(s_session.sock, CLI_FRAME_REQUEST, free_request->id, payload, len) != 0) {
+        printf("Error occurred during sending: errno %d\n", errno);
+        free_request->used = false;
+        // The receive task sees the connection fail and ends the others
+        shutdown(s_session.sock, SHUT_RDWR);
+        xSemaphoreGive(s_session.lock);
+        return ESP_FAIL;
+    }
+    xSemaphoreGive(s_session.lock);
+    *request = free_request;
+    return ESP_OK;
+}
+
+int cli_client_wait(cli_client_request_t *request, TickType_t timeout, int64_t *latency_us)
+{
+    bool done = xSemaphoreTake(request->done_sem, timeout) == pdTRUE;
+
+    xSemaphoreTake(s_session.lock, portMAX_DELAY);
+    if (!done && !request->done) {
+        // Output and result that still come are dropped
+        request->abandoned = true;
+        request->out = NULL;
+        xSemaphoreGive(s_session.lock);
+        return 5;
+    }
+    int ret = request->ret;
+    if (latency_us) {
+        *latency_us = request->done_us - request->sent_us;
+    }
+    request->used = false;
+    xSemaphoreGive(s_session.lock);
+    return ret;
+}
+
+int cli_client(const char *payload)
+{
+    cli_client_request_t *request;
+
+    esp_err_t err = cli_client_submit(payload, stdout, &request);
+    if (err == ESP_ERR_INVALID_SIZE) {
+        printf("Argument to long, limit %d\n", CLI_FRAME_MAX_PAYLOAD - 1);
+        return 20;
+    } else if (err != ESP_OK) {
+        return 2;
+    }
+    return cli_client_wait(request, portMAX_DELAY, NULL);
+}
+
 static int cmd_cli_client(int argc, char **argv)
 {
     // Concat all argument parts into one string
@@ -86,9 +338,106 @@ static int cmd_cli_client(int argc, char **argv)
     return cli_client(buffer);
 }
 
+static int discard_output(void *c, const char *data, int len)
+{
+    return len;
+}
+
+static void bench_print(const char *name, int count, int64_t elapsed_us, int64_t latency_sum_us, int64_t latency_max_us, int errors)
+{
+    printf("%-18s %6d %9u.%u %9u.%u %9u.%u %6d\n", name, count, (uint32_t)(count * 10000000LL / elapsed_us) / 10,
+           (uint32_t)(count * 10000000LL / elapsed_us) % 10, (uint32_t)(latency_sum_us / count / 1000), (uint32_t)(latency_sum_us / count / 100 % 10),
+           (uint32_t)(latency_max_us / 1000), (uint32_t)(latency_max_us / 100 % 10), errors);
+}
+
+/**
+ * Runs the same command count times, a connection per command as before
+ * sessions, then on the session one at a time and with in_flight requests
+ * sent ahead, and prints commands per second and the latency from sending a
+ * command to its result.
+ */
+static int cmd_cli_bench(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, bench_args.end, argv[0]);
+        return 1;
+    }
+    int count = bench_args.count->count ? bench_args.count->ival[0] : 20;
+    int in_flight = bench_args.in_flight->count ? bench_args.in_flight->ival[0] : 4;
+    const char *command = bench_args.command->count ? bench_args.command->sval[0] : "free";
+    if (count < 1 || in_flight < 1 || in_flight > CLI_CLIENT_MAX_IN_FLIGHT) {
+        printf("Count must be positive and in flight 1 to %d\n", CLI_CLIENT_MAX_IN_FLIGHT);
+        return 1;
+    }
+
+    FILE *out = funopen(NULL, NULL, &discard_output, NULL, NULL);
+    int64_t sum_us = 0, max_us = 0;
+    int errors = 0;
+
+    printf("'%s' on %s:%d\n", command, config.server.host, config.server.port);
+    printf("%-18s %6s %11s %11s %11s %6s\n", "", "count", "cmds/s", "avg ms", "max ms", "errors");
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < count; i++) {
+        int64_t sent = esp_timer_get_time();
+        errors += cli_client_oneshot(command, out) != 0;
+        int64_t latency = esp_timer_get_time() - sent;
+        sum_us += latency;
+        max_us = latency > max_us ? latency : max_us;
+    }
+    bench_print("connection each", count, esp_timer_get_time() - start, sum_us, max_us, errors);
+
+    const int depths[2] = {1, in_flight};
+    for (int d = 0; d < (in_flight > 1 ? 2 : 1); d++) {
+        cli_client_request_t *requests[CLI_CLIENT_MAX_IN_FLIGHT];
+        int depth = depths[d];
+        int sent = 0, received = 0;
+        char name[24];
+
+        sum_us = max_us = 0;
+        errors = 0;
+        start = esp_timer_get_time();
+        while (received < count) {
+            // Keep depth requests in flight, wait for the oldest
+            while (sent < count && sent - received < depth) {
+                if (cli_client_submit(command, out, &requests[sent % depth]) != ESP_OK) {
+                    break;
+                }
+                sent++;
+            }
+            if (sent == received) {
+                errors += count - received;
+                break;
+            }
+            int64_t latency = 0;
+            errors += cli_client_wait(requests[received % depth], pdMS_TO_TICKS(CLI_CLIENT_BENCH_TIMEOUT_MS), &latency) != 0;
+            sum_us += latency;
+            max_us = latency > max_us ? latency : max_us;
+            received++;
+        }
+        snprintf(name, sizeof(name), "session, %d ahead", depth);
+        bench_print(name, count, esp_timer_get_time() - start, sum_us, max_us, errors);
+    }
+    fclose(out);
+    return 0;
+}
+
 esp_err_t cli_client_init(const cli_client_config_t *_config)
 {
     config = *_config;
+    s_session.lock = xSemaphoreCreateMutexStatic(&s_session.lock_buffer);
+    for (int i = 0; i < CLI_CLIENT_MAX_IN_FLIGHT; i++) {
+        s_session.requests[i].done_sem = xSemaphoreCreateBinaryStatic(&s_session.requests[i].done_sem_buffer);
+    }
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    s_session.rx_task = xTaskCreateStatic(rx_task_thread, "cli_client_rx", CLI_CLIENT_RX_TASK_STACK, NULL, CLI_CLIENT_RX_TASK_PRIO, rx_task_stack, &rx_task);
+    assert(s_session.rx_task);
+#else
+    BaseType_t ret = xTaskCreate(rx_task_thread, "cli_client_rx", CLI_CLIENT_RX_TASK_STACK, NULL, CLI_CLIENT_RX_TASK_PRIO, &s_session.rx_task);
+    assert(ret == pdTRUE);
+#endif
+
     const esp_console_cmd_t cli_client_cmd = {
         .command = config.client.cmd,
         .help = "Run cli client command",
@@ -97,5 +446,18 @@ esp_err_t cli_client_init(const cli_client_config_t *_config)
     };
     ESP_ERROR_CHECK(esp_console_cmd_register(&cli_client_cmd));
 
+    bench_args.count = arg_int0("n", "count", "<n>", "Commands per run, default 20");
+    bench_args.in_flight = arg_int0("j", "in-flight", "<n>", "Requests sent ahead on the session, default 4");
+    bench_args.command = arg_str0("c", "command", "<cmd>", "Command to run on the server, default free");
+    bench_args.end = arg_end(2);
+    const esp_console_cmd_t cli_bench_cmd = {
+        .command = "cli_bench",
+        .help = "Measure commands per second and latency to the cli server, a connection per command and on a session",
+        .hint = NULL,
+        .func = &cmd_cli_bench,
+        .argtable = &bench_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cli_bench_cmd));
+
     return ESP_OK;
 }
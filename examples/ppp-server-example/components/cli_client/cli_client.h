@@ -1,7 +1,10 @@
 #ifndef __CLI_CLIENT_H_
 #define __CLI_CLIENT_H_
 
+#include <stdio.h>
+
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 
 struct cli_client_config_s {
     struct {
@@ -30,6 +33,24 @@ struct cli_client_config_s {
 
 typedef struct cli_client_config_s cli_client_config_t;
 
+// Requests that can wait for their result at once, over all tasks
+#define CLI_CLIENT_MAX_IN_FLIGHT 8
+// Task that receives the output of the session, its stack is static with CONFIG_PPP_LINK_STATIC_ALLOCATION
+#define CLI_CLIENT_RX_TASK_STACK (3 * 1024)
+#define CLI_CLIENT_RX_TASK_PRIO 5
+#define CLI_CLIENT_BENCH_TIMEOUT_MS 10000
+
+typedef struct cli_client_request_s cli_client_request_t;
+
 esp_err_t cli_client_init(const cli_client_config_t *cli_client_config);
 
+// Runs a command on the server, its output goes to stdout, returns its result or a local error
+int cli_client(const char *payload);
+
+// Sends a command on the session without waiting, its output is written to out as it arrives
+esp_err_t cli_client_submit(const char *payload, FILE *out, cli_client_request_t **request);
+
+// Waits for a submitted command, returns its result and frees the request, latency_us may be NULL
+int cli_client_wait(cli_client_request_t *request, TickType_t timeout, int64_t *latency_us);
+
 #endif /* __CLI_CLIENT_H_ */
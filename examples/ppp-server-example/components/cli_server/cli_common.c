@@ -5,6 +5,11 @@
 #include "esp_console.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+
+#include "cli_protocol.h"
 
 static void sanitize(char *src)
 {
@@ -18,7 +23,7 @@ static void sanitize(char *src)
     *dst = 0;
 }
 
-int run_multiple_commands(char *command_line, bool pre_print_command)
+int run_multiple_commands(char *command_line, bool pre_print_command, SemaphoreHandle_t console_lock)
 {
     char *saveptr = NULL;
     char *token = strtok_r(command_line, ";", &saveptr);
@@ -30,7 +35,16 @@ int run_multiple_commands(char *command_line, bool pre_print_command)
         if (pre_print_command)
             printf("esp32> %s\n", token);
 
+        // Another session runs a command, say so instead of going silent
+        if (console_lock && xSemaphoreTake(console_lock, 0) != pdTRUE) {
+            printf("Waiting for a command of another session\n");
+            fflush(stdout);
+            xSemaphoreTake(console_lock, portMAX_DELAY);
+        }
         esp_err_t err = esp_console_run(token, &ret);
+        if (console_lock) {
+            xSemaphoreGive(console_lock);
+        }
         if (err == ESP_ERR_NOT_FOUND) {
             printf("Unrecognized command '%s'\n", token);
             return err;
@@ -38,7 +52,7 @@ int run_multiple_commands(char *command_line, bool pre_print_command)
             // command was empty
         } else if (err == ESP_OK && ret != ESP_OK) {
             printf("Command '%s' returned non-zero error code: 0x%x (%s)\n", token, ret, esp_err_to_name(ret));
-            return err;
+            return ret;
         } else if (err != ESP_OK) {
             printf("Command '%s' Internal error: %s\n", token, esp_err_to_name(err));
             return err;
@@ -48,4 +62,50 @@ int run_multiple_commands(char *command_line, bool pre_print_command)
         token = strtok_r(NULL, ";", &saveptr);
     }
     return 0;
-}
\ No newline at end of file
+}
+
+static int cli_send_all(int sock, const void *data, size_t len, int flags)
+{
+    const uint8_t *p = data;
+    // send() can return less bytes than supplied length
+    while (len > 0) {
+        int written = send(sock, p, len, flags);
+        if (written < 0) {
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int cli_send_frame(int sock, uint8_t type, uint16_t id, const void *payload, size_t len)
+{
+    cli_frame_t frame = {
+        .magic = CLI_FRAME_MAGIC,
+        .type = type,
+        .id = htons(id),
+        .len = htons(len),
+    };
+
+    // The header waits for the payload, a frame goes out in one segment where it fits
+    if (cli_send_all(sock, &frame, sizeof(frame), len ? MSG_MORE : 0) != 0) {
+        return -1;
+    }
+    return len ? cli_send_all(sock, payload, len, 0) : 0;
+}
+
+int cli_recv_all(int sock, void *buffer, size_t len)
+{
+    uint8_t *p = buffer;
+
+    while (len > 0) {
+        int n = recv(sock, p, len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
-
-int run_multiple_commands(char *command_line, bool pre_print_command);
\ No newline at end of file
+// Runs the commands of a line separated by ';', each with console_lock held when it is not NULL
+int run_multiple_commands(char *command_line, bool pre_print_command, SemaphoreHandle_t console_lock);
@@ -0,0 +1,37 @@
+#ifndef __CLI_PROTOCOL_H_
+#define __CLI_PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A session is one TCP connection that stays open for many commands. Every
+ * message is a frame: this header in network byte order and len bytes of
+ * payload. The client sends a request with the command line and an id of its
+ * choice, the server answers with output frames and a done frame carrying the
+ * same id, so several requests can be in flight and their output told apart.
+ * A connection that does not start with CLI_FRAME_MAGIC is the old one command
+ * per connection protocol: the command line, answered with the output and a
+ * close.
+ */
+
+#define CLI_FRAME_MAGIC 0xc1 // Not printable, a plain command line never starts with it
+#define CLI_FRAME_REQUEST 1  // Command line, client to server
+#define CLI_FRAME_OUTPUT 2   // Output of the command with the id
+#define CLI_FRAME_DONE 3     // The command ended, the payload is its int32_t result
+#define CLI_FRAME_MAX_PAYLOAD 1024
+
+typedef struct {
+    uint8_t magic;
+    uint8_t type;
+    uint16_t id;
+    uint16_t len;
+} cli_frame_t;
+
+// Sends a frame with its payload, returns 0 or -1 when the connection failed
+int cli_send_frame(int sock, uint8_t type, uint16_t id, const void *payload, size_t len);
+
+// Receives exactly len bytes, returns 0 or -1 when the connection closed or failed
+int cli_recv_all(int sock, void *buffer, size_t len);
+
+#endif /* __CLI_PROTOCOL_H_ */
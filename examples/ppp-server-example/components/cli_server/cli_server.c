@@ -1,12 +1,18 @@
 #include <assert.h>
 #include <lwip/netdb.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "esp_console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #include "cli_common.h"
+#include "cli_protocol.h"
 #include "cli_server.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -15,9 +21,56 @@
 static const char *TAG = "cli_server";
 static cli_server_config_t config;
 
-static int console_printf(void *c, const char *data, int len)
+/**
+ * A listener task accepts connections and hands each to an idle worker of a
+ * pool of config.server.max_sessions, a slow command in one session leaves
+ * the others served. A worker points the stdout and stderr of its own task at
+ * the connection for as long as the session lasts, newlib keeps them per task,
+ * so output of one session never ends up in another. esp_console_run() parses
+ * every command line into one shared buffer and the commands keep their
+ * arguments in static argtables, so commands themselves run one at a time
+ * under the console lock, a chain of commands takes it per command.
+ */
+
+typedef struct {
+    TaskHandle_t task;
+    int sock;           // -1 while the worker is idle
+    bool framed;        // A session of cli_protocol.h, else one plain command line
+    uint16_t request_id; // Of the request whose output is being written
+    uint32_t number;    // Session number since the server started
+    char peer[16];
+    int64_t start_us;
+    uint32_t commands;
+    uint32_t failed;
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    int64_t busy_us;    // Spent in commands, waiting for the console lock included
+    char last[32];      // Last command line, cut to fit
+} cli_session_t;
+
+static struct {
+    cli_session_t *sessions;
+    int num_sessions;
+    SemaphoreHandle_t idle; // Counts idle workers
+    StaticSemaphore_t idle_buffer;
+    SemaphoreHandle_t console_lock;
+    StaticSemaphore_t console_lock_buffer;
+    portMUX_TYPE lock; // Hand over of connections to workers
+    uint32_t accepted;
+    uint32_t turned_away;
+    uint32_t commands;
+} s_server = {.lock = portMUX_INITIALIZER_UNLOCKED};
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+static StackType_t listen_task_stack[CLI_SERVER_LISTEN_STACK_SIZE];
+static StaticTask_t listen_task;
+static StackType_t worker_stacks[CLI_SERVER_STATIC_SESSIONS][CLI_SERVER_STATIC_STACK_SIZE];
+static StaticTask_t worker_tasks[CLI_SERVER_STATIC_SESSIONS];
+static cli_session_t static_sessions[CLI_SERVER_STATIC_SESSIONS];
+#endif
+
+static int send_all(int sock, const char *data, int len)
 {
-    int sock = (int)c;
     // send() can return less bytes than supplied length.
     // Walk-around for robust implementation.
     int to_write = len;
@@ -26,19 +79,62 @@ static int console_printf(void *c, const char *data, int len)
         if (written < 0) {
             ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
             // Failed to retransmit, giving up
-            return 0;
+            return -1;
         }
         to_write -= written;
     }
+    return 0;
+}
+
+// Stdout of the worker task during a session, framed with the id of the running request in a session
+static int session_printf(void *c, const char *data, int len)
+{
+    cli_session_t *session = c;
+    int left = len;
+
+    if (!session->framed) {
+        if (send_all(session->sock, data, len) != 0) {
+            return 0;
+        }
+        session->bytes_out += len;
+        return len;
+    }
+    while (left > 0) {
+        int n = left < CLI_FRAME_MAX_PAYLOAD ? left : CLI_FRAME_MAX_PAYLOAD;
+        if (cli_send_frame(session->sock, CLI_FRAME_OUTPUT, session->request_id, data + (len - left), n) != 0) {
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return 0;
+        }
+        session->bytes_out += sizeof(cli_frame_t) + n;
+        left -= n;
+    }
     return len;
 }
 
-static void cli_server_run(const int sock)
+// Runs a command line of the session, its output goes to the stdout of this worker
+static int cli_server_exec(cli_session_t *session, char *command_line)
+{
+    int64_t start = esp_timer_get_time();
+
+    strlcpy(session->last, command_line, sizeof(session->last));
+    // Run multiple command is a hack, to chain multiple commands with ';'
+    int ret = run_multiple_commands(command_line, true, s_server.console_lock);
+    fflush(stdout);
+    fflush(stderr);
+    session->busy_us += esp_timer_get_time() - start;
+    session->commands++;
+    session->failed += ret != 0;
+    s_server.commands++;
+    return ret;
+}
+
+// One command line, answered with its output and a close
+static void cli_server_run(cli_session_t *session)
 {
     int len;
     char rx_buffer[config.server.max_arg_len];
 
-    len = recv(sock, rx_buffer, config.server.max_arg_len - 1, 0);
+    len = recv(session->sock, rx_buffer, config.server.max_arg_len - 1, 0);
     if (len < 0) {
         ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
         return;
@@ -48,23 +144,112 @@ static void cli_server_run(const int sock)
     }
 
     rx_buffer[len] = 0; // Null-terminate whatever is received and treat it like a string
+    session->bytes_in += len;
     ESP_LOGD(TAG, "Received cmd line of %d bytes: '%s'", len, rx_buffer);
 
+    cli_server_exec(session, rx_buffer);
+}
+
+// Requests of a session run one after the other until the client closes, see cli_protocol.h
+static void cli_server_session(cli_session_t *session)
+{
+    char rx_buffer[config.server.max_arg_len];
+    cli_frame_t frame;
+
+    while (cli_recv_all(session->sock, &frame, sizeof(frame)) == 0) {
+        uint16_t len = ntohs(frame.len);
+
+        if (frame.magic != CLI_FRAME_MAGIC || frame.type != CLI_FRAME_REQUEST || len >= sizeof(rx_buffer)) {
+            ESP_LOGE(TAG, "Bad request frame, type %d, %d bytes", frame.type, len);
+            return;
+        }
+        if (cli_recv_all(session->sock, rx_buffer, len) != 0) {
+            break;
+        }
+        rx_buffer[len] = 0;
+        session->bytes_in += sizeof(frame) + len;
+        session->request_id = ntohs(frame.id);
+        ESP_LOGD(TAG, "Request %d: '%s'", session->request_id, rx_buffer);
+
+        int32_t ret = htonl(cli_server_exec(session, rx_buffer));
+        if (cli_send_frame(session->sock, CLI_FRAME_DONE, session->request_id, &ret, sizeof(ret)) != 0) {
+            break;
+        }
+        session->bytes_out += sizeof(frame) + sizeof(ret);
+    }
+    ESP_LOGD(TAG, "Session closed");
+}
+
+static void cli_worker_thread(void *param)
+{
+    cli_session_t *session = param;
     FILE *orig_stdout = __getreent()->_stdout;
     FILE *orig_stderr = __getreent()->_stderr;
 
-    FILE *stdout_console = funopen((void *)sock, NULL, &console_printf, NULL, NULL);
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-    __getreent()->_stdout = stdout_console;
-    __getreent()->_stderr = stdout_console;
+        // A session starts with a frame, anything else is a plain command line
+        uint8_t first;
+        session->framed = recv(session->sock, &first, 1, MSG_PEEK) == 1 && first == CLI_FRAME_MAGIC;
+        if (session->framed) {
+            int nodelay = 1;
+            setsockopt(session->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+        FILE *out = funopen(session, NULL, &session_printf, NULL, NULL);
+        __getreent()->_stdout = out;
+        __getreent()->_stderr = out;
 
-    // Run multiple command is a hack, to chain multiple commands with ';'
-    run_multiple_commands(rx_buffer, true);
+        if (session->framed) {
+            cli_server_session(session);
+        } else {
+            cli_server_run(session);
+        }
+
+        __getreent()->_stdout = orig_stdout;
+        __getreent()->_stderr = orig_stderr;
+        fclose(out);
+        shutdown(session->sock, 0);
+        close(session->sock);
+        portENTER_CRITICAL(&s_server.lock);
+        session->sock = -1;
+        portEXIT_CRITICAL(&s_server.lock);
+        xSemaphoreGive(s_server.idle);
+    }
+}
+
+// Gives the connection to an idle worker, or turns it away when all stay busy
+static void cli_server_dispatch(int sock, const struct sockaddr_storage *source_addr)
+{
+    if (xSemaphoreTake(s_server.idle, pdMS_TO_TICKS(CLI_SERVER_BUSY_WAIT_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "All %d sessions busy, connection closed", s_server.num_sessions);
+        s_server.turned_away++;
+        shutdown(sock, 0);
+        close(sock);
+        return;
+    }
+    cli_session_t *session = NULL;
+    portENTER_CRITICAL(&s_server.lock);
+    for (int i = 0; i < s_server.num_sessions && !session; i++) {
+        if (s_server.sessions[i].sock < 0) {
+            session = &s_server.sessions[i];
+            session->sock = sock;
+        }
+    }
+    portEXIT_CRITICAL(&s_server.lock);
+    assert(session);
 
-    fflush(stdout_console);
-    __getreent()->_stdout = orig_stdout;
-    __getreent()->_stderr = orig_stderr;
-    fclose(stdout_console);
+    TaskHandle_t task = session->task;
+    memset(session, 0, sizeof(*session));
+    session->task = task;
+    session->sock = sock;
+    session->number = ++s_server.accepted;
+    session->start_us = esp_timer_get_time();
+    if (source_addr->ss_family == PF_INET) {
+        inet_ntoa_r(((struct sockaddr_in *)source_addr)->sin_addr, session->peer, sizeof(session->peer));
+    }
+    ESP_LOGD(TAG, "Socket accepted ip address: %s", session->peer);
+    xTaskNotifyGive(session->task);
 }
 
 static void cli_task_thread(void *param)
@@ -96,7 +281,7 @@ static void cli_task_thread(void *param)
     }
     ESP_LOGD(TAG, "Socket bound, port %d", config.server.port);
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, s_server.num_sessions);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
@@ -110,20 +295,7 @@ static void cli_task_thread(void *param)
             ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
             break;
         }
-
-        // Convert ip address to string
-        {
-            char addr_str[128];
-            if (source_addr.ss_family == PF_INET) {
-                inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
-            }
-            ESP_LOGD(TAG, "Socket accepted ip address: %s", addr_str);
-        }
-
-        cli_server_run(sock);
-
-        shutdown(sock, 0);
-        close(sock);
+        cli_server_dispatch(sock, &source_addr);
     }
 
 CLEAN_UP:
@@ -131,12 +303,81 @@ CLEAN_UP:
     vTaskDelete(NULL);
 }
 
+static int cmd_cli_sessions(int argc, char **argv)
+{
+    int64_t now = esp_timer_get_time();
+    int busy = 0;
+
+    printf("%5s %-15s %7s %6s %6s %9s %9s %9s  %s\n", "#", "peer", "age s", "cmds", "failed", "in B", "out B", "busy ms", "last");
+    for (int i = 0; i < s_server.num_sessions; i++) {
+        const cli_session_t *session = &s_server.sessions[i];
+        if (session->sock < 0) {
+            continue;
+        }
+        busy++;
+        printf("%5u %-15s %7u %6u %6u %9u %9u %9u  %s%s\n", session->number, session->peer, (uint32_t)((now - session->start_us) / 1000000),
+               session->commands, session->failed, session->bytes_in, session->bytes_out, (uint32_t)(session->busy_us / 1000), session->last,
+               session->task == xTaskGetCurrentTaskHandle() ? " (this one)" : "");
+    }
+    printf("%d of %d sessions busy, %u served, %u turned away, %u commands\n", busy, s_server.num_sessions, s_server.accepted, s_server.turned_away,
+           s_server.commands);
+    return 0;
+}
+
 esp_err_t cli_server_init(const cli_server_config_t *_config)
 {
+    if (s_server.sessions) {
+        ESP_LOGW(TAG, "Already running");
+        return ESP_ERR_INVALID_STATE;
+    }
     config = *_config;
+    s_server.num_sessions = config.server.max_sessions > 0 ? config.server.max_sessions : 1;
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    if (config.task.stack_size > CLI_SERVER_STATIC_STACK_SIZE || s_server.num_sessions > CLI_SERVER_STATIC_SESSIONS) {
+        ESP_LOGE(TAG, "Stack size %d or %d sessions exceed CLI_SERVER_STATIC_STACK_SIZE or CLI_SERVER_STATIC_SESSIONS", config.task.stack_size,
+                 s_server.num_sessions);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    s_server.sessions = static_sessions;
+#else
+    s_server.sessions = calloc(s_server.num_sessions, sizeof(cli_session_t));
+    if (!s_server.sessions) {
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    s_server.idle = xSemaphoreCreateCountingStatic(s_server.num_sessions, s_server.num_sessions, &s_server.idle_buffer);
+    s_server.console_lock = xSemaphoreCreateMutexStatic(&s_server.console_lock_buffer);
+
+    for (int i = 0; i < s_server.num_sessions; i++) {
+        cli_session_t *session = &s_server.sessions[i];
+        session->sock = -1;
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+        session->task = xTaskCreateStatic(cli_worker_thread, "cli_session", config.task.stack_size, session, config.task.prio, worker_stacks[i],
+                                          &worker_tasks[i]);
+        assert(session->task);
+#else
+        BaseType_t ret = xTaskCreate(cli_worker_thread, "cli_session", config.task.stack_size, session, config.task.prio, &session->task);
+        assert(ret == pdTRUE);
+#endif
+    }
 
-    BaseType_t ret = xTaskCreate(cli_task_thread, "cli_server_task", config.task.stack_size, NULL, config.task.prio, NULL);
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    TaskHandle_t task = xTaskCreateStatic(cli_task_thread, "cli_server_task", CLI_SERVER_LISTEN_STACK_SIZE, NULL, config.task.prio, listen_task_stack,
+                                          &listen_task);
+    assert(task);
+#else
+    BaseType_t ret = xTaskCreate(cli_task_thread, "cli_server_task", CLI_SERVER_LISTEN_STACK_SIZE, NULL, config.task.prio, NULL);
     assert(ret == pdTRUE);
+#endif
+
+    const esp_console_cmd_t sessions_cmd = {
+        .command = "cli_sessions",
+        .help = "Show the sessions of the cli server and what they ran",
+        .hint = NULL,
+        .func = &cmd_cli_sessions,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&sessions_cmd));
 
     return ESP_OK;
 }
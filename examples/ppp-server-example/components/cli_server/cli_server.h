@@ -11,6 +11,7 @@ struct cli_server_config_s {
     struct {
         int port;
         int max_arg_len;
+        int max_sessions; // Connections served at once, each by a worker task of task.stack_size
     } server;
 };
 
@@ -23,6 +24,7 @@ struct cli_server_config_s {
     .server = {                       \
         .port = 1000,                 \
         .max_arg_len = 1024,          \
+        .max_sessions = 3,            \
     }                                 \
   };
 
@@ -30,6 +32,15 @@ struct cli_server_config_s {
 
 typedef struct cli_server_config_s cli_server_config_t;
 
+// Task stack reserved with CONFIG_PPP_LINK_STATIC_ALLOCATION, task.stack_size must not exceed it
+#define CLI_SERVER_STATIC_STACK_SIZE (5 * 1024)
+// Workers reserved with CONFIG_PPP_LINK_STATIC_ALLOCATION, server.max_sessions must not exceed it
+#define CLI_SERVER_STATIC_SESSIONS 3
+// The task accepting connections, the commands run in the workers
+#define CLI_SERVER_LISTEN_STACK_SIZE (2 * 1024)
+// A connection waits this long for a worker to get idle before it is closed
+#define CLI_SERVER_BUSY_WAIT_MS 2000
+
 esp_err_t cli_server_init(const cli_server_config_t *cli_server_config);
 
 #endif /* __CLI_SERVER_H_ */
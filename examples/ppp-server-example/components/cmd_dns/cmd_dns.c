@@ -0,0 +1,97 @@
+/* Console example — DNS forwarder commands
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "cmd_dns.h"
+#include "dns_forwarder.h"
+
+/* "dns" command */
+
+// The ppp server address of this example, answered on unless -l says otherwise
+#define DNS_DEFAULT_LISTEN "10.10.0.1"
+
+static struct {
+    struct arg_lit *start;
+    struct arg_str *upstream;
+    struct arg_str *listen;
+    struct arg_lit *flush;
+    struct arg_lit *abort;
+    struct arg_end *end;
+} dns_args;
+
+static void dns_print_report(const dns_forwarder_report_t *report)
+{
+    printf("dns: %s, %u queries, %u hits (%u%%), %u forwarded, %u timeouts, %u dropped\n", report->running ? "running" : "stopped", report->queries,
+           report->hits, report->queries ? report->hits * 100 / report->queries : 0, report->misses, report->timeouts, report->dropped);
+    printf("cache: %u of %d entries, %u answers not cached, %u to another question dropped\n", report->entries, DNS_FORWARDER_CACHE_ENTRIES,
+           report->not_cached, report->mismatched);
+    printf("latency: hit avg %u us max %u us, forwarded avg %u ms max %u ms\n", report->hit_avg_us, report->hit_max_us, report->miss_avg_us / 1000,
+           report->miss_max_us / 1000);
+}
+
+static int cmd_dns(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&dns_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, dns_args.end, argv[0]);
+        return 1;
+    }
+
+    /* dns -a */
+    if (dns_args.abort->count) {
+        dns_forwarder_stop();
+        return 0;
+    }
+
+    /* dns -f */
+    if (dns_args.flush->count) {
+        return dns_forwarder_flush() == ESP_OK ? 0 : 1;
+    }
+
+    /* dns -s [-u upstream] [-l listen] */
+    if (dns_args.start->count) {
+        dns_forwarder_cfg_t cfg = {
+            .port = DNS_FORWARDER_PORT,
+        };
+        cfg.listen.addr = esp_ip4addr_aton(dns_args.listen->count ? dns_args.listen->sval[0] : DNS_DEFAULT_LISTEN);
+        if (dns_args.upstream->count) {
+            cfg.upstream.addr = esp_ip4addr_aton(dns_args.upstream->sval[0]);
+        }
+        if (dns_forwarder_start(&cfg) != ESP_OK) {
+            return 1;
+        }
+        return 0;
+    }
+
+    dns_forwarder_report_t report;
+    dns_forwarder_get_report(&report);
+    dns_print_report(&report);
+    return 0;
+}
+
+void register_dns(void)
+{
+    dns_args.start = arg_lit0("s", "start", "answer dns queries, the ppp server starts this on its own");
+    dns_args.upstream = arg_str0("u", "upstream", "<ip>", "upstream server, default the dns server of the default interface");
+    dns_args.listen = arg_str0("l", "listen", "<ip>", "address to answer on, default " DNS_DEFAULT_LISTEN ", only ppp clients reach it");
+    dns_args.flush = arg_lit0("f", "flush", "forget all cached answers");
+    dns_args.abort = arg_lit0("a", "abort", "stop answering");
+    dns_args.end = arg_end(1);
+    const esp_console_cmd_t dns_cmd = {
+        .command = "dns",
+        .help = "Caching dns forwarder, without arguments show hit rate and latency",
+        .hint = NULL,
+        .func = &cmd_dns,
+        .argtable = &dns_args
+    };
+
+    ESP_ERROR_CHECK(esp_console_cmd_register(&dns_cmd));
+}
@@ -0,0 +1,20 @@
+/* Console example — DNS forwarder commands
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register DNS forwarder functions
+void register_dns(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,6 +7,7 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
@@ -30,11 +31,61 @@ static struct {
     struct arg_int *length;
     struct arg_int *interval;
     struct arg_int *time;
-    struct arg_int *bw_limit;
+    struct arg_str *bw_limit;
+    struct arg_int *burst;
+    struct arg_int *parallel;
+    struct arg_lit *reverse;
+    struct arg_lit *duplex;
+    struct arg_lit *json;
+    struct arg_lit *incompressible;
+    struct arg_lit *nodelay;
+    struct arg_int *window;
+    struct arg_int *sndbuf;
+    struct arg_int *rcvbuf;
+    struct arg_int *mss;
+    struct arg_str *sweep;
+    struct arg_int *line_rate;
     struct arg_lit *abort;
     struct arg_end *end;
 } iperf_args;
 
+// The iperf task reads the address after the command has returned and its arguments are gone
+static char destination_ip6[48];
+
+// Mbits/sec, or kbits/sec with a k suffix, to pace links slower than 1 Mbit/s
+static int32_t parse_bandwidth_kbps(const char *arg)
+{
+    char *end;
+    double rate = strtod(arg, &end);
+
+    if (*end == 'k' || *end == 'K') {
+        return rate;
+    }
+    return rate * 1000;
+}
+
+// Comma separated datagram lengths, or "default" for 16 bytes up to a full datagram at the usual MTU
+static int parse_sweep(const char *arg, iperf_cfg_t *cfg)
+{
+    static const uint16_t default_lens[] = {16, 32, 64, 128, 256, 512, 1024, 1472};
+
+    if (strcmp(arg, "default") == 0) {
+        memcpy(cfg->sweep_lens, default_lens, sizeof(default_lens));
+        cfg->sweep_count = sizeof(default_lens) / sizeof(default_lens[0]);
+        return 0;
+    }
+    while (*arg) {
+        char *end;
+        long len = strtol(arg, &end, 10);
+        if (end == arg || len < 16 || len > 0xffff || cfg->sweep_count >= IPERF_SWEEP_MAX_LENS || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        cfg->sweep_lens[cfg->sweep_count++] = len;
+        arg = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
 static int eth_cmd_iperf(int argc, char **argv)
 {
     int nerrors = arg_parse(argc, argv, (void **)&iperf_args);
@@ -47,8 +98,8 @@ static int eth_cmd_iperf(int argc, char **argv)
 
     memset(&cfg, 0, sizeof(cfg));
 
-    // ethernet iperf only support IPV4 address
-    cfg.type = IPERF_IP_TYPE_IPV4;
+    /* iperf -V */
+    cfg.type = iperf_args.version->count ? IPERF_IP_TYPE_IPV6 : IPERF_IP_TYPE_IPV4;
 
     /* iperf -a */
     if (iperf_args.abort->count != 0) {
@@ -62,14 +113,21 @@ static int eth_cmd_iperf(int argc, char **argv)
         return 0;
     }
 
-    /* iperf -s */
+    /* iperf -s, an IPv6 server listens on any address */
     if (iperf_args.server->count > 0) {
         cfg.flag |= IPERF_FLAG_SERVER;
-        cfg.source_ip4 = esp_ip4addr_aton(iperf_args.server->sval[0]);
+        if (cfg.type == IPERF_IP_TYPE_IPV4) {
+            cfg.source_ip4 = esp_ip4addr_aton(iperf_args.server->sval[0]);
+        }
     }
     /* iperf -c SERVER_ADDRESS */
     else if (iperf_args.ip->count > 0) {
-        cfg.destination_ip4 = esp_ip4addr_aton(iperf_args.ip->sval[0]);
+        if (cfg.type == IPERF_IP_TYPE_IPV6) {
+            strlcpy(destination_ip6, iperf_args.ip->sval[0], sizeof(destination_ip6));
+            cfg.destination_ip6 = destination_ip6;
+        } else {
+            cfg.destination_ip4 = esp_ip4addr_aton(iperf_args.ip->sval[0]);
+        }
         cfg.flag |= IPERF_FLAG_CLIENT;
     } else {
         ESP_LOGE(__func__, "Please speficy server or client");
@@ -113,9 +171,45 @@ static int eth_cmd_iperf(int argc, char **argv)
         }
     }
 
+    /* iperf --incompressible */
+    if (iperf_args.incompressible->count) {
+        cfg.flag |= IPERF_FLAG_INCOMPRESSIBLE;
+    }
+
+    /* iperf -N */
+    if (iperf_args.nodelay->count) {
+        cfg.flag |= IPERF_FLAG_NODELAY;
+    }
+
+    /* iperf -w, --sndbuf, --rcvbuf */
+    if (iperf_args.window->count && iperf_args.window->ival[0] > 0) {
+        cfg.sndbuf = iperf_args.window->ival[0];
+        cfg.rcvbuf = iperf_args.window->ival[0];
+    }
+    if (iperf_args.sndbuf->count && iperf_args.sndbuf->ival[0] > 0) {
+        cfg.sndbuf = iperf_args.sndbuf->ival[0];
+    }
+    if (iperf_args.rcvbuf->count && iperf_args.rcvbuf->ival[0] > 0) {
+        cfg.rcvbuf = iperf_args.rcvbuf->ival[0];
+    }
+
+    /* iperf -M */
+    if (iperf_args.mss->count && iperf_args.mss->ival[0] > 0) {
+        cfg.mss = iperf_args.mss->ival[0];
+    }
+
+    /* iperf --sweep */
+    if (iperf_args.sweep->count && parse_sweep(iperf_args.sweep->sval[0], &cfg) != 0) {
+        ESP_LOGE(__func__, "Sweep takes up to %d lengths of 16 bytes or more, comma separated", IPERF_SWEEP_MAX_LENS);
+        return 0;
+    }
+    if (iperf_args.line_rate->count) {
+        cfg.line_rate_bps = iperf_args.line_rate->ival[0];
+    }
+
     /* iperf -t */
     if (iperf_args.time->count == 0) {
-        cfg.time = IPERF_DEFAULT_TIME;
+        cfg.time = cfg.sweep_count ? IPERF_DEFAULT_SWEEP_TIME : IPERF_DEFAULT_TIME;
     } else {
         cfg.time = iperf_args.time->ival[0];
         if (cfg.time <= cfg.interval) {
@@ -125,14 +219,52 @@ static int eth_cmd_iperf(int argc, char **argv)
 
     /* iperf -b */
     if (iperf_args.bw_limit->count == 0) {
-        cfg.bw_lim = IPERF_DEFAULT_NO_BW_LIMIT;
+        cfg.bw_lim_kbps = IPERF_DEFAULT_NO_BW_LIMIT;
     } else {
-        cfg.bw_lim = iperf_args.bw_limit->ival[0];
-        if (cfg.bw_lim <= 0) {
-            cfg.bw_lim = IPERF_DEFAULT_NO_BW_LIMIT;
+        cfg.bw_lim_kbps = parse_bandwidth_kbps(iperf_args.bw_limit->sval[0]);
+        if (cfg.bw_lim_kbps <= 0) {
+            cfg.bw_lim_kbps = IPERF_DEFAULT_NO_BW_LIMIT;
         }
     }
 
+    /* iperf --burst */
+    if (iperf_args.burst->count != 0 && iperf_args.burst->ival[0] > 0) {
+        cfg.burst = iperf_args.burst->ival[0];
+    }
+
+    /* iperf -P */
+    if (iperf_args.parallel->count == 0) {
+        cfg.num_streams = 1;
+    } else if (iperf_args.parallel->ival[0] < 1 || iperf_args.parallel->ival[0] > IPERF_MAX_STREAMS) {
+        ESP_LOGE(__func__, "Parallel streams must be 1 to %d", IPERF_MAX_STREAMS);
+        return 0;
+    } else {
+        cfg.num_streams = iperf_args.parallel->ival[0];
+    }
+
+    /* iperf -R, iperf -d */
+    if (iperf_args.reverse->count) {
+        cfg.flag |= IPERF_FLAG_REVERSE;
+    }
+    if (iperf_args.duplex->count) {
+        cfg.flag |= IPERF_FLAG_DUPLEX;
+    }
+
+    /* iperf -J */
+    if (iperf_args.json->count) {
+        cfg.flag |= IPERF_FLAG_JSON;
+    }
+
+    if (cfg.type == IPERF_IP_TYPE_IPV6) {
+        printf("mode=%s-%s ipv6 dip=[%s]:%d, interval=%d, time=%d\r\n",
+               cfg.flag & IPERF_FLAG_TCP ? "tcp" : "udp",
+               cfg.flag & IPERF_FLAG_SERVER ? "server" : "client",
+               cfg.flag & IPERF_FLAG_SERVER ? "::" : cfg.destination_ip6, cfg.flag & IPERF_FLAG_SERVER ? cfg.sport : cfg.dport,
+               cfg.interval, cfg.time);
+        iperf_start(&cfg);
+        return 0;
+    }
+
     printf("mode=%s-%s sip=%d.%d.%d.%d:%d, dip=%d.%d.%d.%d:%d, interval=%d, time=%d\r\n",
            cfg.flag & IPERF_FLAG_TCP ? "tcp" : "udp",
            cfg.flag & IPERF_FLAG_SERVER ? "server" : "client",
@@ -161,7 +293,20 @@ void register_iperf(void)
     iperf_args.interval = arg_int0("i", "interval", "<interval>",
                                    "seconds between periodic bandwidth reports");
     iperf_args.time = arg_int0("t", "time", "<time>", "time in seconds to transmit for (default 10 secs)");
-    iperf_args.bw_limit = arg_int0("b", "bandwidth", "<bandwidth>", "bandwidth to send at in Mbits/sec");
+    iperf_args.bw_limit = arg_str0("b", "bandwidth", "<bandwidth>", "bandwidth to send at in Mbits/sec, or kbits/sec with a k suffix");
+    iperf_args.burst = arg_int0(NULL, "burst", "<n>", "datagrams or writes sent back to back at that bandwidth, default 1");
+    iperf_args.parallel = arg_int0("P", "parallel", "<n>", "number of parallel client streams to run");
+    iperf_args.reverse = arg_lit0("R", "reverse", "the server sends, give it to both client and server");
+    iperf_args.duplex = arg_lit0("d", "full-duplex", "both ends send at the same time, give it to both client and server");
+    iperf_args.json = arg_lit0("J", "json", "print reports as JSON, one object per line");
+    iperf_args.incompressible = arg_lit0(NULL, "incompressible", "send a pseudo random payload instead of zeros");
+    iperf_args.nodelay = arg_lit0("N", "nodelay", "set TCP_NODELAY, write segments out without waiting to fill them");
+    iperf_args.window = arg_int0("w", "window", "<bytes>", "socket send and receive buffer size");
+    iperf_args.sndbuf = arg_int0(NULL, "sndbuf", "<bytes>", "socket send buffer size");
+    iperf_args.rcvbuf = arg_int0(NULL, "rcvbuf", "<bytes>", "socket receive buffer size");
+    iperf_args.mss = arg_int0("M", "mss", "<bytes>", "TCP maximum segment size");
+    iperf_args.sweep = arg_str0(NULL, "sweep", "<len,...>", "one UDP client test per datagram length, 'default' for 16 to 1472 bytes");
+    iperf_args.line_rate = arg_int0(NULL, "line-rate", "<baud>", "uart baud rate, a sweep prints the goodput as a share of it");
     iperf_args.abort = arg_lit0("a", "abort", "abort running iperf");
     iperf_args.end = arg_end(1);
     const esp_console_cmd_t iperf_cmd = {
@@ -15,6 +15,9 @@ extern "C" {
 // Register iperf functions
 void register_iperf(void);
 
+// Record every iperf test in the file at path, on a mounted file system, and register iperf_history
+void register_iperf_history(const char *path);
+
 #ifdef __cplusplus
 }
 #endif
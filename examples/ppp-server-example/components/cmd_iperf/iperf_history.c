@@ -0,0 +1,288 @@
+/* Console example — iperf result history
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_app_desc.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "argtable3/argtable3.h"
+#include "iperf.h"
+#include "cmd_iperf.h"
+#include "sdkconfig.h"
+
+/**
+ * Every iperf test appends a fixed size record to a file: how it was run, the
+ * firmware that ran it and what came out. The file holds the last
+ * IPERF_HISTORY_RECORDS tests and wraps around, the sequence number tells the
+ * order. `iperf_history` lists them and compares two runs, or a run with the
+ * one before it that had the same configuration, to spot a release that made
+ * the link slower on the same hardware.
+ */
+
+#define IPERF_HISTORY_MAGIC 0x49504831 // "IPH1"
+#define IPERF_HISTORY_RECORDS 256
+// A rate this much lower, or a loss, jitter or delay this much higher, is marked as a regression
+#define IPERF_HISTORY_THRESHOLD_PERMILLE 50
+
+// Written as it is in memory, every field is at its natural alignment so there is no padding
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    char version[24];   // Firmware version, cut to fit
+    uint8_t elf_sha[4]; // Tells builds with the same version apart
+    uint32_t baud;
+    uint32_t flag;
+    int32_t bw_lim_kbps;
+    uint16_t len;
+    uint16_t mss;
+    uint16_t burst;
+    uint8_t num_streams;
+    uint8_t sweep;      // The test was one length of a sweep
+    iperf_result_t result;
+} iperf_history_record_t;
+
+_Static_assert(sizeof(iperf_history_record_t) == 84, "iperf history records changed size, change IPERF_HISTORY_MAGIC");
+
+static const char *TAG = "iperf_history";
+static const char *s_history_path;
+
+static struct {
+    struct arg_int *compare;
+    struct arg_int *count;
+    struct arg_lit *clear;
+    struct arg_end *end;
+} history_args;
+
+/**
+ * Calls cb for every valid record of the file in slot order, returns the
+ * highest sequence number, 0 for an empty history. The slot after it is the
+ * next one written.
+ */
+static uint32_t history_scan(FILE *f, uint32_t *next_slot, void (*cb)(const iperf_history_record_t *record, void *arg), void *arg)
+{
+    iperf_history_record_t record;
+    uint32_t last = 0;
+    uint32_t slot = 0;
+
+    *next_slot = 0;
+    fseek(f, 0, SEEK_SET);
+    while (fread(&record, sizeof(record), 1, f) == 1 && record.magic == IPERF_HISTORY_MAGIC) {
+        if (record.seq > last) {
+            last = record.seq;
+            *next_slot = (slot + 1) % IPERF_HISTORY_RECORDS;
+        }
+        if (cb) {
+            cb(&record, arg);
+        }
+        slot++;
+    }
+    return last;
+}
+
+// Appends the test that just ended, runs in the iperf task
+static void history_append(const iperf_cfg_t *cfg, const iperf_result_t *result)
+{
+    const esp_app_desc_t *app = esp_app_get_description();
+    iperf_history_record_t record;
+    uint32_t slot;
+
+    FILE *f = fopen(s_history_path, "r+b");
+    if (!f) {
+        f = fopen(s_history_path, "w+b");
+    }
+    if (!f) {
+        ESP_LOGW(TAG, "can not open %s", s_history_path);
+        return;
+    }
+    uint32_t seq = history_scan(f, &slot, NULL, NULL) + 1;
+    memset(&record, 0, sizeof(record));
+    record.magic = IPERF_HISTORY_MAGIC;
+    record.seq = seq;
+    strlcpy(record.version, app->version, sizeof(record.version));
+    memcpy(record.elf_sha, app->app_elf_sha256, sizeof(record.elf_sha));
+    record.baud = cfg->line_rate_bps ? cfg->line_rate_bps : CONFIG_EXAMPLE_MODEM_PPP_BAUDRATE;
+    record.flag = cfg->flag & ~IPERF_FLAG_JSON;
+    record.bw_lim_kbps = cfg->bw_lim_kbps;
+    record.len = cfg->len_send_buf;
+    record.mss = cfg->mss;
+    record.burst = cfg->burst;
+    record.num_streams = cfg->num_streams;
+    record.sweep = cfg->sweep_count > 0;
+    record.result = *result;
+    if (fseek(f, slot * sizeof(record), SEEK_SET) != 0 || fwrite(&record, sizeof(record), 1, f) != 1) {
+        ESP_LOGW(TAG, "can not write %s", s_history_path);
+    }
+    fclose(f);
+}
+
+static void history_print_header(void)
+{
+    printf("%5s %-24s %8s %9s %5s %3s %5s %10s %10s %7s %9s %9s\n", "run", "firmware", "baud", "mode", "len", "P", "time", "tx kbps", "rx kbps",
+           "lost", "jitter us", "p99 us");
+}
+
+static void history_print(const iperf_history_record_t *record, void *arg)
+{
+    const iperf_result_t *result = &record->result;
+    uint32_t permille = result->datagrams ? (uint64_t)result->lost * 1000 / result->datagrams : 0;
+    char mode[12];
+
+    snprintf(mode, sizeof(mode), "%s-%s%s%s", record->flag & IPERF_FLAG_UDP ? "udp" : "tcp", record->flag & IPERF_FLAG_SERVER ? "s" : "c",
+             record->flag & IPERF_FLAG_DUPLEX ? "d" : record->flag & IPERF_FLAG_REVERSE ? "r" : "", record->sweep ? "w" : "");
+    printf("%5u %-24.24s %8u %9s %5u %3u %5u %10u %10u %3u.%u%% %9u %9u\n", record->seq, record->version, record->baud, mode, record->len,
+           record->num_streams, result->time, result->tx_kbps, result->rx_kbps, permille / 10, permille % 10, result->jitter_us, result->delay_p99_us);
+}
+
+typedef struct {
+    uint32_t first; // Lowest sequence number printed
+} history_list_t;
+
+static void history_print_from(const iperf_history_record_t *record, void *arg)
+{
+    if (record->seq >= ((history_list_t *)arg)->first) {
+        history_print(record, NULL);
+    }
+}
+
+typedef struct {
+    uint32_t seq;   // Run looked for, or 0 for the run before `before` with the same configuration
+    uint32_t before;
+    iperf_history_record_t key;
+    iperf_history_record_t found;
+} history_find_t;
+
+static bool history_same_test(const iperf_history_record_t *a, const iperf_history_record_t *b)
+{
+    return a->baud == b->baud && a->flag == b->flag && a->bw_lim_kbps == b->bw_lim_kbps && a->len == b->len && a->mss == b->mss &&
+           a->burst == b->burst && a->num_streams == b->num_streams && a->sweep == b->sweep;
+}
+
+static void history_find(const iperf_history_record_t *record, void *arg)
+{
+    history_find_t *find = arg;
+
+    if (find->seq) {
+        if (record->seq == find->seq) {
+            find->found = *record;
+        }
+    } else if (record->seq < find->before && record->seq > find->found.seq && history_same_test(record, &find->key)) {
+        find->found = *record;
+    }
+}
+
+// Change from a to b in per mille, worse when it moves against higher_better by more than the threshold
+static void history_compare_value(const char *name, uint32_t a, uint32_t b, bool higher_better)
+{
+    int32_t change = a ? (int32_t)(((int64_t)b - a) * 1000 / a) : 0;
+    bool worse = higher_better ? change < -IPERF_HISTORY_THRESHOLD_PERMILLE : change > IPERF_HISTORY_THRESHOLD_PERMILLE;
+    uint32_t magnitude = change < 0 ? -change : change;
+
+    if (!a && !b) {
+        return;
+    }
+    printf("  %-10s %10u %10u %c%5u.%u%%%s\n", name, a, b, change < 0 ? '-' : '+', magnitude / 10, magnitude % 10, worse ? "  regression" : "");
+}
+
+static void history_compare(const iperf_history_record_t *a, const iperf_history_record_t *b)
+{
+    uint32_t loss_a = a->result.datagrams ? (uint64_t)a->result.lost * 1000 / a->result.datagrams : 0;
+    uint32_t loss_b = b->result.datagrams ? (uint64_t)b->result.lost * 1000 / b->result.datagrams : 0;
+
+    history_print_header();
+    history_print(a, NULL);
+    history_print(b, NULL);
+    if (!history_same_test(a, b)) {
+        printf("The runs had a different configuration\n");
+    }
+    printf("  %-10s %10u %10u\n", "", a->seq, b->seq);
+    history_compare_value("tx kbps", a->result.tx_kbps, b->result.tx_kbps, true);
+    history_compare_value("rx kbps", a->result.rx_kbps, b->result.rx_kbps, true);
+    // A loss that appears where there was none is always worth a look
+    if (loss_a == 0 && loss_b > 0) {
+        printf("  %-10s %10u %10u  regression\n", "lost 0.1%", loss_a, loss_b);
+    } else {
+        history_compare_value("lost 0.1%", loss_a, loss_b, false);
+    }
+    history_compare_value("jitter us", a->result.jitter_us, b->result.jitter_us, false);
+    history_compare_value("p99 us", a->result.delay_p99_us, b->result.delay_p99_us, false);
+}
+
+static int cmd_iperf_history(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&history_args);
+    uint32_t slot;
+
+    if (nerrors != 0) {
+        arg_print_errors(stderr, history_args.end, argv[0]);
+        return 1;
+    }
+    if (history_args.clear->count) {
+        remove(s_history_path);
+        return 0;
+    }
+    FILE *f = fopen(s_history_path, "rb");
+    if (!f) {
+        printf("No iperf runs recorded\n");
+        return 0;
+    }
+    if (history_args.compare->count == 0) {
+        uint32_t last = history_scan(f, &slot, NULL, NULL);
+        int count = history_args.count->count ? history_args.count->ival[0] : 20;
+        history_list_t list = {.first = last >= count ? last - count + 1 : 1};
+        history_print_header();
+        history_scan(f, &slot, history_print_from, &list);
+        fclose(f);
+        return 0;
+    }
+
+    // The last run given is the one looked at, the other the reference
+    history_find_t a = {0};
+    history_find_t b = {0};
+    b.seq = history_args.compare->ival[history_args.compare->count - 1];
+    history_scan(f, &slot, history_find, &b);
+    if (b.found.seq == 0) {
+        printf("No run %u\n", b.seq);
+        fclose(f);
+        return 1;
+    }
+    if (history_args.compare->count > 1) {
+        a.seq = history_args.compare->ival[0];
+    } else {
+        a.before = b.found.seq;
+        a.key = b.found;
+    }
+    history_scan(f, &slot, history_find, &a);
+    fclose(f);
+    if (a.found.seq == 0) {
+        printf("No earlier run like %u\n", b.found.seq);
+        return 1;
+    }
+    history_compare(&a.found, &b.found);
+    return 0;
+}
+
+void register_iperf_history(const char *path)
+{
+    s_history_path = path;
+    iperf_set_result_cb(history_append);
+
+    history_args.compare = arg_intn("c", "compare", "<run>", 0, 2,
+                                    "compare two runs, or a run with the last one before it that had the same configuration");
+    history_args.count = arg_int0("n", "count", "<n>", "list the last n runs, default 20");
+    history_args.clear = arg_lit0(NULL, "clear", "delete the recorded runs");
+    history_args.end = arg_end(2);
+    const esp_console_cmd_t history_cmd = {
+        .command = "iperf_history",
+        .help = "List the recorded iperf runs and compare them",
+        .hint = NULL,
+        .func = &cmd_iperf_history,
+        .argtable = &history_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&history_cmd));
+}
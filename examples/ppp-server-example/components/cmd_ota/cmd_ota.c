@@ -0,0 +1,117 @@
+/* Console example — OTA commands
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "cmd_ota.h"
+#include "ota.h"
+
+/* "ota" command */
+
+static struct {
+    struct arg_lit *server;
+    struct arg_str *client;
+    struct arg_int *port;
+    struct arg_int *block_size;
+    struct arg_lit *abort;
+    struct arg_end *end;
+} ota_args;
+
+static const char *ota_state_name(ota_state_t state)
+{
+    switch (state) {
+    case OTA_STATE_IDLE:
+        return "idle";
+    case OTA_STATE_WAITING:
+        return "waiting for sender";
+    case OTA_STATE_RECEIVING:
+        return "receiving";
+    case OTA_STATE_DONE:
+        return "done";
+    case OTA_STATE_FAILED:
+        return "failed";
+    }
+    return "?";
+}
+
+static void ota_print_report(const ota_report_t *report)
+{
+    printf("ota: %s", ota_state_name(report->state));
+    if (report->state == OTA_STATE_FAILED) {
+        printf(" (%s)", esp_err_to_name(report->error));
+    }
+    printf(", %u bytes in %u ms, %u kbit/s\n", report->bytes, report->elapsed_ms, report->rate_bps / 1000);
+    printf("flash: %u ms busy, receiver blocked %u ms, writer waited %u ms for data", report->flash_ms, report->blocked_ms, report->starved_ms);
+    if (report->blocked_ms || report->starved_ms) {
+        printf(", limited by the %s", report->blocked_ms > report->starved_ms ? "flash" : "link");
+    }
+    printf("\n");
+}
+
+static int cmd_ota(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&ota_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, ota_args.end, argv[0]);
+        return 1;
+    }
+    int port = ota_args.port->count ? ota_args.port->ival[0] : OTA_DEFAULT_PORT;
+
+    /* ota -a */
+    if (ota_args.abort->count) {
+        ota_stop();
+        return 0;
+    }
+
+    /* ota -s, receive in the background so the command also returns when run through cli_server */
+    if (ota_args.server->count) {
+        ota_cfg_t cfg = {
+            .port = port,
+            .block_size = ota_args.block_size->count ? ota_args.block_size->ival[0] : OTA_DEFAULT_BLOCK_SIZE,
+        };
+        if (ota_start(&cfg) != ESP_OK) {
+            return 1;
+        }
+        printf("Waiting for an image on port %d, check progress with \"ota\"\n", port);
+        return 0;
+    }
+
+    ota_report_t report;
+
+    /* ota -c HOST */
+    if (ota_args.client->count) {
+        esp_err_t err = ota_send_running(ota_args.client->sval[0], port, &report);
+        ota_print_report(&report);
+        return err == ESP_OK ? 0 : 1;
+    }
+
+    ota_get_report(&report);
+    ota_print_report(&report);
+    return 0;
+}
+
+void register_ota(void)
+{
+    ota_args.server = arg_lit0("s", "server", "receive an image from a ppp peer and boot it on the next restart, other hosts are refused");
+    ota_args.client = arg_str0("c", "client", "<host>", "send the running firmware to a peer running ota -s");
+    ota_args.port = arg_int0("p", "port", "<port>", "tcp port, default 3232");
+    ota_args.block_size = arg_int0("b", "block", "<bytes>", "receive buffer size, two are used, default 8192");
+    ota_args.abort = arg_lit0("a", "abort", "abort a running receive");
+    ota_args.end = arg_end(1);
+    const esp_console_cmd_t ota_cmd = {
+        .command = "ota",
+        .help = "Firmware update over the ppp link, without arguments show the last transfer",
+        .hint = NULL,
+        .func = &cmd_ota,
+        .argtable = &ota_args
+    };
+
+    ESP_ERROR_CHECK(esp_console_cmd_register(&ota_cmd));
+}
@@ -165,11 +165,16 @@ static void register_free(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
 }
 
-/* 'heap' command prints minumum heap size */
+/* 'heap' command prints minumum heap size and fragmentation */
 static int heap_size(int argc, char **argv)
 {
     uint32_t heap_size = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
     printf("min heap size: %"PRIu32"\n", heap_size);
+    // The share of free memory not usable for one allocation
+    printf("free: %u, largest block: %u, fragmentation: %u%%\n", free_size, largest_block,
+           free_size ? 100 - largest_block * 100 / free_size : 0);
     return 0;
 }
 
@@ -177,7 +182,7 @@ static void register_heap(void)
 {
     const esp_console_cmd_t heap_cmd = {
         .command = "heap",
-        .help = "Get minimum size of free heap memory that was available during program execution",
+        .help = "Get minimum size of free heap memory that was available during program execution, and current fragmentation",
         .hint = NULL,
         .func = &heap_size,
     };
@@ -0,0 +1,530 @@
+/* Caching DNS forwarder - implementation
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "dns_forwarder.h"
+
+/**
+ * One task and two sockets: queries from clients arrive on the one bound to
+ * the ppp server address and are answered from the cache or sent on to the
+ * upstream server from the other, bound to a random port. Upstream answers
+ * come back to that one and are passed on and cached when they repeat the
+ * question that was forwarded. A forged answer has to guess the port as
+ * well as the id.
+ *
+ * The cache is a fixed table of whole responses, found by a hash of the
+ * question and probed linearly for a few slots. A cached response gets the
+ * client's query id and its TTLs lowered by the time it spent in the cache,
+ * so clients never keep an answer longer than the upstream server allowed.
+ */
+
+#define DNS_HEADER_LEN 12
+#define DNS_TYPE_OPT 41
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RECV_TIMEOUT_MS 500
+#define DNS_MAX_QUESTION (255 + 4) // Longest name, type and class
+#define DNS_UPSTREAM_PORT_FIRST 49152 // Ephemeral range the upstream socket takes a random port from
+#define DNS_UPSTREAM_BIND_TRIES 8
+
+typedef struct {
+    uint16_t len; // 0 for a free slot
+    uint16_t question_len;
+    uint32_t hash;
+    uint32_t ttl_s;
+    int64_t stored_us;
+    uint8_t response[DNS_FORWARDER_MAX_RESPONSE];
+} dns_cache_entry_t;
+
+typedef struct {
+    bool used;
+    uint16_t id; // Id sent upstream, random
+    uint16_t client_id;
+    uint16_t question_len;
+    uint8_t question[DNS_MAX_QUESTION]; // The question forwarded, an answer must repeat it
+    struct sockaddr_in client;
+    struct sockaddr_in upstream;
+    int64_t start_us;
+} dns_pending_t;
+
+typedef struct {
+    dns_forwarder_cfg_t cfg;
+    bool finish;
+    bool flush;
+    int sock;          // Queries from the clients
+    int upstream_sock; // Forwarded queries and their answers
+    dns_cache_entry_t *cache;
+    dns_pending_t pending[DNS_FORWARDER_MAX_PENDING];
+    dns_forwarder_report_t report;
+    int64_t hit_us;
+    int64_t miss_us;
+} dns_forwarder_ctrl_t;
+
+static bool s_dns_is_running = false;
+static dns_forwarder_ctrl_t s_dns_ctrl;
+static const char *TAG = "dns_forwarder";
+
+static inline uint16_t dns_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// Offset just after the name at off, or -1 when the name runs past the message. A compression pointer ends the name.
+static int dns_skip_name(const uint8_t *msg, int len, int off)
+{
+    while (off < len) {
+        uint8_t label = msg[off];
+        if (label == 0) {
+            return off + 1;
+        }
+        if ((label & 0xc0) == 0xc0) {
+            return off + 2 <= len ? off + 2 : -1;
+        }
+        if (label & 0xc0) {
+            return -1;
+        }
+        off += label + 1;
+    }
+    return -1;
+}
+
+// Length of the single question after the header, or -1 when the message does not have exactly one.
+static int dns_question_len(const uint8_t *msg, int len)
+{
+    if (len < DNS_HEADER_LEN || dns_get16(msg + 4) != 1) {
+        return -1;
+    }
+    int end = dns_skip_name(msg, len, DNS_HEADER_LEN);
+    if (end < 0 || end + 4 > len) {
+        return -1;
+    }
+    return end + 4 - DNS_HEADER_LEN;
+}
+
+// FNV-1a of the question, names compare without case.
+static uint32_t dns_question_hash(const uint8_t *question, int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ tolower(question[i])) * 16777619u;
+    }
+    return hash;
+}
+
+static bool dns_question_equal(const uint8_t *a, const uint8_t *b, int len)
+{
+    for (int i = 0; i < len; i++) {
+        if (tolower(a[i]) != tolower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Walk the records after the question. Lowers every TTL by age seconds when
+ * age is not 0, and returns the smallest TTL found, UINT32_MAX when there
+ * are no records, or -1 for a broken message. The EDNS record is skipped,
+ * its TTL field holds flags.
+ */
+static int64_t dns_walk_records(uint8_t *msg, int len, int question_len, uint32_t age)
+{
+    int records = dns_get16(msg + 6) + dns_get16(msg + 8) + dns_get16(msg + 10);
+    int off = DNS_HEADER_LEN + question_len;
+    int64_t min_ttl = UINT32_MAX;
+
+    for (int i = 0; i < records; i++) {
+        off = dns_skip_name(msg, len, off);
+        if (off < 0 || off + 10 > len) {
+            return -1;
+        }
+        uint16_t type = dns_get16(msg + off);
+        uint8_t *ttl_field = msg + off + 4;
+        uint16_t rdlength = dns_get16(msg + off + 8);
+        off += 10 + rdlength;
+        if (off > len) {
+            return -1;
+        }
+        if (type == DNS_TYPE_OPT) {
+            continue;
+        }
+        uint32_t ttl = ((uint32_t)ttl_field[0] << 24) | (ttl_field[1] << 16) | (ttl_field[2] << 8) | ttl_field[3];
+        min_ttl = MIN(min_ttl, ttl);
+        if (age) {
+            ttl = ttl > age ? ttl - age : 0;
+            ttl_field[0] = ttl >> 24;
+            ttl_field[1] = ttl >> 16;
+            ttl_field[2] = ttl >> 8;
+            ttl_field[3] = ttl;
+        }
+    }
+    return min_ttl;
+}
+
+static bool dns_cache_expired(const dns_cache_entry_t *entry, int64_t now)
+{
+    return now - entry->stored_us >= (int64_t)entry->ttl_s * 1000 * 1000;
+}
+
+static dns_cache_entry_t *dns_cache_find(const uint8_t *question, int question_len, uint32_t hash, int64_t now)
+{
+    for (int i = 0; i < DNS_FORWARDER_PROBES; i++) {
+        dns_cache_entry_t *entry = &s_dns_ctrl.cache[(hash + i) & (DNS_FORWARDER_CACHE_ENTRIES - 1)];
+        if (entry->len && entry->hash == hash && entry->question_len == question_len &&
+            dns_question_equal(entry->response + DNS_HEADER_LEN, question, question_len)) {
+            if (dns_cache_expired(entry, now)) {
+                entry->len = 0;
+                return NULL;
+            }
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void dns_cache_store(const uint8_t *response, int len, int question_len)
+{
+    uint8_t rcode = response[3] & 0x0f;
+    bool truncated = response[2] & 0x02;
+    int64_t now = esp_timer_get_time();
+
+    if (truncated || len > DNS_FORWARDER_MAX_RESPONSE || (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN)) {
+        s_dns_ctrl.report.not_cached++;
+        return;
+    }
+    int64_t ttl = dns_walk_records((uint8_t *)response, len, question_len, 0);
+    if (ttl < 0) {
+        s_dns_ctrl.report.not_cached++;
+        return;
+    }
+    // Names that do not exist, or have no record of the type asked for, come back as errors or empty answers
+    ttl = MIN(ttl, (rcode == DNS_RCODE_NXDOMAIN || dns_get16(response + 6) == 0) ? DNS_FORWARDER_NEGATIVE_TTL : DNS_FORWARDER_MAX_TTL);
+    if (ttl == 0) {
+        s_dns_ctrl.report.not_cached++;
+        return;
+    }
+
+    uint32_t hash = dns_question_hash(response + DNS_HEADER_LEN, question_len);
+    dns_cache_entry_t *slot = NULL;
+    for (int i = 0; i < DNS_FORWARDER_PROBES; i++) {
+        dns_cache_entry_t *entry = &s_dns_ctrl.cache[(hash + i) & (DNS_FORWARDER_CACHE_ENTRIES - 1)];
+        if (entry->len && entry->hash == hash && entry->question_len == question_len &&
+            dns_question_equal(entry->response + DNS_HEADER_LEN, response + DNS_HEADER_LEN, question_len)) {
+            slot = entry;
+            break;
+        }
+        if (!entry->len || dns_cache_expired(entry, now)) {
+            if (!slot || slot->len) {
+                slot = entry;
+            }
+        } else if (!slot || (slot->len && entry->stored_us < slot->stored_us)) {
+            slot = entry;
+        }
+    }
+    memcpy(slot->response, response, len);
+    slot->len = len;
+    slot->question_len = question_len;
+    slot->hash = hash;
+    slot->ttl_s = ttl;
+    slot->stored_us = now;
+}
+
+static void dns_account(int64_t start_us, bool hit)
+{
+    uint32_t us = esp_timer_get_time() - start_us;
+
+    if (hit) {
+        s_dns_ctrl.hit_us += us;
+        s_dns_ctrl.report.hit_max_us = MAX(s_dns_ctrl.report.hit_max_us, us);
+    } else {
+        s_dns_ctrl.miss_us += us;
+        s_dns_ctrl.report.miss_max_us = MAX(s_dns_ctrl.report.miss_max_us, us);
+    }
+}
+
+static bool dns_upstream(struct sockaddr_in *upstream)
+{
+    esp_ip4_addr_t addr = s_dns_ctrl.cfg.upstream;
+
+    if (addr.addr == 0) {
+        esp_netif_dns_info_t dns;
+        esp_netif_t *netif = esp_netif_get_default_netif();
+        if (!netif || esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK || dns.ip.type != ESP_IPADDR_TYPE_V4) {
+            return false;
+        }
+        addr = dns.ip.u_addr.ip4;
+    }
+    memset(upstream, 0, sizeof(*upstream));
+    upstream->sin_family = AF_INET;
+    upstream->sin_port = htons(DNS_FORWARDER_PORT);
+    upstream->sin_addr.s_addr = addr.addr;
+    return addr.addr != 0;
+}
+
+static void dns_on_query(uint8_t *msg, int len, const struct sockaddr_in *client, int64_t start_us)
+{
+    int question_len = dns_question_len(msg, len);
+
+    s_dns_ctrl.report.queries++;
+    // Only standard queries, with the response bit clear
+    if (question_len < 0 || question_len > DNS_MAX_QUESTION || (msg[2] & 0xf8) != 0) {
+        s_dns_ctrl.report.dropped++;
+        return;
+    }
+
+    uint32_t hash = dns_question_hash(msg + DNS_HEADER_LEN, question_len);
+    dns_cache_entry_t *entry = dns_cache_find(msg + DNS_HEADER_LEN, question_len, hash, start_us);
+    if (entry) {
+        uint8_t answer[DNS_FORWARDER_MAX_RESPONSE];
+        memcpy(answer, entry->response, entry->len);
+        answer[0] = msg[0];
+        answer[1] = msg[1];
+        dns_walk_records(answer, entry->len, question_len, (start_us - entry->stored_us) / (1000 * 1000));
+        sendto(s_dns_ctrl.sock, answer, entry->len, 0, (const struct sockaddr *)client, sizeof(*client));
+        s_dns_ctrl.report.hits++;
+        dns_account(start_us, true);
+        return;
+    }
+
+    dns_pending_t *pending = NULL;
+    for (int i = 0; i < DNS_FORWARDER_MAX_PENDING; i++) {
+        if (!s_dns_ctrl.pending[i].used) {
+            pending = &s_dns_ctrl.pending[i];
+            break;
+        }
+    }
+    if (!pending || !dns_upstream(&pending->upstream)) {
+        s_dns_ctrl.report.dropped++;
+        return;
+    }
+    pending->used = true;
+    pending->client = *client;
+    pending->client_id = dns_get16(msg);
+    pending->id = esp_random();
+    pending->question_len = question_len;
+    memcpy(pending->question, msg + DNS_HEADER_LEN, question_len);
+    pending->start_us = start_us;
+    msg[0] = pending->id >> 8;
+    msg[1] = pending->id;
+    if (sendto(s_dns_ctrl.upstream_sock, msg, len, 0, (const struct sockaddr *)&pending->upstream, sizeof(pending->upstream)) != len) {
+        ESP_LOGW(TAG, "Forward failed: errno %d", errno);
+        pending->used = false;
+        s_dns_ctrl.report.dropped++;
+        return;
+    }
+    s_dns_ctrl.report.misses++;
+}
+
+static void dns_on_answer(uint8_t *msg, int len, const struct sockaddr_in *from)
+{
+    if (len < DNS_HEADER_LEN || !(msg[2] & 0x80)) {
+        return;
+    }
+    for (int i = 0; i < DNS_FORWARDER_MAX_PENDING; i++) {
+        dns_pending_t *pending = &s_dns_ctrl.pending[i];
+        if (pending->used && pending->id == dns_get16(msg) && pending->upstream.sin_addr.s_addr == from->sin_addr.s_addr &&
+            pending->upstream.sin_port == from->sin_port) {
+            // An answer to another question is forged, or a server gone wrong, it is neither cached nor passed on.
+            // The query stays pending for the real answer.
+            int question_len = dns_question_len(msg, len);
+            if (question_len != pending->question_len || !dns_question_equal(msg + DNS_HEADER_LEN, pending->question, question_len)) {
+                s_dns_ctrl.report.mismatched++;
+                return;
+            }
+            pending->used = false;
+            msg[0] = pending->client_id >> 8;
+            msg[1] = pending->client_id;
+            sendto(s_dns_ctrl.sock, msg, len, 0, (const struct sockaddr *)&pending->client, sizeof(pending->client));
+            dns_account(pending->start_us, false);
+            dns_cache_store(msg, len, question_len);
+            return;
+        }
+    }
+    // A late or spoofed answer, nobody is waiting for it
+}
+
+static void dns_expire_pending(int64_t now)
+{
+    for (int i = 0; i < DNS_FORWARDER_MAX_PENDING; i++) {
+        dns_pending_t *pending = &s_dns_ctrl.pending[i];
+        if (pending->used && now - pending->start_us > DNS_FORWARDER_TIMEOUT_MS * 1000) {
+            pending->used = false;
+            s_dns_ctrl.report.timeouts++;
+        }
+    }
+}
+
+static void dns_forwarder_task(void *arg)
+{
+    uint8_t msg[512]; // Plain DNS over UDP, no EDNS buffer sizes
+
+    while (!s_dns_ctrl.finish) {
+        struct timeval timeout = {.tv_usec = DNS_RECV_TIMEOUT_MS * 1000};
+        struct sockaddr_in from;
+        socklen_t from_len;
+        fd_set readable;
+        int len;
+
+        FD_ZERO(&readable);
+        FD_SET(s_dns_ctrl.sock, &readable);
+        FD_SET(s_dns_ctrl.upstream_sock, &readable);
+        int ready = select(MAX(s_dns_ctrl.sock, s_dns_ctrl.upstream_sock) + 1, &readable, NULL, NULL, &timeout);
+        int64_t now = esp_timer_get_time();
+        if (s_dns_ctrl.flush) {
+            s_dns_ctrl.flush = false;
+            memset(s_dns_ctrl.cache, 0, DNS_FORWARDER_CACHE_ENTRIES * sizeof(dns_cache_entry_t));
+        }
+        if (ready > 0 && FD_ISSET(s_dns_ctrl.upstream_sock, &readable)) {
+            from_len = sizeof(from);
+            len = recvfrom(s_dns_ctrl.upstream_sock, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+            if (len > 0) {
+                dns_on_answer(msg, len, &from);
+            }
+        }
+        if (ready > 0 && FD_ISSET(s_dns_ctrl.sock, &readable)) {
+            from_len = sizeof(from);
+            len = recvfrom(s_dns_ctrl.sock, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+            if (len > 0) {
+                dns_on_query(msg, len, &from, now);
+            }
+        }
+        dns_expire_pending(now);
+    }
+
+    close(s_dns_ctrl.sock);
+    close(s_dns_ctrl.upstream_sock);
+    free(s_dns_ctrl.cache);
+    s_dns_ctrl.cache = NULL;
+    s_dns_is_running = false;
+    vTaskDelete(NULL);
+}
+
+// Socket for the upstream queries on a random port, so a forged answer has to find it as well as the id
+static int dns_upstream_socket(void)
+{
+    struct sockaddr_in addr = {0};
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (sock < 0) {
+        return -1;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    for (int i = 0; i < DNS_UPSTREAM_BIND_TRIES; i++) {
+        addr.sin_port = htons(DNS_UPSTREAM_PORT_FIRST + esp_random() % (65536 - DNS_UPSTREAM_PORT_FIRST));
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return sock;
+        }
+    }
+    close(sock);
+    return -1;
+}
+
+esp_err_t dns_forwarder_start(const dns_forwarder_cfg_t *cfg)
+{
+    esp_err_t ret = ESP_OK;
+    struct sockaddr_in listen_addr = {0};
+
+    ESP_RETURN_ON_FALSE(cfg, ESP_ERR_INVALID_ARG, TAG, "Invalid config");
+    // On every interface it would answer anyone on the uplink as well, an open resolver
+    ESP_RETURN_ON_FALSE(cfg->listen.addr != 0, ESP_ERR_INVALID_ARG, TAG, "No address to answer on");
+    if (s_dns_is_running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(&s_dns_ctrl, 0, sizeof(s_dns_ctrl));
+    s_dns_ctrl.cfg = *cfg;
+    s_dns_ctrl.cache = calloc(DNS_FORWARDER_CACHE_ENTRIES, sizeof(dns_cache_entry_t));
+    ESP_RETURN_ON_FALSE(s_dns_ctrl.cache, ESP_ERR_NO_MEM, TAG, "create cache: not enough memory");
+
+    s_dns_ctrl.upstream_sock = dns_upstream_socket();
+    s_dns_ctrl.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    ESP_GOTO_ON_FALSE((s_dns_ctrl.sock >= 0), ESP_FAIL, fail, TAG, "Unable to create socket: errno %d", errno);
+    ESP_GOTO_ON_FALSE((s_dns_ctrl.upstream_sock >= 0), ESP_FAIL, fail, TAG, "Unable to create upstream socket: errno %d", errno);
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_port = htons(cfg->port);
+    listen_addr.sin_addr.s_addr = cfg->listen.addr;
+    ESP_GOTO_ON_FALSE((bind(s_dns_ctrl.sock, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) == 0), ESP_FAIL, fail, TAG,
+                      "Socket unable to bind: errno %d", errno);
+
+    s_dns_is_running = true;
+    if (xTaskCreate(dns_forwarder_task, DNS_FORWARDER_TASK_NAME, DNS_FORWARDER_TASK_STACK, NULL, DNS_FORWARDER_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", DNS_FORWARDER_TASK_NAME);
+        s_dns_is_running = false;
+        ret = ESP_ERR_NO_MEM;
+        goto fail;
+    }
+    return ESP_OK;
+
+fail:
+    if (s_dns_ctrl.sock >= 0) {
+        close(s_dns_ctrl.sock);
+    }
+    if (s_dns_ctrl.upstream_sock >= 0) {
+        close(s_dns_ctrl.upstream_sock);
+    }
+    free(s_dns_ctrl.cache);
+    s_dns_ctrl.cache = NULL;
+    return ret;
+}
+
+esp_err_t dns_forwarder_stop(void)
+{
+    if (s_dns_is_running) {
+        s_dns_ctrl.finish = true;
+    }
+
+    while (s_dns_is_running) {
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t dns_forwarder_flush(void)
+{
+    if (!s_dns_is_running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_dns_ctrl.flush = true;
+    return ESP_OK;
+}
+
+esp_err_t dns_forwarder_get_report(dns_forwarder_report_t *report)
+{
+    ESP_RETURN_ON_FALSE(report, ESP_ERR_INVALID_ARG, TAG, "Invalid report");
+
+    *report = s_dns_ctrl.report;
+    report->running = s_dns_is_running;
+    report->hit_avg_us = report->hits ? s_dns_ctrl.hit_us / report->hits : 0;
+    // Misses still waiting are not in miss_us yet
+    uint32_t answered = report->misses - report->timeouts;
+    report->miss_avg_us = answered ? s_dns_ctrl.miss_us / answered : 0;
+    report->entries = 0;
+    if (s_dns_is_running && s_dns_ctrl.cache) {
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < DNS_FORWARDER_CACHE_ENTRIES; i++) {
+            if (s_dns_ctrl.cache[i].len && !dns_cache_expired(&s_dns_ctrl.cache[i], now)) {
+                report->entries++;
+            }
+        }
+    }
+    return ESP_OK;
+}
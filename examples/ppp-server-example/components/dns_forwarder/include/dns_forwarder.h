@@ -0,0 +1,72 @@
+/* Caching DNS forwarder - declarations
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __DNS_FORWARDER_H_
+#define __DNS_FORWARDER_H_
+
+#include "esp_err.h"
+#include "esp_netif.h"
+#include "esp_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DNS_FORWARDER_PORT 53
+
+// Answers kept, a power of two. Each entry holds a whole response, larger ones are forwarded but not cached.
+#define DNS_FORWARDER_CACHE_ENTRIES 64
+#define DNS_FORWARDER_MAX_RESPONSE 256
+#define DNS_FORWARDER_PROBES 4 // Slots searched from the hash slot on, the oldest of them is replaced when all are taken
+
+#define DNS_FORWARDER_MAX_PENDING 8 // Queries waiting for the upstream server at once
+#define DNS_FORWARDER_TIMEOUT_MS 3000
+#define DNS_FORWARDER_NEGATIVE_TTL 30 // Seconds a name that does not exist is remembered
+#define DNS_FORWARDER_MAX_TTL 3600
+
+#define DNS_FORWARDER_TASK_NAME "dns_fwd"
+#define DNS_FORWARDER_TASK_PRIORITY 5
+#define DNS_FORWARDER_TASK_STACK 4096
+
+typedef struct {
+    uint16_t port;
+    esp_ip4_addr_t listen;   // Address answered on, the ppp server address so only ppp clients can ask
+    esp_ip4_addr_t upstream; // 0 for the main DNS server of the default interface, looked up for every forwarded query
+} dns_forwarder_cfg_t;
+
+typedef struct {
+    bool running;
+    uint32_t queries;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t timeouts; // Forwarded queries the upstream server never answered
+    uint32_t dropped;  // Malformed queries, or no room to forward
+    uint32_t not_cached; // Answers too large or with a TTL of 0
+    uint32_t mismatched; // Answers from upstream that do not repeat the question forwarded, dropped
+    uint32_t entries;    // Answers in the cache that have not expired
+    uint32_t hit_avg_us; // From receiving the query to sending the answer
+    uint32_t hit_max_us;
+    uint32_t miss_avg_us;
+    uint32_t miss_max_us;
+} dns_forwarder_report_t;
+
+// Answer DNS on cfg->listen and cfg->port, usually the ppp server address for the ppp clients.
+esp_err_t dns_forwarder_start(const dns_forwarder_cfg_t *cfg);
+
+esp_err_t dns_forwarder_stop(void);
+
+esp_err_t dns_forwarder_flush(void);
+
+esp_err_t dns_forwarder_get_report(dns_forwarder_report_t *report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,6 +12,7 @@
 
 #include "esp_err.h"
 #include "esp_types.h"
+#include "sdkconfig.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,10 +30,16 @@ extern "C" {
 #define IPERF_FLAG_SERVER (1 << 1)
 #define IPERF_FLAG_TCP (1 << 2)
 #define IPERF_FLAG_UDP (1 << 3)
+#define IPERF_FLAG_REVERSE (1 << 4) // The server sends to the client, both ends must be started with it
+#define IPERF_FLAG_DUPLEX (1 << 5)  // Both send at the same time, both ends must be started with it
+#define IPERF_FLAG_JSON (1 << 6)    // Reports as one JSON object per interval and one for the summary
+#define IPERF_FLAG_INCOMPRESSIBLE (1 << 7) // Pseudo random payload instead of zeros
+#define IPERF_FLAG_NODELAY (1 << 8) // TCP_NODELAY, segments go out as soon as they are written
 
 #define IPERF_DEFAULT_PORT 5001
 #define IPERF_DEFAULT_INTERVAL 3
 #define IPERF_DEFAULT_TIME 30
+#define IPERF_DEFAULT_SWEEP_TIME 5 // Per datagram length
 #define IPERF_DEFAULT_NO_BW_LIMIT -1
 
 #define IPERF_TRAFFIC_TASK_NAME "iperf_traffic"
@@ -41,13 +48,30 @@ extern "C" {
 #define IPERF_REPORT_TASK_NAME "iperf_report"
 #define IPERF_REPORT_TASK_PRIORITY 6
 #define IPERF_REPORT_TASK_STACK 4096
+#define IPERF_STREAM_TASK_NAME "iperf_stream"
+#define IPERF_STREAM_TASK_STACK 3072
+// Stream tasks with CONFIG_PPP_LINK_STATIC_ALLOCATION, enough for 4 streams one way or 2 both ways
+#define IPERF_STATIC_WORKERS 4
 
 #define IPERF_UDP_TX_LEN (1472)
-#define IPERF_UDP_RX_LEN (16 << 10)
-#define IPERF_TCP_TX_LEN (16 << 10)
-#define IPERF_TCP_RX_LEN (16 << 10)
+#define IPERF_TCP_TX_LEN (16 << 10) // A single stream sending
+// Every other stream, and the UDP server for all of them, holds a datagram at the ppp MTU
+#define IPERF_STREAM_BUFFER_LEN (2 << 10)
+// Allocated on the first start, or static with CONFIG_PPP_LINK_STATIC_ALLOCATION, the buffers of all streams are taken from it.
+// Room for a buffer per stream task, every stream both ways, or the few stream tasks of static allocation and the large buffer.
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+#define IPERF_BUFFER_POOL_LEN (16 << 10)
+#else
+#define IPERF_BUFFER_POOL_LEN (IPERF_MAX_STREAMS * 2 * IPERF_STREAM_BUFFER_LEN)
+#endif
+
+#define IPERF_MAX_STREAMS 8
+// Datagram lengths of one sweep, room for 16 bytes to the MTU in finer steps than the default list
+#define IPERF_SWEEP_MAX_LENS 16
 
 #define IPERF_MAX_DELAY 64
+// Waits of a paced sender shorter than this are spun instead of sleeping on a timer
+#define IPERF_PACER_SPIN_US 100
 
 #define IPERF_SOCKET_RX_TIMEOUT 10
 #define IPERF_SOCKET_ACCEPT_TIMEOUT 5
@@ -68,11 +92,36 @@ typedef struct {
     uint32_t interval;
     uint32_t time;
     uint16_t len_send_buf;
-    int32_t bw_lim;
+    int32_t bw_lim_kbps; // Rate each stream sends at, IPERF_DEFAULT_NO_BW_LIMIT for as fast as it can
+    uint16_t burst;      // Datagrams or writes sent back to back at that rate, 0 for 1
+    uint8_t num_streams; // Parallel connections the client opens, 0 for 1
+    uint16_t sweep_lens[IPERF_SWEEP_MAX_LENS]; // Datagram lengths of a UDP client sweep, a test of time seconds each
+    uint8_t sweep_count;                       // 0 for a single test with len_send_buf
+    uint32_t line_rate_bps;                    // Uart baud rate a sweep compares the goodput with, 0 to leave it out
+    uint32_t sndbuf; // SO_SNDBUF in bytes, 0 for the default of the stack
+    uint32_t rcvbuf; // SO_RCVBUF in bytes, 0 for the default of the stack
+    uint16_t mss;    // TCP_MAXSEG, 0 for what the link MTU allows
 } iperf_cfg_t;
 
+// Totals of a finished test, or of one length of a sweep
+typedef struct {
+    uint32_t time;         // Seconds reported
+    uint32_t tx_kbps;      // All streams this end sent, 0 when it did not send
+    uint32_t rx_kbps;      // All streams this end received
+    uint32_t datagrams;    // UDP datagrams the receiver expected, from the server report on a UDP client
+    uint32_t lost;
+    uint32_t jitter_us;    // Highest of the receiving streams
+    uint32_t delay_p99_us; // One-way delay over the lowest, 0 when this end did not receive datagrams
+} iperf_result_t;
+
+// Called from the iperf task when a test ends, cfg holds the datagram length of the test for a sweep
+typedef void (*iperf_result_cb_t)(const iperf_cfg_t *cfg, const iperf_result_t *result);
+
 esp_err_t iperf_start(iperf_cfg_t *cfg);
 
+// The callback gets the results of every later test, NULL to stop
+void iperf_set_result_cb(iperf_result_cb_t cb);
+
 esp_err_t iperf_stop(void);
 
 #ifdef __cplusplus
@@ -8,27 +8,190 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_check.h"
 #include "esp_log.h"
-#include "esp_rom_sys.h"
 #include "esp_timer.h"
+#include "lwip/opt.h"
 #include "iperf.h"
 
+// Start of every UDP datagram, as iperf2 sends it, in network byte order. A negative id ends the test.
 typedef struct {
-    iperf_cfg_t cfg;
-    bool finish;
-    uint32_t actual_len;
-    uint32_t buffer_len;
+    int32_t id;
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+} iperf_udp_datagram_t;
+
+// Sent back by the server after the datagram header of the final packet, in network byte order.
+typedef struct {
+    int32_t flags;
+    int32_t total_len1; // Bytes received, high and low 32 bits
+    int32_t total_len2;
+    int32_t stop_sec;   // Duration of the test
+    int32_t stop_usec;
+    int32_t error_cnt;  // Datagrams lost
+    int32_t outorder_cnt;
+    int32_t datagrams;
+    int32_t jitter1;    // Seconds and microseconds
+    int32_t jitter2;
+} iperf_udp_server_report_t;
+
+#define IPERF_UDP_REPORT_VERSION1 0x80000000
+#define IPERF_UDP_FIN_TRIES 10
+#define IPERF_UDP_FIN_TIMEOUT_MS 250
+// Seconds the UDP server waits for the next test once all streams ended, the tests of a sweep follow each other closely
+#define IPERF_UDP_SERVER_LINGER 2
+
+typedef struct {
+    uint32_t packets;      // Datagrams received
+    uint32_t lost;         // Gaps in the sequence numbers, late arrivals are taken off again
+    uint32_t out_of_order; // Datagrams that arrived after a later one
+    int32_t last_id;       // Highest sequence number seen
+    float jitter_us;       // Interarrival jitter of RFC 3550, smoothed over 16 datagrams
+    int64_t last_transit_us;
+    int64_t first_us;
+    int64_t last_us;
+} iperf_udp_stats_t;
+
+// Integer histogram, exact below IPERF_HIST_SUB and with IPERF_HIST_SUB buckets per power of two above
+#define IPERF_HIST_SUB_BITS 3
+#define IPERF_HIST_SUB (1 << IPERF_HIST_SUB_BITS)
+#define IPERF_HIST_BUCKETS ((32 - IPERF_HIST_SUB_BITS + 1) * IPERF_HIST_SUB)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[IPERF_HIST_BUCKETS];
+} iperf_hist_t;
+
+typedef struct {
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t count;
+} iperf_delay_t;
+
+// Reports print rates and times with integer math, kbit/s as Mbits/sec and microseconds as milliseconds
+#define IPERF_MBPS_FMT "%5u.%02u"
+#define IPERF_MBPS(kbps) (unsigned)((kbps) / 1000), (unsigned)((kbps) % 1000 / 10)
+#define IPERF_MS_FMT "%u.%03u"
+#define IPERF_MS(us) (unsigned)((us) / 1000), (unsigned)((us) % 1000)
+
+// Socket options of the first connection as the stack reports them, -1 where it does not
+typedef struct {
+    int nodelay;
+    int sndbuf;
+    int rcvbuf;
+    int mss;
+} iperf_sockopts_t;
+
+typedef struct {
+    esp_timer_handle_t timer;
+    int64_t period_us; // Between the starts of two bursts
+    int64_t next_us;   // Start of the next burst
+} iperf_pacer_t;
+
+// One direction of one connection, or of one UDP flow.
+typedef struct {
+    int id;   // Connection number in the reports, both directions of a duplex connection share it
+    bool tx;
+    int sock;
+    bool own_sock; // Closed with this stream, the other direction and the UDP server share theirs
+    struct sockaddr_storage peer; // UDP destination or source, unused for TCP
+    socklen_t peer_len;
     uint8_t *buffer;
-    uint32_t sockfd;
+    uint32_t buffer_len;
+    uint64_t total_len;    // Bytes sent or received
+    uint64_t reported_len; // total_len at the last interval report
+    iperf_udp_stats_t udp; // Datagrams received
+    iperf_udp_stats_t udp_reported;
+    int64_t delay_base_us; // Lowest transit time of a datagram, sender and receiver clocks differ by it and the link latency
+    iperf_delay_t delay;   // One-way delay over that lowest this interval
+    int32_t udp_next_id;   // Datagrams sent
+    uint32_t send_errors;
+    uint32_t pacer_behind; // Bursts the pacer gave up on, the sender could not keep the requested rate
+    bool done;             // Ended before the test did, the peer closed or went silent
+    bool server_report;    // A UDP client got the counts of the receiver below
+    uint64_t server_bytes;
+    uint32_t server_us;
+    uint32_t server_datagrams;
+    uint32_t server_lost;
+    uint32_t server_jitter_us;
+} iperf_stream_t;
+
+// Both directions of every parallel stream, or on a UDP server a stream per length of a sweep
+#define IPERF_STREAM_SLOTS (IPERF_MAX_STREAMS * 2 > IPERF_SWEEP_MAX_LENS ? IPERF_MAX_STREAMS * 2 : IPERF_SWEEP_MAX_LENS)
+
+typedef struct {
+    iperf_cfg_t cfg;
+    bool finish; // Ends the test
+    bool stop;   // iperf_stop(), also ends a sweep
+    int num_streams;
+    int connections;
+    int tasks; // Stream tasks still running
+    bool report_started;
+    bool report_running;
+    uint32_t reported_time; // Seconds the summary covers, 0 when no data went through
+    iperf_sockopts_t sockopts;
+    uint32_t sockopts_failed; // Options the stack refused, each logged once
+    iperf_hist_t throughput[2]; // kbit/s of the streams received and sent, per interval
+    iperf_hist_t delay;         // One-way delay of received datagrams in microseconds, see iperf_stream_t.delay_base_us
+    iperf_stream_t streams[IPERF_STREAM_SLOTS];
 } iperf_ctrl_t;
 
+// Runs the streams of a test, created when first needed and kept idle between tests
+typedef struct {
+    TaskHandle_t task;
+    esp_timer_handle_t pacer_timer; // Wakes the task when a paced sender may send again
+    iperf_stream_t *stream;         // Running, NULL while the worker idles
+} iperf_worker_t;
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+#define IPERF_MAX_WORKERS IPERF_STATIC_WORKERS
+#else
+#define IPERF_MAX_WORKERS (IPERF_MAX_STREAMS * 2)
+#endif
+
+_Static_assert(IPERF_BUFFER_POOL_LEN >= IPERF_MAX_WORKERS * IPERF_STREAM_BUFFER_LEN && IPERF_BUFFER_POOL_LEN >= IPERF_TCP_TX_LEN,
+               "IPERF_BUFFER_POOL_LEN must hold a buffer for every stream task");
+
 static bool s_iperf_is_running = false;
 static iperf_ctrl_t s_iperf_ctrl;
+static portMUX_TYPE s_iperf_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t s_iperf_traffic_task;
+static iperf_result_cb_t s_iperf_result_cb;
+static TaskHandle_t s_iperf_report_task;
+static iperf_worker_t s_iperf_workers[IPERF_MAX_WORKERS];
+static int s_iperf_num_workers;
+
+/**
+ * Every buffer comes from one pool, allocated once. Send buffers are taken
+ * from the bottom and receive buffers from the top, so the payload pattern
+ * written below s_iperf_pattern_len stays valid from test to test and is
+ * only written again where received data went.
+ */
+static uint8_t *s_iperf_pool;
+static uint32_t s_iperf_pool_bottom;
+static uint32_t s_iperf_pool_top;
+static uint32_t s_iperf_pattern_len;
+static bool s_iperf_pattern_random;
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+static uint8_t s_iperf_pool_buffer[IPERF_BUFFER_POOL_LEN];
+static StackType_t s_iperf_traffic_stack[IPERF_TRAFFIC_TASK_STACK];
+static StaticTask_t s_iperf_traffic_tcb;
+static StackType_t s_iperf_report_stack[IPERF_REPORT_TASK_STACK];
+static StaticTask_t s_iperf_report_tcb;
+static StackType_t s_iperf_worker_stacks[IPERF_STATIC_WORKERS][IPERF_STREAM_TASK_STACK];
+static StaticTask_t s_iperf_worker_tcbs[IPERF_STATIC_WORKERS];
+#endif
 static const char *TAG = "iperf";
 
 inline static bool iperf_is_udp_client(void)
@@ -51,6 +214,17 @@ inline static bool iperf_is_tcp_server(void)
     return ((s_iperf_ctrl.cfg.flag & IPERF_FLAG_SERVER) && (s_iperf_ctrl.cfg.flag & IPERF_FLAG_TCP));
 }
 
+// Data goes from the client to the server, unless reversed, or both ways
+inline static bool iperf_client_sends(void)
+{
+    return !(s_iperf_ctrl.cfg.flag & IPERF_FLAG_REVERSE) || (s_iperf_ctrl.cfg.flag & IPERF_FLAG_DUPLEX);
+}
+
+inline static bool iperf_server_sends(void)
+{
+    return s_iperf_ctrl.cfg.flag & (IPERF_FLAG_REVERSE | IPERF_FLAG_DUPLEX);
+}
+
 static int iperf_get_socket_error_code(int sockfd)
 {
     return errno;
@@ -66,150 +240,1005 @@ static int iperf_show_socket_error_reason(const char *str, int sockfd)
     return err;
 }
 
-static void iperf_report_task(void *arg)
+// Pseudo random words from their offset, so any part of the pool can be filled on its own
+static uint32_t iperf_pattern_word(uint32_t i)
+{
+    uint32_t x = i + 0x9e3779b9;
+
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
+static void iperf_pattern_fill(uint32_t from, uint32_t to)
+{
+    // The pool is word aligned and a multiple of words long, from is a word boundary
+    to = (to + 3) & ~3;
+    if (!s_iperf_pattern_random) {
+        memset(&s_iperf_pool[from], 0, to - from);
+        return;
+    }
+    for (uint32_t i = from / 4; i < to / 4; i++) {
+        uint32_t word = iperf_pattern_word(i);
+        memcpy(&s_iperf_pool[i * 4], &word, sizeof(word));
+    }
+}
+
+static uint8_t *iperf_buffer_alloc(uint32_t len, bool tx)
+{
+    uint8_t *buffer;
+
+    if (len > s_iperf_pool_top - s_iperf_pool_bottom) {
+        ESP_LOGE(TAG, "create buffer: %d bytes more than left of IPERF_BUFFER_POOL_LEN", len);
+        return NULL;
+    }
+    if (tx) {
+        buffer = &s_iperf_pool[s_iperf_pool_bottom];
+        s_iperf_pool_bottom += len;
+        if (s_iperf_pool_bottom > s_iperf_pattern_len) {
+            iperf_pattern_fill(s_iperf_pattern_len, s_iperf_pool_bottom);
+            s_iperf_pattern_len = (s_iperf_pool_bottom + 3) & ~3;
+        }
+    } else {
+        s_iperf_pool_top -= len;
+        buffer = &s_iperf_pool[s_iperf_pool_top];
+        if (s_iperf_pool_top < s_iperf_pattern_len) {
+            s_iperf_pattern_len = s_iperf_pool_top & ~3;
+        }
+    }
+    return buffer;
+}
+
+// Hand the pool to the next test, keeping the pattern unless another one is asked for
+static void iperf_pool_reset(void)
+{
+    bool random = s_iperf_ctrl.cfg.flag & IPERF_FLAG_INCOMPRESSIBLE;
+
+    if (random != s_iperf_pattern_random) {
+        s_iperf_pattern_random = random;
+        s_iperf_pattern_len = 0;
+    }
+    s_iperf_pool_bottom = 0;
+    s_iperf_pool_top = IPERF_BUFFER_POOL_LEN;
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        s_iperf_ctrl.streams[i].buffer = NULL;
+    }
+}
+
+static int64_t iperf_time_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void iperf_hist_add(iperf_hist_t *hist, uint32_t value)
+{
+    int bucket = value;
+
+    if (value >= IPERF_HIST_SUB) {
+        int shift = 31 - __builtin_clz(value) - IPERF_HIST_SUB_BITS;
+        bucket = (shift + 1) * IPERF_HIST_SUB + (value >> shift) - IPERF_HIST_SUB;
+    }
+    if (hist->count == 0 || value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    hist->count++;
+    hist->sum += value;
+    hist->buckets[bucket]++;
+}
+
+static uint32_t iperf_hist_lower(int bucket)
+{
+    if (bucket < IPERF_HIST_SUB) {
+        return bucket;
+    }
+    return (uint32_t)(IPERF_HIST_SUB + bucket % IPERF_HIST_SUB) << (bucket / IPERF_HIST_SUB - 1);
+}
+
+// Upper end of the bucket the percentile falls in, at most 1/8 above the value
+static uint32_t iperf_hist_percentile(const iperf_hist_t *hist, uint32_t percent)
+{
+    uint64_t rank = ((uint64_t)hist->count * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < IPERF_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > 0 && seen >= rank) {
+            uint32_t upper = i + 1 < IPERF_HIST_BUCKETS ? iperf_hist_lower(i + 1) - 1 : UINT32_MAX;
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static uint32_t iperf_hist_avg(const iperf_hist_t *hist)
+{
+    return hist->count ? hist->sum / hist->count : 0;
+}
+
+static void iperf_record_delay(iperf_stream_t *stream, uint32_t delay_us)
+{
+    portENTER_CRITICAL(&s_iperf_lock);
+    if (stream->delay.count == 0 || delay_us < stream->delay.min_us) {
+        stream->delay.min_us = delay_us;
+    }
+    if (delay_us > stream->delay.max_us) {
+        stream->delay.max_us = delay_us;
+    }
+    stream->delay.sum_us += delay_us;
+    stream->delay.count++;
+    iperf_hist_add(&s_iperf_ctrl.delay, delay_us);
+    portEXIT_CRITICAL(&s_iperf_lock);
+}
+
+static bool iperf_udp_is_fin(const uint8_t *data, int len)
+{
+    int32_t id;
+
+    if (len < sizeof(iperf_udp_datagram_t)) {
+        return false;
+    }
+    memcpy(&id, data, sizeof(id));
+    return (int32_t)ntohl(id) < 0;
+}
+
+// Account a received UDP datagram, the way iperf2 does. Returns false for the final datagram of the stream.
+static bool iperf_udp_account(iperf_stream_t *stream, const uint8_t *data, int len)
+{
+    iperf_udp_stats_t *udp = &stream->udp;
+    iperf_udp_datagram_t hdr;
+
+    if (len < sizeof(hdr)) {
+        return true;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    int32_t id = ntohl(hdr.id);
+    int64_t now_us = iperf_time_us();
+    int64_t transit_us = now_us - ((int64_t)ntohl(hdr.tv_sec) * 1000000 + ntohl(hdr.tv_usec));
+
+    if (id < 0) {
+        // The final datagram repeats the last sequence number negated, it is not counted
+        return false;
+    }
+    if (udp->packets == 0) {
+        udp->last_id = id - 1;
+        udp->first_us = now_us;
+    } else {
+        // Clocks of the two ends need not agree, the offset cancels out in the difference
+        int64_t d = transit_us - udp->last_transit_us;
+        udp->jitter_us += ((d < 0 ? -d : d) - udp->jitter_us) / 16;
+    }
+    // Clocks need not agree either, the delay is counted from the fastest datagram so far, what queues added to it
+    if (udp->packets == 0 || transit_us < stream->delay_base_us) {
+        stream->delay_base_us = transit_us;
+    }
+    iperf_record_delay(stream, transit_us - stream->delay_base_us);
+    udp->last_transit_us = transit_us;
+    udp->last_us = now_us;
+    udp->packets++;
+    if (id > udp->last_id + 1) {
+        udp->lost += id - udp->last_id - 1;
+    } else if (id <= udp->last_id) {
+        udp->out_of_order++;
+        if (udp->lost > 0) {
+            udp->lost--;
+        }
+    }
+    if (id > udp->last_id) {
+        udp->last_id = id;
+    }
+    return true;
+}
+
+static uint32_t iperf_kbps(uint64_t len, uint32_t seconds)
+{
+    return len * 8 / 1000 / seconds;
+}
+
+static bool iperf_json(void)
+{
+    return s_iperf_ctrl.cfg.flag & IPERF_FLAG_JSON;
+}
+
+/**
+ * One stream over an interval, or over the whole run with delay NULL. In JSON
+ * mode an object of the streams array, the rates in kbit/s and times in
+ * microseconds.
+ */
+static void iperf_print_stream(const iperf_stream_t *stream, uint32_t from, uint32_t to, uint64_t len, const iperf_udp_stats_t *prev,
+                               const iperf_delay_t *delay, bool first)
+{
+    uint32_t kbps = iperf_kbps(len, to - from);
+    bool udp_rx = !stream->tx && (s_iperf_ctrl.cfg.flag & IPERF_FLAG_UDP);
+    const iperf_udp_stats_t *udp = &stream->udp;
+    uint32_t lost = udp->lost - prev->lost;
+    uint32_t total = lost + udp->packets - prev->packets;
+    uint32_t requested_kbps = stream->tx && s_iperf_ctrl.cfg.bw_lim_kbps > 0 ? s_iperf_ctrl.cfg.bw_lim_kbps : 0;
+
+    if (iperf_json()) {
+        printf("%s{\"id\":%d,\"dir\":\"%s\",\"bytes\":%llu,\"kbps\":%u", first ? "" : ",", stream->id, stream->tx ? "tx" : "rx", len, kbps);
+        if (udp_rx) {
+            printf(",\"packets\":%u,\"lost\":%u,\"out_of_order\":%u,\"jitter_us\":%u", total, lost, udp->out_of_order - prev->out_of_order,
+                   (uint32_t)udp->jitter_us);
+        }
+        if (udp_rx && delay && delay->count) {
+            printf(",\"delay_min_us\":%u,\"delay_avg_us\":%u,\"delay_max_us\":%u", delay->min_us, (uint32_t)(delay->sum_us / delay->count), delay->max_us);
+        }
+        if (requested_kbps) {
+            printf(",\"requested_kbps\":%u", requested_kbps);
+        }
+        if (!delay) {
+            printf(",\"send_errors\":%u,\"pacer_behind\":%u", stream->send_errors, stream->pacer_behind);
+        }
+        printf("}");
+        return;
+    }
+
+    printf("[%3d] %s %4u-%4u sec " IPERF_MBPS_FMT " Mbits/sec", stream->id, stream->tx ? "tx" : "rx", from, to, IPERF_MBPS(kbps));
+    if (udp_rx) {
+        uint32_t permille = total ? lost * 1000 / total : 0;
+        printf(" " IPERF_MS_FMT " ms %6u/%6u (%u.%u%%) %6u", IPERF_MS((uint32_t)udp->jitter_us), lost, total, permille / 10, permille % 10,
+               udp->out_of_order - prev->out_of_order);
+    }
+    if (udp_rx && delay && delay->count) {
+        printf(" " IPERF_MS_FMT "/" IPERF_MS_FMT "/" IPERF_MS_FMT " ms", IPERF_MS(delay->min_us), IPERF_MS((uint32_t)(delay->sum_us / delay->count)),
+               IPERF_MS(delay->max_us));
+    }
+    if (requested_kbps) {
+        // Achieved against requested rate of a paced sender
+        uint32_t permille = (uint64_t)kbps * 1000 / requested_kbps;
+        printf("  %u.%u%% of " IPERF_MBPS_FMT " Mbits/sec", permille / 10, permille % 10, IPERF_MBPS(requested_kbps));
+    }
+    printf("\n");
+}
+
+/**
+ * Aggregate of the streams in one direction, added to the throughput histogram
+ * of the direction for an interval. For the whole run also how evenly the link
+ * was shared, Jain's index in per mille, 1000 when every stream got the same
+ * share and 1000/n when one took everything. In JSON the object is preceded by
+ * a comma unless it is the first, first is cleared once one was written.
+ */
+static void iperf_print_sum(int n, bool tx, uint32_t from, uint32_t to, bool total, bool *first)
+{
+    uint64_t sum = 0;
+    uint64_t kbps_sum = 0;
+    uint64_t squares = 0;
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        const iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+        if (stream->tx == tx) {
+            uint64_t len = total ? stream->total_len : stream->total_len - stream->reported_len;
+            uint32_t kbps = iperf_kbps(len, to - from);
+            sum += len;
+            kbps_sum += kbps;
+            squares += (uint64_t)kbps * kbps;
+            count++;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    uint32_t kbps = iperf_kbps(sum, to - from);
+    uint32_t fairness = squares ? kbps_sum * kbps_sum * 1000 / (count * squares) : 1000;
+    if (!total) {
+        iperf_hist_add(&s_iperf_ctrl.throughput[tx], kbps);
+    }
+    if (iperf_json()) {
+        printf("%s\"%s\":{\"streams\":%d,\"bytes\":%llu,\"kbps\":%u", *first ? "" : ",", tx ? "tx" : "rx", count, sum, kbps);
+        *first = false;
+        if (total) {
+            printf(",\"fairness_permille\":%u", fairness);
+        }
+        printf("}");
+        return;
+    }
+    if (count < 2) {
+        return;
+    }
+    printf("[SUM] %s %4u-%4u sec " IPERF_MBPS_FMT " Mbits/sec", tx ? "tx" : "rx", from, to, IPERF_MBPS(kbps));
+    if (total) {
+        printf("  fairness %u.%03u", fairness / 1000, fairness % 1000);
+    }
+    printf("\n");
+}
+
+static void iperf_print_sums(int n, uint32_t from, uint32_t to, bool total)
+{
+    bool first = true;
+
+    if (iperf_json()) {
+        printf("],\"sum\":{");
+    }
+    iperf_print_sum(n, true, from, to, total, &first);
+    iperf_print_sum(n, false, from, to, total, &first);
+    if (iperf_json()) {
+        printf("}");
+    }
+}
+
+// How the interval rates and the delays of the run were spread
+static void iperf_print_distribution(void)
+{
+    const iperf_hist_t *delay = &s_iperf_ctrl.delay;
+
+    if (iperf_json()) {
+        printf(",\"interval_kbps\":{");
+        for (int tx = 1; tx >= 0; tx--) {
+            const iperf_hist_t *hist = &s_iperf_ctrl.throughput[tx];
+            printf("%s\"%s\":{\"intervals\":%u,\"min\":%u,\"avg\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u}", tx ? "" : ",", tx ? "tx" : "rx", hist->count,
+                   hist->min, iperf_hist_avg(hist), iperf_hist_percentile(hist, 50), iperf_hist_percentile(hist, 90), iperf_hist_percentile(hist, 99), hist->max);
+        }
+        printf("},\"delay_us\":{\"datagrams\":%u,\"min\":%u,\"avg\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u,\"histogram\":[", delay->count, delay->min,
+               iperf_hist_avg(delay), iperf_hist_percentile(delay, 50), iperf_hist_percentile(delay, 90), iperf_hist_percentile(delay, 99), delay->max);
+        bool first = true;
+        for (int i = 0; i < IPERF_HIST_BUCKETS; i++) {
+            if (delay->buckets[i]) {
+                // Lower end of the bucket and its count
+                printf("%s[%u,%u]", first ? "" : ",", iperf_hist_lower(i), delay->buckets[i]);
+                first = false;
+            }
+        }
+        printf("]}");
+        return;
+    }
+
+    for (int tx = 1; tx >= 0; tx--) {
+        const iperf_hist_t *hist = &s_iperf_ctrl.throughput[tx];
+        if (hist->count > 1) {
+            printf("      %s %u intervals, min " IPERF_MBPS_FMT " avg " IPERF_MBPS_FMT " p50 " IPERF_MBPS_FMT " p90 " IPERF_MBPS_FMT " p99 " IPERF_MBPS_FMT
+                   " max " IPERF_MBPS_FMT " Mbits/sec\n", tx ? "tx" : "rx", hist->count, IPERF_MBPS(hist->min), IPERF_MBPS(iperf_hist_avg(hist)),
+                   IPERF_MBPS(iperf_hist_percentile(hist, 50)), IPERF_MBPS(iperf_hist_percentile(hist, 90)), IPERF_MBPS(iperf_hist_percentile(hist, 99)),
+                   IPERF_MBPS(hist->max));
+        }
+    }
+    if (delay->count) {
+        printf("      rx delay over the lowest, %u datagrams, avg " IPERF_MS_FMT " p50 " IPERF_MS_FMT " p90 " IPERF_MS_FMT " p99 " IPERF_MS_FMT " max " IPERF_MS_FMT
+               " ms\n", delay->count, IPERF_MS(iperf_hist_avg(delay)), IPERF_MS(iperf_hist_percentile(delay, 50)), IPERF_MS(iperf_hist_percentile(delay, 90)),
+               IPERF_MS(iperf_hist_percentile(delay, 99)), IPERF_MS(delay->max));
+    }
+}
+
+static void iperf_print_sockopt(const char *name, int value)
+{
+    if (iperf_json()) {
+        if (value < 0) {
+            printf(",\"%s\":null", name);
+        } else {
+            printf(",\"%s\":%d", name, value);
+        }
+    } else if (value < 0) {
+        printf(" %s n/a", name);
+    } else {
+        printf(" %s %d", name, value);
+    }
+}
+
+/**
+ * The socket options in effect, as far as lwip tells, and the build options of
+ * lwip that decide the rest: the TCP window and send buffer are fixed at build
+ * time, SO_RCVBUF only limits what waits in the socket.
+ */
+static void iperf_print_socket_options(void)
+{
+    const iperf_sockopts_t *opts = &s_iperf_ctrl.sockopts;
+    bool tcp = s_iperf_ctrl.cfg.flag & IPERF_FLAG_TCP;
+
+    printf(iperf_json() ? ",\"socket\":{\"tcp\":%s" : "Socket (%s):", tcp ? (iperf_json() ? "true" : "tcp") : (iperf_json() ? "false" : "udp"));
+    if (tcp) {
+        iperf_print_sockopt("nodelay", opts->nodelay);
+        iperf_print_sockopt("mss", opts->mss);
+    }
+    iperf_print_sockopt("sndbuf", opts->sndbuf);
+    iperf_print_sockopt("rcvbuf", opts->rcvbuf);
+    if (tcp) {
+        iperf_print_sockopt("lwip_tcp_mss", TCP_MSS);
+        iperf_print_sockopt("lwip_tcp_wnd", TCP_WND);
+        iperf_print_sockopt("lwip_tcp_snd_buf", TCP_SND_BUF);
+#if LWIP_WND_SCALE
+        iperf_print_sockopt("lwip_wnd_scale", TCP_RCV_SCALE);
+#else
+        iperf_print_sockopt("lwip_wnd_scale", -1);
+#endif
+    }
+    printf(iperf_json() ? "}" : "\n");
+}
+
+static void iperf_report(void)
 {
     uint32_t interval = s_iperf_ctrl.cfg.interval;
     uint32_t time = s_iperf_ctrl.cfg.time;
     TickType_t delay_interval = (interval * 1000) / portTICK_PERIOD_MS;
     uint32_t cur = 0;
-    double average = 0;
-    double actual_bandwidth = 0;
-    int k = 1;
-
-    printf("\n%16s %s\n", "Interval", "Bandwidth");
+    const iperf_udp_stats_t zero = {0};
+    // A sweep prints a line per test when it is over
+    bool quiet = s_iperf_ctrl.cfg.sweep_count > 0;
+
+    if (quiet || iperf_json()) {
+        // One object per line, easy to plot or to diff between builds
+    } else if (s_iperf_ctrl.cfg.flag & IPERF_FLAG_UDP) {
+        iperf_print_socket_options();
+        printf("\n%5s %2s %13s %22s %10s %22s %6s %21s\n", "ID", "", "Interval", "Bandwidth", "Jitter", "Lost/Total", "Reord", "Delay min/avg/max");
+    } else {
+        iperf_print_socket_options();
+        printf("\n%5s %2s %13s %22s\n", "ID", "", "Interval", "Bandwidth");
+    }
     while (!s_iperf_ctrl.finish) {
         vTaskDelay(delay_interval);
-        actual_bandwidth = (s_iperf_ctrl.actual_len / 1e6 * 8) / interval;
-        printf("%4d-%4d sec       %.2f Mbits/sec\n", cur, cur + interval,
-            actual_bandwidth);
+        int n = s_iperf_ctrl.num_streams;
+        if (quiet) {
+            n = 0;
+        } else if (iperf_json()) {
+            printf("{\"event\":\"interval\",\"start\":%u,\"end\":%u,\"streams\":[", cur, cur + interval);
+        }
+        for (int i = 0; i < n; i++) {
+            iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+            portENTER_CRITICAL(&s_iperf_lock);
+            iperf_udp_stats_t udp = stream->udp;
+            iperf_delay_t delay = stream->delay;
+            memset(&stream->delay, 0, sizeof(stream->delay));
+            portEXIT_CRITICAL(&s_iperf_lock);
+            iperf_print_stream(stream, cur, cur + interval, stream->total_len - stream->reported_len, &stream->udp_reported, &delay, i == 0);
+            stream->udp_reported = udp;
+        }
+        if (!quiet) {
+            iperf_print_sums(n, cur, cur + interval, false);
+        }
+        if (!quiet && iperf_json()) {
+            printf("}\n");
+        }
+        for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+            s_iperf_ctrl.streams[i].reported_len = s_iperf_ctrl.streams[i].total_len;
+        }
         cur += interval;
-        average = ((average * (k - 1) / k) + (actual_bandwidth / k));
-        k++;
-        s_iperf_ctrl.actual_len = 0;
         if (cur >= time) {
-            printf("%4d-%4d sec       %.2f Mbits/sec\n", 0, time,
-                average);
             break;
         }
     }
-
     s_iperf_ctrl.finish = true;
-    vTaskDelete(NULL);
+    s_iperf_ctrl.reported_time = cur;
+
+    if (cur > 0 && !quiet) {
+        int n = s_iperf_ctrl.num_streams;
+        if (iperf_json()) {
+            printf("{\"event\":\"summary\",\"start\":0,\"end\":%u,\"streams\":[", cur);
+        }
+        for (int i = 0; i < n; i++) {
+            iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+            iperf_print_stream(stream, 0, cur, stream->total_len, &zero, NULL, i == 0);
+            if (iperf_json()) {
+                continue;
+            }
+            if (stream->send_errors) {
+                printf("[%3d] %u datagrams could not be sent\n", stream->id, stream->send_errors);
+            }
+            if (stream->pacer_behind) {
+                printf("[%3d] %u bursts late, the sender could not keep up\n", stream->id, stream->pacer_behind);
+            }
+        }
+        iperf_print_sums(n, 0, cur, true);
+        iperf_print_distribution();
+        iperf_print_socket_options();
+        if (iperf_json()) {
+            printf("}\n");
+        }
+    }
 }
 
-static esp_err_t iperf_start_report(void)
+static void iperf_report_task(void *arg)
 {
-    int ret;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        iperf_report();
+        s_iperf_ctrl.report_running = false;
+    }
+}
 
-    ret = xTaskCreatePinnedToCore(iperf_report_task, IPERF_REPORT_TASK_NAME, IPERF_REPORT_TASK_STACK, NULL, IPERF_REPORT_TASK_PRIORITY, NULL, portNUM_PROCESSORS - 1);
+// The first data of a test starts the reports
+static void iperf_start_report(void)
+{
+    portENTER_CRITICAL(&s_iperf_lock);
+    bool started = s_iperf_ctrl.report_started;
+    s_iperf_ctrl.report_started = true;
+    if (!started) {
+        s_iperf_ctrl.report_running = true;
+    }
+    portEXIT_CRITICAL(&s_iperf_lock);
+    if (!started) {
+        xTaskNotifyGive(s_iperf_report_task);
+    }
+}
 
-    if (ret != pdPASS) {
-        ESP_LOGE(TAG, "create task %s failed", IPERF_REPORT_TASK_NAME);
-        return ESP_FAIL;
+// Acknowledge the final datagram with the totals, an iperf2 client prints them as the server report.
+static void iperf_udp_send_server_report(iperf_stream_t *stream, const uint8_t *fin)
+{
+    const iperf_udp_stats_t *udp = &stream->udp;
+    uint8_t reply[sizeof(iperf_udp_datagram_t) + sizeof(iperf_udp_server_report_t)];
+    int64_t duration_us = udp->last_us - udp->first_us;
+    uint32_t jitter_us = udp->jitter_us;
+    iperf_udp_server_report_t report = {
+        .flags = htonl(IPERF_UDP_REPORT_VERSION1),
+        .total_len1 = htonl(stream->total_len >> 32),
+        .total_len2 = htonl(stream->total_len),
+        .stop_sec = htonl(duration_us / 1000000),
+        .stop_usec = htonl(duration_us % 1000000),
+        .error_cnt = htonl(udp->lost),
+        .outorder_cnt = htonl(udp->out_of_order),
+        .datagrams = htonl(udp->last_id + 1),
+        .jitter1 = htonl(jitter_us / 1000000),
+        .jitter2 = htonl(jitter_us % 1000000),
+    };
+
+    memcpy(reply, fin, sizeof(iperf_udp_datagram_t));
+    memcpy(&reply[sizeof(iperf_udp_datagram_t)], &report, sizeof(report));
+    sendto(stream->sock, reply, sizeof(reply), 0, (struct sockaddr *)&stream->peer, stream->peer_len);
+}
+
+// Stamp the sequence number and send time into the datagram, when it is large enough to hold them.
+static void iperf_udp_stamp(uint8_t *buffer, int len, int32_t id)
+{
+    if (len >= sizeof(iperf_udp_datagram_t)) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        iperf_udp_datagram_t hdr = {.id = htonl(id), .tv_sec = htonl(tv.tv_sec), .tv_usec = htonl(tv.tv_usec)};
+        memcpy(buffer, &hdr, sizeof(hdr));
     }
+}
 
-    return ESP_OK;
+/**
+ * Tell the receiver the stream is over. A client that only sends waits for the
+ * server report and prints it, like an iperf2 client. Where the other direction
+ * runs on the same socket the final datagram is just repeated a few times.
+ */
+static void iperf_udp_send_fin(iperf_stream_t *stream, bool wait_report)
+{
+    uint8_t *buffer = stream->buffer;
+    int len = stream->buffer_len;
+    // Not into the send buffer, that keeps its payload pattern for the next test
+    uint8_t reply[sizeof(iperf_udp_datagram_t) + sizeof(iperf_udp_server_report_t)];
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = IPERF_UDP_FIN_TIMEOUT_MS * 1000};
+
+    if (len < sizeof(iperf_udp_datagram_t)) {
+        return;
+    }
+    setsockopt(stream->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < IPERF_UDP_FIN_TRIES; i++) {
+        iperf_udp_stamp(buffer, len, -stream->udp_next_id);
+        sendto(stream->sock, buffer, len, 0, (struct sockaddr *)&stream->peer, stream->peer_len);
+        if (!wait_report) {
+            if (i >= 2) {
+                return;
+            }
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        int n = recv(stream->sock, reply, sizeof(reply), 0);
+        if (n >= (int)sizeof(reply)) {
+            iperf_udp_server_report_t report;
+            memcpy(&report, &reply[sizeof(iperf_udp_datagram_t)], sizeof(report));
+            stream->server_report = true;
+            stream->server_bytes = ((uint64_t)ntohl(report.total_len1) << 32) | (uint32_t)ntohl(report.total_len2);
+            stream->server_us = ntohl(report.stop_sec) * 1000000 + ntohl(report.stop_usec);
+            stream->server_lost = ntohl(report.error_cnt);
+            stream->server_datagrams = ntohl(report.datagrams);
+            stream->server_jitter_us = ntohl(report.jitter1) * 1000000 + ntohl(report.jitter2);
+            if (s_iperf_ctrl.cfg.sweep_count == 0) {
+                uint32_t permille = stream->server_datagrams ? (uint64_t)stream->server_lost * 1000 / stream->server_datagrams : 0;
+                printf("[%3d] Server report: " IPERF_MBPS_FMT " Mbits/sec, jitter " IPERF_MS_FMT " ms, lost %u/%u (%u.%u%%), %d out-of-order\n", stream->id,
+                       IPERF_MBPS(stream->server_us ? (uint32_t)(stream->server_bytes * 8000 / stream->server_us) : 0), IPERF_MS(stream->server_jitter_us), stream->server_lost,
+                       stream->server_datagrams, permille / 10, permille % 10, (int)ntohl(report.outorder_cnt));
+            }
+            return;
+        }
+    }
+    if (wait_report) {
+        ESP_LOGW(TAG, "[%3d] no server report after %d tries", stream->id, IPERF_UDP_FIN_TRIES);
+    }
 }
 
-static void socket_recv(int recv_socket, struct sockaddr_storage listen_addr, uint8_t type)
+// All streams that started have ended on their own
+static bool iperf_streams_done(void)
 {
-    bool udp_recv_start = true;
-    uint8_t *buffer;
-    int want_recv = 0;
-    int actual_recv = 0;
-    socklen_t addr_len = sizeof(struct sockaddr);
+    int n = s_iperf_ctrl.num_streams;
+
+    for (int i = 0; i < n; i++) {
+        if (!s_iperf_ctrl.streams[i].done) {
+            return false;
+        }
+    }
+    return n > 0;
+}
 
-    buffer = s_iperf_ctrl.buffer;
-    want_recv = s_iperf_ctrl.buffer_len;
+static void socket_recv(iperf_stream_t *stream, uint8_t type)
+{
+    uint8_t *buffer = stream->buffer;
+    int want_recv = stream->buffer_len;
+    int actual_recv = 0;
+    int timeouts = 0;
+    bool udp_hello = type == IPERF_TRANS_TYPE_UDP && !iperf_client_sends();
 
     while (!s_iperf_ctrl.finish) {
-        if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV6) {
-            addr_len = sizeof(struct sockaddr_in6);
-            actual_recv = recvfrom(recv_socket, buffer, want_recv, 0, (struct sockaddr *)&listen_addr, &addr_len);
-        } else if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4) {
-            addr_len = sizeof(struct sockaddr_in);
-            actual_recv = recvfrom(recv_socket, buffer, want_recv, 0, (struct sockaddr *)&listen_addr, &addr_len);
+        if (udp_hello && stream->total_len == 0 && timeouts < IPERF_SOCKET_RX_TIMEOUT) {
+            // A reversed UDP stream starts when the server hears from us, repeated until data arrives
+            iperf_udp_stamp(buffer, want_recv, 0);
+            sendto(stream->sock, buffer, want_recv, 0, (struct sockaddr *)&stream->peer, stream->peer_len);
+        }
+        actual_recv = recv(stream->sock, buffer, want_recv, 0);
+        if (actual_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && ++timeouts < IPERF_SOCKET_RX_TIMEOUT) {
+            continue;
         }
         if (actual_recv < 0) {
             if (type == IPERF_TRANS_TYPE_TCP) {
-                iperf_show_socket_error_reason("tcp server recv", recv_socket);
+                iperf_show_socket_error_reason("tcp recv", stream->sock);
             }
             if (type == IPERF_TRANS_TYPE_UDP) {
-                iperf_show_socket_error_reason("udp server recv", recv_socket);
+                iperf_show_socket_error_reason("udp recv", stream->sock);
             }
-            s_iperf_ctrl.finish = true;
+            break;
+        } else if (actual_recv == 0) {
+            // The peer closed the connection
             break;
         } else {
-            if (udp_recv_start) {
-                iperf_start_report();
-                udp_recv_start = false;
+            timeouts = 0;
+            iperf_start_report();
+            stream->total_len += actual_recv;
+            if (type == IPERF_TRANS_TYPE_UDP && !iperf_udp_account(stream, buffer, actual_recv)) {
+                break;
             }
-            s_iperf_ctrl.actual_len += actual_recv;
         }
     }
 }
 
-static void socket_send(int send_socket, struct sockaddr_storage dest_addr, uint8_t type, int bw_lim)
+/**
+ * Pace the sender at period_us per burst. Deadlines are absolute, so the time
+ * send() takes does not add up. Waits longer than IPERF_PACER_SPIN_US sleep on
+ * an esp_timer that wakes the task a little early, the rest is spun, which
+ * keeps the rate within microseconds without the tick granularity of
+ * vTaskDelay.
+ */
+static void iperf_pacer_init(iperf_pacer_t *pacer, int64_t period_us, esp_timer_handle_t timer)
+{
+    pacer->timer = timer;
+    pacer->period_us = period_us;
+    pacer->next_us = esp_timer_get_time();
+}
+
+static void iperf_pacer_wait(iperf_pacer_t *pacer, iperf_stream_t *stream)
+{
+    pacer->next_us += pacer->period_us;
+    int64_t now = esp_timer_get_time();
+    if (now - pacer->next_us > pacer->period_us) {
+        // More than a burst behind, the link or the socket held us up. Sending the backlog at once would only overflow the uart.
+        pacer->next_us = now;
+        stream->pacer_behind++;
+        return;
+    }
+    if (pacer->next_us - now > IPERF_PACER_SPIN_US) {
+        esp_timer_start_once(pacer->timer, pacer->next_us - now - IPERF_PACER_SPIN_US);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    while (esp_timer_get_time() < pacer->next_us) {
+    }
+}
+
+static void socket_send(iperf_stream_t *stream, uint8_t type, esp_timer_handle_t pacer_timer)
 {
     uint8_t *buffer;
     int actual_send = 0;
     int want_send = 0;
-    int period_us = -1;
-    int delay_us = 0;
-    int64_t prev_time = 0;
-    int64_t send_time = 0;
     int err = 0;
+    uint32_t burst = s_iperf_ctrl.cfg.burst ? s_iperf_ctrl.cfg.burst : 1;
+    uint32_t burst_left = burst;
+    iperf_pacer_t pacer = { 0 };
 
-    buffer = s_iperf_ctrl.buffer;
-    want_send = s_iperf_ctrl.buffer_len;
+    buffer = stream->buffer;
+    want_send = stream->buffer_len;
     iperf_start_report();
 
-    if (bw_lim > 0) {
-        period_us = want_send * 8 / bw_lim;
+    // Bits of a burst at the requested kbit/s, in microseconds
+    int64_t period_us = s_iperf_ctrl.cfg.bw_lim_kbps > 0 ? (int64_t)burst * want_send * 8 * 1000 / s_iperf_ctrl.cfg.bw_lim_kbps : 0;
+    if (period_us > 0) {
+        iperf_pacer_init(&pacer, period_us, pacer_timer);
     }
 
     while (!s_iperf_ctrl.finish) {
-        if (period_us > 0) {
-            send_time = esp_timer_get_time();
-            if (actual_send > 0){
-                // Last packet "send" was successful, check how much off the previous loop duration was to the ideal send period. Result will adjust the
-                // next send delay.
-                delay_us += period_us + (int32_t)(prev_time - send_time);
-            } else {
-                // Last packet "send" was not successful. Ideally we should try to catch up the whole previous loop duration (e.g. prev_time - send_time).
-                // However, that's not possible since the most probable reason why the send was unsuccessful is the HW was not able to process the packet.
-                // Hence, we cannot queue more packets with shorter (or no) delay to catch up since we are already at the performance edge. The best we
-                // can do is to reset the send delay (which is probably big negative number) and start all over again.
-                delay_us = 0;
-            }
-            prev_time = send_time;
+        if (pacer.timer && burst_left == 0) {
+            iperf_pacer_wait(&pacer, stream);
+            burst_left = burst;
         }
-        if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV6) {
-            actual_send = sendto(send_socket, buffer, want_send, 0, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in6));
-        } else if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4) {
-            actual_send = sendto(send_socket, buffer, want_send, 0, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in));
+        if (type == IPERF_TRANS_TYPE_UDP) {
+            iperf_udp_stamp(buffer, want_send, stream->udp_next_id);
+            actual_send = sendto(stream->sock, buffer, want_send, 0, (struct sockaddr *)&stream->peer, stream->peer_len);
+        } else {
+            actual_send = send(stream->sock, buffer, want_send, 0);
         }
+        burst_left--;
         if (actual_send != want_send) {
             if (type == IPERF_TRANS_TYPE_UDP) {
-                err = iperf_get_socket_error_code(send_socket);
+                err = iperf_get_socket_error_code(stream->sock);
                 // ENOMEM is expected under heavy load => do not print it
                 if (err != ENOMEM) {
-                    iperf_show_socket_error_reason("udp client send", send_socket);
+                    iperf_show_socket_error_reason("udp send", stream->sock);
                 }
+                stream->send_errors++;
             }
             if (type == IPERF_TRANS_TYPE_TCP) {
-                iperf_show_socket_error_reason("tcp client send", send_socket);
-                ESP_LOGI(TAG, "tcp client send error\n");
+                iperf_show_socket_error_reason("tcp send", stream->sock);
+                ESP_LOGI(TAG, "tcp send error\n");
                 break;
             }
         } else {
-            s_iperf_ctrl.actual_len += actual_send;
+            stream->total_len += actual_send;
+            // Only datagrams that left are numbered, gaps the receiver sees were lost on the way
+            stream->udp_next_id++;
         }
-        // The send delay may be negative, it indicates we are trying to catch up and hence to not delay the loop at all.
-        if (delay_us > 0) {
-            esp_rom_delay_us(delay_us);
+    }
+    if (pacer.timer) {
+        esp_timer_stop(pacer.timer);
+    }
+    if (type == IPERF_TRANS_TYPE_UDP) {
+        iperf_udp_send_fin(stream, iperf_is_udp_client() && !iperf_server_sends());
+    }
+}
+
+static void iperf_pacer_timeout(void *arg)
+{
+    xTaskNotifyGive((TaskHandle_t)arg);
+}
+
+static void iperf_stream_task(void *arg)
+{
+    iperf_worker_t *worker = arg;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        iperf_stream_t *stream = worker->stream;
+        if (!stream) {
+            // The pacer timer of the last test fired as it was stopped
+            continue;
+        }
+        uint8_t type = (s_iperf_ctrl.cfg.flag & IPERF_FLAG_UDP) ? IPERF_TRANS_TYPE_UDP : IPERF_TRANS_TYPE_TCP;
+        if (stream->tx) {
+            socket_send(stream, type, worker->pacer_timer);
+        } else {
+            socket_recv(stream, type);
+        }
+        stream->done = true;
+        portENTER_CRITICAL(&s_iperf_lock);
+        worker->stream = NULL;
+        s_iperf_ctrl.tasks--;
+        portEXIT_CRITICAL(&s_iperf_lock);
+    }
+}
+
+// An idle worker, or a new one while there are fewer than IPERF_MAX_WORKERS
+static iperf_worker_t *iperf_get_worker(void)
+{
+    for (int i = 0; i < s_iperf_num_workers; i++) {
+        if (!s_iperf_workers[i].stream) {
+            return &s_iperf_workers[i];
+        }
+    }
+    if (s_iperf_num_workers >= IPERF_MAX_WORKERS) {
+        ESP_LOGE(TAG, "all %d stream tasks busy", IPERF_MAX_WORKERS);
+        return NULL;
+    }
+
+    iperf_worker_t *worker = &s_iperf_workers[s_iperf_num_workers];
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    worker->task = xTaskCreateStaticPinnedToCore(iperf_stream_task, IPERF_STREAM_TASK_NAME, IPERF_STREAM_TASK_STACK, worker, IPERF_TRAFFIC_TASK_PRIORITY,
+                                                 s_iperf_worker_stacks[s_iperf_num_workers], &s_iperf_worker_tcbs[s_iperf_num_workers], portNUM_PROCESSORS - 1);
+#else
+    if (xTaskCreatePinnedToCore(iperf_stream_task, IPERF_STREAM_TASK_NAME, IPERF_STREAM_TASK_STACK, worker, IPERF_TRAFFIC_TASK_PRIORITY, &worker->task,
+                                portNUM_PROCESSORS - 1) != pdPASS) {
+        worker->task = NULL;
+    }
+#endif
+    if (!worker->task) {
+        ESP_LOGE(TAG, "create task %s failed", IPERF_STREAM_TASK_NAME);
+        return NULL;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = iperf_pacer_timeout,
+        .arg = worker->task,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "iperf_pacer",
+    };
+    if (esp_timer_create(&timer_args, &worker->pacer_timer) != ESP_OK) {
+        // The slot is not counted, the next try creates the task again
+        ESP_LOGE(TAG, "create pacer timer failed");
+        vTaskDelete(worker->task);
+        worker->task = NULL;
+        return NULL;
+    }
+    s_iperf_num_workers++;
+    return worker;
+}
+
+/**
+ * Add a stream on sock, sending or receiving. buffer_len 0 leaves the stream
+ * without a buffer, the UDP server receives for all its streams in one. With
+ * start set the stream runs on a worker task of its own.
+ */
+static iperf_stream_t *iperf_add_stream(int id, bool tx, int sock, bool own_sock, const struct sockaddr_storage *peer, socklen_t peer_len,
+                                        uint32_t buffer_len, bool start)
+{
+    if (s_iperf_ctrl.num_streams >= IPERF_STREAM_SLOTS) {
+        return NULL;
+    }
+    iperf_stream_t *stream = &s_iperf_ctrl.streams[s_iperf_ctrl.num_streams];
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+    stream->tx = tx;
+    stream->sock = sock;
+    stream->own_sock = own_sock;
+    if (peer) {
+        memcpy(&stream->peer, peer, peer_len);
+        stream->peer_len = peer_len;
+    }
+    if (buffer_len > 0) {
+        stream->buffer = iperf_buffer_alloc(buffer_len, tx);
+        if (!stream->buffer) {
+            return NULL;
         }
+        stream->buffer_len = buffer_len;
+    }
+    iperf_worker_t *worker = start ? iperf_get_worker() : NULL;
+    if (start && !worker) {
+        return NULL;
+    }
+    // The report task reads the streams, publish this one once it is complete
+    portENTER_CRITICAL(&s_iperf_lock);
+    s_iperf_ctrl.num_streams++;
+    if (worker) {
+        s_iperf_ctrl.tasks++;
+        worker->stream = stream;
+    }
+    portEXIT_CRITICAL(&s_iperf_lock);
+    if (worker) {
+        xTaskNotifyGive(worker->task);
     }
+    return stream;
+}
+
+static void iperf_setsockopt(int sock, int level, int name, int value, const char *what, int bit)
+{
+    if (setsockopt(sock, level, name, &value, sizeof(value)) != 0 && !(s_iperf_ctrl.sockopts_failed & bit)) {
+        s_iperf_ctrl.sockopts_failed |= bit;
+        ESP_LOGW(TAG, "%s %d not taken by the stack: %s", what, value, strerror(errno));
+    }
+}
+
+// The options asked for, before connect() or listen() so a TCP connection starts out with them
+static void iperf_set_socket_options(int sock, bool tcp)
+{
+    const iperf_cfg_t *cfg = &s_iperf_ctrl.cfg;
+
+    if (cfg->sndbuf) {
+        iperf_setsockopt(sock, SOL_SOCKET, SO_SNDBUF, cfg->sndbuf, "SO_SNDBUF", 1);
+    }
+    if (cfg->rcvbuf) {
+        iperf_setsockopt(sock, SOL_SOCKET, SO_RCVBUF, cfg->rcvbuf, "SO_RCVBUF", 2);
+    }
+    if (tcp && (cfg->flag & IPERF_FLAG_NODELAY)) {
+        iperf_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", 4);
+    }
+    if (tcp && cfg->mss) {
+        iperf_setsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, cfg->mss, "TCP_MAXSEG", 8);
+    }
+}
+
+static int iperf_getsockopt(int sock, int level, int name)
+{
+    int value;
+    socklen_t len = sizeof(value);
+
+    return getsockopt(sock, level, name, &value, &len) == 0 ? value : -1;
+}
+
+static void iperf_read_socket_options(int sock, bool tcp)
+{
+    s_iperf_ctrl.sockopts.sndbuf = iperf_getsockopt(sock, SOL_SOCKET, SO_SNDBUF);
+    s_iperf_ctrl.sockopts.rcvbuf = iperf_getsockopt(sock, SOL_SOCKET, SO_RCVBUF);
+    s_iperf_ctrl.sockopts.nodelay = tcp ? iperf_getsockopt(sock, IPPROTO_TCP, TCP_NODELAY) : -1;
+    s_iperf_ctrl.sockopts.mss = tcp ? iperf_getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG) : -1;
+}
+
+static uint32_t iperf_get_buffer_len(bool tx)
+{
+    bool udp = s_iperf_ctrl.cfg.flag & IPERF_FLAG_UDP;
+    // Only a lone stream from the client gets the large buffers, with several every one has a small one
+    bool single = (s_iperf_ctrl.cfg.flag & IPERF_FLAG_CLIENT) && s_iperf_ctrl.cfg.num_streams <= 1 && !iperf_server_sends();
+
+    if (tx && s_iperf_ctrl.cfg.len_send_buf != 0) {
+        return s_iperf_ctrl.cfg.len_send_buf;
+    }
+    if (tx && udp) {
+        return IPERF_UDP_TX_LEN;
+    }
+    if (tx && single) {
+        return IPERF_TCP_TX_LEN;
+    }
+    return IPERF_STREAM_BUFFER_LEN;
+}
+
+// Add the streams of a new connection, or UDP flow, in the directions the mode asks for.
+static esp_err_t iperf_add_connection(int sock, bool own_sock, const struct sockaddr_storage *peer, socklen_t peer_len, bool rx_task)
+{
+    bool client = s_iperf_ctrl.cfg.flag & IPERF_FLAG_CLIENT;
+    bool tx = client ? iperf_client_sends() : iperf_server_sends();
+    bool rx = client ? iperf_server_sends() : iperf_client_sends();
+    int id = ++s_iperf_ctrl.connections;
+
+    if (id == 1) {
+        iperf_read_socket_options(sock, s_iperf_ctrl.cfg.flag & IPERF_FLAG_TCP);
+    }
+    if (tx && !iperf_add_stream(id, true, sock, own_sock, peer, peer_len, iperf_get_buffer_len(true), true)) {
+        return ESP_FAIL;
+    }
+    if (rx && !iperf_add_stream(id, false, sock, own_sock && !tx, peer, peer_len, rx_task ? iperf_get_buffer_len(false) : 0, rx_task)) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static iperf_stream_t *iperf_find_udp_stream(const struct sockaddr_storage *from, socklen_t from_len, bool tx)
+{
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+        if (stream->tx == tx && stream->peer_len == from_len && memcmp(&stream->peer, from, from_len) == 0) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+// Connections with a stream still running, a sweep leaves a finished one per length on the server
+static int iperf_running_connections(void)
+{
+    int running = 0;
+
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        const iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+        const iperf_stream_t *prev = i > 0 ? &s_iperf_ctrl.streams[i - 1] : NULL;
+        // Both streams of a connection are added together and share its id
+        if (!stream->done && !(prev && prev->id == stream->id && !prev->done)) {
+            running++;
+        }
+    }
+    return running;
+}
+
+// Wait for the stream tasks to end and close the sockets they used.
+static void iperf_close_streams(void)
+{
+    s_iperf_ctrl.finish = true;
+    while (s_iperf_ctrl.tasks > 0) {
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+        if (stream->own_sock) {
+            shutdown(stream->sock, 0);
+            close(stream->sock);
+        }
+    }
+}
+
+static void iperf_set_rx_timeout(int sock)
+{
+    // Short, so a stream notices the end of the test, IPERF_SOCKET_RX_TIMEOUT of them in a row end the stream
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 }
 
 static esp_err_t IRAM_ATTR iperf_run_tcp_server(void)
@@ -219,10 +1248,9 @@ static esp_err_t IRAM_ATTR iperf_run_tcp_server(void)
     int opt = 1;
     int err = 0;
     esp_err_t ret = ESP_OK;
-    struct sockaddr_in remote_addr;
+    struct sockaddr_storage remote_addr;
     struct timeval timeout = { 0 };
-    socklen_t addr_len = sizeof(struct sockaddr);
-    struct sockaddr_storage listen_addr = { 0 };
+    socklen_t addr_len = sizeof(remote_addr);
     struct sockaddr_in6 listen_addr6 = { 0 };
     struct sockaddr_in listen_addr4 = { 0 };
 
@@ -244,13 +1272,6 @@ static esp_err_t IRAM_ATTR iperf_run_tcp_server(void)
 
         err = bind(listen_socket, (struct sockaddr *)&listen_addr6, sizeof(listen_addr6));
         ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Socket unable to bind: errno %d, IPPROTO: %d", errno, AF_INET6);
-        err = listen(listen_socket, 1);
-        ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Error occurred during listen: errno %d", errno);
-
-        timeout.tv_sec = IPERF_SOCKET_RX_TIMEOUT;
-        setsockopt(listen_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-        memcpy(&listen_addr, &listen_addr6, sizeof(listen_addr6));
     } else if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4) {
         listen_addr4.sin_family = AF_INET;
         listen_addr4.sin_port = htons(s_iperf_ctrl.cfg.sport);
@@ -265,31 +1286,44 @@ static esp_err_t IRAM_ATTR iperf_run_tcp_server(void)
 
         err = bind(listen_socket, (struct sockaddr *)&listen_addr4, sizeof(listen_addr4));
         ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Socket unable to bind: errno %d, IPPROTO: %d", errno, AF_INET);
-
-        err = listen(listen_socket, 5);
-        ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Error occurred during listen: errno %d", errno);
-        memcpy(&listen_addr, &listen_addr4, sizeof(listen_addr4));
     }
+    // Accepted connections take most options from the listening socket, they are set again on each below
+    iperf_set_socket_options(listen_socket, true);
+    err = listen(listen_socket, IPERF_MAX_STREAMS);
+    ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Error occurred during listen: errno %d", errno);
 
-    client_socket = accept(listen_socket, (struct sockaddr *)&remote_addr, &addr_len);
-    ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to accept connection: errno %d", errno);
-    ESP_LOGI(TAG, "accept: %s,%d\n", inet_ntoa(remote_addr.sin_addr), htons(remote_addr.sin_port));
-
-    timeout.tv_sec = IPERF_SOCKET_RX_TIMEOUT;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    socket_recv(client_socket, listen_addr, IPERF_TRANS_TYPE_TCP);
-exit:
-    if (client_socket != -1) {
-        close(client_socket);
+    // Accept parallel streams until the test is over, or all of them have ended
+    timeout.tv_sec = IPERF_SOCKET_ACCEPT_TIMEOUT;
+    setsockopt(listen_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (!s_iperf_ctrl.finish && !iperf_streams_done()) {
+        addr_len = sizeof(remote_addr);
+        client_socket = accept(listen_socket, (struct sockaddr *)&remote_addr, &addr_len);
+        if (client_socket < 0) {
+            continue;
+        }
+        if (s_iperf_ctrl.connections >= IPERF_MAX_STREAMS) {
+            ESP_LOGW(TAG, "more than %d streams, closing", IPERF_MAX_STREAMS);
+            close(client_socket);
+            continue;
+        }
+        ESP_LOGI(TAG, "accept: stream %d", s_iperf_ctrl.connections + 1);
+        iperf_set_socket_options(client_socket, true);
+        iperf_set_rx_timeout(client_socket);
+        if (iperf_add_connection(client_socket, true, NULL, 0, true) != ESP_OK) {
+            ESP_LOGW(TAG, "Unable to start stream %d", s_iperf_ctrl.connections);
+            // Closed here unless a stream of this connection took it over
+            if (s_iperf_ctrl.num_streams == 0 || s_iperf_ctrl.streams[s_iperf_ctrl.num_streams - 1].sock != client_socket) {
+                close(client_socket);
+            }
+        }
     }
-
+exit:
+    iperf_close_streams();
     if (listen_socket != -1) {
         shutdown(listen_socket, 0);
         close(listen_socket);
         ESP_LOGI(TAG, "TCP Socket server is closed.");
     }
-    s_iperf_ctrl.finish = true;
     return ret;
 }
 
@@ -298,45 +1332,52 @@ static esp_err_t iperf_run_tcp_client(void)
     int client_socket = -1;
     int err = 0;
     esp_err_t ret = ESP_OK;
-    struct sockaddr_storage dest_addr = { 0 };
     struct sockaddr_in6 dest_addr6 = { 0 };
     struct sockaddr_in dest_addr4 = { 0 };
 
     ESP_GOTO_ON_FALSE((s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV6 || s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4), ESP_FAIL, exit, TAG, "Ivalid AF types");
 
-    if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV6) {
-        client_socket = socket(AF_INET6, SOCK_STREAM, IPPROTO_IPV6);
-        ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
-
-        inet6_aton(s_iperf_ctrl.cfg.destination_ip6, &dest_addr6.sin6_addr);
-        dest_addr6.sin6_family = AF_INET6;
-        dest_addr6.sin6_port = htons(s_iperf_ctrl.cfg.dport);
+    for (int i = 0; i < s_iperf_ctrl.cfg.num_streams; i++) {
+        if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV6) {
+            client_socket = socket(AF_INET6, SOCK_STREAM, IPPROTO_IPV6);
+            ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
+            iperf_set_socket_options(client_socket, true);
 
-        err = connect(client_socket, (struct sockaddr *)&dest_addr6, sizeof(struct sockaddr_in6));
-        ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Socket unable to connect: errno %d", errno);
-        ESP_LOGI(TAG, "Successfully connected");
-        memcpy(&dest_addr, &dest_addr6, sizeof(dest_addr6));
-    } else if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4) {
-        client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
+            inet6_aton(s_iperf_ctrl.cfg.destination_ip6, &dest_addr6.sin6_addr);
+            dest_addr6.sin6_family = AF_INET6;
+            dest_addr6.sin6_port = htons(s_iperf_ctrl.cfg.dport);
 
-        dest_addr4.sin_family = AF_INET;
-        dest_addr4.sin_port = htons(s_iperf_ctrl.cfg.dport);
-        dest_addr4.sin_addr.s_addr = s_iperf_ctrl.cfg.destination_ip4;
-        err = connect(client_socket, (struct sockaddr *)&dest_addr4, sizeof(struct sockaddr_in));
+            err = connect(client_socket, (struct sockaddr *)&dest_addr6, sizeof(struct sockaddr_in6));
+        } else {
+            client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
+            iperf_set_socket_options(client_socket, true);
+
+            dest_addr4.sin_family = AF_INET;
+            dest_addr4.sin_port = htons(s_iperf_ctrl.cfg.dport);
+            dest_addr4.sin_addr.s_addr = s_iperf_ctrl.cfg.destination_ip4;
+            err = connect(client_socket, (struct sockaddr *)&dest_addr4, sizeof(struct sockaddr_in));
+        }
+        if (err != 0) {
+            close(client_socket);
+        }
         ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Socket unable to connect: errno %d", errno);
-        ESP_LOGI(TAG, "Successfully connected");
-        memcpy(&dest_addr, &dest_addr4, sizeof(dest_addr4));
+        ESP_LOGI(TAG, "Successfully connected, stream %d", i + 1);
+        iperf_set_rx_timeout(client_socket);
+        if (iperf_add_connection(client_socket, true, NULL, 0, true) != ESP_OK) {
+            if (s_iperf_ctrl.num_streams == 0 || s_iperf_ctrl.streams[s_iperf_ctrl.num_streams - 1].sock != client_socket) {
+                close(client_socket);
+            }
+            ESP_GOTO_ON_FALSE(false, ESP_FAIL, exit, TAG, "Unable to start stream %d", i + 1);
+        }
     }
 
-    socket_send(client_socket, dest_addr, IPERF_TRANS_TYPE_TCP, s_iperf_ctrl.cfg.bw_lim);
-exit:
-    if (client_socket != -1) {
-        shutdown(client_socket, 0);
-        close(client_socket);
-        ESP_LOGI(TAG, "TCP Socket client is closed.");
+    while (!s_iperf_ctrl.finish && !iperf_streams_done()) {
+        vTaskDelay(pdMS_TO_TICKS(100));
     }
-    s_iperf_ctrl.finish = true;
+exit:
+    iperf_close_streams();
+    ESP_LOGI(TAG, "TCP Socket client is closed.");
     return ret;
 }
 
@@ -346,8 +1387,11 @@ static esp_err_t IRAM_ATTR iperf_run_udp_server(void)
     int opt = 1;
     int err = 0;
     esp_err_t ret = ESP_OK;
-    struct timeval timeout = { 0 };
-    struct sockaddr_storage listen_addr = { 0 };
+    uint8_t *buffer = NULL;
+    int actual_recv;
+    int timeouts = 0;
+    struct sockaddr_storage from;
+    socklen_t from_len;
     struct sockaddr_in6 listen_addr6 = { 0 };
     struct sockaddr_in listen_addr4 = { 0 };
 
@@ -368,8 +1412,6 @@ static esp_err_t IRAM_ATTR iperf_run_udp_server(void)
         err = bind(listen_socket, (struct sockaddr *)&listen_addr6, sizeof(struct sockaddr_in6));
         ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Socket unable to bind: errno %d", errno);
         ESP_LOGI(TAG, "Socket bound, port %d", listen_addr6.sin6_port);
-
-        memcpy(&listen_addr, &listen_addr6, sizeof(listen_addr6));
     } else if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4) {
         listen_addr4.sin_family = AF_INET;
         listen_addr4.sin_port = htons(s_iperf_ctrl.cfg.sport);
@@ -384,20 +1426,59 @@ static esp_err_t IRAM_ATTR iperf_run_udp_server(void)
         err = bind(listen_socket, (struct sockaddr *)&listen_addr4, sizeof(struct sockaddr_in));
         ESP_GOTO_ON_FALSE((err == 0), ESP_FAIL, exit, TAG, "Socket unable to bind: errno %d", errno);
         ESP_LOGI(TAG, "Socket bound, port %d", listen_addr4.sin_port);
-        memcpy(&listen_addr, &listen_addr4, sizeof(listen_addr4));
     }
+    iperf_set_socket_options(listen_socket, false);
+    iperf_set_rx_timeout(listen_socket);
+    buffer = iperf_buffer_alloc(IPERF_STREAM_BUFFER_LEN, false);
+    ESP_GOTO_ON_FALSE(buffer, ESP_FAIL, exit, TAG, "No receive buffer");
 
-    timeout.tv_sec = IPERF_SOCKET_RX_TIMEOUT;
-    setsockopt(listen_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    socket_recv(listen_socket, listen_addr, IPERF_TRANS_TYPE_UDP);
+    // Every sender address is a stream of its own, answered with a stream back when the mode asks for it
+    while (!s_iperf_ctrl.finish) {
+        from_len = sizeof(from);
+        actual_recv = recvfrom(listen_socket, buffer, IPERF_STREAM_BUFFER_LEN, 0, (struct sockaddr *)&from, &from_len);
+        if (actual_recv < 0) {
+            // Silence ends the test once no stream of ours is sending any more
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                (++timeouts < (iperf_streams_done() ? IPERF_UDP_SERVER_LINGER : IPERF_SOCKET_RX_TIMEOUT) || s_iperf_ctrl.num_streams == 0 || s_iperf_ctrl.tasks > 0)) {
+                continue;
+            }
+            iperf_show_socket_error_reason("udp server recv", listen_socket);
+            break;
+        }
+        timeouts = 0;
+        iperf_stream_t *stream = iperf_find_udp_stream(&from, from_len, false);
+        if (!stream && !iperf_find_udp_stream(&from, from_len, true)) {
+            if (iperf_running_connections() >= IPERF_MAX_STREAMS || iperf_add_connection(listen_socket, false, &from, from_len, false) != ESP_OK) {
+                continue;
+            }
+            stream = iperf_find_udp_stream(&from, from_len, false);
+        }
+        if (stream && stream->done && !iperf_server_sends() && iperf_udp_is_fin(buffer, actual_recv)) {
+            // The final datagram again, the report got lost on the way back
+            iperf_udp_send_server_report(stream, buffer);
+            continue;
+        }
+        if (!stream || stream->done) {
+            // Only asking for a reversed stream
+            continue;
+        }
+        iperf_start_report();
+        stream->total_len += actual_recv;
+        if (!iperf_udp_account(stream, buffer, actual_recv)) {
+            if (!iperf_server_sends()) {
+                // The other direction would take the report for its data
+                iperf_udp_send_server_report(stream, buffer);
+            }
+            stream->done = true;
+        }
+    }
 exit:
+    iperf_close_streams();
     if (listen_socket != -1) {
         shutdown(listen_socket, 0);
         close(listen_socket);
     }
     ESP_LOGI(TAG, "Udp socket server is closed.");
-    s_iperf_ctrl.finish = true;
     return ret;
 }
 
@@ -407,6 +1488,7 @@ static esp_err_t iperf_run_udp_client(void)
     int opt = 1;
     esp_err_t ret = ESP_OK;
     struct sockaddr_storage dest_addr = { 0 };
+    socklen_t dest_len = 0;
     struct sockaddr_in6 dest_addr6 = { 0 };
     struct sockaddr_in dest_addr4 = { 0 };
 
@@ -416,76 +1498,227 @@ static esp_err_t iperf_run_udp_client(void)
         inet6_aton(s_iperf_ctrl.cfg.destination_ip6, &dest_addr6.sin6_addr);
         dest_addr6.sin6_family = AF_INET6;
         dest_addr6.sin6_port = htons(s_iperf_ctrl.cfg.dport);
-
-        client_socket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_IPV6);
-        ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
-        ESP_LOGI(TAG, "Socket created, sending to %s:%d", s_iperf_ctrl.cfg.destination_ip6, s_iperf_ctrl.cfg.dport);
-
-        setsockopt(client_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
         memcpy(&dest_addr, &dest_addr6, sizeof(dest_addr6));
+        dest_len = sizeof(dest_addr6);
+        ESP_LOGI(TAG, "Sending to %s:%d", s_iperf_ctrl.cfg.destination_ip6, s_iperf_ctrl.cfg.dport);
     } else if (s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV4) {
         dest_addr4.sin_family = AF_INET;
         dest_addr4.sin_port = htons(s_iperf_ctrl.cfg.dport);
         dest_addr4.sin_addr.s_addr = s_iperf_ctrl.cfg.destination_ip4;
+        memcpy(&dest_addr, &dest_addr4, sizeof(dest_addr4));
+        dest_len = sizeof(dest_addr4);
+        ESP_LOGI(TAG, "Sending to %d:%d", s_iperf_ctrl.cfg.destination_ip4, s_iperf_ctrl.cfg.dport);
+    }
 
-        client_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    // Each stream has a socket and so a source port of its own, that is how the server tells them apart
+    for (int i = 0; i < s_iperf_ctrl.cfg.num_streams; i++) {
+        client_socket = socket(s_iperf_ctrl.cfg.type == IPERF_IP_TYPE_IPV6 ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP);
         ESP_GOTO_ON_FALSE((client_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
-        ESP_LOGI(TAG, "Socket created, sending to %d:%d", s_iperf_ctrl.cfg.destination_ip4, s_iperf_ctrl.cfg.dport);
-
         setsockopt(client_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        memcpy(&dest_addr, &dest_addr4, sizeof(dest_addr4));
+        iperf_set_socket_options(client_socket, false);
+        iperf_set_rx_timeout(client_socket);
+        if (iperf_add_connection(client_socket, true, &dest_addr, dest_len, true) != ESP_OK) {
+            if (s_iperf_ctrl.num_streams == 0 || s_iperf_ctrl.streams[s_iperf_ctrl.num_streams - 1].sock != client_socket) {
+                close(client_socket);
+            }
+            ESP_GOTO_ON_FALSE(false, ESP_FAIL, exit, TAG, "Unable to start stream %d", i + 1);
+        }
     }
 
-    socket_send(client_socket, dest_addr, IPERF_TRANS_TYPE_UDP, s_iperf_ctrl.cfg.bw_lim);
-exit:
-    if (client_socket != -1) {
-        shutdown(client_socket, 0);
-        close(client_socket);
+    while (!s_iperf_ctrl.finish && !iperf_streams_done()) {
+        vTaskDelay(pdMS_TO_TICKS(100));
     }
-    s_iperf_ctrl.finish = true;
+exit:
+    iperf_close_streams();
     ESP_LOGI(TAG, "UDP Socket client is closed");
     return ret;
 }
 
-static void iperf_task_traffic(void *arg)
+// Clear the streams and counters of the last test of a sweep for the next one
+static void iperf_reset_run(void)
 {
-    if (iperf_is_udp_client()) {
+    iperf_pool_reset();
+    s_iperf_ctrl.finish = false;
+    s_iperf_ctrl.num_streams = 0;
+    s_iperf_ctrl.connections = 0;
+    s_iperf_ctrl.tasks = 0;
+    s_iperf_ctrl.report_started = false;
+    s_iperf_ctrl.reported_time = 0;
+    memset(s_iperf_ctrl.throughput, 0, sizeof(s_iperf_ctrl.throughput));
+    memset(&s_iperf_ctrl.delay, 0, sizeof(s_iperf_ctrl.delay));
+}
+
+static void iperf_print_sweep(uint16_t len)
+{
+    uint64_t bytes = 0;
+    uint32_t packets = 0;
+    uint32_t datagrams = 0;
+    uint32_t lost = 0;
+    uint32_t us = 0;
+    bool received = true;
+
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        received &= s_iperf_ctrl.streams[i].server_report;
+    }
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        const iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+        if (received) {
+            bytes += stream->server_bytes;
+            datagrams += stream->server_datagrams;
+            lost += stream->server_lost;
+            us = stream->server_us > us ? stream->server_us : us;
+        } else {
+            // No report from the server, what left this end instead
+            bytes += stream->total_len;
+            datagrams += stream->udp_next_id;
+            us = s_iperf_ctrl.cfg.time * 1000000;
+        }
+    }
+    packets = datagrams - lost;
+    uint32_t kbps = us ? bytes * 8000 / us : 0;
+    uint32_t pps = us ? (uint64_t)packets * 1000000 / us : 0;
+    uint32_t lost_permille = datagrams ? (uint64_t)lost * 1000 / datagrams : 0;
+    uint32_t line_permille = s_iperf_ctrl.cfg.line_rate_bps ? (uint64_t)kbps * 1000000 / s_iperf_ctrl.cfg.line_rate_bps : 0;
+
+    if (iperf_json()) {
+        printf("{\"event\":\"sweep\",\"len\":%u,\"received\":%s,\"bytes\":%llu,\"us\":%u,\"packets\":%u,\"lost\":%u,\"pps\":%u,\"kbps\":%u", len,
+               received ? "true" : "false", bytes, us, packets, lost, pps, kbps);
+        if (s_iperf_ctrl.cfg.line_rate_bps) {
+            printf(",\"line_permille\":%u", line_permille);
+        }
+        printf("}\n");
+        return;
+    }
+    printf("%6u %10u " IPERF_MBPS_FMT " Mbits/sec %4u.%u%%", len, pps, IPERF_MBPS(kbps), lost_permille / 10, lost_permille % 10);
+    if (s_iperf_ctrl.cfg.line_rate_bps) {
+        printf(" %6u.%u%%", line_permille / 10, line_permille % 10);
+    }
+    printf("%s\n", received ? "" : "  sent, no server report");
+}
+
+/**
+ * Totals of the test for the result callback. What a UDP client sent is
+ * counted by the server report where it came back, the loss and jitter
+ * there are the ones the link caused.
+ */
+static void iperf_notify_result(void)
+{
+    iperf_result_cb_t cb = s_iperf_result_cb;
+    uint32_t time = s_iperf_ctrl.reported_time;
+    uint64_t bytes[2] = {0};
+    iperf_result_t result = {.time = time};
+
+    if (!cb || time == 0) {
+        return;
+    }
+    for (int i = 0; i < s_iperf_ctrl.num_streams; i++) {
+        const iperf_stream_t *stream = &s_iperf_ctrl.streams[i];
+        bytes[stream->tx] += stream->total_len;
+        if (stream->tx && stream->server_report) {
+            result.datagrams += stream->server_datagrams;
+            result.lost += stream->server_lost;
+            result.jitter_us = stream->server_jitter_us > result.jitter_us ? stream->server_jitter_us : result.jitter_us;
+        } else if (!stream->tx) {
+            result.datagrams += stream->udp.packets + stream->udp.lost;
+            result.lost += stream->udp.lost;
+            result.jitter_us = stream->udp.jitter_us > result.jitter_us ? stream->udp.jitter_us : result.jitter_us;
+        }
+    }
+    result.tx_kbps = iperf_kbps(bytes[1], time);
+    result.rx_kbps = iperf_kbps(bytes[0], time);
+    result.delay_p99_us = iperf_hist_percentile(&s_iperf_ctrl.delay, 99);
+    cb(&s_iperf_ctrl.cfg, &result);
+}
+
+/**
+ * A short UDP client test per datagram length, each a new stream to the
+ * server, and a line per length with what the server received: packets per
+ * second, goodput and its share of the line rate. The share is of the raw
+ * baud rate, with 8N1 framing on the uart it can not go past 80%.
+ */
+static void iperf_run_sweep(void)
+{
+    if (!iperf_json()) {
+        printf("\n%6s %10s %22s %6s %8s\n", "bytes", "packets/s", "Goodput", "Lost", s_iperf_ctrl.cfg.line_rate_bps ? "of line" : "");
+    }
+    for (int i = 0; i < s_iperf_ctrl.cfg.sweep_count && !s_iperf_ctrl.stop; i++) {
+        iperf_reset_run();
+        s_iperf_ctrl.cfg.len_send_buf = s_iperf_ctrl.cfg.sweep_lens[i];
         iperf_run_udp_client();
-    } else if (iperf_is_udp_server()) {
-        iperf_run_udp_server();
-    } else if (iperf_is_tcp_client()) {
-        iperf_run_tcp_client();
-    } else {
-        iperf_run_tcp_server();
+        while (s_iperf_ctrl.report_running) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        iperf_print_sweep(s_iperf_ctrl.cfg.sweep_lens[i]);
+        iperf_notify_result();
     }
+}
 
-    if (s_iperf_ctrl.buffer) {
-        free(s_iperf_ctrl.buffer);
-        s_iperf_ctrl.buffer = NULL;
+static void iperf_task_traffic(void *arg)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        iperf_pool_reset();
+        if (s_iperf_ctrl.cfg.sweep_count > 0) {
+            iperf_run_sweep();
+        } else if (iperf_is_udp_client()) {
+            iperf_run_udp_client();
+        } else if (iperf_is_udp_server()) {
+            iperf_run_udp_server();
+        } else if (iperf_is_tcp_client()) {
+            iperf_run_tcp_client();
+        } else {
+            iperf_run_tcp_server();
+        }
+
+        // The report task ends at its next interval and must not see the next test start
+        while (s_iperf_ctrl.report_running) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+        if (s_iperf_ctrl.cfg.sweep_count == 0) {
+            iperf_notify_result();
+        }
+        ESP_LOGI(TAG, "iperf exit");
+        s_iperf_is_running = false;
     }
-    ESP_LOGI(TAG, "iperf exit");
-    s_iperf_is_running = false;
-    vTaskDelete(NULL);
 }
 
-static uint32_t iperf_get_buffer_len(void)
+// The pool and the traffic and report tasks, on the first start, they stay for every later test
+static esp_err_t iperf_init(void)
 {
-    if (iperf_is_udp_client()) {
-        return (s_iperf_ctrl.cfg.len_send_buf == 0 ? IPERF_UDP_TX_LEN : s_iperf_ctrl.cfg.len_send_buf);
-    } else if (iperf_is_udp_server()) {
-        return IPERF_UDP_RX_LEN;
-    } else if (iperf_is_tcp_client()) {
-        return (s_iperf_ctrl.cfg.len_send_buf == 0 ? IPERF_TCP_TX_LEN : s_iperf_ctrl.cfg.len_send_buf);
-    } else {
-        return IPERF_TCP_RX_LEN;
+    if (s_iperf_traffic_task) {
+        return ESP_OK;
+    }
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    s_iperf_pool = s_iperf_pool_buffer;
+    s_iperf_report_task = xTaskCreateStaticPinnedToCore(iperf_report_task, IPERF_REPORT_TASK_NAME, IPERF_REPORT_TASK_STACK, NULL, IPERF_REPORT_TASK_PRIORITY,
+                                                        s_iperf_report_stack, &s_iperf_report_tcb, portNUM_PROCESSORS - 1);
+    s_iperf_traffic_task = xTaskCreateStaticPinnedToCore(iperf_task_traffic, IPERF_TRAFFIC_TASK_NAME, IPERF_TRAFFIC_TASK_STACK, NULL, IPERF_TRAFFIC_TASK_PRIORITY,
+                                                         s_iperf_traffic_stack, &s_iperf_traffic_tcb, portNUM_PROCESSORS - 1);
+    assert(s_iperf_report_task && s_iperf_traffic_task);
+#else
+    if (!s_iperf_pool) {
+        s_iperf_pool = malloc(IPERF_BUFFER_POOL_LEN);
+        ESP_RETURN_ON_FALSE(s_iperf_pool, ESP_ERR_NO_MEM, TAG, "create buffer: not enough memory");
+    }
+    if (!s_iperf_report_task &&
+        xTaskCreatePinnedToCore(iperf_report_task, IPERF_REPORT_TASK_NAME, IPERF_REPORT_TASK_STACK, NULL, IPERF_REPORT_TASK_PRIORITY, &s_iperf_report_task,
+                                portNUM_PROCESSORS - 1) != pdPASS) {
+        s_iperf_report_task = NULL;
+        ESP_LOGE(TAG, "create task %s failed", IPERF_REPORT_TASK_NAME);
+        return ESP_FAIL;
+    }
+    if (xTaskCreatePinnedToCore(iperf_task_traffic, IPERF_TRAFFIC_TASK_NAME, IPERF_TRAFFIC_TASK_STACK, NULL, IPERF_TRAFFIC_TASK_PRIORITY, &s_iperf_traffic_task,
+                                portNUM_PROCESSORS - 1) != pdPASS) {
+        s_iperf_traffic_task = NULL;
+        ESP_LOGE(TAG, "create task %s failed", IPERF_TRAFFIC_TASK_NAME);
+        return ESP_FAIL;
     }
-    return 0;
+#endif
+    return ESP_OK;
 }
 
 esp_err_t iperf_start(iperf_cfg_t *cfg)
 {
-    BaseType_t ret;
-
     if (!cfg) {
         return ESP_FAIL;
     }
@@ -495,30 +1728,35 @@ esp_err_t iperf_start(iperf_cfg_t *cfg)
         return ESP_FAIL;
     }
 
+    ESP_RETURN_ON_ERROR(iperf_init(), TAG, "iperf init failed");
     memset(&s_iperf_ctrl, 0, sizeof(s_iperf_ctrl));
     memcpy(&s_iperf_ctrl.cfg, cfg, sizeof(*cfg));
-    s_iperf_is_running = true;
-    s_iperf_ctrl.finish = false;
-    s_iperf_ctrl.buffer_len = iperf_get_buffer_len();
-    s_iperf_ctrl.buffer = (uint8_t *)malloc(s_iperf_ctrl.buffer_len);
-    if (!s_iperf_ctrl.buffer) {
-        ESP_LOGE(TAG, "create buffer: not enough memory");
+    if (s_iperf_ctrl.cfg.num_streams == 0) {
+        s_iperf_ctrl.cfg.num_streams = 1;
+    }
+    if (s_iperf_ctrl.cfg.num_streams > IPERF_MAX_STREAMS) {
+        ESP_LOGE(TAG, "at most %d streams", IPERF_MAX_STREAMS);
         return ESP_FAIL;
     }
-    memset(s_iperf_ctrl.buffer, 0, s_iperf_ctrl.buffer_len);
-    ret = xTaskCreatePinnedToCore(iperf_task_traffic, IPERF_TRAFFIC_TASK_NAME, IPERF_TRAFFIC_TASK_STACK, NULL, IPERF_TRAFFIC_TASK_PRIORITY, NULL, portNUM_PROCESSORS - 1);
-    if (ret != pdPASS) {
-        ESP_LOGE(TAG, "create task %s failed", IPERF_TRAFFIC_TASK_NAME);
-        free(s_iperf_ctrl.buffer);
-        s_iperf_ctrl.buffer = NULL;
+    if (s_iperf_ctrl.cfg.sweep_count > 0 && (!iperf_is_udp_client() || iperf_server_sends() || s_iperf_ctrl.cfg.sweep_count > IPERF_SWEEP_MAX_LENS)) {
+        ESP_LOGE(TAG, "a sweep runs up to %d lengths from a UDP client to the server", IPERF_SWEEP_MAX_LENS);
         return ESP_FAIL;
     }
+    s_iperf_is_running = true;
+    s_iperf_ctrl.finish = false;
+    xTaskNotifyGive(s_iperf_traffic_task);
     return ESP_OK;
 }
 
+void iperf_set_result_cb(iperf_result_cb_t cb)
+{
+    s_iperf_result_cb = cb;
+}
+
 esp_err_t iperf_stop(void)
 {
     if (s_iperf_is_running) {
+        s_iperf_ctrl.stop = true;
         s_iperf_ctrl.finish = true;
     }
 
@@ -0,0 +1,77 @@
+/* OTA over the ppp link - declarations
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#ifndef __OTA_H_
+#define __OTA_H_
+
+#include "esp_err.h"
+#include "esp_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OTA_DEFAULT_PORT 3232
+#define OTA_DEFAULT_BLOCK_SIZE (8 << 10)
+#define OTA_MIN_BLOCK_SIZE (4 << 10)
+
+// Largest single flash write, the cache is off and the link stands still for the duration of one
+#define OTA_WRITE_CHUNK (4 << 10)
+
+#define OTA_RECV_TASK_NAME "ota_recv"
+#define OTA_RECV_TASK_PRIORITY 4
+#define OTA_RECV_TASK_STACK 4096
+#define OTA_WRITE_TASK_NAME "ota_write"
+#define OTA_WRITE_TASK_PRIORITY 5
+#define OTA_WRITE_TASK_STACK 4096
+
+#define OTA_SOCKET_RX_TIMEOUT 10
+#define OTA_SOCKET_ACCEPT_TIMEOUT 60
+
+typedef struct {
+    uint16_t port;
+    uint32_t block_size; // Bytes per receive buffer, two of them are allocated
+} ota_cfg_t;
+
+typedef enum {
+    OTA_STATE_IDLE,
+    OTA_STATE_WAITING, // Listening for the sender
+    OTA_STATE_RECEIVING,
+    OTA_STATE_DONE, // Image verified and selected for the next boot
+    OTA_STATE_FAILED,
+} ota_state_t;
+
+typedef struct {
+    ota_state_t state;
+    esp_err_t error;
+    uint32_t bytes;
+    uint32_t elapsed_ms; // From the first received byte to the last byte in flash
+    uint32_t rate_bps;   // Image bits per second over elapsed_ms
+    uint32_t flash_ms;   // Time spent in flash writes, including the erase in front of them
+    uint32_t blocked_ms; // Time the receiver waited for a free buffer, flash was the bottleneck
+    uint32_t starved_ms; // Time the writer waited for data, the link was the bottleneck
+} ota_report_t;
+
+// Receive an image in the background on cfg->port of the ppp link address, the first connection is taken as the sender and
+// refused unless it is the peer of a ppp link.
+esp_err_t ota_start(const ota_cfg_t *cfg);
+
+esp_err_t ota_stop(void);
+
+// State and timing of the running or last transfer.
+esp_err_t ota_get_report(ota_report_t *report);
+
+// Send the running firmware to a peer running ota_start(), returns when it is sent.
+esp_err_t ota_send_running(const char *host, uint16_t port, ota_report_t *report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
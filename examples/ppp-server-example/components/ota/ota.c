@@ -0,0 +1,402 @@
+/* OTA over the ppp link - implementation
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_check.h"
+#include "esp_image_format.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "ota.h"
+
+/**
+ * Two buffers go round between the receive task and the write task, so the
+ * flash erase and write of one block overlaps the receive of the next.
+ * Blocks are written OTA_WRITE_CHUNK bytes at a time and erased just ahead
+ * of the data, which keeps every flash operation, and so every stall of the
+ * link, short. When the link is slower than the flash, the receiver hands
+ * over a block as soon as it holds a chunk and the writer is waiting, so the
+ * flash keeps up with the data instead of waiting for full blocks.
+ *
+ * Only a peer of a ppp link may send an image: the listener is bound to the
+ * local address of the links and a connection from anywhere else, say a
+ * host on the WiFi side that routes to that address, is refused.
+ */
+
+typedef struct {
+    uint8_t *data;
+    size_t len; // 0 marks the end of the image
+} ota_block_t;
+
+typedef struct {
+    ota_cfg_t cfg;
+    bool finish;
+    ota_report_t report;
+    uint8_t *buffer; // Both blocks
+    QueueHandle_t free_blocks;
+    QueueHandle_t full_blocks;
+    SemaphoreHandle_t written; // Given by the write task when the whole image is in flash
+    esp_ota_handle_t handle;
+    volatile bool writer_idle;
+    int64_t start_us; // First byte received, 0 before
+    int64_t end_us;   // Last byte written, 0 while running
+    int64_t flash_us;
+    int64_t blocked_us;
+    int64_t starved_us;
+} ota_ctrl_t;
+
+static bool s_ota_is_running = false;
+static ota_ctrl_t s_ota_ctrl;
+static const char *TAG = "ota";
+
+static void ota_write_task(void *arg)
+{
+    ota_block_t block;
+    bool first = true;
+
+    while (1) {
+        int64_t wait_us = esp_timer_get_time();
+        s_ota_ctrl.writer_idle = true;
+        xQueueReceive(s_ota_ctrl.full_blocks, &block, portMAX_DELAY);
+        s_ota_ctrl.writer_idle = false;
+
+        int64_t write_us = esp_timer_get_time();
+        if (!first) {
+            // Waiting for the first block is waiting for the sender, not for the link
+            s_ota_ctrl.starved_us += write_us - wait_us;
+        }
+        first = false;
+        if (block.len == 0) {
+            break;
+        }
+        for (size_t offset = 0; offset < block.len && s_ota_ctrl.report.error == ESP_OK; offset += OTA_WRITE_CHUNK) {
+            esp_err_t err = esp_ota_write(s_ota_ctrl.handle, block.data + offset, MIN(OTA_WRITE_CHUNK, block.len - offset));
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Flash write failed at %u: %s", s_ota_ctrl.report.bytes, esp_err_to_name(err));
+                s_ota_ctrl.report.error = err;
+            }
+        }
+        s_ota_ctrl.flash_us += esp_timer_get_time() - write_us;
+        s_ota_ctrl.report.bytes += block.len;
+        xQueueSend(s_ota_ctrl.free_blocks, &block, portMAX_DELAY);
+    }
+    s_ota_ctrl.end_us = esp_timer_get_time();
+    xSemaphoreGive(s_ota_ctrl.written);
+    vTaskDelete(NULL);
+}
+
+// Fill a block from the socket, returns false at the end of the image or on error.
+static bool ota_recv_block(int sock, ota_block_t *block)
+{
+    block->len = 0;
+    while (block->len < s_ota_ctrl.cfg.block_size) {
+        if (block->len >= OTA_WRITE_CHUNK && s_ota_ctrl.writer_idle) {
+            // The link is the bottleneck, let the flash work on what is here
+            return true;
+        }
+        int len = recv(sock, block->data + block->len, s_ota_ctrl.cfg.block_size - block->len, 0);
+        if (len < 0) {
+            ESP_LOGE(TAG, "recv failed: errno %d", errno);
+            s_ota_ctrl.report.error = ESP_ERR_TIMEOUT;
+            return false;
+        }
+        if (len == 0) {
+            return false;
+        }
+        if (s_ota_ctrl.start_us == 0) {
+            s_ota_ctrl.start_us = esp_timer_get_time();
+        }
+        block->len += len;
+    }
+    return true;
+}
+
+// ppp_link names its interfaces ppp0, ppp1, ...
+static bool ota_netif_is_ppp(esp_netif_t *netif)
+{
+    const char *desc = esp_netif_get_desc(netif);
+
+    return desc && strncmp(desc, "ppp", 3) == 0 && esp_netif_is_netif_up(netif);
+}
+
+// Local address of the first ppp link that is up, 0 when there is none. Server links all share theirs.
+static uint32_t ota_ppp_local_addr(void)
+{
+    esp_netif_ip_info_t ip_info;
+
+    for (esp_netif_t *netif = esp_netif_next(NULL); netif; netif = esp_netif_next(netif)) {
+        if (ota_netif_is_ppp(netif) && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK && ip_info.ip.addr) {
+            return ip_info.ip.addr;
+        }
+    }
+    return 0;
+}
+
+// The far end of a point to point link is its gateway
+static bool ota_is_ppp_peer(uint32_t addr)
+{
+    esp_netif_ip_info_t ip_info;
+
+    for (esp_netif_t *netif = esp_netif_next(NULL); netif; netif = esp_netif_next(netif)) {
+        if (ota_netif_is_ppp(netif) && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK && ip_info.gw.addr == addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ota_recv_task(void *arg)
+{
+    esp_err_t ret = ESP_OK;
+    int listen_socket = -1;
+    int sock = -1;
+    int opt = 1;
+    bool writing = false;
+    struct timeval timeout = { 0 };
+    struct sockaddr_in listen_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(s_ota_ctrl.cfg.port),
+        .sin_addr.s_addr = ota_ppp_local_addr(),
+    };
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+
+    ESP_GOTO_ON_FALSE(listen_addr.sin_addr.s_addr, ESP_ERR_INVALID_STATE, exit, TAG, "No ppp link up to receive on");
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    ESP_GOTO_ON_FALSE(partition, ESP_ERR_NOT_FOUND, exit, TAG, "No ota partition to write to");
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    ESP_GOTO_ON_FALSE((listen_socket >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    ESP_GOTO_ON_FALSE((bind(listen_socket, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) == 0), ESP_FAIL, exit, TAG,
+                      "Socket unable to bind: errno %d", errno);
+    ESP_GOTO_ON_FALSE((listen(listen_socket, 1) == 0), ESP_FAIL, exit, TAG, "Error occurred during listen: errno %d", errno);
+    timeout.tv_sec = OTA_SOCKET_ACCEPT_TIMEOUT;
+    setsockopt(listen_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ESP_LOGI(TAG, "Waiting for an image on %s:%d, writing to %s", inet_ntoa(listen_addr.sin_addr), s_ota_ctrl.cfg.port, partition->label);
+    sock = accept(listen_socket, (struct sockaddr *)&peer, &peer_len);
+    ESP_GOTO_ON_FALSE((sock >= 0), ESP_ERR_TIMEOUT, exit, TAG, "No sender: errno %d", errno);
+    ESP_GOTO_ON_FALSE(ota_is_ppp_peer(peer.sin_addr.s_addr), ESP_ERR_INVALID_STATE, exit, TAG, "Refused %s, not a ppp peer",
+                      inet_ntoa(peer.sin_addr));
+    timeout.tv_sec = OTA_SOCKET_RX_TIMEOUT;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    s_ota_ctrl.report.state = OTA_STATE_RECEIVING;
+    ESP_GOTO_ON_ERROR(esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &s_ota_ctrl.handle), exit, TAG, "esp_ota_begin failed");
+    writing = true;
+    if (xTaskCreate(ota_write_task, OTA_WRITE_TASK_NAME, OTA_WRITE_TASK_STACK, NULL, OTA_WRITE_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", OTA_WRITE_TASK_NAME);
+        ret = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    bool more = true;
+    while (more && !s_ota_ctrl.finish && s_ota_ctrl.report.error == ESP_OK) {
+        ota_block_t block;
+        int64_t wait_us = esp_timer_get_time();
+        xQueueReceive(s_ota_ctrl.free_blocks, &block, portMAX_DELAY);
+        s_ota_ctrl.blocked_us += esp_timer_get_time() - wait_us;
+
+        more = ota_recv_block(sock, &block);
+        xQueueSend(block.len > 0 ? s_ota_ctrl.full_blocks : s_ota_ctrl.free_blocks, &block, portMAX_DELAY);
+    }
+    ota_block_t end = { 0 };
+    xQueueSend(s_ota_ctrl.full_blocks, &end, portMAX_DELAY);
+    xSemaphoreTake(s_ota_ctrl.written, portMAX_DELAY);
+
+    if (s_ota_ctrl.finish) {
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        ret = s_ota_ctrl.report.error;
+    }
+    if (ret != ESP_OK) {
+        esp_ota_abort(s_ota_ctrl.handle);
+    } else if ((ret = esp_ota_end(s_ota_ctrl.handle)) != ESP_OK) {
+        ESP_LOGE(TAG, "Image invalid: %s", esp_err_to_name(ret));
+    } else if ((ret = esp_ota_set_boot_partition(partition)) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to select %s for boot: %s", partition->label, esp_err_to_name(ret));
+    }
+    writing = false;
+
+exit:
+    if (writing) {
+        esp_ota_abort(s_ota_ctrl.handle);
+    }
+    if (sock != -1) {
+        shutdown(sock, 0);
+        close(sock);
+    }
+    if (listen_socket != -1) {
+        close(listen_socket);
+    }
+    s_ota_ctrl.report.error = ret;
+    s_ota_ctrl.report.state = ret == ESP_OK ? OTA_STATE_DONE : OTA_STATE_FAILED;
+    ota_report_t report;
+    ota_get_report(&report);
+    ESP_LOGI(TAG, "%s: %u bytes in %u ms, %u bps, %u ms writing flash, %u ms blocked on flash, %u ms waiting for the link",
+             ret == ESP_OK ? "Image ready, restart to boot it" : esp_err_to_name(ret), report.bytes, report.elapsed_ms, report.rate_bps, report.flash_ms,
+             report.blocked_ms, report.starved_ms);
+
+    vQueueDelete(s_ota_ctrl.free_blocks);
+    vQueueDelete(s_ota_ctrl.full_blocks);
+    vSemaphoreDelete(s_ota_ctrl.written);
+    free(s_ota_ctrl.buffer);
+    s_ota_ctrl.buffer = NULL;
+    s_ota_is_running = false;
+    vTaskDelete(NULL);
+}
+
+esp_err_t ota_start(const ota_cfg_t *cfg)
+{
+    ESP_RETURN_ON_FALSE(cfg, ESP_ERR_INVALID_ARG, TAG, "Invalid config");
+    ESP_RETURN_ON_FALSE(cfg->block_size >= OTA_MIN_BLOCK_SIZE, ESP_ERR_INVALID_ARG, TAG, "Block size below %d", OTA_MIN_BLOCK_SIZE);
+    if (s_ota_is_running) {
+        ESP_LOGW(TAG, "ota is running");
+        return ESP_FAIL;
+    }
+
+    memset(&s_ota_ctrl, 0, sizeof(s_ota_ctrl));
+    s_ota_ctrl.cfg = *cfg;
+    s_ota_ctrl.report.state = OTA_STATE_WAITING;
+    s_ota_ctrl.buffer = malloc(2 * cfg->block_size);
+    s_ota_ctrl.free_blocks = xQueueCreate(2, sizeof(ota_block_t));
+    s_ota_ctrl.full_blocks = xQueueCreate(3, sizeof(ota_block_t)); // Both blocks and the end marker
+    s_ota_ctrl.written = xSemaphoreCreateBinary();
+    if (!s_ota_ctrl.buffer || !s_ota_ctrl.free_blocks || !s_ota_ctrl.full_blocks || !s_ota_ctrl.written) {
+        ESP_LOGE(TAG, "create buffers: not enough memory");
+        goto fail;
+    }
+    for (int i = 0; i < 2; i++) {
+        ota_block_t block = { .data = s_ota_ctrl.buffer + i * cfg->block_size };
+        xQueueSend(s_ota_ctrl.free_blocks, &block, 0);
+    }
+
+    s_ota_is_running = true;
+    if (xTaskCreate(ota_recv_task, OTA_RECV_TASK_NAME, OTA_RECV_TASK_STACK, NULL, OTA_RECV_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "create task %s failed", OTA_RECV_TASK_NAME);
+        s_ota_is_running = false;
+        goto fail;
+    }
+    return ESP_OK;
+
+fail:
+    if (s_ota_ctrl.free_blocks) {
+        vQueueDelete(s_ota_ctrl.free_blocks);
+    }
+    if (s_ota_ctrl.full_blocks) {
+        vQueueDelete(s_ota_ctrl.full_blocks);
+    }
+    if (s_ota_ctrl.written) {
+        vSemaphoreDelete(s_ota_ctrl.written);
+    }
+    free(s_ota_ctrl.buffer);
+    s_ota_ctrl.buffer = NULL;
+    s_ota_ctrl.report.state = OTA_STATE_IDLE;
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t ota_stop(void)
+{
+    if (s_ota_is_running) {
+        s_ota_ctrl.finish = true;
+    }
+
+    while (s_ota_is_running) {
+        ESP_LOGI(TAG, "wait current ota to stop ...");
+        vTaskDelay(300 / portTICK_PERIOD_MS);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t ota_get_report(ota_report_t *report)
+{
+    ESP_RETURN_ON_FALSE(report, ESP_ERR_INVALID_ARG, TAG, "Invalid report");
+
+    *report = s_ota_ctrl.report;
+    if (s_ota_ctrl.start_us) {
+        int64_t end_us = s_ota_ctrl.end_us ? s_ota_ctrl.end_us : esp_timer_get_time();
+        int64_t elapsed_us = MAX(end_us - s_ota_ctrl.start_us, 1);
+        report->elapsed_ms = elapsed_us / 1000;
+        report->rate_bps = (uint64_t)report->bytes * 8 * 1000000 / elapsed_us;
+    }
+    report->flash_ms = s_ota_ctrl.flash_us / 1000;
+    report->blocked_ms = s_ota_ctrl.blocked_us / 1000;
+    report->starved_ms = s_ota_ctrl.starved_us / 1000;
+    return ESP_OK;
+}
+
+esp_err_t ota_send_running(const char *host, uint16_t port, ota_report_t *report)
+{
+    esp_err_t ret = ESP_OK;
+    int sock = -1;
+    uint8_t *buffer = NULL;
+    esp_image_metadata_t metadata;
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    const esp_partition_pos_t pos = {
+        .offset = running->address,
+        .size = running->size,
+    };
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+
+    memset(report, 0, sizeof(*report));
+    ESP_RETURN_ON_FALSE(inet_pton(AF_INET, host, &dest_addr.sin_addr) == 1, ESP_ERR_INVALID_ARG, TAG, "Invalid address %s", host);
+    ESP_RETURN_ON_ERROR(esp_image_get_metadata(&pos, &metadata), TAG, "No valid image in %s", running->label);
+    buffer = malloc(OTA_WRITE_CHUNK);
+    ESP_RETURN_ON_FALSE(buffer, ESP_ERR_NO_MEM, TAG, "create buffer: not enough memory");
+
+    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    ESP_GOTO_ON_FALSE((sock >= 0), ESP_FAIL, exit, TAG, "Unable to create socket: errno %d", errno);
+    ESP_GOTO_ON_FALSE((connect(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) == 0), ESP_FAIL, exit, TAG, "Unable to connect to %s:%d: errno %d",
+                      host, port, errno);
+
+    ESP_LOGI(TAG, "Sending %u bytes from %s", metadata.image_len, running->label);
+    int64_t start_us = esp_timer_get_time();
+    int64_t flash_us = 0;
+    while (report->bytes < metadata.image_len) {
+        size_t len = MIN(OTA_WRITE_CHUNK, metadata.image_len - report->bytes);
+        int64_t read_us = esp_timer_get_time();
+        ESP_GOTO_ON_ERROR(esp_partition_read(running, report->bytes, buffer, len), exit, TAG, "Flash read failed");
+        flash_us += esp_timer_get_time() - read_us;
+        for (size_t sent = 0; sent < len;) {
+            int n = send(sock, buffer + sent, len - sent, 0);
+            ESP_GOTO_ON_FALSE((n > 0), ESP_FAIL, exit, TAG, "send failed: errno %d", errno);
+            sent += n;
+        }
+        report->bytes += len;
+    }
+    int64_t elapsed_us = MAX(esp_timer_get_time() - start_us, 1);
+    report->elapsed_ms = elapsed_us / 1000;
+    report->rate_bps = (uint64_t)report->bytes * 8 * 1000000 / elapsed_us;
+    report->flash_ms = flash_us / 1000;
+
+exit:
+    if (sock != -1) {
+        shutdown(sock, 0);
+        close(sock);
+    }
+    free(buffer);
+    report->error = ret;
+    report->state = ret == ESP_OK ? OTA_STATE_DONE : OTA_STATE_FAILED;
+    return ret;
+}
@@ -0,0 +1,219 @@
+/* PPP FEC benchmark
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "esp_console.h"
+
+#include "ppp_fec.h"
+#include "ppp_fec_bench.h"
+#include "ppp_hdlc.h"
+
+/**
+ * Sends frames through a simulated serial channel with random bit errors and
+ * counts how many arrive intact, once as plain HDLC and once FEC encoded.
+ * Goodput is the share of the line rate left for frame payload, so framing,
+ * escaping and parity overhead are all accounted for.
+ */
+
+static struct {
+    struct arg_int *frames;
+    struct arg_int *size;
+    struct arg_int *block_size;
+    struct arg_int *parity;
+    struct arg_int *baud;
+    struct arg_end *end;
+} bench_args;
+
+typedef struct {
+    uint32_t rng;
+    double ber;
+    uint64_t next_error; // Bits left until the next flipped bit
+    size_t frame_len;
+    uint32_t good_frames;
+    uint64_t wire_bytes;
+    ppp_hdlc_decoder_t hdlc;
+    ppp_fec_decoder_t fec;
+    uint8_t *channel;
+    size_t channel_len;
+} bench_t;
+
+static uint32_t bench_random(bench_t *bench)
+{
+    // xorshift32, cheap and the same sequence on every run
+    bench->rng ^= bench->rng << 13;
+    bench->rng ^= bench->rng >> 17;
+    bench->rng ^= bench->rng << 5;
+    return bench->rng;
+}
+
+static void bench_next_error(bench_t *bench)
+{
+    if (bench->ber <= 0) {
+        bench->next_error = UINT64_MAX;
+        return;
+    }
+    // Geometric distribution of the distance between two bit errors
+    double uniform = (bench_random(bench) + 1.0) / 4294967297.0;
+    bench->next_error = (uint64_t)(log(uniform) / log1p(-bench->ber));
+}
+
+static void bench_channel(void *ctx, const uint8_t *data, size_t len)
+{
+    bench_t *bench = ctx;
+    uint8_t *out = &bench->channel[bench->channel_len];
+
+    memcpy(out, data, len);
+    bench->channel_len += len;
+    bench->wire_bytes += len;
+
+    uint64_t bits = 8 * (uint64_t)len;
+    uint64_t pos = 0;
+    while (bench->next_error < bits - pos) {
+        pos += bench->next_error;
+        out[pos / 8] ^= 1 << (pos % 8);
+        pos++;
+        bench_next_error(bench);
+    }
+    bench->next_error -= bits - pos;
+}
+
+static void bench_on_frame(void *ctx, uint8_t *frame, size_t len, bool fcs_ok)
+{
+    bench_t *bench = ctx;
+
+    if (fcs_ok && len == bench->frame_len + PPP_HDLC_FCS_LEN) {
+        bench->good_frames++;
+    }
+}
+
+static void bench_fec_output(void *ctx, const uint8_t *data, size_t len)
+{
+    bench_t *bench = ctx;
+    ppp_hdlc_decode(&bench->hdlc, data, len);
+}
+
+static void bench_run(bench_t *bench, int frames, int frame_size, ppp_fec_encoder_t *fec, uint8_t *frame, uint8_t *encoded, uint8_t *rx_frame)
+{
+    bench->rng = 0x12345678;
+    bench->frame_len = frame_size;
+    bench->good_frames = 0;
+    bench->wire_bytes = 0;
+    bench_next_error(bench);
+    ppp_hdlc_decoder_init(&bench->hdlc, rx_frame, frame_size + 16, bench_on_frame, bench);
+    ppp_fec_decoder_init(&bench->fec, bench_fec_output, bench);
+    if (fec) {
+        ppp_fec_decoder_set_params(&bench->fec, fec->block_size, fec->parity);
+    }
+
+    for (int i = 0; i < frames; i++) {
+        for (int j = 0; j < frame_size; j++) {
+            frame[j] = bench_random(bench);
+        }
+        size_t encoded_len = ppp_hdlc_encode(encoded, frame, frame_size);
+
+        bench->channel_len = 0;
+        if (fec) {
+            ppp_fec_encode(fec, encoded, encoded_len, true, bench_channel, bench);
+            ppp_fec_decode(&bench->fec, bench->channel, bench->channel_len);
+        } else {
+            bench_channel(bench, encoded, encoded_len);
+            ppp_hdlc_decode(&bench->hdlc, bench->channel, bench->channel_len);
+        }
+    }
+}
+
+static int do_ppp_fec_bench(int argc, char **argv)
+{
+    static const double bers[] = {0, 1e-6, 1e-5, 3e-5, 1e-4, 3e-4, 1e-3, 3e-3};
+
+    int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, bench_args.end, argv[0]);
+        return 1;
+    }
+    int frames = bench_args.frames->count ? bench_args.frames->ival[0] : 200;
+    int frame_size = bench_args.size->count ? bench_args.size->ival[0] : 1500;
+    int block_size = bench_args.block_size->count ? bench_args.block_size->ival[0] : 128;
+    int parity = bench_args.parity->count ? bench_args.parity->ival[0] : 8;
+    int baud = bench_args.baud->count ? bench_args.baud->ival[0] : 115200;
+
+    if (frames <= 0 || frame_size < 4 || frame_size > 1510 || !ppp_fec_params_valid(block_size, parity)) {
+        printf("Invalid parameters\n");
+        return 1;
+    }
+
+    int ret = 1;
+    size_t encoded_max = PPP_HDLC_ENCODED_MAX(frame_size);
+    bench_t *bench = calloc(1, sizeof(bench_t));
+    ppp_fec_encoder_t *fec = calloc(1, sizeof(ppp_fec_encoder_t));
+    uint8_t *frame = malloc(frame_size);
+    uint8_t *encoded = malloc(encoded_max);
+    uint8_t *rx_frame = malloc(frame_size + 16);
+    if (!bench || !fec || !frame || !encoded || !rx_frame) {
+        printf("Out of memory\n");
+        goto out;
+    }
+    ppp_fec_encoder_init(fec, block_size, parity);
+    bench->channel = malloc(ppp_fec_encoded_max(fec, encoded_max));
+    if (!bench->channel) {
+        printf("Out of memory\n");
+        goto out;
+    }
+
+    // 8N1, every byte costs 10 bits on the line
+    double payload_bps = baud * 0.8;
+    printf("%d frames of %d bytes, fec block %d + %d parity, %d baud\n", frames, frame_size, block_size, parity, baud);
+    printf("%9s %14s %14s %10s %10s %10s\n", "ber", "plain bps", "fec bps", "corrected", "bytes", "lost");
+    for (int i = 0; i < sizeof(bers) / sizeof(bers[0]); i++) {
+        bench->ber = bers[i];
+
+        bench_run(bench, frames, frame_size, NULL, frame, encoded, rx_frame);
+        double plain = payload_bps * bench->good_frames * frame_size / bench->wire_bytes;
+
+        bench_run(bench, frames, frame_size, fec, frame, encoded, rx_frame);
+        double coded = payload_bps * bench->good_frames * frame_size / bench->wire_bytes;
+
+        printf("%9.1e %14.0f %14.0f %10u %10u %10u\n", bench->ber, plain, coded, bench->fec.stats.corrected_blocks, bench->fec.stats.corrected_bytes,
+               bench->fec.stats.uncorrectable_blocks);
+    }
+    ret = 0;
+
+out:
+    if (bench) {
+        free(bench->channel);
+    }
+    free(bench);
+    free(fec);
+    free(frame);
+    free(encoded);
+    free(rx_frame);
+    return ret;
+}
+
+void register_ppp_fec_bench(void)
+{
+    bench_args.frames = arg_int0("n", "frames", "<n>", "Number of frames to send, default 200");
+    bench_args.size = arg_int0("s", "size", "<n>", "Frame size, default 1500");
+    bench_args.block_size = arg_int0("b", "block", "<n>", "FEC data bytes per block, default 128");
+    bench_args.parity = arg_int0("p", "parity", "<n>", "FEC parity bytes per block, default 8");
+    bench_args.baud = arg_int0(NULL, "baud", "<n>", "Line rate used to report goodput, default 115200");
+    bench_args.end = arg_end(1);
+    const esp_console_cmd_t bench_cmd = {
+        .command = "ppp_fec_bench",
+        .help = "Simulate a noisy serial line and compare goodput with and without FEC",
+        .hint = NULL,
+        .func = &do_ppp_fec_bench,
+        .argtable = &bench_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&bench_cmd));
+}
@@ -0,0 +1,131 @@
+/* PPP flash stress test
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "argtable3/argtable3.h"
+#include "esp_console.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+
+#include "ppp_flash_stress.h"
+#include "ppp_link.h"
+
+/**
+ * Erases and writes a data partition sector by sector for a while, the way
+ * NVS, a file system or an OTA update would, and reports how much received
+ * data the ppp link lost meanwhile. Start a transfer towards this side
+ * first, e.g. `iperf -s` here and `iperf -c <ip> -t 60` or `iperf -u` on the
+ * peer, then run the test once with and once without
+ * CONFIG_PPP_LINK_FAST_PATH_IN_IRAM.
+ */
+
+#define STRESS_SECTOR_SIZE 4096
+
+static struct {
+    struct arg_int *time;
+    struct arg_str *partition;
+    struct arg_end *end;
+} stress_args;
+
+static int do_ppp_flash_stress(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&stress_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, stress_args.end, argv[0]);
+        return 1;
+    }
+    int seconds = stress_args.time->count ? stress_args.time->ival[0] : 10;
+    const char *label = stress_args.partition->count ? stress_args.partition->sval[0] : "storage";
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!partition) {
+        printf("No data partition \"%s\"\n", label);
+        return 1;
+    }
+    if (seconds <= 0 || partition->size < STRESS_SECTOR_SIZE) {
+        printf("Invalid parameters\n");
+        return 1;
+    }
+
+    ppp_link_t *link = ppp_link_get(0);
+    ppp_link_stats_t before, after;
+    if (ppp_link_get_stats(link, &before) != ESP_OK) {
+        printf("No ppp link\n");
+        return 1;
+    }
+
+    uint8_t *sector = malloc(STRESS_SECTOR_SIZE);
+    if (!sector) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < STRESS_SECTOR_SIZE; i++) {
+        sector[i] = i * 7 + 1;
+    }
+
+    printf("Writing partition \"%s\" (%u kB) for %d seconds\n", label, partition->size / 1024, seconds);
+    int64_t start = esp_timer_get_time();
+    int64_t end = start + seconds * 1000000LL;
+    int64_t blocked_us = 0;
+    int64_t max_op_us = 0;
+    uint32_t sectors = 0;
+    size_t offset = 0;
+    esp_err_t err = ESP_OK;
+
+    while (esp_timer_get_time() < end) {
+        int64_t t0 = esp_timer_get_time();
+        err = esp_partition_erase_range(partition, offset, STRESS_SECTOR_SIZE);
+        int64_t t1 = esp_timer_get_time();
+        if (err == ESP_OK) {
+            err = esp_partition_write(partition, offset, sector, STRESS_SECTOR_SIZE);
+        }
+        int64_t t2 = esp_timer_get_time();
+        if (err != ESP_OK) {
+            printf("Flash error at 0x%x: %s\n", offset, esp_err_to_name(err));
+            break;
+        }
+        blocked_us += t2 - t0;
+        max_op_us = MAX(max_op_us, MAX(t1 - t0, t2 - t1));
+        sectors++;
+        offset += STRESS_SECTOR_SIZE;
+        if (offset + STRESS_SECTOR_SIZE > partition->size) {
+            offset = 0;
+        }
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    free(sector);
+
+    ppp_link_get_stats(link, &after);
+    printf("%u sectors, %u kB/s, in flash calls %lld ms (%lld%%), longest call %lld ms\n", sectors,
+           (uint32_t)((uint64_t)sectors * STRESS_SECTOR_SIZE * 1000 / elapsed_us), blocked_us / 1000, blocked_us * 100 / elapsed_us, max_op_us / 1000);
+    printf("rx: %u bytes, %u frames, %u fcs errors, %u overflows\n", after.rx_bytes - before.rx_bytes, after.rx_frames - before.rx_frames,
+           after.rx_fcs_errors - before.rx_fcs_errors, after.rx_overflows - before.rx_overflows);
+    if (after.direct.active) {
+        printf("direct uart: at most %u bytes queued, throttled %u times\n", after.direct.rx_max_fill, after.direct.rx_throttled - before.direct.rx_throttled);
+    }
+    return err == ESP_OK ? 0 : 1;
+}
+
+void register_ppp_flash_stress(void)
+{
+    stress_args.time = arg_int0("t", "time", "<s>", "Seconds to keep writing, default 10");
+    stress_args.partition = arg_str0("p", "partition", "<label>", "Data partition to overwrite, default storage");
+    stress_args.end = arg_end(1);
+    const esp_console_cmd_t stress_cmd = {
+        .command = "ppp_flash_stress",
+        .help = "Overwrite a data partition while traffic runs and count receive overflows",
+        .hint = NULL,
+        .func = &do_ppp_flash_stress,
+        .argtable = &stress_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&stress_cmd));
+}
@@ -0,0 +1,20 @@
+/* PPP flash stress test
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register the "ppp_flash_stress" command
+void register_ppp_flash_stress(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,170 @@
+/* PPP header compression benchmark
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "esp_console.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "ppp_hc_bench.h"
+#include "ppp_link.h"
+
+/**
+ * `hc_bench` runs a UDP iperf from the client of a link to this end, for a
+ * few datagram sizes, and measures what arrives over the link: packets per
+ * second, goodput and the bytes each packet costs on the line besides its
+ * payload. Small datagrams show the difference the header compression
+ * makes, run it once with and once without
+ * CONFIG_EXAMPLE_PPP_UDP_HEADER_COMPRESSION on the client, or
+ * CONFIG_EXAMPLE_PPP_IPV6_HEADER_COMPRESSION with -V.
+ */
+
+#define HC_BENCH_LENGTHS 4
+
+static struct {
+    struct arg_int *link;
+    struct arg_int *time;
+    struct arg_int *length;
+    struct arg_int *bandwidth;
+    struct arg_lit *ipv6;
+    struct arg_end *end;
+} bench_args;
+
+#if CONFIG_LWIP_IPV6
+// The address from the link prefix, the client sends to it
+static bool link_global_ip6(esp_netif_t *netif, esp_ip6_addr_t *addr)
+{
+    esp_ip6_addr_t addrs[MAX_IP6_ADDRS_PER_NETIF];
+    int count = esp_netif_get_all_ip6(netif, addrs);
+
+    for (int i = 0; i < count; i++) {
+        if (esp_netif_ip6_get_addr_type(&addrs[i]) != ESP_IP6_ADDR_IS_LINK_LOCAL) {
+            *addr = addrs[i];
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+// Compressed packets received, from the counters of the address family in use
+static uint32_t compressed_packets(const ppp_link_stats_t *stats, bool ipv6)
+{
+    return ipv6 ? stats->iphc.rx_packets : stats->rohc.rx_packets;
+}
+
+static int bench_length(ppp_link_t *link, const char *server, bool ipv6, int length, int seconds, int bandwidth)
+{
+    char cmd[128];
+    int ret;
+    ppp_link_stats_t first, last;
+
+    snprintf(cmd, sizeof(cmd), "cli iperf -c %s%s -u -l %d -t %d -b %d", server, ipv6 ? " -V" : "", length, seconds, bandwidth);
+    ppp_link_get_stats(link, &first);
+    if (esp_console_run(cmd, &ret) != ESP_OK || ret != 0) {
+        printf("Could not start iperf on the client\n");
+        return 1;
+    }
+    int64_t start = esp_timer_get_time();
+    // One more second for the last packets in flight
+    vTaskDelay(pdMS_TO_TICKS((seconds + 1) * 1000));
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    ppp_link_get_stats(link, &last);
+
+    uint32_t frames = last.rx_frames - first.rx_frames;
+    uint32_t bytes = last.rx_bytes - first.rx_bytes;
+    uint32_t compressed = compressed_packets(&last, ipv6) - compressed_packets(&first, ipv6);
+    // Line bytes per packet besides the payload: headers, framing and FCS
+    int overhead = frames ? (int)(bytes / frames) - length : 0;
+    printf("%6d %10u %12u %10d %10u%%\n", length, (uint32_t)((uint64_t)frames * 1000000 / elapsed_us),
+           (uint32_t)((uint64_t)frames * length * 8000 / elapsed_us), overhead, frames ? compressed * 100 / frames : 0);
+    return 0;
+}
+
+static int do_hc_bench(int argc, char **argv)
+{
+    static const int lengths[HC_BENCH_LENGTHS] = {16, 64, 256, 1024};
+
+    int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, bench_args.end, argv[0]);
+        return 1;
+    }
+    int seconds = bench_args.time->count ? bench_args.time->ival[0] : 5;
+    // Well above the line rate, the link is the bottleneck
+    int bandwidth = bench_args.bandwidth->count ? bench_args.bandwidth->ival[0] : 10;
+    bool ipv6 = bench_args.ipv6->count;
+    ppp_link_t *link = ppp_link_get(bench_args.link->count ? bench_args.link->ival[0] : 0);
+    if (!link) {
+        printf("No such link\n");
+        return 1;
+    }
+
+    char server[48];
+    if (ipv6) {
+#if CONFIG_LWIP_IPV6
+        esp_ip6_addr_t addr;
+        if (!link_global_ip6(ppp_link_get_netif(link), &addr)) {
+            printf("No IPv6 address on the link, the server hands them out\n");
+            return 1;
+        }
+        snprintf(server, sizeof(server), IPV6STR, IPV62STR(addr));
+#else
+        printf("IPv6 is not enabled\n");
+        return 1;
+#endif
+    } else {
+        esp_netif_ip_info_t ip_info;
+        if (esp_netif_get_ip_info(ppp_link_get_netif(link), &ip_info) != ESP_OK || ip_info.ip.addr == 0) {
+            printf("Link is not up\n");
+            return 1;
+        }
+        snprintf(server, sizeof(server), IPSTR, IP2STR(&ip_info.ip));
+    }
+
+    int ret;
+    if (esp_console_run(ipv6 ? "iperf -s -u -V" : "iperf -s -u", &ret) != ESP_OK || ret != 0) {
+        printf("Could not start the iperf server\n");
+        return 1;
+    }
+    printf("UDP to %s, %d s per size\n", server, seconds);
+    printf("%6s %10s %12s %10s %11s\n", "bytes", "packets/s", "goodput kbps", "overhead", "compressed");
+    if (bench_args.length->count) {
+        ret = bench_length(link, server, ipv6, bench_args.length->ival[0], seconds, bandwidth);
+    } else {
+        for (int i = 0; i < HC_BENCH_LENGTHS && ret == 0; i++) {
+            ret = bench_length(link, server, ipv6, lengths[i], seconds, bandwidth);
+        }
+    }
+    esp_console_run("iperf -a", NULL);
+    return ret;
+}
+
+void register_ppp_hc_bench(void)
+{
+    bench_args.link = arg_int0("n", "link", "<n>", "Link to measure, default 0");
+    bench_args.time = arg_int0("t", "time", "<s>", "Seconds per datagram size, default 5");
+    bench_args.length = arg_int0("l", "len", "<bytes>", "Only this datagram size");
+    bench_args.bandwidth = arg_int0("b", "bandwidth", "<Mbit/s>", "Rate the client sends at, default 10");
+    bench_args.ipv6 = arg_lit0("V", "ipv6", "Over IPv6 instead of IPv4");
+    bench_args.end = arg_end(1);
+    const esp_console_cmd_t bench_cmd = {
+        .command = "hc_bench",
+        .help = "Run UDP iperf from the ppp client to here and measure packet rate and per packet overhead",
+        .hint = NULL,
+        .func = &do_hc_bench,
+        .argtable = &bench_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&bench_cmd));
+}
@@ -0,0 +1,20 @@
+/* PPP header compression benchmark
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register the "hc_bench" command
+void register_ppp_hc_bench(void);
+
+#ifdef __cplusplus
+}
+#endif
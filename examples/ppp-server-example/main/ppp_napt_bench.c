@@ -0,0 +1,192 @@
+/* PPP NAPT commands
+
+   This example code is in the Public Domain (or CC0 licensed, at your option.)
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "esp_console.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "ppp_link.h"
+#include "ppp_napt.h"
+#include "ppp_napt_bench.h"
+
+/**
+ * `napt -e` translates traffic from the ppp clients out of the wifi
+ * station, `napt` prints the counters.
+ *
+ * `napt_bench -c <host>` measures forwarding from the ppp client to a host
+ * on the wifi network: it starts `iperf -c <host>` on the client through the
+ * cli and samples the translation counters every second. Run `iperf -s` on
+ * the host first, and `join` here.
+ */
+
+static struct {
+    struct arg_lit *enable;
+    struct arg_lit *disable;
+    struct arg_str *uplink;
+    struct arg_end *end;
+} napt_args;
+
+static struct {
+    struct arg_str *host;
+    struct arg_int *time;
+    struct arg_lit *udp;
+    struct arg_int *bandwidth;
+    struct arg_end *end;
+} bench_args;
+
+static void print_napt_stats(const ppp_napt_stats_t *stats)
+{
+    uint32_t packets = stats->out_packets + stats->in_packets;
+
+    printf("out: %u packets, %u bytes, in: %u packets, %u bytes\n", stats->out_packets, stats->out_bytes, stats->in_packets, stats->in_bytes);
+    printf("fast path %u%%, %u lookups\n", packets ? (uint32_t)((uint64_t)stats->fast_path * 100 / packets) : 0, stats->lookups);
+    printf("flows: %u active, at most %u, %u created, %u expired, %u refused on full table\n", stats->flows_active, stats->flows_max,
+           stats->flows_created, stats->flows_expired, stats->table_full);
+    printf("%u replies without a flow, %u dropped\n", stats->in_unmatched, stats->dropped);
+}
+
+static int do_napt(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&napt_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, napt_args.end, argv[0]);
+        return 1;
+    }
+
+    if (napt_args.enable->count) {
+        const char *key = napt_args.uplink->count ? napt_args.uplink->sval[0] : "WIFI_STA_DEF";
+        esp_netif_t *uplink = esp_netif_get_handle_from_ifkey(key);
+        if (!uplink || ppp_napt_enable(uplink) != ESP_OK) {
+            printf("No interface %s\n", key);
+            return 1;
+        }
+        return 0;
+    }
+    if (napt_args.disable->count) {
+        return ppp_napt_disable() == ESP_OK ? 0 : 1;
+    }
+
+    ppp_napt_stats_t stats;
+    if (ppp_napt_get_stats(&stats) != ESP_OK) {
+        printf("Translation is off\n");
+    }
+    print_napt_stats(&stats);
+    return 0;
+}
+
+// Bytes received from all ppp clients, frame overhead and retransmissions included.
+static uint32_t ppp_rx_bytes(void)
+{
+    uint32_t bytes = 0;
+    ppp_link_t *link;
+
+    for (int i = 0; (link = ppp_link_get(i)) != NULL; i++) {
+        ppp_link_stats_t stats;
+        if (ppp_link_get_stats(link, &stats) == ESP_OK) {
+            bytes += stats.rx_bytes;
+        }
+    }
+    return bytes;
+}
+
+static int do_napt_bench(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, bench_args.end, argv[0]);
+        return 1;
+    }
+    int seconds = bench_args.time->count ? bench_args.time->ival[0] : 10;
+
+    ppp_napt_stats_t first, last, now;
+    if (ppp_napt_get_stats(&first) != ESP_OK) {
+        printf("Translation is off, run napt -e first\n");
+        return 1;
+    }
+
+    char cmd[128];
+    int len = snprintf(cmd, sizeof(cmd), "cli iperf -c %s -t %d", bench_args.host->sval[0], seconds);
+    if (bench_args.udp->count) {
+        len += snprintf(cmd + len, sizeof(cmd) - len, " -u");
+    }
+    if (bench_args.bandwidth->count) {
+        snprintf(cmd + len, sizeof(cmd) - len, " -b %d", bench_args.bandwidth->ival[0]);
+    }
+    int ret;
+    if (esp_console_run(cmd, &ret) != ESP_OK || ret != 0) {
+        printf("Could not start iperf on the client\n");
+        return 1;
+    }
+
+    uint32_t link_first = ppp_rx_bytes();
+    int64_t start = esp_timer_get_time();
+    int64_t previous = start;
+    last = first;
+    // One more second for the last packets in flight
+    for (int i = 0; i <= seconds; i++) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        ppp_napt_get_stats(&now);
+        int64_t elapsed_us = esp_timer_get_time() - previous;
+        previous += elapsed_us;
+        uint32_t packets = now.out_packets - last.out_packets + now.in_packets - last.in_packets;
+        printf("%2d-%2d s: out %u kbit/s, in %u kbit/s, %u packets/s, fast path %u%%\n", i, i + 1,
+               (uint32_t)((uint64_t)(now.out_bytes - last.out_bytes) * 8000 / elapsed_us),
+               (uint32_t)((uint64_t)(now.in_bytes - last.in_bytes) * 8000 / elapsed_us), (uint32_t)((uint64_t)packets * 1000000 / elapsed_us),
+               packets ? (uint32_t)((uint64_t)(now.fast_path - last.fast_path) * 100 / packets) : 0);
+        last = now;
+    }
+
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    uint32_t out_bytes = last.out_bytes - first.out_bytes;
+    uint32_t link_bytes = ppp_rx_bytes() - link_first;
+    uint32_t packets = last.out_packets - first.out_packets + last.in_packets - first.in_packets;
+    printf("forwarded %u kbit/s out, %u kbit/s in, %u packets/s\n", (uint32_t)((uint64_t)out_bytes * 8000 / elapsed_us),
+           (uint32_t)((uint64_t)(last.in_bytes - first.in_bytes) * 8000 / elapsed_us), (uint32_t)((uint64_t)packets * 1000000 / elapsed_us));
+    printf("%u%% of the bytes received over ppp went out, fast path %u%%, %u new flows, %u refused, %u dropped\n",
+           link_bytes ? (uint32_t)((uint64_t)out_bytes * 100 / link_bytes) : 0,
+           packets ? (uint32_t)((uint64_t)(last.fast_path - first.fast_path) * 100 / packets) : 0, last.flows_created - first.flows_created,
+           last.table_full - first.table_full, last.dropped - first.dropped);
+    return 0;
+}
+
+void register_ppp_napt_bench(void)
+{
+    napt_args.enable = arg_lit0("e", "enable", "Translate ppp client traffic out of the uplink");
+    napt_args.disable = arg_lit0("d", "disable", "Stop translating");
+    napt_args.uplink = arg_str0("i", "interface", "<key>", "Uplink interface key, default WIFI_STA_DEF");
+    napt_args.end = arg_end(1);
+    const esp_console_cmd_t napt_cmd = {
+        .command = "napt",
+        .help = "Enable address translation to the uplink, or show its counters",
+        .hint = NULL,
+        .func = &do_napt,
+        .argtable = &napt_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&napt_cmd));
+
+    bench_args.host = arg_str1("c", "client", "<host>", "Host on the uplink running iperf -s");
+    bench_args.time = arg_int0("t", "time", "<s>", "Seconds to run, default 10");
+    bench_args.udp = arg_lit0("u", "udp", "UDP instead of TCP");
+    bench_args.bandwidth = arg_int0("b", "bandwidth", "<Mbit/s>", "UDP rate");
+    bench_args.end = arg_end(1);
+    const esp_console_cmd_t bench_cmd = {
+        .command = "napt_bench",
+        .help = "Run iperf from the ppp client to an uplink host and measure the forwarding rate",
+        .hint = NULL,
+        .func = &do_napt_bench,
+        .argtable = &bench_args
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&bench_cmd));
+}
@@ -7,18 +7,23 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <sys/param.h>
 
+#include "argtable3/argtable3.h"
 #include "esp_console.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_netif_ppp.h"
 #include "nvs_flash.h"
 #include "esp_vfs_fat.h"
+#include "esp_timer.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 
+#include "cmd_dns.h"
 #include "cmd_iperf.h"
+#include "cmd_ota.h"
 #include "cmd_ping.h"
 #include "cmd_system.h"
 #include "cmd_wifi.h"
@@ -27,14 +32,20 @@
 #include "lwip/sockets.h"
 #include "mqtt_client.h"
 #include "cli_client.h"
+#include "dns_forwarder.h"
 #include "netif/ppp/ppp.h"
 #include "ppp_link.h"
+#include "ppp_fec_bench.h"
+#include "ppp_flash_stress.h"
+#include "ppp_napt_bench.h"
+#include "ppp_hc_bench.h"
 #include "cli_server.h"
 
 static const char *TAG = "ppp_server_main";
 
 #define MOUNT_PATH "/data"
 #define HISTORY_PATH MOUNT_PATH "/history.txt"
+#define IPERF_HISTORY_PATH MOUNT_PATH "/iperf.bin"
 
 #if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
 #define UART_CLK UART_SCLK_REF_TICK
@@ -42,6 +53,67 @@ static const char *TAG = "ppp_server_main";
 #define UART_CLK UART_SCLK_XTAL
 #endif
 
+#ifdef CONFIG_EXAMPLE_PPP_MRU_AUTO_TUNE
+#define EXAMPLE_PPP_MRU_AUTO_TUNE true
+#else
+#define EXAMPLE_PPP_MRU_AUTO_TUNE false
+#endif
+
+#ifdef CONFIG_EXAMPLE_PPP_FEC
+#define EXAMPLE_PPP_FEC true
+#define EXAMPLE_PPP_FEC_BLOCK_SIZE CONFIG_EXAMPLE_PPP_FEC_BLOCK_SIZE
+#define EXAMPLE_PPP_FEC_PARITY CONFIG_EXAMPLE_PPP_FEC_PARITY
+#else
+#define EXAMPLE_PPP_FEC false
+#define EXAMPLE_PPP_FEC_BLOCK_SIZE 128
+#define EXAMPLE_PPP_FEC_PARITY 8
+#endif
+
+#ifdef CONFIG_EXAMPLE_PPP_ARQ
+#define EXAMPLE_PPP_ARQ true
+#define EXAMPLE_PPP_ARQ_WINDOW CONFIG_EXAMPLE_PPP_ARQ_WINDOW
+#else
+#define EXAMPLE_PPP_ARQ false
+#define EXAMPLE_PPP_ARQ_WINDOW 8
+#endif
+
+#ifdef CONFIG_EXAMPLE_PPP_LQM
+#define EXAMPLE_PPP_LQM true
+#else
+#define EXAMPLE_PPP_LQM false
+#endif
+
+#ifdef CONFIG_EXAMPLE_PPP_UDP_HEADER_COMPRESSION
+#define EXAMPLE_PPP_UDP_HEADER_COMPRESSION true
+#define EXAMPLE_PPP_UDP_HEADER_CONTEXTS CONFIG_EXAMPLE_PPP_UDP_HEADER_CONTEXTS
+#else
+#define EXAMPLE_PPP_UDP_HEADER_COMPRESSION false
+#define EXAMPLE_PPP_UDP_HEADER_CONTEXTS 8
+#endif
+
+#ifdef CONFIG_EXAMPLE_PPP_IPV6_HEADER_COMPRESSION
+#define EXAMPLE_PPP_IPV6_HEADER_COMPRESSION true
+#else
+#define EXAMPLE_PPP_IPV6_HEADER_COMPRESSION false
+#endif
+
+#ifdef CONFIG_EXAMPLE_PPP_DIRECT_UART
+#define EXAMPLE_PPP_DIRECT_UART true
+#else
+#define EXAMPLE_PPP_DIRECT_UART false
+#endif
+
+// Pipelined, the uart is read on the app core and frames enter the ip stack from the core running wifi and tcpip
+#ifdef CONFIG_EXAMPLE_PPP_RX_PIPELINE
+#define EXAMPLE_PPP_RX_PIPELINE true
+#define EXAMPLE_PPP_TASK_CORE 1
+#define EXAMPLE_PPP_RX_TASK_CORE 0
+#else
+#define EXAMPLE_PPP_RX_PIPELINE false
+#define EXAMPLE_PPP_TASK_CORE tskNO_AFFINITY
+#define EXAMPLE_PPP_RX_TASK_CORE tskNO_AFFINITY
+#endif
+
 #define DEFAULT_LINK_CONFIG                                                   \
     {.type = PPP_LINK_CLIENT,                                                 \
      .uart = UART_NUM_1,                                                      \
@@ -62,9 +134,49 @@ static const char *TAG = "ppp_server_main";
      .buffer = {.rx_buffer_size = CONFIG_EXAMPLE_MODEM_UART_RX_BUFFER_SIZE,   \
                 .tx_buffer_size = CONFIG_EXAMPLE_MODEM_UART_TX_BUFFER_SIZE,   \
                 .rx_queue_size = CONFIG_EXAMPLE_MODEM_UART_EVENT_QUEUE_SIZE}, \
+     .direct = {.enabled = EXAMPLE_PPP_DIRECT_UART},                          \
+     .rx_pool = {.frames = CONFIG_EXAMPLE_PPP_RX_POOL_FRAMES},                \
      .task = {                                                                \
          .stack_size = (3 * 1024),                                            \
          .prio = 100,                                                         \
+         .core = EXAMPLE_PPP_TASK_CORE,                                       \
+         .pipeline = {                                                        \
+             .enabled = EXAMPLE_PPP_RX_PIPELINE,                              \
+             .core = EXAMPLE_PPP_RX_TASK_CORE,                                \
+             .stack_size = (3 * 1024),                                        \
+             .prio = 100,                                                     \
+             .frames = 8,                                                     \
+         },                                                                   \
+     },                                                                       \
+     .mru = {                                                                 \
+         .auto_tune = EXAMPLE_PPP_MRU_AUTO_TUNE,                               \
+         .min = 256,                                                          \
+         .max = 1500,                                                         \
+         .hold_time_s = 60,                                                   \
+         .hysteresis_pct = 10,                                                \
+     },                                                                       \
+     .fec = {                                                                 \
+         .enabled = EXAMPLE_PPP_FEC,                                          \
+         .block_size = EXAMPLE_PPP_FEC_BLOCK_SIZE,                            \
+         .parity = EXAMPLE_PPP_FEC_PARITY,                                    \
+     },                                                                       \
+     .arq = {                                                                 \
+         .enabled = EXAMPLE_PPP_ARQ,                                          \
+         .window = EXAMPLE_PPP_ARQ_WINDOW,                                    \
+         .max_retries = 4,                                                    \
+     },                                                                       \
+     .lqm = {                                                                 \
+         .enabled = EXAMPLE_PPP_LQM,                                          \
+         .interval_ms = 1000,                                                 \
+         .good_score = 80,                                                    \
+         .bad_score = 50,                                                     \
+     },                                                                       \
+     .ipv4 = {                                                                \
+         .header_compression = EXAMPLE_PPP_UDP_HEADER_COMPRESSION,            \
+         .contexts = EXAMPLE_PPP_UDP_HEADER_CONTEXTS,                         \
+     },                                                                       \
+     .ipv6 = {                                                                \
+         .header_compression = EXAMPLE_PPP_IPV6_HEADER_COMPRESSION,           \
      }};
 
 
@@ -173,17 +285,93 @@ static void on_ip_event(void *arg, esp_event_base_t event_base, int32_t event_id
     }
 }
 
+static const char *health_level_name(ppp_link_health_level_t level)
+{
+    switch (level) {
+    case PPP_LINK_HEALTH_GOOD:
+        return "good";
+    case PPP_LINK_HEALTH_DEGRADED:
+        return "degraded";
+    case PPP_LINK_HEALTH_BAD:
+        return "bad";
+    default:
+        return "unknown";
+    }
+}
+
+static void on_link_event(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (event_id == PPP_LINK_EVENT_HEALTH_CHANGED) {
+        ppp_link_health_t *health = (ppp_link_health_t *)event_data;
+        ppp_link_stats_t stats;
+        int uart = ppp_link_get_stats(health->link, &stats) == ESP_OK ? stats.uart : -1;
+        ESP_LOGI(TAG, "Link health on uart %d %s, score %d", uart, health_level_name(health->level), health->score);
+    }
+}
+
 #ifdef CONFIG_PPP_SERVER_SUPPORT
+// Clients get 10.10.0.2 and up, in the order their links are started
+static ppp_link_addr_pool_t server_pool = {
+    .first = {.addr = ESP_IP4TOADDR(10, 10, 0, 2)},
+    .size = 16,
+};
+
+static struct {
+    struct arg_int *uart;
+    struct arg_int *tx;
+    struct arg_int *rx;
+    struct arg_int *rts;
+    struct arg_int *cts;
+    struct arg_end *end;
+} ppp_server_args;
+
 static int cmd_ppp_server(int argc, char **argv)
 {
+    int nerrors = arg_parse(argc, argv, (void **)&ppp_server_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, ppp_server_args.end, argv[0]);
+        return 1;
+    }
+
     ppp_link_config_t ppp_link_config = DEFAULT_LINK_CONFIG;
     ppp_link_config.type = PPP_LINK_SERVER;
     ppp_link_config.ppp_server.localaddr.addr = esp_netif_htonl(esp_netif_ip4_makeu32(10, 10, 0, 1));
-    ppp_link_config.ppp_server.remoteaddr.addr = esp_netif_htonl(esp_netif_ip4_makeu32(10, 10, 0, 2));
+    ppp_link_config.ppp_server.remote_pool = &server_pool;
     ppp_link_config.ppp_server.dnsaddr1.addr = esp_netif_htonl(esp_netif_ip4_makeu32(10, 10, 0, 1));
+    // fd00:10:10:<link>::/64, the server is ::a0a:1 and each client ::a0a:<n> after its IPv4 address
+    ppp_link_config.ppp_server.ip6_prefix.addr[0] = esp_netif_htonl(0xfd000010);
+    ppp_link_config.ppp_server.ip6_prefix.addr[1] = esp_netif_htonl(0x00100000);
+    if (ppp_server_args.uart->count) {
+        // Another client on another uart, the pins have no sensible default there
+        if (!ppp_server_args.tx->count || !ppp_server_args.rx->count) {
+            printf("--tx and --rx are needed with -u\n");
+            return 1;
+        }
+        ppp_link_config.uart = ppp_server_args.uart->ival[0];
+        ppp_link_config.io.tx = ppp_server_args.tx->ival[0];
+        ppp_link_config.io.rx = ppp_server_args.rx->ival[0];
+        ppp_link_config.io.rts = ppp_server_args.rts->count ? ppp_server_args.rts->ival[0] : UART_PIN_NO_CHANGE;
+        ppp_link_config.io.cts = ppp_server_args.cts->count ? ppp_server_args.cts->ival[0] : UART_PIN_NO_CHANGE;
+        if (ppp_link_config.io.rts == UART_PIN_NO_CHANGE || ppp_link_config.io.cts == UART_PIN_NO_CHANGE) {
+            ppp_link_config.uart_config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+        }
+    }
+
+    ESP_LOGI(TAG, "Will configure as PPP SERVER on uart %d", ppp_link_config.uart);
+    if (ppp_link_init(&ppp_link_config, NULL) != ESP_OK) {
+        printf("Could not start ppp server\n");
+        return 1;
+    }
 
-    ESP_LOGI(TAG, "Will configure as PPP SERVER");
-    ppp_link_init(&ppp_link_config);
+    // Clients are handed 10.10.0.1 as their dns server, answer them from the cache. Already running for the second link.
+    dns_forwarder_cfg_t dns_cfg = {
+        .port = DNS_FORWARDER_PORT,
+        .listen = ppp_link_config.ppp_server.localaddr,
+    };
+    esp_err_t err = dns_forwarder_start(&dns_cfg);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        printf("Could not start dns forwarder\n");
+    }
 
     return 0;
 }
@@ -194,7 +382,110 @@ static int cmd_ppp_client(int argc, char **argv)
     ppp_link_config_t ppp_link_config = DEFAULT_LINK_CONFIG;
 
     ESP_LOGI(TAG, "Will configure as PPP CLIENT");
-    ppp_link_init(&ppp_link_config);
+    ppp_link_init(&ppp_link_config, NULL);
+    return 0;
+}
+
+// Per client byte counters, rates are taken over the time since the previous ppp_clients
+static struct {
+    int64_t time;
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+} clients_last[CONFIG_PPP_LINK_MAX_LINKS];
+
+static int cmd_ppp_clients(int argc, char **argv)
+{
+    int64_t now = esp_timer_get_time();
+    ppp_link_t *link;
+
+    for (int i = 0; (link = ppp_link_get(i)) != NULL; i++) {
+        ppp_link_stats_t stats;
+        ppp_link_health_t health;
+        esp_netif_ip_info_t ip_info = {0};
+
+        ppp_link_get_stats(link, &stats);
+        esp_netif_get_ip_info(ppp_link_get_netif(link), &ip_info);
+        printf("%d: uart %d, peer " IPSTR ", rx %u bytes, tx %u bytes", i, stats.uart, IP2STR(&ip_info.gw), stats.rx_bytes, stats.tx_bytes);
+        if (clients_last[i].time) {
+            int64_t elapsed_us = MAX(now - clients_last[i].time, 1);
+            printf(", rx %u kbit/s, tx %u kbit/s", (uint32_t)((uint64_t)(stats.rx_bytes - clients_last[i].rx_bytes) * 8000 / elapsed_us),
+                   (uint32_t)((uint64_t)(stats.tx_bytes - clients_last[i].tx_bytes) * 8000 / elapsed_us));
+        }
+        if (ppp_link_get_health(link, &health) == ESP_OK && health.level != PPP_LINK_HEALTH_UNKNOWN) {
+            printf(", health %s", health_level_name(health.level));
+        }
+        printf("\n");
+        clients_last[i].time = now;
+        clients_last[i].rx_bytes = stats.rx_bytes;
+        clients_last[i].tx_bytes = stats.tx_bytes;
+    }
+    return 0;
+}
+
+static void print_link_stats(ppp_link_t *link)
+{
+    ppp_link_stats_t stats;
+
+    ppp_link_get_stats(link, &stats);
+    printf("rx: %u bytes, %u frames, %u fcs errors, %u dropped, %u overflows\n", stats.rx_bytes, stats.rx_frames, stats.rx_fcs_errors, stats.rx_dropped,
+           stats.rx_overflows);
+    printf("tx: %u bytes\n", stats.tx_bytes);
+    printf("rx pbuf: avg %u cycles, max %u cycles\n", stats.rx_alloc_avg_cycles, stats.rx_alloc_max_cycles);
+    if (stats.rx_pool.size) {
+        printf("rx pool: %u buffers, %u free, at least %u free, %u misses\n", stats.rx_pool.size, stats.rx_pool.free, stats.rx_pool.min_free,
+               stats.rx_pool.misses);
+    }
+    for (int i = 0; i < PPP_LINK_FRAME_BUCKETS; i++) {
+        if (i < PPP_LINK_FRAME_BUCKETS - 1) {
+            printf("  < %4d bytes: %u frames, %u fcs errors\n", PPP_LINK_FRAME_BUCKET_LIMIT(i), stats.rx_size[i].frames, stats.rx_size[i].fcs_errors);
+        } else {
+            printf(" >= %4d bytes: %u frames, %u fcs errors\n", PPP_LINK_FRAME_BUCKET_LIMIT(i - 1), stats.rx_size[i].frames, stats.rx_size[i].fcs_errors);
+        }
+    }
+    printf("mru: %d (%u changes), bit error rate: %.2e, estimated goodput: %u bps\n", stats.mru, stats.mru_changes, stats.bit_error_rate, stats.goodput_bps);
+    printf("fec: tx %s, %u blocks sent, %u blocks received, %u corrected (%u bytes), %u uncorrectable\n", stats.fec.tx_active ? "on" : "off",
+           stats.fec.tx_blocks, stats.fec.rx_blocks, stats.fec.corrected_blocks, stats.fec.corrected_bytes, stats.fec.uncorrectable_blocks);
+    printf("arq: tx %s, %u frames, %u retransmissions (%u timeouts), %u failed, %u unprotected, rtt %u ms\n", stats.arq.tx_active ? "on" : "off",
+           stats.arq.tx_frames, stats.arq.retransmissions, stats.arq.timeouts, stats.arq.failed, stats.arq.unprotected, stats.arq.rtt_us / 1000);
+    printf("     %u recovered, extra latency avg %u ms max %u ms, rx %u frames, %u duplicates, %u out of order\n", stats.arq.recovered,
+           stats.arq.recovery_avg_us / 1000, stats.arq.recovery_max_us / 1000, stats.arq.rx_frames, stats.arq.rx_duplicates, stats.arq.rx_out_of_order);
+    printf("iphc: tx %s, %u packets sent, %u header bytes saved, %u received, %u errors\n", stats.iphc.tx_active ? "on" : "off", stats.iphc.tx_packets,
+           stats.iphc.tx_saved_bytes, stats.iphc.rx_packets, stats.iphc.rx_errors);
+    printf("rohc: tx %s, %u packets sent, %u full headers, %u evictions, %u header bytes saved, %u received, %u errors\n", stats.rohc.tx_active ? "on" : "off",
+           stats.rohc.tx_packets, stats.rohc.tx_ir, stats.rohc.tx_evictions, stats.rohc.tx_saved_bytes, stats.rohc.rx_packets, stats.rohc.rx_errors);
+    if (stats.direct.active) {
+        printf("direct uart: %u interrupts, %u wakeups, at most %u bytes queued, throttled %u times\n", stats.direct.interrupts, stats.direct.wakeups,
+               stats.direct.rx_max_fill, stats.direct.rx_throttled);
+    }
+    if (stats.pipeline.active) {
+        printf("pipeline: %u frames, %u dropped on full ring, at most %u queued\n", stats.pipeline.frames, stats.pipeline.ring_full,
+               stats.pipeline.max_queued);
+    }
+
+    ppp_link_health_t health;
+    if (ppp_link_get_health(link, &health) == ESP_OK) {
+        printf("health: %s, score %d, rtt %u ms, loss in %.1f%% out %.1f%%, errors in %.1f%% out %.1f%%\n", health_level_name(health.level), health.score,
+               health.rtt_us / 1000, health.loss_in_permille / 10.0, health.loss_out_permille / 10.0, health.errors_in_permille / 10.0,
+               health.errors_out_permille / 10.0);
+    }
+}
+
+static int cmd_ppp_stats(int argc, char **argv)
+{
+    ppp_link_t *link;
+    int i;
+
+    for (i = 0; (link = ppp_link_get(i)) != NULL; i++) {
+        ppp_link_stats_t stats;
+
+        ppp_link_get_stats(link, &stats);
+        printf("%sppp link %d, uart %d\n", i ? "\n" : "", i, stats.uart);
+        print_link_stats(link);
+    }
+    if (i == 0) {
+        printf("No ppp link\n");
+        return 1;
+    }
     return 0;
 }
 
@@ -216,6 +507,21 @@ static void initialize_nvs(void)
     ESP_ERROR_CHECK(err);
 }
 
+// FAT with wear levelling on the storage partition, formatted when it does not mount
+static esp_err_t initialize_filesystem(void)
+{
+    static wl_handle_t wl_handle;
+    const esp_vfs_fat_mount_config_t mount_config = {
+        .max_files = 4,
+        .format_if_mount_failed = true
+    };
+    esp_err_t err = esp_vfs_fat_spiflash_mount_rw_wl(MOUNT_PATH, "storage", &mount_config, &wl_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount FATFS (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
 void app_main(void)
 {
 
@@ -239,20 +545,39 @@ void app_main(void)
     initialize_nvs();
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, &on_ip_event, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(NETIF_PPP_STATUS, ESP_EVENT_ANY_ID, &on_ppp_changed, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(PPP_LINK_EVENT, ESP_EVENT_ANY_ID, &on_link_event, NULL));
 
     /* Register commands */
     register_system_common();
     register_wifi();
+    register_dns();
     register_iperf();
+    if (initialize_filesystem() == ESP_OK) {
+        register_iperf_history(IPERF_HISTORY_PATH);
+    }
+    register_ota();
     register_ping();
+    register_ppp_fec_bench();
+    register_ppp_flash_stress();
+#ifdef CONFIG_PPP_NAPT
+    register_ppp_napt_bench();
+#endif
+    register_ppp_hc_bench();
 
 
 #ifdef CONFIG_PPP_SERVER_SUPPORT
+    ppp_server_args.uart = arg_int0("u", "uart", "<n>", "Serve another client on this uart, default the configured modem uart");
+    ppp_server_args.tx = arg_int0(NULL, "tx", "<gpio>", "Tx pin of the other uart");
+    ppp_server_args.rx = arg_int0(NULL, "rx", "<gpio>", "Rx pin of the other uart");
+    ppp_server_args.rts = arg_int0(NULL, "rts", "<gpio>", "Rts pin of the other uart, no flow control without rts and cts");
+    ppp_server_args.cts = arg_int0(NULL, "cts", "<gpio>", "Cts pin of the other uart");
+    ppp_server_args.end = arg_end(2);
     const esp_console_cmd_t ppp_server = {
         .command = "ppp_server",
-        .help = "Start ppp server",
+        .help = "Start ppp server, run again with -u for every further client",
         .hint = NULL,
         .func = &cmd_ppp_server,
+        .argtable = &ppp_server_args,
     };
     ESP_ERROR_CHECK(esp_console_cmd_register(&ppp_server));
 #endif
@@ -264,6 +589,22 @@ void app_main(void)
     };
     ESP_ERROR_CHECK(esp_console_cmd_register(&ppp_client));
 
+    const esp_console_cmd_t ppp_stats = {
+        .command = "ppp_stats",
+        .help = "Show ppp link statistics",
+        .hint = NULL,
+        .func = &cmd_ppp_stats,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&ppp_stats));
+
+    const esp_console_cmd_t ppp_clients = {
+        .command = "ppp_clients",
+        .help = "Show address and throughput of every ppp link",
+        .hint = NULL,
+        .func = &cmd_ppp_clients,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&ppp_clients));
+
     const esp_console_cmd_t cli_server_cmd = {
         .command = "cli_server",
         .help = "Start cli server",
@@ -0,0 +1,226 @@
+#include "ppp_arq.h"
+#include <string.h>
+#include <sys/param.h>
+
+#define PPP_ARQ_INITIAL_RTO_US (1000 * 1000)
+#define PPP_ARQ_MIN_RTO_US (50 * 1000)
+#define PPP_ARQ_MAX_RTO_US (4 * 1000 * 1000)
+
+// Acknowledge at least every this many frames, or after this delay.
+#define PPP_ARQ_ACK_FRAMES 4
+#define PPP_ARQ_ACK_DELAY_US (20 * 1000)
+
+void ppp_arq_init(ppp_arq_t *arq, uint8_t *buffer, size_t frame_size, int window, int max_retries)
+{
+    memset(arq, 0, sizeof(*arq));
+    arq->window = MIN(window, PPP_ARQ_MAX_WINDOW);
+    arq->max_retries = max_retries;
+    arq->frame_size = frame_size;
+    for (int i = 0; i < arq->window; i++) {
+        arq->slots[i].frame = buffer + i * frame_size;
+    }
+    ppp_arq_reset(arq);
+}
+
+void ppp_arq_reset(ppp_arq_t *arq)
+{
+    arq->first = 0;
+    arq->count = 0;
+    arq->base = 0;
+    arq->srtt_us = 0;
+    arq->rttvar_us = 0;
+    arq->rto_us = PPP_ARQ_INITIAL_RTO_US;
+    arq->rx_next = 0;
+    arq->rx_bitmap = 0;
+    arq->ack_pending = false;
+    arq->ack_now = false;
+    arq->ack_frames = 0;
+}
+
+static inline ppp_arq_slot_t *ppp_arq_slot(ppp_arq_t *arq, int i)
+{
+    return &arq->slots[(arq->first + i) % arq->window];
+}
+
+// Release acknowledged and abandoned frames at the start of the window.
+static void ppp_arq_slide(ppp_arq_t *arq)
+{
+    while (arq->count > 0 && ppp_arq_slot(arq, 0)->acked) {
+        arq->first = (arq->first + 1) % arq->window;
+        arq->count--;
+        arq->base++;
+    }
+}
+
+ppp_arq_slot_t *ppp_arq_queue(ppp_arq_t *arq, const uint8_t *frame, size_t len)
+{
+    if (arq->count >= arq->window || len > arq->frame_size) {
+        return NULL;
+    }
+    ppp_arq_slot_t *slot = ppp_arq_slot(arq, arq->count);
+    memcpy(slot->frame, frame, len);
+    slot->len = len;
+    slot->seq = arq->base + arq->count;
+    slot->retries = 0;
+    slot->acked = false;
+    slot->lost = false;
+    slot->first_sent_us = 0;
+    slot->sent_us = 0;
+    arq->count++;
+    return slot;
+}
+
+ppp_arq_slot_t *ppp_arq_next_tx(ppp_arq_t *arq, int64_t now_us)
+{
+    for (int i = 0; i < arq->count; i++) {
+        ppp_arq_slot_t *slot = ppp_arq_slot(arq, i);
+
+        if (slot->acked) {
+            continue;
+        }
+        if (slot->first_sent_us == 0) {
+            return slot;
+        }
+        if (!slot->lost && now_us - slot->sent_us < arq->rto_us) {
+            continue;
+        }
+        if (slot->retries >= arq->max_retries) {
+            // Leave it to the end to end protocol, the receiver skips it when it sees our new base.
+            slot->acked = true;
+            arq->stats.failed++;
+            continue;
+        }
+        return slot;
+    }
+    ppp_arq_slide(arq);
+    return NULL;
+}
+
+void ppp_arq_sent(ppp_arq_t *arq, ppp_arq_slot_t *slot, int64_t now_us)
+{
+    if (slot->first_sent_us == 0) {
+        slot->first_sent_us = now_us;
+        arq->stats.tx_frames++;
+    } else {
+        slot->retries++;
+        arq->stats.retransmissions++;
+        if (!slot->lost) {
+            arq->stats.timeouts++;
+            // Back off, the line may be much slower than the last samples suggest
+            arq->rto_us = MIN(arq->rto_us * 2, PPP_ARQ_MAX_RTO_US);
+        }
+    }
+    slot->sent_us = now_us;
+    slot->lost = false;
+}
+
+// Retransmission timeout as in RFC 6298.
+static void ppp_arq_rtt_sample(ppp_arq_t *arq, int64_t rtt_us)
+{
+    if (arq->srtt_us == 0) {
+        arq->srtt_us = rtt_us;
+        arq->rttvar_us = rtt_us / 2;
+    } else {
+        int64_t delta = arq->srtt_us > rtt_us ? arq->srtt_us - rtt_us : rtt_us - arq->srtt_us;
+        arq->rttvar_us = (3 * arq->rttvar_us + delta) / 4;
+        arq->srtt_us = (7 * arq->srtt_us + rtt_us) / 8;
+    }
+    arq->rto_us = MIN(MAX(arq->srtt_us + 4 * arq->rttvar_us, PPP_ARQ_MIN_RTO_US), PPP_ARQ_MAX_RTO_US);
+}
+
+void ppp_arq_on_ack(ppp_arq_t *arq, uint8_t next, uint32_t bitmap, int64_t now_us)
+{
+    int64_t latest_acked_sent_us = 0;
+
+    for (int i = 0; i < arq->count; i++) {
+        ppp_arq_slot_t *slot = ppp_arq_slot(arq, i);
+        uint8_t distance = slot->seq - next;
+
+        if (slot->acked || slot->first_sent_us == 0) {
+            continue;
+        }
+        // Sequence numbers behind next are negative distances, they have all been received.
+        bool received = distance >= 128 || (distance < 32 && (bitmap & (1UL << distance)));
+        if (!received) {
+            continue;
+        }
+        slot->acked = true;
+        latest_acked_sent_us = MAX(latest_acked_sent_us, slot->sent_us);
+        if (slot->retries == 0) {
+            ppp_arq_rtt_sample(arq, now_us - slot->sent_us);
+        } else {
+            // Karn's algorithm, no rtt sample from retransmitted frames
+            uint32_t recovery_us = now_us - slot->first_sent_us;
+            arq->stats.recovered++;
+            arq->stats.recovery_time_us += recovery_us;
+            arq->stats.max_recovery_time_us = MAX(arq->stats.max_recovery_time_us, recovery_us);
+        }
+    }
+
+    // Anything sent before a frame that made it is lost, the line does not reorder.
+    for (int i = 0; i < arq->count; i++) {
+        ppp_arq_slot_t *slot = ppp_arq_slot(arq, i);
+        if (!slot->acked && slot->first_sent_us != 0 && slot->sent_us < latest_acked_sent_us) {
+            slot->lost = true;
+        }
+    }
+
+    ppp_arq_slide(arq);
+}
+
+bool ppp_arq_receive(ppp_arq_t *arq, uint8_t seq, uint8_t base, int64_t now_us)
+{
+    uint8_t skip = base - arq->rx_next;
+    uint8_t distance = seq - arq->rx_next;
+
+    arq->stats.rx_frames++;
+    if (!arq->ack_pending) {
+        arq->ack_since_us = now_us;
+    }
+    arq->ack_pending = true;
+    arq->ack_frames++;
+
+    if (skip > 0 && skip < 128) {
+        // The sender has given up on frames we are still waiting for, step over them.
+        arq->rx_next = base;
+        arq->rx_bitmap = skip < 32 ? arq->rx_bitmap >> skip : 0;
+        distance = seq - arq->rx_next;
+    }
+
+    if (distance >= 128 || (distance < 32 && (arq->rx_bitmap & (1UL << distance)))) {
+        // Our acknowledge got lost, repeat it right away.
+        arq->stats.rx_duplicates++;
+        arq->ack_now = true;
+        return false;
+    }
+    if (distance >= 32) {
+        // Far ahead of anything we know, the peer restarted its numbering.
+        arq->rx_next = seq;
+        arq->rx_bitmap = 0;
+        distance = 0;
+    }
+    if (distance > 0) {
+        // A gap, tell the sender now so it can repeat the missing frames.
+        arq->stats.rx_out_of_order++;
+        arq->ack_now = true;
+    }
+
+    arq->rx_bitmap |= 1UL << distance;
+    while (arq->rx_bitmap & 1) {
+        arq->rx_bitmap >>= 1;
+        arq->rx_next++;
+    }
+    return true;
+}
+
+bool ppp_arq_ack_due(const ppp_arq_t *arq, int64_t now_us)
+{
+    return arq->ack_pending && (arq->ack_now || arq->ack_frames >= PPP_ARQ_ACK_FRAMES || now_us - arq->ack_since_us >= PPP_ARQ_ACK_DELAY_US);
+}
+
+void ppp_arq_ack_sent(ppp_arq_t *arq)
+{
+    arq->ack_pending = false;
+    arq->ack_now = false;
+    arq->ack_frames = 0;
+}
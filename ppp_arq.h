@@ -0,0 +1,101 @@
+#ifndef __PPP_ARQ_H_
+#define __PPP_ARQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Selective repeat ARQ for frames sent over ppp_link.
+ *
+ * Every frame gets an 8 bit sequence number and is kept in a slot until the
+ * peer acknowledges it. The peer acknowledges with the next sequence number it
+ * is waiting for plus a bitmap of frames received beyond it. A frame is sent
+ * again when a later frame has been acknowledged (fast retransmit) or when the
+ * retransmission timeout expires, until max_retries is reached. Each data
+ * frame also carries the oldest sequence number the sender still holds, so
+ * the receiver can skip frames the sender has given up on.
+ *
+ * Received frames are delivered as soon as they arrive, a lost frame does not
+ * hold back the ones after it. Only duplicates are dropped.
+ */
+
+#define PPP_ARQ_MAX_WINDOW 32
+
+typedef struct {
+    uint8_t *frame;
+    size_t len;
+    uint8_t seq;
+    uint8_t retries;
+    bool acked;
+    bool lost;             // A later frame was acknowledged first
+    int64_t first_sent_us; // 0 while not sent yet
+    int64_t sent_us;
+} ppp_arq_slot_t;
+
+typedef struct {
+    uint32_t tx_frames;
+    uint32_t retransmissions;
+    uint32_t timeouts; // Retransmissions after the timeout, the rest were fast retransmits
+    uint32_t failed;   // Frames given up after max retries
+    uint32_t recovered;
+    uint64_t recovery_time_us; // Summed time from first transmission to acknowledge of recovered frames
+    uint32_t max_recovery_time_us;
+    uint32_t rx_frames;
+    uint32_t rx_duplicates;
+    uint32_t rx_out_of_order;
+} ppp_arq_stats_t;
+
+typedef struct {
+    // Sender
+    ppp_arq_slot_t slots[PPP_ARQ_MAX_WINDOW];
+    int window;
+    int max_retries;
+    size_t frame_size;
+    int first;
+    int count;
+    uint8_t base; // Sequence number of slots[first]
+    int64_t srtt_us;
+    int64_t rttvar_us;
+    int64_t rto_us;
+
+    // Receiver
+    uint8_t rx_next;    // Oldest sequence number not received yet
+    uint32_t rx_bitmap; // Bit i set when rx_next + i has been received
+    bool ack_pending;
+    bool ack_now;
+    int ack_frames;
+    int64_t ack_since_us;
+
+    ppp_arq_stats_t stats;
+} ppp_arq_t;
+
+/**
+ * Buffer holds window frames of frame_size bytes each. A receive only
+ * instance, which just acknowledges, is created with window 0 and no buffer.
+ */
+void ppp_arq_init(ppp_arq_t *arq, uint8_t *buffer, size_t frame_size, int window, int max_retries);
+
+// Forget all frames in flight and received, used when the link restarts.
+void ppp_arq_reset(ppp_arq_t *arq);
+
+// Store a frame for transmission. Returns NULL when the window is full or the frame does not fit a slot.
+ppp_arq_slot_t *ppp_arq_queue(ppp_arq_t *arq, const uint8_t *frame, size_t len);
+
+// Oldest frame that should be (re)sent now, or NULL. Frames out of retries are dropped here.
+ppp_arq_slot_t *ppp_arq_next_tx(ppp_arq_t *arq, int64_t now_us);
+
+// Mark the frame returned by ppp_arq_next_tx() as written to the line.
+void ppp_arq_sent(ppp_arq_t *arq, ppp_arq_slot_t *slot, int64_t now_us);
+
+void ppp_arq_on_ack(ppp_arq_t *arq, uint8_t next, uint32_t bitmap, int64_t now_us);
+
+// Account a received frame with the sender's base. Returns false for duplicates, which must not be delivered.
+bool ppp_arq_receive(ppp_arq_t *arq, uint8_t seq, uint8_t base, int64_t now_us);
+
+// True when rx_next and rx_bitmap should be sent to the peer, call ppp_arq_ack_sent() once done.
+bool ppp_arq_ack_due(const ppp_arq_t *arq, int64_t now_us);
+
+void ppp_arq_ack_sent(ppp_arq_t *arq);
+
+#endif /* __PPP_ARQ_H_ */
@@ -0,0 +1,357 @@
+#include "ppp_fec.h"
+
+#include <string.h>
+
+#include "ppp_hdlc.h"
+
+// GF(2^8) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1, generator roots alpha^1 .. alpha^parity.
+#define GF_POLY 0x11d
+#define GF_SIZE 255
+
+static uint8_t gf_exp[2 * GF_SIZE];
+static uint8_t gf_log[GF_SIZE + 1];
+static bool gf_ready;
+
+static void gf_init(void)
+{
+    if (gf_ready) {
+        return;
+    }
+    unsigned x = 1;
+    for (int i = 0; i < GF_SIZE; i++) {
+        gf_exp[i] = x;
+        gf_exp[i + GF_SIZE] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+    gf_ready = true;
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_div(uint8_t a, uint8_t b)
+{
+    if (a == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + GF_SIZE - gf_log[b]];
+}
+
+// alpha^e for any non negative e
+static inline uint8_t gf_pow(unsigned e)
+{
+    return gf_exp[e % GF_SIZE];
+}
+
+bool ppp_fec_params_valid(int block_size, int parity)
+{
+    return block_size > 0 && parity >= 2 && parity <= PPP_FEC_MAX_PARITY && (parity % 2) == 0 && block_size + parity <= PPP_FEC_MAX_CODEWORD;
+}
+
+void ppp_fec_encoder_init(ppp_fec_encoder_t *enc, int block_size, int parity)
+{
+    gf_init();
+    memset(enc, 0, sizeof(*enc));
+    enc->block_size = block_size;
+    enc->parity = parity;
+    enc->block[0] = PPP_FEC_SYNC;
+    enc->block[1] = PPP_FEC_SYNC;
+
+    // g(x) = (x - alpha^1)(x - alpha^2)...(x - alpha^parity), genpoly[i] is the coefficient of x^i.
+    enc->genpoly[0] = 1;
+    for (int i = 0; i < parity; i++) {
+        uint8_t root = gf_pow(i + 1);
+        enc->genpoly[i + 1] = 1;
+        for (int j = i; j > 0; j--) {
+            enc->genpoly[j] = enc->genpoly[j - 1] ^ gf_mul(enc->genpoly[j], root);
+        }
+        enc->genpoly[0] = gf_mul(enc->genpoly[0], root);
+    }
+}
+
+static void ppp_fec_encode_block(ppp_fec_encoder_t *enc, ppp_fec_output_cb_t output, void *ctx)
+{
+    uint8_t *data = &enc->block[PPP_FEC_SYNC_LEN];
+    uint8_t *parity = data + enc->block_size;
+    int nroots = enc->parity;
+
+    // Systematic encoding, parity is the remainder of data(x) * x^nroots divided by g(x).
+    memset(parity, 0, nroots);
+    for (int i = 0; i < enc->block_size; i++) {
+        uint8_t feedback = data[i] ^ parity[0];
+        memmove(&parity[0], &parity[1], nroots - 1);
+        parity[nroots - 1] = 0;
+        if (feedback) {
+            for (int j = 0; j < nroots; j++) {
+                parity[j] ^= gf_mul(feedback, enc->genpoly[nroots - 1 - j]);
+            }
+        }
+    }
+
+    output(ctx, enc->block, PPP_FEC_SYNC_LEN + enc->block_size + nroots);
+    enc->fill = 0;
+}
+
+void ppp_fec_encode(ppp_fec_encoder_t *enc, const uint8_t *data, size_t len, bool flush, ppp_fec_output_cb_t output, void *ctx)
+{
+    uint8_t *block_data = &enc->block[PPP_FEC_SYNC_LEN];
+
+    while (len > 0) {
+        size_t chunk = enc->block_size - enc->fill;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(&block_data[enc->fill], data, chunk);
+        enc->fill += chunk;
+        data += chunk;
+        len -= chunk;
+        if (enc->fill == enc->block_size) {
+            ppp_fec_encode_block(enc, output, ctx);
+        }
+    }
+
+    if (flush && enc->fill > 0) {
+        memset(&block_data[enc->fill], PPP_HDLC_FLAG, enc->block_size - enc->fill);
+        ppp_fec_encode_block(enc, output, ctx);
+    }
+}
+
+size_t ppp_fec_encoded_max(const ppp_fec_encoder_t *enc, size_t len)
+{
+    size_t blocks = (enc->fill + len + enc->block_size - 1) / enc->block_size;
+    return blocks * (PPP_FEC_BLOCK_OVERHEAD(enc->parity) + enc->block_size);
+}
+
+int ppp_fec_correct(uint8_t *codeword, size_t len, int nroots)
+{
+    uint8_t syndromes[PPP_FEC_MAX_PARITY];
+    uint8_t lambda[PPP_FEC_MAX_PARITY + 1] = {1};
+    uint8_t prev[PPP_FEC_MAX_PARITY + 1] = {1};
+    uint8_t omega[PPP_FEC_MAX_PARITY];
+    bool errors = false;
+
+    // codeword[0] is the coefficient of x^(len - 1)
+    for (int i = 0; i < nroots; i++) {
+        uint8_t root = gf_pow(i + 1);
+        uint8_t s = 0;
+        for (size_t j = 0; j < len; j++) {
+            s = gf_mul(s, root) ^ codeword[j];
+        }
+        syndromes[i] = s;
+        errors |= s != 0;
+    }
+    if (!errors) {
+        return 0;
+    }
+
+    // Berlekamp-Massey, find the error locator polynomial lambda.
+    int degree = 0;
+    int shift = 1;
+    uint8_t prev_discrepancy = 1;
+    for (int n = 0; n < nroots; n++) {
+        uint8_t discrepancy = syndromes[n];
+        for (int i = 1; i <= degree; i++) {
+            discrepancy ^= gf_mul(lambda[i], syndromes[n - i]);
+        }
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+        uint8_t scale = gf_div(discrepancy, prev_discrepancy);
+        if (2 * degree <= n) {
+            uint8_t tmp[PPP_FEC_MAX_PARITY + 1];
+            memcpy(tmp, lambda, sizeof(tmp));
+            for (int i = 0; i + shift <= nroots; i++) {
+                lambda[i + shift] ^= gf_mul(scale, prev[i]);
+            }
+            memcpy(prev, tmp, sizeof(prev));
+            degree = n + 1 - degree;
+            prev_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            for (int i = 0; i + shift <= nroots; i++) {
+                lambda[i + shift] ^= gf_mul(scale, prev[i]);
+            }
+            shift++;
+        }
+    }
+    if (degree == 0 || degree > nroots / 2) {
+        return -1;
+    }
+
+    // omega(x) = syndromes(x) * lambda(x) mod x^nroots
+    for (int i = 0; i < nroots; i++) {
+        omega[i] = 0;
+        for (int j = 0; j <= i && j <= degree; j++) {
+            omega[i] ^= gf_mul(lambda[j], syndromes[i - j]);
+        }
+    }
+
+    // Chien search for the roots of lambda, Forney for the error values.
+    int found = 0;
+    for (size_t pos = 0; pos < len; pos++) {
+        unsigned exponent = len - 1 - pos;
+        uint8_t x_inv = gf_pow(GF_SIZE - (exponent % GF_SIZE));
+
+        uint8_t value = 0;
+        uint8_t x_pow = 1;
+        for (int i = 0; i <= degree; i++) {
+            value ^= gf_mul(lambda[i], x_pow);
+            x_pow = gf_mul(x_pow, x_inv);
+        }
+        if (value != 0) {
+            continue;
+        }
+
+        uint8_t numerator = 0;
+        x_pow = 1;
+        for (int i = 0; i < nroots; i++) {
+            numerator ^= gf_mul(omega[i], x_pow);
+            x_pow = gf_mul(x_pow, x_inv);
+        }
+        // Formal derivative of lambda only keeps the odd terms.
+        uint8_t denominator = 0;
+        uint8_t x_inv_sq = gf_mul(x_inv, x_inv);
+        x_pow = 1;
+        for (int i = 1; i <= degree; i += 2) {
+            denominator ^= gf_mul(lambda[i], x_pow);
+            x_pow = gf_mul(x_pow, x_inv_sq);
+        }
+        if (denominator == 0) {
+            return -1;
+        }
+        codeword[pos] ^= gf_div(numerator, denominator);
+        found++;
+    }
+
+    return found == degree ? found : -1;
+}
+
+void ppp_fec_decoder_init(ppp_fec_decoder_t *dec, ppp_fec_output_cb_t output, void *ctx)
+{
+    gf_init();
+    memset(dec, 0, sizeof(*dec));
+    dec->state = PPP_FEC_HUNT;
+    dec->output = output;
+    dec->ctx = ctx;
+}
+
+void ppp_fec_decoder_set_params(ppp_fec_decoder_t *dec, int block_size, int parity)
+{
+    if (dec->block_size != block_size || dec->parity != parity) {
+        dec->block_size = block_size;
+        dec->parity = parity;
+        dec->state = PPP_FEC_HUNT;
+        dec->fill = 0;
+    }
+}
+
+static void ppp_fec_decode_block(ppp_fec_decoder_t *dec)
+{
+    int corrected = ppp_fec_correct(dec->block, dec->block_size + dec->parity, dec->parity);
+
+    dec->stats.blocks++;
+    if (corrected < 0) {
+        // Close whatever frame was in progress, it can not be complete anyway.
+        const uint8_t flag = PPP_HDLC_FLAG;
+        dec->stats.uncorrectable_blocks++;
+        dec->output(dec->ctx, &flag, 1);
+        return;
+    }
+    if (corrected > 0) {
+        dec->stats.corrected_blocks++;
+        dec->stats.corrected_bytes += corrected;
+    }
+    dec->output(dec->ctx, dec->block, dec->block_size);
+}
+
+typedef struct {
+    uint8_t data[64];
+    size_t len;
+} ppp_fec_plain_t;
+
+static void ppp_fec_plain_flush(ppp_fec_decoder_t *dec, ppp_fec_plain_t *plain)
+{
+    if (plain->len > 0) {
+        dec->output(dec->ctx, plain->data, plain->len);
+        plain->len = 0;
+    }
+}
+
+static inline void ppp_fec_plain_put(ppp_fec_decoder_t *dec, ppp_fec_plain_t *plain, uint8_t c)
+{
+    if (plain->len == sizeof(plain->data)) {
+        ppp_fec_plain_flush(dec, plain);
+    }
+    plain->data[plain->len++] = c;
+}
+
+void ppp_fec_decode(ppp_fec_decoder_t *dec, const uint8_t *data, size_t len)
+{
+    ppp_fec_plain_t plain = {.len = 0};
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+
+        switch (dec->state) {
+        case PPP_FEC_HUNT:
+            if (c == PPP_FEC_SYNC && dec->block_size > 0) {
+                if (!dec->held_sync) {
+                    // Hold it until we know if it starts a block.
+                    dec->held_sync = true;
+                    break;
+                }
+                dec->held_sync = false;
+                dec->state = PPP_FEC_BLOCK;
+                dec->fill = 0;
+                break;
+            }
+            if (dec->held_sync) {
+                ppp_fec_plain_put(dec, &plain, PPP_FEC_SYNC);
+                dec->held_sync = false;
+            }
+            ppp_fec_plain_put(dec, &plain, c);
+            break;
+
+        case PPP_FEC_SYNC_NEXT:
+            dec->sync_matches += c == PPP_FEC_SYNC;
+            if (dec->sync_seen++ == 0) {
+                dec->sync_first = c;
+                break;
+            }
+            if (dec->sync_matches > 0) {
+                // Tolerate one broken sync byte while the block boundaries are known.
+                dec->state = PPP_FEC_BLOCK;
+                dec->fill = 0;
+            } else {
+                // Peer went back to plain HDLC, neither byte was a sync byte.
+                dec->state = PPP_FEC_HUNT;
+                ppp_fec_plain_put(dec, &plain, dec->sync_first);
+                ppp_fec_plain_put(dec, &plain, c);
+            }
+            break;
+
+        case PPP_FEC_BLOCK:
+            dec->block[dec->fill++] = c;
+            if (dec->fill == dec->block_size + dec->parity) {
+                ppp_fec_plain_flush(dec, &plain);
+                ppp_fec_decode_block(dec);
+                dec->state = PPP_FEC_SYNC_NEXT;
+                dec->sync_seen = 0;
+                dec->sync_matches = 0;
+            }
+            break;
+        }
+    }
+
+    ppp_fec_plain_flush(dec, &plain);
+}
@@ -0,0 +1,91 @@
+#ifndef __PPP_FEC_H_
+#define __PPP_FEC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Reed-Solomon forward error correction below HDLC framing.
+ *
+ * The HDLC byte stream is cut into blocks of block_size bytes, each sent as
+ *
+ *     SYNC SYNC data[block_size] parity[parity]
+ *
+ * which corrects up to parity / 2 broken bytes per block. A block is closed
+ * early at the end of a frame and padded with flags, which the HDLC decoder
+ * ignores. The sync sequence is two escape characters, which never occur in a
+ * valid HDLC stream, so the decoder can tell blocks from plain HDLC bytes and
+ * passes the latter through untouched.
+ */
+
+#define PPP_FEC_SYNC 0x7d
+#define PPP_FEC_SYNC_LEN 2
+#define PPP_FEC_MAX_PARITY 32
+#define PPP_FEC_MAX_CODEWORD 255
+#define PPP_FEC_BLOCK_OVERHEAD(parity) (PPP_FEC_SYNC_LEN + (parity))
+
+typedef void (*ppp_fec_output_cb_t)(void *ctx, const uint8_t *data, size_t len);
+
+typedef struct {
+    uint8_t parity;
+    uint8_t block_size;
+    uint8_t genpoly[PPP_FEC_MAX_PARITY + 1];
+    uint8_t block[PPP_FEC_SYNC_LEN + PPP_FEC_MAX_CODEWORD];
+    size_t fill;
+} ppp_fec_encoder_t;
+
+typedef struct {
+    uint32_t blocks;
+    uint32_t corrected_blocks;
+    uint32_t corrected_bytes;
+    uint32_t uncorrectable_blocks;
+} ppp_fec_stats_t;
+
+typedef struct {
+    enum {
+        PPP_FEC_HUNT,
+        PPP_FEC_SYNC_NEXT,
+        PPP_FEC_BLOCK,
+    } state;
+    uint8_t parity;
+    uint8_t block_size;
+    bool held_sync;
+    uint8_t sync_seen;
+    uint8_t sync_matches;
+    uint8_t sync_first;
+    uint8_t block[PPP_FEC_MAX_CODEWORD];
+    size_t fill;
+    ppp_fec_output_cb_t output;
+    void *ctx;
+    ppp_fec_stats_t stats;
+} ppp_fec_decoder_t;
+
+bool ppp_fec_params_valid(int block_size, int parity);
+
+void ppp_fec_encoder_init(ppp_fec_encoder_t *enc, int block_size, int parity);
+
+/**
+ * Add HDLC bytes to the current block. Complete blocks are passed to output.
+ * With flush set, a partially filled block is padded and sent, this must only
+ * be done on a frame boundary.
+ */
+void ppp_fec_encode(ppp_fec_encoder_t *enc, const uint8_t *data, size_t len, bool flush, ppp_fec_output_cb_t output, void *ctx);
+
+// Upper bound of bytes ppp_fec_encode() outputs for len bytes of input.
+size_t ppp_fec_encoded_max(const ppp_fec_encoder_t *enc, size_t len);
+
+void ppp_fec_decoder_init(ppp_fec_decoder_t *dec, ppp_fec_output_cb_t output, void *ctx);
+
+// Parameters used by the peer encoder, blocks are not recognised until these are known.
+void ppp_fec_decoder_set_params(ppp_fec_decoder_t *dec, int block_size, int parity);
+
+void ppp_fec_decode(ppp_fec_decoder_t *dec, const uint8_t *data, size_t len);
+
+/**
+ * Correct a codeword of data followed by parity bytes in place.
+ * Returns number of corrected bytes, or -1 if the codeword is uncorrectable.
+ */
+int ppp_fec_correct(uint8_t *codeword, size_t len, int parity);
+
+#endif /* __PPP_FEC_H_ */
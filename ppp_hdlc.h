@@ -0,0 +1,56 @@
+#ifndef __PPP_HDLC_H_
+#define __PPP_HDLC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PPP_HDLC_FLAG 0x7e
+#define PPP_HDLC_ESCAPE 0x7d
+#define PPP_HDLC_TRANS 0x20
+
+#define PPP_HDLC_FCS_INIT 0xffff
+#define PPP_HDLC_FCS_GOOD 0xf0b8
+#define PPP_HDLC_FCS_LEN 2
+
+// Worst case encoded size: every byte escaped, plus two flags.
+#define PPP_HDLC_ENCODED_MAX(len) (2 * ((len) + PPP_HDLC_FCS_LEN) + 2)
+
+/**
+ * Called for every frame found between two flags. The frame is unescaped and
+ * still carries its FCS in the last two bytes. Runt frames (shorter than the
+ * FCS) are reported with fcs_ok set to false.
+ */
+typedef void (*ppp_hdlc_frame_cb_t)(void *ctx, uint8_t *frame, size_t len, bool fcs_ok);
+
+typedef struct {
+    uint8_t *buffer;
+    size_t size;
+    size_t len;
+    uint16_t fcs;
+    bool escaped;
+    bool overrun;
+    ppp_hdlc_frame_cb_t on_frame;
+    void *ctx;
+} ppp_hdlc_decoder_t;
+
+void ppp_hdlc_decoder_init(ppp_hdlc_decoder_t *dec, uint8_t *buffer, size_t size, ppp_hdlc_frame_cb_t on_frame, void *ctx);
+
+// Drop any partially received frame, used when the line is known to be broken.
+void ppp_hdlc_decoder_reset(ppp_hdlc_decoder_t *dec);
+
+void ppp_hdlc_decode(ppp_hdlc_decoder_t *dec, const uint8_t *data, size_t len);
+
+uint16_t ppp_hdlc_fcs16(uint16_t fcs, const uint8_t *data, size_t len);
+
+/**
+ * Frame and escape data (which must start at the protocol or address field),
+ * append the FCS and surround it by flags. Escapes flag, escape and the
+ * XON/XOFF characters so the output is safe with software flow control.
+ *
+ * Returns number of bytes written to out, which must hold at least
+ * PPP_HDLC_ENCODED_MAX(len) bytes.
+ */
+size_t ppp_hdlc_encode(uint8_t *out, const uint8_t *data, size_t len);
+
+#endif /* __PPP_HDLC_H_ */
@@ -0,0 +1,302 @@
+#include "ppp_iphc.h"
+#include <string.h>
+
+#define IPHC_NEXT_HEADER_UDP 17
+#define IPHC_UDP_HEADER_LEN 8
+#define IPHC_UDP_NHC 0xf0
+
+// Traffic class and flow label: both inline, flow label only, traffic class only, both zero
+enum { IPHC_TF_INLINE, IPHC_TF_FLOW, IPHC_TF_CLASS, IPHC_TF_ZERO };
+// Hop limit inline, or one of the values everybody uses
+enum { IPHC_HLIM_INLINE, IPHC_HLIM_1, IPHC_HLIM_64, IPHC_HLIM_255 };
+
+enum {
+    IPHC_ADDR_INLINE,    // All 16 bytes
+    IPHC_ADDR_LL_IID,    // fe80::/64, identifier inline
+    IPHC_ADDR_LL_LINK,   // fe80::/64 and the identifier of the link end
+    IPHC_ADDR_CTX_IID,   // Link prefix, identifier inline
+    IPHC_ADDR_CTX_LINK,  // Link prefix and the identifier of the link end
+    IPHC_ADDR_MCAST_8,   // ff02::00XX, destination only
+    IPHC_ADDR_MCAST_32,  // ffXX::00XX:XXXX, destination only
+    IPHC_ADDR_UNSPECIFIED,
+    IPHC_ADDR_MODES,
+};
+
+// UDP ports: both inline, destination 0xf0XX, source 0xf0XX, both 0xf0bX
+enum { IPHC_PORTS_INLINE, IPHC_PORTS_DST_8, IPHC_PORTS_SRC_8, IPHC_PORTS_BOTH_4 };
+
+static const uint8_t iphc_addr_inline_len[IPHC_ADDR_MODES] = {16, 8, 0, 8, 0, 1, 4, 0};
+static const uint8_t iphc_tf_inline_len[] = {4, 3, 1, 0};
+static const uint8_t iphc_ports_inline_len[] = {4, 3, 3, 1};
+static const uint8_t iphc_link_local[8] = {0xfe, 0x80};
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static bool is_zero(const uint8_t *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (p[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// link_iid is the identifier of the end that would own the address.
+static int iphc_addr_mode(const ppp_iphc_context_t *ctx, const uint8_t *addr, const uint8_t *link_iid, bool dst)
+{
+    if (memcmp(addr, iphc_link_local, 8) == 0) {
+        return memcmp(addr + 8, link_iid, 8) == 0 ? IPHC_ADDR_LL_LINK : IPHC_ADDR_LL_IID;
+    }
+    if (ctx->has_prefix && memcmp(addr, ctx->prefix, 8) == 0) {
+        return memcmp(addr + 8, link_iid, 8) == 0 ? IPHC_ADDR_CTX_LINK : IPHC_ADDR_CTX_IID;
+    }
+    if (dst && addr[0] == 0xff && is_zero(addr + 2, 11)) {
+        return addr[1] == 0x02 && is_zero(addr + 13, 2) ? IPHC_ADDR_MCAST_8 : IPHC_ADDR_MCAST_32;
+    }
+    if (!dst && is_zero(addr, 16)) {
+        return IPHC_ADDR_UNSPECIFIED;
+    }
+    return IPHC_ADDR_INLINE;
+}
+
+static uint8_t *iphc_put_addr(uint8_t *p, int mode, const uint8_t *addr)
+{
+    switch (mode) {
+    case IPHC_ADDR_INLINE:
+        memcpy(p, addr, 16);
+        break;
+    case IPHC_ADDR_LL_IID:
+    case IPHC_ADDR_CTX_IID:
+        memcpy(p, addr + 8, 8);
+        break;
+    case IPHC_ADDR_MCAST_8:
+        p[0] = addr[15];
+        break;
+    case IPHC_ADDR_MCAST_32:
+        p[0] = addr[1];
+        memcpy(p + 1, addr + 13, 3);
+        break;
+    default:
+        break;
+    }
+    return p + iphc_addr_inline_len[mode];
+}
+
+// Returns NULL when the address needs a prefix this end does not have.
+static const uint8_t *iphc_get_addr(const ppp_iphc_context_t *ctx, const uint8_t *p, int mode, const uint8_t *link_iid, uint8_t *addr)
+{
+    memset(addr, 0, 16);
+    switch (mode) {
+    case IPHC_ADDR_INLINE:
+        memcpy(addr, p, 16);
+        break;
+    case IPHC_ADDR_LL_IID:
+        memcpy(addr, iphc_link_local, 8);
+        memcpy(addr + 8, p, 8);
+        break;
+    case IPHC_ADDR_LL_LINK:
+        memcpy(addr, iphc_link_local, 8);
+        memcpy(addr + 8, link_iid, 8);
+        break;
+    case IPHC_ADDR_CTX_IID:
+    case IPHC_ADDR_CTX_LINK:
+        if (!ctx->has_prefix) {
+            return NULL;
+        }
+        memcpy(addr, ctx->prefix, 8);
+        memcpy(addr + 8, mode == IPHC_ADDR_CTX_IID ? p : link_iid, 8);
+        break;
+    case IPHC_ADDR_MCAST_8:
+        addr[0] = 0xff;
+        addr[1] = 0x02;
+        addr[15] = p[0];
+        break;
+    case IPHC_ADDR_MCAST_32:
+        addr[0] = 0xff;
+        addr[1] = p[0];
+        memcpy(addr + 13, p + 1, 3);
+        break;
+    default:
+        break;
+    }
+    return p + iphc_addr_inline_len[mode];
+}
+
+size_t ppp_iphc_compress(const ppp_iphc_context_t *ctx, const uint8_t *header, size_t header_len, size_t packet_len, uint8_t *out, size_t *consumed)
+{
+    if (header_len < PPP_IPHC_IP6_HEADER_LEN || (header[0] >> 4) != 6 || get_u16(header + 4) + PPP_IPHC_IP6_HEADER_LEN != packet_len) {
+        return 0;
+    }
+    uint8_t traffic_class = (header[0] << 4) | (header[1] >> 4);
+    uint32_t flow_label = ((header[1] & 0x0f) << 16) | (header[2] << 8) | header[3];
+    uint8_t hop_limit = header[7];
+    bool udp = header[6] == IPHC_NEXT_HEADER_UDP && header_len >= PPP_IPHC_MAX_HEADER &&
+               get_u16(header + PPP_IPHC_IP6_HEADER_LEN + 4) == packet_len - PPP_IPHC_IP6_HEADER_LEN;
+    uint8_t *p = out + 2;
+    int tf;
+    int hlim;
+
+    if (flow_label == 0) {
+        tf = traffic_class == 0 ? IPHC_TF_ZERO : IPHC_TF_CLASS;
+    } else {
+        tf = traffic_class == 0 ? IPHC_TF_FLOW : IPHC_TF_INLINE;
+    }
+    if (tf == IPHC_TF_INLINE || tf == IPHC_TF_CLASS) {
+        *p++ = traffic_class;
+    }
+    if (tf == IPHC_TF_INLINE || tf == IPHC_TF_FLOW) {
+        *p++ = flow_label >> 16;
+        *p++ = flow_label >> 8;
+        *p++ = flow_label;
+    }
+    if (!udp) {
+        *p++ = header[6];
+    }
+    hlim = hop_limit == 1 ? IPHC_HLIM_1 : hop_limit == 64 ? IPHC_HLIM_64 : hop_limit == 255 ? IPHC_HLIM_255 : IPHC_HLIM_INLINE;
+    if (hlim == IPHC_HLIM_INLINE) {
+        *p++ = hop_limit;
+    }
+    int sam = iphc_addr_mode(ctx, header + 8, ctx->our_iid, false);
+    int dam = iphc_addr_mode(ctx, header + 24, ctx->peer_iid, true);
+    p = iphc_put_addr(p, sam, header + 8);
+    p = iphc_put_addr(p, dam, header + 24);
+    out[0] = (tf << 6) | (udp << 5) | (hlim << 3);
+    out[1] = (sam << 4) | dam;
+
+    size_t replaced = PPP_IPHC_IP6_HEADER_LEN;
+    if (udp) {
+        const uint8_t *udp_header = header + PPP_IPHC_IP6_HEADER_LEN;
+        uint16_t src_port = get_u16(udp_header);
+        uint16_t dst_port = get_u16(udp_header + 2);
+        uint8_t *nhc = p++;
+        int ports;
+
+        if ((src_port & 0xfff0) == 0xf0b0 && (dst_port & 0xfff0) == 0xf0b0) {
+            ports = IPHC_PORTS_BOTH_4;
+            *p++ = ((src_port & 0x0f) << 4) | (dst_port & 0x0f);
+        } else if ((dst_port & 0xff00) == 0xf000) {
+            ports = IPHC_PORTS_DST_8;
+            put_u16(p, src_port);
+            p[2] = dst_port;
+            p += 3;
+        } else if ((src_port & 0xff00) == 0xf000) {
+            ports = IPHC_PORTS_SRC_8;
+            p[0] = src_port;
+            put_u16(p + 1, dst_port);
+            p += 3;
+        } else {
+            ports = IPHC_PORTS_INLINE;
+            memcpy(p, udp_header, 4);
+            p += 4;
+        }
+        *nhc = IPHC_UDP_NHC | ports;
+        memcpy(p, udp_header + 6, 2); // Checksum
+        p += 2;
+        replaced += IPHC_UDP_HEADER_LEN;
+    }
+
+    size_t len = p - out;
+    if (len >= replaced) {
+        return 0;
+    }
+    *consumed = replaced;
+    return len;
+}
+
+size_t ppp_iphc_decompress(const ppp_iphc_context_t *ctx, const uint8_t *data, size_t len, uint8_t *out, size_t *consumed)
+{
+    if (len < 2) {
+        return 0;
+    }
+    int tf = data[0] >> 6;
+    bool udp = data[0] & 0x20;
+    int hlim = (data[0] >> 3) & 0x03;
+    int sam = data[1] >> 4;
+    int dam = data[1] & 0x0f;
+
+    if (sam >= IPHC_ADDR_MODES || sam == IPHC_ADDR_MCAST_8 || sam == IPHC_ADDR_MCAST_32 || dam >= IPHC_ADDR_MODES || dam == IPHC_ADDR_UNSPECIFIED) {
+        return 0;
+    }
+    size_t inline_len = 2 + iphc_tf_inline_len[tf] + !udp + (hlim == IPHC_HLIM_INLINE) + iphc_addr_inline_len[sam] + iphc_addr_inline_len[dam] + udp;
+    if (inline_len > len) {
+        return 0;
+    }
+
+    const uint8_t *p = data + 2;
+    uint8_t traffic_class = 0;
+    uint32_t flow_label = 0;
+    if (tf == IPHC_TF_INLINE || tf == IPHC_TF_CLASS) {
+        traffic_class = *p++;
+    }
+    if (tf == IPHC_TF_INLINE || tf == IPHC_TF_FLOW) {
+        flow_label = ((uint32_t)(p[0] & 0x0f) << 16) | (p[1] << 8) | p[2];
+        p += 3;
+    }
+    out[0] = 0x60 | (traffic_class >> 4);
+    out[1] = (traffic_class << 4) | (flow_label >> 16);
+    out[2] = flow_label >> 8;
+    out[3] = flow_label;
+    out[6] = udp ? IPHC_NEXT_HEADER_UDP : *p++;
+    static const uint8_t hop_limits[] = {0, 1, 64, 255};
+    out[7] = hlim == IPHC_HLIM_INLINE ? *p++ : hop_limits[hlim];
+    p = iphc_get_addr(ctx, p, sam, ctx->peer_iid, out + 8);
+    if (p) {
+        p = iphc_get_addr(ctx, p, dam, ctx->our_iid, out + 24);
+    }
+    if (!p) {
+        return 0;
+    }
+
+    size_t header_len = PPP_IPHC_IP6_HEADER_LEN;
+    if (udp) {
+        uint8_t *udp_header = out + PPP_IPHC_IP6_HEADER_LEN;
+        uint8_t nhc = *p++;
+        int ports = nhc & 0x03;
+
+        if ((nhc & 0xfc) != IPHC_UDP_NHC || p + iphc_ports_inline_len[ports] + 2 > data + len) {
+            return 0;
+        }
+        switch (ports) {
+        case IPHC_PORTS_BOTH_4:
+            put_u16(udp_header, 0xf0b0 | (p[0] >> 4));
+            put_u16(udp_header + 2, 0xf0b0 | (p[0] & 0x0f));
+            break;
+        case IPHC_PORTS_DST_8:
+            memcpy(udp_header, p, 2);
+            put_u16(udp_header + 2, 0xf000 | p[2]);
+            break;
+        case IPHC_PORTS_SRC_8:
+            put_u16(udp_header, 0xf000 | p[0]);
+            memcpy(udp_header + 2, p + 1, 2);
+            break;
+        default:
+            memcpy(udp_header, p, 4);
+            break;
+        }
+        p += iphc_ports_inline_len[ports];
+        memcpy(udp_header + 6, p, 2);
+        p += 2;
+        header_len += IPHC_UDP_HEADER_LEN;
+    }
+
+    *consumed = p - data;
+    size_t payload_len = header_len - PPP_IPHC_IP6_HEADER_LEN + len - *consumed;
+    if (payload_len > 0xffff) {
+        return 0;
+    }
+    put_u16(out + 4, payload_len);
+    if (udp) {
+        put_u16(out + PPP_IPHC_IP6_HEADER_LEN + 4, payload_len);
+    }
+    return header_len;
+}
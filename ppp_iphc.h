@@ -0,0 +1,58 @@
+#ifndef __PPP_IPHC_H_
+#define __PPP_IPHC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * IPv6 and UDP header compression between two ppp_link peers, after the
+ * IPHC encoding of RFC 6282 adapted to a point to point link.
+ *
+ * Version and payload length are always elided, the length follows from the
+ * frame. Traffic class, flow label and hop limit are elided when they have
+ * their usual values. Addresses built from the link-local prefix or the link
+ * prefix and the interface identifier of either end, both known from IPv6CP,
+ * are elided completely, so a UDP packet between the two ends carries 9
+ * header bytes instead of 48. A UDP header directly after the IPv6 header is
+ * compressed too, its checksum is always kept.
+ *
+ * The compressed header is
+ *   u8  TF:2 NH:1 HLIM:2 reserved:3
+ *   u8  SAM:4 DAM:4
+ *   inline traffic class and flow label, next header, hop limit, source and
+ *   destination address as TF, NH, HLIM, SAM and DAM require
+ *   u8  0xf0 | P:2, ports as P requires, u16 checksum when NH is set
+ */
+
+// Largest compressed header, and largest header rebuilt from one: IPv6 plus UDP.
+#define PPP_IPHC_MAX_HEADER 48
+#define PPP_IPHC_IP6_HEADER_LEN 40
+
+typedef struct {
+    uint8_t our_iid[8];  // Interface identifier of this end
+    uint8_t peer_iid[8]; // Interface identifier of the other end
+    uint8_t prefix[8];   // /64 prefix of the link, both ends must agree on it
+    bool has_prefix;
+} ppp_iphc_context_t;
+
+/**
+ * Compress the headers of an IPv6 packet of packet_len bytes, header holds its
+ * first header_len bytes (at least PPP_IPHC_MAX_HEADER or the whole packet).
+ *
+ * Writes the compressed header to out, which must hold PPP_IPHC_MAX_HEADER
+ * bytes, and returns its length. consumed is set to the number of packet
+ * bytes it replaces, the rest of the packet follows unchanged. Returns 0 when
+ * the packet is not worth compressing or not a well formed IPv6 packet.
+ */
+size_t ppp_iphc_compress(const ppp_iphc_context_t *ctx, const uint8_t *header, size_t header_len, size_t packet_len, uint8_t *out, size_t *consumed);
+
+/**
+ * Rebuild the headers from the len bytes following the protocol field of a
+ * compressed frame. Writes them to out, which must hold PPP_IPHC_MAX_HEADER
+ * bytes, and returns their length. consumed is set to the number of compressed
+ * bytes, the rest of the frame is payload. Returns 0 for a broken header.
+ */
+size_t ppp_iphc_decompress(const ppp_iphc_context_t *ctx, const uint8_t *data, size_t len, uint8_t *out, size_t *consumed);
+
+#endif /* __PPP_IPHC_H_ */
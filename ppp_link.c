@@ -1,112 +1,1189 @@
 #include "ppp_link.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/param.h>
 
+#include "esp_attr.h"
+#include "esp_cpu.h"
 #include "esp_event.h"
+#include "esp_intr_alloc.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_netif_net_stack.h"
 #include "esp_netif_ppp.h"
+#include "esp_timer.h"
 
 #include "driver/uart.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "hal/uart_hal.h"
+#include "soc/uart_periph.h"
 
 #include "lwip/inet.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
+#include "lwip/tcpip.h"
 #include "netif/ppp/ppp.h"
+#include "netif/ppp/ppp_impl.h"
+#include "ppp_arq.h"
+#include "ppp_fec.h"
+#include "ppp_hdlc.h"
+#include "ppp_iphc.h"
+#include "ppp_lqm.h"
+#include "ppp_mru.h"
+#include "ppp_pool.h"
+#include "ppp_ring.h"
+#include "ppp_rohc.h"
 
 #define MAX_PPP_FRAME_SIZE (PPP_MAXMRU + 10) // 10 bytes of ppp framing around max 1500 bytes information
 
+// Link control frames are only understood by ppp_link peers, the protocol number is unassigned.
+// A plain PPP peer answers them with an LCP Protocol-Reject, which is harmless.
+#define PPP_LINK_CTRL_PROTOCOL 0x4c4d
+#define PPP_LINK_CTRL_MAX_LEN 24
+
+// IPv6 packets with compressed headers, see ppp_iphc.h. Only sent to ppp_link peers that offered to rebuild them.
+#define PPP_LINK_IPHC_PROTOCOL 0x4c49
+// IPv4 UDP packets with compressed headers, see ppp_rohc.h. Only sent to ppp_link peers that offered to rebuild them.
+#define PPP_LINK_ROHC_PROTOCOL 0x4c52
+
+#define PPP_LINK_CAPS_INTERVAL_US (1000 * 1000)
+#define PPP_LINK_CAPS_RETRIES 5 // Give up on peers that do not run ppp_link
+
+// Numbered frames are sent as link control frames with code, sequence number and base in front.
+#define PPP_LINK_ARQ_HEADER_LEN 5
+#define PPP_LINK_ARQ_POLL_MS 10
+
+// Direct uart access: interrupt when the receive FIFO holds this many bytes or the line has been idle for a byte time,
+// and refill the transmit FIFO once it is down to this many bytes.
+#define PPP_LINK_DIRECT_RX_THRESHOLD 64
+#define PPP_LINK_DIRECT_TX_THRESHOLD 16
+#define PPP_LINK_DIRECT_RX_INTR (UART_INTR_RXFIFO_FULL | UART_INTR_RXFIFO_TOUT | UART_INTR_RXFIFO_OVF)
+
+// With the data path in IRAM the uart interrupt keeps filling the receive ring while the flash cache is off. The functions
+// of this file on the path carry PPP_LINK_FAST_ATTR, so they stay in IRAM whether or not the compiler inlines them, linker.lf
+// places the helper objects.
+#ifdef CONFIG_PPP_LINK_FAST_PATH_IN_IRAM
+#define PPP_LINK_UART_INTR_FLAGS ESP_INTR_FLAG_IRAM
+#define PPP_LINK_FAST_ATTR IRAM_ATTR
+#else
+#define PPP_LINK_UART_INTR_FLAGS 0
+#define PPP_LINK_FAST_ATTR
+#endif
+
+enum {
+    PPP_LINK_CTRL_MRU_HINT = 1, // u16: largest frame the sender wants to receive
+    PPP_LINK_CTRL_CAPS = 2,     // u8 flags, u8 fec block size, u8 fec parity of the sender
+    PPP_LINK_CTRL_ARQ_DATA = 3, // u8 seq, u8 oldest seq held by the sender, frame
+    PPP_LINK_CTRL_ARQ_ACK = 4,  // u8 next seq expected, u32 bitmap of received frames from next
+    PPP_LINK_CTRL_LQR = 5,      // Link quality report, see ppp_lqm.h
+};
+
+enum {
+    PPP_LINK_CAPS_FEC = 0x01, // Sender decodes FEC blocks
+    PPP_LINK_CAPS_ACK = 0x02, // Sender has received our capabilities
+    PPP_LINK_CAPS_REQ = 0x04, // Sender wants a reply
+    PPP_LINK_CAPS_ARQ = 0x08, // Sender acknowledges numbered frames
+    PPP_LINK_CAPS_LQM = 0x10, // Sender wants link quality reports
+    PPP_LINK_CAPS_IPHC = 0x20, // Sender rebuilds compressed IPv6 headers
+    PPP_LINK_CAPS_ROHC = 0x40, // Sender keeps contexts to rebuild compressed IPv4 UDP headers
+};
+
+// Capabilities of a server that has a link prefix carry its 8 bytes after the FEC parameters
+#define PPP_LINK_CAPS_LEN 3
+#define PPP_LINK_CAPS_PREFIX_LEN (PPP_LINK_CAPS_LEN + 8)
+
+ESP_EVENT_DEFINE_BASE(PPP_LINK_EVENT);
+
 static const char *TAG = "ppp_link";
-static QueueHandle_t uart_event_queue;
-static int current_phase = PPP_PHASE_DEAD;
-static ppp_link_config_t config;
+static portMUX_TYPE links_lock = portMUX_INITIALIZER_UNLOCKED; // Guards the list of links, their slots and address pools
+static ppp_link_t *links[CONFIG_PPP_LINK_MAX_LINKS];
+// Slots of links being set up or running and their uarts, taken before a link is set up so two can not share a uart
+static uint32_t link_slots_taken;
+static uart_port_t link_slot_uart[CONFIG_PPP_LINK_MAX_LINKS];
+
+// Everything one link owns. Each link has its own uart, tasks and buffers, so a slow peer only holds up its own link.
+struct ppp_link_s {
+    int index; // Position in links[]
+    ppp_link_config_t config;
+    QueueHandle_t uart_event_queue;
+    int current_phase;
+    esp_netif_t *esp_netif;
+    struct netif *ppp_netif;
+    char if_key[12];
+    char if_desc[8];
+
+    SemaphoreHandle_t tx_lock;
+    bool tx_at_frame_boundary;
+
+    ppp_hdlc_decoder_t rx_decoder;
+    uint8_t rx_frame[MAX_PPP_FRAME_SIZE];
+    ppp_mru_t mru;
+    bool mru_hint_pending;
+    uint16_t peer_mru_hint; // Handed to the tcpip thread by ppp_link_apply_mru_hint()
+    ppp_link_stats_t stats;
+
+    ppp_fec_encoder_t fec_encoder;
+    ppp_fec_decoder_t fec_decoder;
+    bool tx_fec;
+    bool peer_fec;
+    bool peer_caps_received;
+    bool caps_acked;
+    bool caps_reply_pending;
+    int caps_retries;
+    int64_t caps_sent_us;
+
+    ppp_arq_t arq;
+    bool tx_arq;
+    bool peer_arq;
+    ppp_hdlc_decoder_t tx_decoder; // Takes lwip output apart so frames can be numbered
+    uint8_t *tx_frame;
+    uint8_t *arq_frame;
+    uint8_t *arq_encoded;
+
+    ppp_lqm_t lqm;
+    bool peer_lqm;
+
+    ppp_iphc_context_t iphc; // Written on the tcpip thread while ip6_up is false
+    bool tx_iphc;
+    bool peer_iphc;
+    bool ip6_up; // IPv6CP is open and iphc holds its interface identifiers
+    bool ip6_changed;
+    bool ip6_update_queued;
+    bool ip6_prefix_known;
+    uint8_t ip6_prefix[8];
+    int ip6_global_index; // lwip address slot of the address from the link prefix, -1 for none
+    ppp_rohc_t rohc;
+    // Set by the ppp task and read by the tcpip thread, rohc_reset is published before tx_rohc and taken with an exchange
+    atomic_bool tx_rohc;
+    bool peer_rohc;
+    atomic_bool rohc_reset; // The peer may have lost its contexts, start every flow with a full header again
+    uint8_t *hc_frame; // Compressed packets are built here, only on the tcpip thread
+    uint8_t *hc_encoded;
+
+    ppp_pool_t rx_pool;
+    uint64_t rx_alloc_cycles;
+    uint32_t rx_allocs;
+
+    ppp_frame_ring_t rx_ring; // Frames for the ip stack when pipelined
+    TaskHandle_t rx_task;
+
+    // Direct uart access, the interrupt handler fills uart_rx_ring and drains uart_tx_ring
+    TaskHandle_t ppp_task;
+    uart_hal_context_t uart_hal;
+    intr_handle_t uart_intr;
+    portMUX_TYPE uart_intr_lock; // Guards the interrupt enable register
+    ppp_byte_ring_t uart_rx_ring;
+    ppp_byte_ring_t uart_tx_ring;
+    volatile bool uart_rx_lost;      // Received bytes were dropped, the frame being decoded is broken
+    volatile bool uart_rx_throttled; // Receive interrupts are off until the ppp task has made room
+};
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+// Everything ppp_link would take from the heap, sized at build time, once per link. ppp_link_static_check() makes sure the configuration fits.
+#define PPP_LINK_STATIC_ARQ (CONFIG_PPP_LINK_STATIC_ARQ_WINDOW > 0)
+#define PPP_LINK_STATIC_LINKS CONFIG_PPP_LINK_MAX_LINKS
+#ifdef CONFIG_PPP_LINK_STATIC_HEADER_COMPRESSION
+#define PPP_LINK_STATIC_HC 1
+#else
+#define PPP_LINK_STATIC_HC 0
+#endif
+static ppp_link_t static_links[PPP_LINK_STATIC_LINKS];
+static WORD_ALIGNED_ATTR uint8_t static_uart_rx[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_UART_RX_BUFFER];
+static WORD_ALIGNED_ATTR uint8_t static_uart_tx[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_UART_TX_BUFFER];
+static uint8_t static_arq_window[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_ARQ_WINDOW * MAX_PPP_FRAME_SIZE];
+static uint8_t static_tx_frame[PPP_LINK_STATIC_LINKS][PPP_LINK_STATIC_ARQ * MAX_PPP_FRAME_SIZE];
+static uint8_t static_arq_frame[PPP_LINK_STATIC_LINKS][PPP_LINK_STATIC_ARQ * (PPP_LINK_ARQ_HEADER_LEN + MAX_PPP_FRAME_SIZE)];
+static uint8_t static_arq_encoded[PPP_LINK_STATIC_LINKS][PPP_LINK_STATIC_ARQ * PPP_HDLC_ENCODED_MAX(PPP_LINK_ARQ_HEADER_LEN + MAX_PPP_FRAME_SIZE)];
+static WORD_ALIGNED_ATTR uint8_t static_rx_pool[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_RX_POOL_FRAMES * PPP_POOL_BUFFER_SIZE(MAX_PPP_FRAME_SIZE)];
+static uint8_t static_pipeline_frames[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES * MAX_PPP_FRAME_SIZE];
+static uint16_t static_pipeline_lens[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES];
+static uint8_t static_hc_frame[PPP_LINK_STATIC_LINKS][PPP_LINK_STATIC_HC * MAX_PPP_FRAME_SIZE];
+static uint8_t static_hc_encoded[PPP_LINK_STATIC_LINKS][PPP_LINK_STATIC_HC * PPP_HDLC_ENCODED_MAX(MAX_PPP_FRAME_SIZE)];
+static StaticSemaphore_t static_tx_lock[PPP_LINK_STATIC_LINKS];
+static StackType_t static_task_stack[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_TASK_STACK];
+static StaticTask_t static_task[PPP_LINK_STATIC_LINKS];
+#if CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES > 0
+static StackType_t static_rx_task_stack[PPP_LINK_STATIC_LINKS][CONFIG_PPP_LINK_STATIC_PIPELINE_STACK];
+static StaticTask_t static_rx_task[PPP_LINK_STATIC_LINKS];
+#define PPP_LINK_STATIC_RX_TASK_RAM (sizeof(static_rx_task_stack) + sizeof(static_rx_task))
+#else
+#define PPP_LINK_STATIC_RX_TASK_RAM 0
+#endif
+
+#define PPP_LINK_STATIC_RAM                                                                                                                          \
+    (sizeof(static_links) + sizeof(static_uart_rx) + sizeof(static_uart_tx) + sizeof(static_arq_window) + sizeof(static_tx_frame) +             \
+     sizeof(static_arq_frame) + sizeof(static_arq_encoded) + sizeof(static_rx_pool) + sizeof(static_pipeline_frames) +                         \
+     sizeof(static_pipeline_lens) + sizeof(static_hc_frame) + sizeof(static_hc_encoded) + sizeof(static_tx_lock) + sizeof(static_task_stack) +  \
+     sizeof(static_task) + PPP_LINK_STATIC_RX_TASK_RAM)
+
+_Static_assert((sizeof(static_uart_rx[0]) & (sizeof(static_uart_rx[0]) - 1)) == 0, "CONFIG_PPP_LINK_STATIC_UART_RX_BUFFER must be a power of two");
+_Static_assert((sizeof(static_uart_tx[0]) & (sizeof(static_uart_tx[0]) - 1)) == 0, "CONFIG_PPP_LINK_STATIC_UART_TX_BUFFER must be a power of two");
+_Static_assert(sizeof(static_uart_tx[0]) >= MAX_PPP_FRAME_SIZE, "CONFIG_PPP_LINK_STATIC_UART_TX_BUFFER must hold a full frame");
+_Static_assert((CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES & (CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES - 1)) == 0,
+               "CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES must be a power of two");
+_Static_assert(CONFIG_PPP_LINK_STATIC_RAM_BUDGET == 0 || PPP_LINK_STATIC_RAM <= CONFIG_PPP_LINK_STATIC_RAM_BUDGET,
+               "ppp_link static allocation exceeds CONFIG_PPP_LINK_STATIC_RAM_BUDGET");
+
+#define PPP_LINK_ALLOC(name, size) ((void *)(name[link->index]))
+#define PPP_LINK_FREE(ptr) ((void)(ptr))
+#else
+#define PPP_LINK_ALLOC(name, size) malloc(size)
+#define PPP_LINK_FREE(ptr) free(ptr)
+#endif
 
 static void on_ppp_changed(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
+    ppp_link_t *link = arg;
+
+    // Every link sees the events of all ppp interfaces
+    if (*(esp_netif_t **)event_data != link->esp_netif) {
+        return;
+    }
     if (event_id >= NETIF_PP_PHASE_OFFSET) {
-        current_phase = event_id - NETIF_PP_PHASE_OFFSET;
+        link->current_phase = event_id - NETIF_PP_PHASE_OFFSET;
+
+        // The peer falls back to the negotiated MRU when the link restarts
+        if (link->current_phase == PPP_PHASE_RUNNING && link->mru.current != link->mru.max) {
+            link->mru_hint_pending = true;
+        }
+    }
+}
+
+static void PPP_ISR_ATTR ppp_link_uart_isr(void *arg)
+{
+    ppp_link_t *link = arg;
+    BaseType_t woken = pdFALSE;
+    uint32_t status = uart_hal_get_intsts_mask(&link->uart_hal);
+
+    uart_hal_clr_intsts_mask(&link->uart_hal, status);
+    link->stats.direct.interrupts++;
+
+    if (status & UART_INTR_RXFIFO_OVF) {
+        uart_hal_rxfifo_rst(&link->uart_hal);
+        link->stats.rx_overflows++;
+        link->uart_rx_lost = true;
+    }
+    if (status & (UART_INTR_RXFIFO_FULL | UART_INTR_RXFIFO_TOUT)) {
+        int available = uart_hal_get_rxfifo_len(&link->uart_hal);
+
+        while (available > 0) {
+            size_t space;
+            uint8_t *out = ppp_byte_ring_write_ptr(&link->uart_rx_ring, &space);
+            int len = MIN(available, space);
+
+            if (len == 0) {
+                if (link->config.uart_config.flow_ctrl & UART_HW_FLOWCTRL_RTS) {
+                    // Leave the rest in the FIFO, RTS stops the peer once it fills up
+                    portENTER_CRITICAL_ISR(&link->uart_intr_lock);
+                    uart_hal_disable_intr_mask(&link->uart_hal, UART_INTR_RXFIFO_FULL | UART_INTR_RXFIFO_TOUT);
+                    portEXIT_CRITICAL_ISR(&link->uart_intr_lock);
+                    link->uart_rx_throttled = true;
+                    link->stats.direct.rx_throttled++;
+                } else {
+                    uart_hal_rxfifo_rst(&link->uart_hal);
+                    link->stats.rx_overflows++;
+                    link->uart_rx_lost = true;
+                }
+                break;
+            }
+            uart_hal_read_rxfifo(&link->uart_hal, out, &len);
+            ppp_byte_ring_produce(&link->uart_rx_ring, len);
+            available -= len;
+        }
+        vTaskNotifyGiveFromISR(link->ppp_task, &woken);
+    }
+    if (status & UART_INTR_TXFIFO_EMPTY) {
+        portENTER_CRITICAL_ISR(&link->uart_intr_lock);
+        size_t len;
+        const uint8_t *data = ppp_byte_ring_read_ptr(&link->uart_tx_ring, &len);
+        if (len == 0) {
+            // Checked and disabled under the lock, so a write from the ppp task can not slip in between
+            uart_hal_disable_intr_mask(&link->uart_hal, UART_INTR_TXFIFO_EMPTY);
+        } else {
+            uint32_t written = 0;
+            uart_hal_write_txfifo(&link->uart_hal, data, len, &written);
+            ppp_byte_ring_consume(&link->uart_tx_ring, written);
+        }
+        portEXIT_CRITICAL_ISR(&link->uart_intr_lock);
+    }
+
+    if (woken) {
+        portYIELD_FROM_ISR();
     }
 }
 
-static esp_err_t on_ppp_transmit(void *h, void *buffer, size_t len)
+static size_t PPP_LINK_FAST_ATTR ppp_link_uart_tx_free(ppp_link_t *link)
 {
     size_t free_size = 0;
-    ESP_ERROR_CHECK(uart_get_tx_buffer_free_size(config.uart, &free_size));
 
-    if (unlikely(free_size < len)) {
-        // ESP_LOGW(TAG, "Uart TX buffer full. free_size: %d len: %d", free_size, len);
-        return ESP_FAIL;
+    if (link->config.direct.enabled) {
+        return ppp_byte_ring_free(&link->uart_tx_ring);
+    }
+    ESP_ERROR_CHECK(uart_get_tx_buffer_free_size(link->config.uart, &free_size));
+    return free_size;
+}
+
+static void PPP_LINK_FAST_ATTR ppp_link_uart_write(void *ctx, const uint8_t *data, size_t len)
+{
+    ppp_link_t *link = ctx;
+    int written;
+
+    if (link->config.direct.enabled) {
+        written = ppp_byte_ring_write(&link->uart_tx_ring, data, len);
+        portENTER_CRITICAL(&link->uart_intr_lock);
+        uart_hal_ena_intr_mask(&link->uart_hal, UART_INTR_TXFIFO_EMPTY);
+        portEXIT_CRITICAL(&link->uart_intr_lock);
+    } else {
+        written = uart_write_bytes(link->config.uart, data, len);
     }
-    int written = uart_write_bytes(config.uart, buffer, len);
     if (unlikely(len != written)) {
-        ESP_LOGE(TAG, "Failed to write bytes. bytes: %d free: %d written: %d", len, free_size, written);
+        ESP_LOGE(TAG, "Failed to write bytes. bytes: %d written: %d", len, written);
         abort();
     }
+    link->stats.tx_bytes += len;
+}
+
+static void PPP_LINK_FAST_ATTR ppp_link_fec_write(void *ctx, const uint8_t *data, size_t len)
+{
+    ppp_link_t *link = ctx;
+
+    link->stats.fec.tx_blocks++;
+    ppp_link_uart_write(ctx, data, len);
+}
+
+// Write HDLC bytes to the uart, FEC encoded if agreed with the peer. Must be called with tx_lock held.
+static esp_err_t PPP_LINK_FAST_ATTR ppp_link_write(ppp_link_t *link, const uint8_t *data, size_t len)
+{
+    size_t free_size = ppp_link_uart_tx_free(link);
+    size_t needed = link->tx_fec ? ppp_fec_encoded_max(&link->fec_encoder, len) : len;
+
+    if (unlikely(free_size < needed)) {
+        // ESP_LOGW(TAG, "Uart TX buffer full. free_size: %d len: %d", free_size, len);
+        return ESP_FAIL;
+    }
+
+    // lwip closes every frame with a flag, so anything we send after a flag can not split a frame.
+    link->tx_at_frame_boundary = data[len - 1] == PPP_HDLC_FLAG;
+    if (link->tx_at_frame_boundary) {
+        link->stats.tx_frames++;
+    }
+    if (link->tx_fec) {
+        // Close the block with the frame, so the frame is not held back waiting for more data.
+        ppp_fec_encode(&link->fec_encoder, data, len, link->tx_at_frame_boundary, ppp_link_fec_write, link);
+    } else {
+        ppp_link_uart_write(link, data, len);
+    }
     return ESP_OK;
 }
 
+// Switch FEC and numbered frames on or off, only possible between two frames.
+static void ppp_link_set_tx_mode(ppp_link_t *link, bool fec, bool numbered)
+{
+    xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+    if (link->tx_at_frame_boundary) {
+        if (link->tx_fec != fec) {
+            link->tx_fec = fec;
+            ESP_LOGI(TAG, "FEC %s for sent data", fec ? "enabled" : "disabled");
+        }
+        if (link->tx_arq != numbered) {
+            link->tx_arq = numbered;
+            ppp_hdlc_decoder_reset(&link->tx_decoder);
+            ESP_LOGI(TAG, "Retransmission %s for sent frames", numbered ? "enabled" : "disabled");
+        }
+    }
+    xSemaphoreGive(link->tx_lock);
+}
+
+// Must be called with tx_lock held.
+static esp_err_t ppp_link_arq_write(ppp_link_t *link, const ppp_arq_slot_t *slot)
+{
+    link->arq_frame[0] = PPP_LINK_CTRL_PROTOCOL >> 8;
+    link->arq_frame[1] = PPP_LINK_CTRL_PROTOCOL & 0xff;
+    link->arq_frame[2] = PPP_LINK_CTRL_ARQ_DATA;
+    link->arq_frame[3] = slot->seq;
+    link->arq_frame[4] = link->arq.base;
+    memcpy(&link->arq_frame[PPP_LINK_ARQ_HEADER_LEN], slot->frame, slot->len);
+    size_t encoded_len = ppp_hdlc_encode(link->arq_encoded, link->arq_frame, PPP_LINK_ARQ_HEADER_LEN + slot->len);
+    return ppp_link_write(link, link->arq_encoded, encoded_len);
+}
+
+// Send new frames and the ones due for retransmission while the uart has room. Must be called with tx_lock held.
+static void ppp_link_arq_pump(ppp_link_t *link, int64_t now)
+{
+    ppp_arq_slot_t *slot;
+
+    while ((slot = ppp_arq_next_tx(&link->arq, now)) != NULL) {
+        if (ppp_link_arq_write(link, slot) != ESP_OK) {
+            break;
+        }
+        ppp_arq_sent(&link->arq, slot, now);
+    }
+}
+
+// Send a frame without FCS numbered, called with tx_lock held.
+static void ppp_link_arq_send(ppp_link_t *link, const uint8_t *frame, size_t len)
+{
+    if (!ppp_arq_queue(&link->arq, frame, len)) {
+        // Window full, better send it unprotected than not at all.
+        link->stats.arq.unprotected++;
+        size_t encoded_len = ppp_hdlc_encode(link->arq_encoded, frame, len);
+        ppp_link_write(link, link->arq_encoded, encoded_len);
+        return;
+    }
+    ppp_link_arq_pump(link, esp_timer_get_time());
+}
+
+// A complete frame from lwip while numbered frames are in use, called with tx_lock held.
+static void on_tx_frame(void *ctx, uint8_t *frame, size_t len, bool fcs_ok)
+{
+    ppp_link_t *link = ctx;
+
+    if (!fcs_ok) {
+        return;
+    }
+    ppp_link_arq_send(link, frame, len - PPP_HDLC_FCS_LEN);
+}
+
+static esp_err_t PPP_LINK_FAST_ATTR on_ppp_transmit(void *h, void *buffer, size_t len)
+{
+    ppp_link_t *link = h;
+    esp_err_t ret = ESP_OK;
+
+    xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+    if (link->tx_arq) {
+        // Frames are kept until acknowledged, so a full uart is no reason to drop them.
+        ppp_hdlc_decode(&link->tx_decoder, buffer, len);
+        link->tx_at_frame_boundary = ((uint8_t *)buffer)[len - 1] == PPP_HDLC_FLAG;
+    } else {
+        ret = ppp_link_write(link, buffer, len);
+    }
+    xSemaphoreGive(link->tx_lock);
+    return ret;
+}
+
+static PPP_LINK_FAST_ATTR ppp_link_t *ppp_link_from_netif(struct netif *netif)
+{
+    ppp_link_t *link = NULL;
+
+    portENTER_CRITICAL(&links_lock);
+    for (int i = 0; i < CONFIG_PPP_LINK_MAX_LINKS; i++) {
+        if (links[i] && links[i]->ppp_netif == netif) {
+            link = links[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&links_lock);
+    return link;
+}
+
+// Send the packet with its first consumed bytes replaced by the compressed header already in hc_frame after the protocol field.
+static err_t PPP_LINK_FAST_ATTR ppp_link_send_compressed(ppp_link_t *link, uint16_t protocol, size_t compressed_len, struct pbuf *p, size_t consumed)
+{
+    uint8_t *frame = link->hc_frame;
+    frame[0] = protocol >> 8;
+    frame[1] = protocol & 0xff;
+    size_t len = 2 + compressed_len;
+    len += pbuf_copy_partial(p, &frame[len], p->tot_len - consumed, consumed);
+
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+    if (link->tx_arq) {
+        ppp_link_arq_send(link, frame, len);
+    } else {
+        size_t encoded_len = ppp_hdlc_encode(link->hc_encoded, frame, len);
+        ret = ppp_link_write(link, link->hc_encoded, encoded_len);
+    }
+    xSemaphoreGive(link->tx_lock);
+    return ret == ESP_OK ? ERR_OK : ERR_MEM;
+}
+
+static netif_output_fn ppp_output_ip4; // lwip's output, the same for every ppp netif
+
+// IPv4 output of the ppp netifs, sends UDP packets with compressed headers to peers that take them and leaves the rest to lwip.
+static err_t PPP_LINK_FAST_ATTR ppp_link_output_ip4(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+    ppp_link_t *link = ppp_link_from_netif(netif);
+    if (!link || !atomic_load_explicit(&link->tx_rohc, memory_order_acquire) || p->tot_len > MAX_PPP_FRAME_SIZE - 2) {
+        return ppp_output_ip4(netif, p, ipaddr);
+    }
+    if (atomic_exchange_explicit(&link->rohc_reset, false, memory_order_acquire)) {
+        ppp_rohc_reset_tx(&link->rohc);
+    }
+
+    uint8_t header[PPP_ROHC_HEADER_LEN];
+    size_t consumed;
+    size_t header_len = pbuf_copy_partial(p, header, sizeof(header), 0);
+    size_t compressed_len = ppp_rohc_compress(&link->rohc, header, header_len, p->tot_len, &link->hc_frame[2], &consumed);
+    if (compressed_len == 0) {
+        return ppp_output_ip4(netif, p, ipaddr);
+    }
+    return ppp_link_send_compressed(link, PPP_LINK_ROHC_PROTOCOL, compressed_len, p, consumed);
+}
+
+#if PPP_IPV6_SUPPORT
+static netif_output_ip6_fn ppp_output_ip6; // lwip's output, the same for every ppp netif
+
+// IPv6 output of the ppp netifs, sends packets with compressed headers to peers that take them and leaves the rest to lwip.
+static err_t PPP_LINK_FAST_ATTR ppp_link_output_ip6(struct netif *netif, struct pbuf *p, const ip6_addr_t *ipaddr)
+{
+    ppp_link_t *link = ppp_link_from_netif(netif);
+    if (!link || !link->tx_iphc || !link->ip6_up || p->tot_len > MAX_PPP_FRAME_SIZE - 2) {
+        return ppp_output_ip6(netif, p, ipaddr);
+    }
+
+    uint8_t header[PPP_IPHC_MAX_HEADER];
+    size_t consumed;
+    size_t header_len = pbuf_copy_partial(p, header, sizeof(header), 0);
+    size_t compressed_len = ppp_iphc_compress(&link->iphc, header, header_len, p->tot_len, &link->hc_frame[2], &consumed);
+    if (compressed_len == 0) {
+        return ppp_output_ip6(netif, p, ipaddr);
+    }
+    err_t err = ppp_link_send_compressed(link, PPP_LINK_IPHC_PROTOCOL, compressed_len, p, consumed);
+    if (err == ERR_OK) {
+        link->stats.iphc.tx_packets++;
+        link->stats.iphc.tx_saved_bytes += consumed - compressed_len;
+    }
+    return err;
+}
+
+// Take the interface identifiers from IPv6CP and keep the address from the link prefix in step, runs on the tcpip thread.
+static void ppp_link_ip6_update(void *ctx)
+{
+    ppp_link_t *link = ctx;
+    ppp_pcb *pcb = (ppp_pcb *)link->ppp_netif->state;
+    bool up = pcb->if6_up;
+
+    link->ip6_up = false;
+    if (link->ip6_global_index >= 0) {
+        netif_ip6_addr_set_state(link->ppp_netif, link->ip6_global_index, IP6_ADDR_INVALID);
+        link->ip6_global_index = -1;
+    }
+    if (up) {
+        memcpy(link->iphc.our_iid, pcb->ipv6cp_gotoptions.ourid.e8, sizeof(link->iphc.our_iid));
+        memcpy(link->iphc.peer_iid, pcb->ipv6cp_hisoptions.hisid.e8, sizeof(link->iphc.peer_iid));
+        memcpy(link->iphc.prefix, link->ip6_prefix, sizeof(link->iphc.prefix));
+        link->iphc.has_prefix = link->ip6_prefix_known;
+        if (link->ip6_prefix_known) {
+            ip6_addr_t addr = {0};
+            s8_t index;
+
+            memcpy(&addr.addr[0], link->ip6_prefix, sizeof(link->ip6_prefix));
+            memcpy(&addr.addr[2], link->iphc.our_iid, sizeof(link->iphc.our_iid));
+            if (netif_add_ip6_address(link->ppp_netif, &addr, &index) == ERR_OK) {
+                // Both ends of the link know the prefix, there is nobody else to detect duplicates with
+                netif_ip6_addr_set_state(link->ppp_netif, index, IP6_ADDR_PREFERRED);
+                link->ip6_global_index = index;
+                ESP_LOGI(TAG, "%s: IPv6 address %s", link->if_desc, ip6addr_ntoa(&addr));
+            } else {
+                ESP_LOGW(TAG, "%s: no room for an IPv6 address, see CONFIG_LWIP_IPV6_NUM_ADDRESSES", link->if_desc);
+            }
+        }
+    }
+    link->ip6_up = up;
+    link->ip6_update_queued = false;
+}
+#endif
+
+// With plain set the frame bypasses FEC, the encoder holds no data between frames so this is always possible.
+static esp_err_t ppp_link_send_ctrl(ppp_link_t *link, uint8_t code, const uint8_t *data, size_t len, bool plain)
+{
+    uint8_t frame[3 + PPP_LINK_CTRL_MAX_LEN];
+    uint8_t encoded[PPP_HDLC_ENCODED_MAX(sizeof(frame))];
+    esp_err_t ret = ESP_OK;
+
+    assert(len <= PPP_LINK_CTRL_MAX_LEN);
+    frame[0] = PPP_LINK_CTRL_PROTOCOL >> 8;
+    frame[1] = PPP_LINK_CTRL_PROTOCOL & 0xff;
+    frame[2] = code;
+    memcpy(&frame[3], data, len);
+    size_t encoded_len = ppp_hdlc_encode(encoded, frame, 3 + len);
+
+    xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+    bool fec = link->tx_fec;
+    link->tx_fec = fec && !plain;
+    if (!link->tx_at_frame_boundary || ppp_link_write(link, encoded, encoded_len) != ESP_OK) {
+        // Try again later, lwip is in the middle of a frame or the line is busy.
+        ret = ESP_ERR_INVALID_STATE;
+    }
+    link->tx_fec = fec;
+    xSemaphoreGive(link->tx_lock);
+    return ret;
+}
+
+// Only ends that want to use a feature start the negotiation, the others just answer.
+static bool ppp_link_wants_caps(ppp_link_t *link)
+{
+    return link->config.fec.enabled || link->config.arq.enabled || link->config.lqm.enabled || link->config.ipv4.header_compression ||
+           link->config.ipv6.header_compression || link->ip6_prefix_known;
+}
+
+// Capabilities are always sent as plain HDLC, a peer that lost our FEC parameters can still read them.
+static esp_err_t ppp_link_send_caps(ppp_link_t *link)
+{
+    // Acknowledging numbered frames and rebuilding headers costs nothing, so every ppp_link offers it.
+    uint8_t flags = PPP_LINK_CAPS_ARQ | PPP_LINK_CAPS_ROHC;
+#if PPP_IPV6_SUPPORT
+    flags |= PPP_LINK_CAPS_IPHC;
+#endif
+
+    if (link->config.fec.enabled) {
+        flags |= PPP_LINK_CAPS_FEC;
+    }
+    if (link->config.lqm.enabled) {
+        flags |= PPP_LINK_CAPS_LQM;
+    }
+    if (link->peer_caps_received) {
+        flags |= PPP_LINK_CAPS_ACK;
+    }
+    if (ppp_link_wants_caps(link) && !link->caps_acked) {
+        flags |= PPP_LINK_CAPS_REQ;
+    }
+    uint8_t caps[PPP_LINK_CAPS_PREFIX_LEN] = {flags, link->config.fec.block_size, link->config.fec.parity};
+    size_t len = PPP_LINK_CAPS_LEN;
+
+    // The server hands out the link prefix, both ends use it for an address and to compress addresses
+    if (link->config.type != PPP_LINK_CLIENT && link->ip6_prefix_known) {
+        memcpy(&caps[PPP_LINK_CAPS_LEN], link->ip6_prefix, sizeof(link->ip6_prefix));
+        len = PPP_LINK_CAPS_PREFIX_LEN;
+    }
+    return ppp_link_send_ctrl(link, PPP_LINK_CTRL_CAPS, caps, len, true);
+}
+
+static void ppp_link_apply_mru_hint(void *ctx)
+{
+    ppp_link_t *link = ctx;
+    ppp_pcb *pcb = (ppp_pcb *)link->ppp_netif->state;
+    u16_t negotiated = pcb->lcp_hisoptions.neg_mru ? pcb->lcp_hisoptions.mru : PPP_DEFMRU;
+
+    link->ppp_netif->mtu = LWIP_MIN(link->peer_mru_hint, negotiated);
+    ESP_LOGI(TAG, "%s: peer asked for MRU %d, mtu is now %d", link->if_desc, link->peer_mru_hint, link->ppp_netif->mtu);
+}
+
+static void ppp_link_on_caps(ppp_link_t *link, uint8_t flags, int fec_block_size, int fec_parity, const uint8_t *prefix)
+{
+    link->peer_caps_received = true;
+    link->peer_fec = false;
+    if ((flags & PPP_LINK_CAPS_FEC) && ppp_fec_params_valid(fec_block_size, fec_parity)) {
+        ppp_fec_decoder_set_params(&link->fec_decoder, fec_block_size, fec_parity);
+        link->peer_fec = true;
+    }
+    link->peer_arq = flags & PPP_LINK_CAPS_ARQ;
+    link->peer_lqm = flags & PPP_LINK_CAPS_LQM;
+    link->peer_iphc = flags & PPP_LINK_CAPS_IPHC;
+    link->peer_rohc = flags & PPP_LINK_CAPS_ROHC;
+    if (prefix && link->config.type == PPP_LINK_CLIENT && (!link->ip6_prefix_known || memcmp(link->ip6_prefix, prefix, sizeof(link->ip6_prefix)) != 0)) {
+        memcpy(link->ip6_prefix, prefix, sizeof(link->ip6_prefix));
+        link->ip6_prefix_known = true;
+        link->ip6_changed = true;
+    }
+    // A peer that restarted has forgotten our parameters and can not read our blocks until it has them again.
+    link->caps_acked = flags & PPP_LINK_CAPS_ACK;
+    if (!link->caps_acked) {
+        // Its frame numbering starts over as well.
+        xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+        ppp_arq_reset(&link->arq);
+        xSemaphoreGive(link->tx_lock);
+    }
+    if (flags & PPP_LINK_CAPS_REQ) {
+        link->caps_reply_pending = true;
+    }
+    ESP_LOGD(TAG, "Peer capabilities 0x%02x, fec %d/%d", flags, fec_block_size, fec_parity);
+}
+
+static void ppp_link_post_health(ppp_link_t *link)
+{
+    if (!link->config.lqm.enabled) {
+        return;
+    }
+    ESP_LOGD(TAG, "Link health %d, level %d, rtt %d ms, loss in %d out %d permille", link->lqm.health.score, link->lqm.health.level, link->lqm.health.rtt_us / 1000,
+             link->lqm.health.loss_in_permille, link->lqm.health.loss_out_permille);
+    ppp_link_health_t health = link->lqm.health;
+    health.link = link;
+    esp_event_post(PPP_LINK_EVENT, PPP_LINK_EVENT_HEALTH_CHANGED, &health, sizeof(health), 0);
+}
+
+static void ppp_link_deliver(ppp_link_t *link, const uint8_t *frame, size_t len);
+static void ppp_link_to_stack(ppp_link_t *link, const uint8_t *frame, size_t len);
+static void ppp_link_queue_rx(ppp_link_t *link, const uint8_t *frame, size_t len);
+
+static void ppp_link_on_ctrl(ppp_link_t *link, const uint8_t *data, size_t len)
+{
+    if (len < 1) {
+        return;
+    }
+    switch (data[0]) {
+    case PPP_LINK_CTRL_ARQ_DATA:
+        if (len >= 3 && ppp_arq_receive(&link->arq, data[1], data[2], esp_timer_get_time())) {
+            ppp_link_deliver(link, &data[3], len - 3);
+        }
+        break;
+    case PPP_LINK_CTRL_ARQ_ACK:
+        if (len >= 6) {
+            uint32_t bitmap = ((uint32_t)data[2] << 24) | (data[3] << 16) | (data[4] << 8) | data[5];
+            int64_t now = esp_timer_get_time();
+
+            xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+            ppp_arq_on_ack(&link->arq, data[1], bitmap, now);
+            if (link->tx_arq) {
+                ppp_link_arq_pump(link, now);
+            }
+            xSemaphoreGive(link->tx_lock);
+        }
+        break;
+    case PPP_LINK_CTRL_LQR:
+        if (ppp_lqm_on_report(&link->lqm, &data[1], len - 1, esp_timer_get_time(), link->stats.rx_frames - link->stats.rx_fcs_errors, link->stats.rx_fcs_errors)) {
+            ppp_link_post_health(link);
+        }
+        break;
+    case PPP_LINK_CTRL_MRU_HINT:
+        if (len >= 3) {
+            link->peer_mru_hint = (data[1] << 8) | data[2];
+            if (tcpip_callback(ppp_link_apply_mru_hint, link) != ERR_OK) {
+                ESP_LOGW(TAG, "Failed to apply MRU hint");
+            }
+        }
+        break;
+    case PPP_LINK_CTRL_CAPS:
+        if (len >= 1 + PPP_LINK_CAPS_LEN) {
+            ppp_link_on_caps(link, data[1], data[2], data[3], len >= 1 + PPP_LINK_CAPS_PREFIX_LEN ? &data[1 + PPP_LINK_CAPS_LEN] : NULL);
+        }
+        break;
+    default:
+        ESP_LOGD(TAG, "Unknown link control code %d", data[0]);
+        break;
+    }
+}
+
+static err_t PPP_LINK_FAST_ATTR ppp_link_input(struct pbuf *p, struct netif *netif)
+{
+    ppp_input((ppp_pcb *)netif->state, p);
+    return ERR_OK;
+}
+
+static void PPP_LINK_FAST_ATTR ppp_link_fec_output(void *ctx, const uint8_t *data, size_t len)
+{
+    ppp_link_t *link = ctx;
+
+    ppp_hdlc_decode(&link->rx_decoder, data, len);
+}
+
+static void PPP_LINK_FAST_ATTR on_rx_frame(void *ctx, uint8_t *frame, size_t len, bool fcs_ok)
+{
+    ppp_link_t *link = ctx;
+    int bucket = ppp_mru_bucket(len);
+
+    ppp_mru_account(&link->mru, len, fcs_ok);
+    link->stats.rx_frames++;
+    link->stats.rx_size[bucket].frames++;
+    if (!fcs_ok) {
+        link->stats.rx_fcs_errors++;
+        link->stats.rx_size[bucket].fcs_errors++;
+        return;
+    }
+    ppp_link_deliver(link, frame, len - PPP_HDLC_FCS_LEN);
+}
+
+// Hand a frame without FCS to the stack, or to ppp_link itself for link control frames.
+static void PPP_LINK_FAST_ATTR ppp_link_deliver(ppp_link_t *link, const uint8_t *frame, size_t len)
+{
+    // Address and control field may be compressed away, see RFC 1661 section 6.6
+    if (len >= 2 && frame[0] == PPP_ALLSTATIONS && frame[1] == PPP_UI) {
+        frame += 2;
+        len -= 2;
+    }
+    if (len < 1) {
+        return;
+    }
+
+    if (len >= 2 && ((frame[0] << 8) | frame[1]) == PPP_LINK_CTRL_PROTOCOL) {
+        ppp_link_on_ctrl(link, frame + 2, len - 2);
+        return;
+    }
+
+    if (link->config.task.pipeline.enabled) {
+        ppp_link_queue_rx(link, frame, len);
+    } else {
+        ppp_link_to_stack(link, frame, len);
+    }
+}
+
+// A pbuf for a received frame, from the receive pool while it lasts.
+static PPP_LINK_FAST_ATTR struct pbuf *ppp_link_rx_alloc(ppp_link_t *link, size_t len)
+{
+    esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+    struct pbuf *p = NULL;
+    if (link->config.rx_pool.frames > 0) {
+        p = ppp_pool_alloc(&link->rx_pool, len);
+        if (!p) {
+            link->stats.rx_pool.misses++;
+        }
+    }
+    if (!p) {
+        p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+    }
+    uint32_t cycles = esp_cpu_get_cycle_count() - start;
+    link->rx_alloc_cycles += cycles;
+    link->rx_allocs++;
+    link->stats.rx_alloc_max_cycles = MAX(link->stats.rx_alloc_max_cycles, cycles);
+    if (!p) {
+        link->stats.rx_dropped++;
+    }
+    return p;
+}
+
+static void PPP_LINK_FAST_ATTR ppp_link_pbuf_to_stack(ppp_link_t *link, struct pbuf *p)
+{
+    if (tcpip_inpkt(p, link->ppp_netif, ppp_link_input) != ERR_OK) {
+        pbuf_free(p);
+        link->stats.rx_dropped++;
+    }
+}
+
+// Rebuild the headers of a compressed IPv6 packet and pass it on as a plain one.
+static void PPP_LINK_FAST_ATTR ppp_link_iphc_to_stack(ppp_link_t *link, const uint8_t *data, size_t len)
+{
+    uint8_t header[2 + PPP_IPHC_MAX_HEADER] = {0, PPP_IPV6};
+    size_t consumed;
+    size_t header_len = link->ip6_up ? ppp_iphc_decompress(&link->iphc, data, len, &header[2], &consumed) : 0;
+
+    if (header_len == 0) {
+        link->stats.iphc.rx_errors++;
+        return;
+    }
+    link->stats.iphc.rx_packets++;
+    struct pbuf *p = ppp_link_rx_alloc(link, 2 + header_len + len - consumed);
+    if (!p) {
+        return;
+    }
+    pbuf_take(p, header, 2 + header_len);
+    pbuf_take_at(p, &data[consumed], len - consumed, 2 + header_len);
+    ppp_link_pbuf_to_stack(link, p);
+}
+
+// Rebuild the headers of a compressed IPv4 UDP packet and pass it on as a plain one.
+static void PPP_LINK_FAST_ATTR ppp_link_rohc_to_stack(ppp_link_t *link, const uint8_t *data, size_t len)
+{
+    uint8_t header[2 + PPP_ROHC_HEADER_LEN] = {0, PPP_IP};
+    size_t consumed;
+    size_t header_len = ppp_rohc_decompress(&link->rohc, data, len, &header[2], &consumed);
+
+    if (header_len == 0) {
+        return;
+    }
+    struct pbuf *p = ppp_link_rx_alloc(link, 2 + header_len + len - consumed);
+    if (!p) {
+        return;
+    }
+    pbuf_take(p, header, 2 + header_len);
+    pbuf_take_at(p, &data[consumed], len - consumed, 2 + header_len);
+    ppp_link_pbuf_to_stack(link, p);
+}
+
+// Copy a frame into a pbuf and pass it to the tcpip thread.
+static void PPP_LINK_FAST_ATTR ppp_link_to_stack(ppp_link_t *link, const uint8_t *frame, size_t len)
+{
+    if (len >= 2 && ((frame[0] << 8) | frame[1]) == PPP_LINK_IPHC_PROTOCOL) {
+        ppp_link_iphc_to_stack(link, frame + 2, len - 2);
+        return;
+    }
+    if (len >= 2 && ((frame[0] << 8) | frame[1]) == PPP_LINK_ROHC_PROTOCOL) {
+        ppp_link_rohc_to_stack(link, frame + 2, len - 2);
+        return;
+    }
+
+    // The stack expects the protocol field uncompressed, see RFC 1661 section 6.5
+    bool compressed_protocol = frame[0] & 1;
+    struct pbuf *p = ppp_link_rx_alloc(link, len + compressed_protocol);
+    if (!p) {
+        return;
+    }
+    if (compressed_protocol) {
+        const uint8_t protocol_high = 0;
+        pbuf_take(p, &protocol_high, 1);
+        pbuf_take_at(p, frame, len, 1);
+    } else {
+        pbuf_take(p, frame, len);
+    }
+    ppp_link_pbuf_to_stack(link, p);
+}
+
+// Hand a frame to the rx task, called from the uart task.
+static void PPP_LINK_FAST_ATTR ppp_link_queue_rx(ppp_link_t *link, const uint8_t *frame, size_t len)
+{
+    uint8_t *slot = ppp_frame_ring_reserve(&link->rx_ring);
+
+    if (!slot) {
+        link->stats.pipeline.ring_full++;
+        return;
+    }
+    memcpy(slot, frame, len);
+    ppp_frame_ring_commit(&link->rx_ring, len);
+    link->stats.pipeline.frames++;
+    link->stats.pipeline.max_queued = MAX(link->stats.pipeline.max_queued, ppp_frame_ring_count(&link->rx_ring));
+    xTaskNotifyGive(link->rx_task);
+}
+
+// Second half of the receive pipeline, moves decoded frames to the ip stack while the uart task decodes the next ones.
+static void ppp_rx_task_thread(void *param)
+{
+    ppp_link_t *link = param;
+
+    while (1) {
+        uint8_t *frame;
+        size_t len;
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while ((frame = ppp_frame_ring_peek(&link->rx_ring, &len)) != NULL) {
+            ppp_link_to_stack(link, frame, len);
+            ppp_frame_ring_release(&link->rx_ring);
+        }
+    }
+}
+
+static void ppp_link_poll(ppp_link_t *link)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (link->current_phase == PPP_PHASE_RUNNING) {
+        bool retry = ppp_link_wants_caps(link) && !link->caps_acked && link->caps_retries < PPP_LINK_CAPS_RETRIES && now - link->caps_sent_us >= PPP_LINK_CAPS_INTERVAL_US;
+        if ((link->caps_reply_pending || retry) && ppp_link_send_caps(link) == ESP_OK) {
+            link->caps_reply_pending = false;
+            link->caps_sent_us = now;
+            link->caps_retries += retry;
+        }
+    }
+    ppp_link_set_tx_mode(link, link->config.fec.enabled && link->peer_fec && link->caps_acked, link->config.arq.enabled && link->peer_arq && link->caps_acked);
+    // Compressed packets are whole frames of their own, so this can change at any time
+    bool iphc = link->config.ipv6.header_compression && link->peer_iphc && link->caps_acked;
+    if (link->tx_iphc != iphc) {
+        link->tx_iphc = iphc;
+        ESP_LOGI(TAG, "IPv6 header compression %s for sent packets", iphc ? "enabled" : "disabled");
+    }
+    bool rohc = link->config.ipv4.header_compression && link->peer_rohc && link->caps_acked;
+    if (atomic_load_explicit(&link->tx_rohc, memory_order_relaxed) != rohc) {
+        // Contexts the peer had are gone or stale after a restart, the tcpip thread sees the reset no later than the change
+        atomic_store_explicit(&link->rohc_reset, rohc, memory_order_release);
+        atomic_store_explicit(&link->tx_rohc, rohc, memory_order_release);
+        ESP_LOGI(TAG, "IPv4 UDP header compression %s for sent packets", rohc ? "enabled" : "disabled");
+    }
+#if PPP_IPV6_SUPPORT
+    ppp_pcb *pcb = (ppp_pcb *)link->ppp_netif->state;
+    if ((pcb->if6_up != link->ip6_up || link->ip6_changed) && !link->ip6_update_queued) {
+        link->ip6_update_queued = true;
+        link->ip6_changed = false;
+        if (tcpip_callback(ppp_link_ip6_update, link) != ERR_OK) {
+            link->ip6_update_queued = false;
+            link->ip6_changed = true;
+        }
+    }
+#endif
+
+    if (ppp_arq_ack_due(&link->arq, now)) {
+        const uint8_t ack[5] = {link->arq.rx_next, link->arq.rx_bitmap >> 24, link->arq.rx_bitmap >> 16, link->arq.rx_bitmap >> 8, link->arq.rx_bitmap};
+        if (ppp_link_send_ctrl(link, PPP_LINK_CTRL_ARQ_ACK, ack, sizeof(ack), false) == ESP_OK) {
+            ppp_arq_ack_sent(&link->arq);
+        }
+    }
+    if (link->tx_arq) {
+        xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+        ppp_link_arq_pump(link, now);
+        xSemaphoreGive(link->tx_lock);
+    }
+
+    // Reports go both ways even if only one end asked, each end measures what the other sends.
+    if (link->current_phase == PPP_PHASE_RUNNING && link->peer_caps_received && (link->config.lqm.enabled || link->peer_lqm) && ppp_lqm_report_due(&link->lqm, now)) {
+        uint8_t report[PPP_LQM_REPORT_LEN];
+        ppp_lqm_build_report(&link->lqm, now, link->stats.tx_frames, report);
+        ppp_link_send_ctrl(link, PPP_LINK_CTRL_LQR, report, sizeof(report), false);
+    }
+    if (ppp_lqm_poll(&link->lqm, now)) {
+        ppp_link_post_health(link);
+    }
+
+    if (ppp_mru_poll(&link->mru, now)) {
+        ESP_LOGI(TAG, "Bit error rate %.2e, asking peer for MRU %d, estimated goodput %d bps", link->mru.bit_error_rate, link->mru.current, link->mru.goodput_bps);
+        link->mru_hint_pending = true;
+    }
+
+    if (link->mru_hint_pending && link->current_phase == PPP_PHASE_RUNNING) {
+        const uint8_t hint[2] = {link->mru.current >> 8, link->mru.current & 0xff};
+        if (ppp_link_send_ctrl(link, PPP_LINK_CTRL_MRU_HINT, hint, sizeof(hint), false) == ESP_OK) {
+            link->mru_hint_pending = false;
+        }
+    }
+}
+
+// Usable bits per second on the wire, each byte costs a start bit, data bits, parity and stop bits.
+static uint32_t ppp_link_line_rate(const uart_config_t *uart_config)
+{
+    uint32_t bits_per_byte_x2 = 2 * (1 + 5 + uart_config->data_bits);
+    if (uart_config->parity != UART_PARITY_DISABLE) {
+        bits_per_byte_x2 += 2;
+    }
+    bits_per_byte_x2 += uart_config->stop_bits == UART_STOP_BITS_1 ? 2 : uart_config->stop_bits == UART_STOP_BITS_1_5 ? 3 : 4;
+    return (uint64_t)uart_config->baud_rate * 2 * 8 / bits_per_byte_x2;
+}
+
+static void PPP_LINK_FAST_ATTR ppp_link_receive(ppp_link_t *link, const uint8_t *data, size_t len)
+{
+    link->stats.rx_bytes += len;
+    if (link->config.fec.enabled) {
+        ppp_fec_decode(&link->fec_decoder, data, len);
+    } else {
+        ppp_hdlc_decode(&link->rx_decoder, data, len);
+    }
+}
+
+// Decode everything the interrupt handler has queued, straight from the ring.
+static void PPP_LINK_FAST_ATTR ppp_link_direct_receive(ppp_link_t *link)
+{
+    const uint8_t *data;
+    size_t len;
+
+    link->stats.direct.wakeups++;
+    link->stats.direct.rx_max_fill = MAX(link->stats.direct.rx_max_fill, ppp_byte_ring_count(&link->uart_rx_ring));
+    while ((data = ppp_byte_ring_read_ptr(&link->uart_rx_ring, &len)), len > 0) {
+        ppp_link_receive(link, data, len);
+        ppp_byte_ring_consume(&link->uart_rx_ring, len);
+    }
+    if (link->uart_rx_lost) {
+        link->uart_rx_lost = false;
+        ESP_LOGW(TAG, "Receive overflow");
+        ppp_hdlc_decoder_reset(&link->rx_decoder);
+    }
+    if (link->uart_rx_throttled) {
+        link->uart_rx_throttled = false;
+        portENTER_CRITICAL(&link->uart_intr_lock);
+        uart_hal_ena_intr_mask(&link->uart_hal, UART_INTR_RXFIFO_FULL | UART_INTR_RXFIFO_TOUT);
+        portEXIT_CRITICAL(&link->uart_intr_lock);
+    }
+}
+
+// Ip events are posted for every ppp netif, only pass on the ones for this link.
+static void on_ip_changed(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    ppp_link_t *link = arg;
+    const ip_event_got_ip_t *event = event_data;
+
+    if (event->esp_netif != link->esp_netif) {
+        return;
+    }
+    if (event_id == IP_EVENT_PPP_GOT_IP) {
+        esp_netif_action_connected(link->esp_netif, event_base, event_id, event_data);
+    } else {
+        esp_netif_action_disconnected(link->esp_netif, event_base, event_id, event_data);
+    }
+}
+
 static void ppp_task_thread(void *param)
 {
-    const esp_netif_config_t cfg = ESP_NETIF_DEFAULT_PPP();
-    esp_netif_t *esp_netif = esp_netif_new(&cfg);
-    assert(esp_netif);
+    ppp_link_t *link = param;
+    esp_netif_inherent_config_t base = ESP_NETIF_INHERENT_DEFAULT_PPP();
+    if (link->index > 0) {
+        // Every netif needs its own key, later links rank below the first one for the default route
+        base.if_key = link->if_key;
+        base.if_desc = link->if_desc;
+        base.route_prio -= link->index;
+    }
+    const esp_netif_config_t cfg = {.base = &base, .stack = ESP_NETIF_NETSTACK_DEFAULT_PPP};
+    link->esp_netif = esp_netif_new(&cfg);
+    assert(link->esp_netif);
+    link->ppp_netif = esp_netif_get_netif_impl(link->esp_netif);
+    if (link->config.ipv4.header_compression) {
+        ppp_output_ip4 = link->ppp_netif->output;
+        link->ppp_netif->output = ppp_link_output_ip4;
+    }
+#if PPP_IPV6_SUPPORT
+    if (link->config.ipv6.header_compression) {
+        ppp_output_ip6 = link->ppp_netif->output_ip6;
+        link->ppp_netif->output_ip6 = ppp_link_output_ip6;
+    }
+#endif
 
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_GOT_IP, esp_netif_action_connected, esp_netif));
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_LOST_IP, esp_netif_action_disconnected, esp_netif));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_GOT_IP, on_ip_changed, link));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_LOST_IP, on_ip_changed, link));
 
     const esp_netif_driver_ifconfig_t driver_ifconfig = {
+        .handle = link,
         .driver_free_rx_buffer = NULL,
         .transmit = on_ppp_transmit,
     };
-    ESP_ERROR_CHECK(esp_netif_set_driver_config(esp_netif, &driver_ifconfig));
+    ESP_ERROR_CHECK(esp_netif_set_driver_config(link->esp_netif, &driver_ifconfig));
 
     // enable both events, so we could notify the modem layer if an error occurred/state changed
     const esp_netif_ppp_config_t ppp_config = {.ppp_error_event_enabled = true, .ppp_phase_event_enabled = true};
-    ESP_ERROR_CHECK(esp_netif_ppp_set_params(esp_netif, &ppp_config));
+    ESP_ERROR_CHECK(esp_netif_ppp_set_params(link->esp_netif, &ppp_config));
 
 #ifdef CONFIG_PPP_SERVER_SUPPORT
-    if (config.type == PPP_LINK_SERVER) {
-        ESP_ERROR_CHECK(esp_netif_ppp_start_server(esp_netif, config.ppp_server.localaddr, config.ppp_server.remoteaddr, config.ppp_server.dnsaddr1,
-                                                   config.ppp_server.dnsaddr2, config.ppp_server.login, config.ppp_server.password,
-                                                   config.ppp_server.auth_req));
+    if (link->config.type == PPP_LINK_SERVER) {
+        ESP_LOGI(TAG, "%s: serving " IPSTR " on uart %d", link->if_desc, IP2STR(&link->config.ppp_server.remoteaddr), link->config.uart);
+#if PPP_IPV6_SUPPORT
+        // Interface identifiers from the IPv4 addresses, IPv6CP makes the client take the one offered
+        ppp_pcb *pcb = (ppp_pcb *)link->ppp_netif->state;
+        pcb->ipv6cp_wantoptions.ourid.e32[1] = link->config.ppp_server.localaddr.addr;
+        pcb->ipv6cp_wantoptions.opt_local = 1;
+        pcb->ipv6cp_wantoptions.hisid.e32[1] = link->config.ppp_server.remoteaddr.addr;
+        pcb->ipv6cp_wantoptions.opt_remote = 1;
+#endif
+        ESP_ERROR_CHECK(esp_netif_ppp_start_server(link->esp_netif, link->config.ppp_server.localaddr, link->config.ppp_server.remoteaddr, link->config.ppp_server.dnsaddr1,
+                                                   link->config.ppp_server.dnsaddr2, link->config.ppp_server.login, link->config.ppp_server.password,
+                                                   link->config.ppp_server.auth_req));
     }
 #endif
 
+    if (link->config.direct.enabled) {
+        // The interrupt handler wakes this task, so it can only start now
+        link->ppp_task = xTaskGetCurrentTaskHandle();
+        portENTER_CRITICAL(&link->uart_intr_lock);
+        uart_hal_ena_intr_mask(&link->uart_hal, PPP_LINK_DIRECT_RX_INTR);
+        portEXIT_CRITICAL(&link->uart_intr_lock);
+    }
+
     while (1) {
         uart_event_t event;
 
-        if (xQueueReceive(uart_event_queue, &event, pdMS_TO_TICKS(100))) {
+        // Acknowledges and retransmissions need a finer timer than the dead link check
+        TickType_t timeout = link->tx_arq || link->arq.ack_pending ? pdMS_TO_TICKS(PPP_LINK_ARQ_POLL_MS) : pdMS_TO_TICKS(100);
+        if (link->config.direct.enabled) {
+            if (ulTaskNotifyTake(pdTRUE, timeout)) {
+                ppp_link_direct_receive(link);
+            }
+        } else if (xQueueReceive(link->uart_event_queue, &event, timeout)) {
             switch (event.type) {
             case UART_DATA:
                 while (true) {
                     char buffer[512];
                     size_t length = 0;
 
-                    uart_get_buffered_data_len(config.uart, &length);
+                    uart_get_buffered_data_len(link->config.uart, &length);
                     if (!length)
                         break;
 
                     length = MIN(sizeof(buffer), length);
-                    size_t read_length = uart_read_bytes(config.uart, buffer, length, portMAX_DELAY);
+                    size_t read_length = uart_read_bytes(link->config.uart, buffer, length, portMAX_DELAY);
                     if (read_length > 0) {
-                        esp_err_t res = esp_netif_receive(esp_netif, buffer, read_length, NULL);
-                        if (res != ESP_OK) {
-                            ESP_LOGE(TAG, "esp_netif_receive error %d", res);
-                            break;
-                        }
+                        ppp_link_receive(link, (uint8_t *)buffer, read_length);
                     }
                 }
                 break;
             case UART_FIFO_OVF:
                 ESP_LOGW(TAG, "HW FIFO Overflow");
-                uart_flush_input(config.uart);
-                xQueueReset(uart_event_queue);
+                link->stats.rx_overflows++;
+                uart_flush_input(link->config.uart);
+                xQueueReset(link->uart_event_queue);
+                ppp_hdlc_decoder_reset(&link->rx_decoder);
                 break;
             case UART_BUFFER_FULL:
                 ESP_LOGW(TAG, "Ring Buffer Full");
-                uart_flush_input(config.uart);
-                xQueueReset(uart_event_queue);
+                link->stats.rx_overflows++;
+                uart_flush_input(link->config.uart);
+                xQueueReset(link->uart_event_queue);
+                ppp_hdlc_decoder_reset(&link->rx_decoder);
                 break;
             case UART_BREAK:
                 ESP_LOGW(TAG, "Rx Break");
@@ -123,35 +1200,491 @@ static void ppp_task_thread(void *param)
             }
         }
 
-        if (current_phase == PPP_PHASE_DEAD) {
-            ESP_LOGI(TAG, "Connection is dead, restarting ppp interface");
-            esp_netif_action_start(esp_netif, NULL, 0, NULL);
+        if (link->current_phase == PPP_PHASE_DEAD) {
+            ESP_LOGI(TAG, "%s: connection is dead, restarting ppp interface", link->if_desc);
+            ppp_hdlc_decoder_reset(&link->rx_decoder);
+            // Start over in plain HDLC, the peer may not be the same ppp_link as before.
+            link->peer_fec = false;
+            link->peer_arq = false;
+            link->peer_lqm = false;
+            link->peer_iphc = false;
+            link->peer_rohc = false;
+            if (link->config.type == PPP_LINK_CLIENT) {
+                link->ip6_prefix_known = false;
+            }
+            link->peer_caps_received = false;
+            link->caps_acked = false;
+            link->caps_retries = 0;
+            ppp_link_set_tx_mode(link, false, false);
+            xSemaphoreTake(link->tx_lock, portMAX_DELAY);
+            ppp_arq_reset(&link->arq);
+            xSemaphoreGive(link->tx_lock);
+            if (link->lqm.health.level != PPP_LINK_HEALTH_UNKNOWN) {
+                ppp_lqm_reset(&link->lqm);
+                ppp_link_post_health(link);
+            }
+            esp_netif_action_start(link->esp_netif, NULL, 0, NULL);
         }
+
+        ppp_link_poll(link);
     }
 }
 
-esp_err_t ppp_link_init(const ppp_link_config_t *_config)
+static bool ppp_link_core_valid(int core)
 {
-    config = *_config;
+    return core == tskNO_AFFINITY || (core >= 0 && core < portNUM_PROCESSORS);
+}
+
+static size_t ppp_link_ring_size(int size)
+{
+    size_t ring_size = 1;
+    while (ring_size < size) {
+        ring_size <<= 1;
+    }
+    return ring_size;
+}
+
+// Take the uart over from the driver, buffer sizes are rounded up to a power of two.
+static esp_err_t ppp_link_direct_init(ppp_link_t *link)
+{
+    size_t rx_size = ppp_link_ring_size(link->config.buffer.rx_buffer_size);
+    size_t tx_size = ppp_link_ring_size(link->config.buffer.tx_buffer_size);
+    uint8_t *rx_buffer = PPP_LINK_ALLOC(static_uart_rx, rx_size);
+    uint8_t *tx_buffer = PPP_LINK_ALLOC(static_uart_tx, tx_size);
 
+    if (!rx_buffer || !tx_buffer) {
+        ESP_LOGE(TAG, "No memory for uart buffers");
+        PPP_LINK_FREE(rx_buffer);
+        PPP_LINK_FREE(tx_buffer);
+        return ESP_ERR_NO_MEM;
+    }
+    ppp_byte_ring_init(&link->uart_rx_ring, rx_buffer, rx_size);
+    ppp_byte_ring_init(&link->uart_tx_ring, tx_buffer, tx_size);
+
+    link->uart_hal.dev = UART_LL_GET_HW(link->config.uart);
+    uart_hal_disable_intr_mask(&link->uart_hal, UINT32_MAX);
+    uart_hal_clr_intsts_mask(&link->uart_hal, UINT32_MAX);
+    uart_hal_rxfifo_rst(&link->uart_hal);
+    uart_hal_txfifo_rst(&link->uart_hal);
+    uart_hal_set_rxfifo_full_thr(&link->uart_hal, PPP_LINK_DIRECT_RX_THRESHOLD);
+    uart_hal_set_rx_timeout(&link->uart_hal, 1);
+    uart_hal_set_txfifo_empty_thr(&link->uart_hal, PPP_LINK_DIRECT_TX_THRESHOLD);
+
+    // Interrupts stay masked until the ppp task is running
+    return esp_intr_alloc(uart_periph_signal[link->config.uart].irq, PPP_LINK_UART_INTR_FLAGS, ppp_link_uart_isr, link, &link->uart_intr);
+}
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+static esp_err_t ppp_link_static_check(const ppp_link_config_t *config)
+{
+    const char *what = NULL;
+
+    if (!config->direct.enabled) {
+        what = "direct uart access, the uart driver allocates";
+    } else if (ppp_link_ring_size(config->buffer.rx_buffer_size) > sizeof(static_uart_rx[0])) {
+        what = "uart receive buffer";
+    } else if (ppp_link_ring_size(config->buffer.tx_buffer_size) > sizeof(static_uart_tx[0])) {
+        what = "uart transmit buffer";
+    } else if (config->arq.enabled && config->arq.window > CONFIG_PPP_LINK_STATIC_ARQ_WINDOW) {
+        what = "retransmission window";
+    } else if (config->rx_pool.frames > CONFIG_PPP_LINK_STATIC_RX_POOL_FRAMES) {
+        what = "receive pool";
+    } else if (config->task.pipeline.enabled && config->task.pipeline.frames > CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES) {
+        what = "receive pipeline";
+    } else if ((config->ipv4.header_compression || config->ipv6.header_compression) && !PPP_LINK_STATIC_HC) {
+        what = "header compression buffers";
+    } else if (config->task.stack_size > sizeof(static_task_stack[0])) {
+        what = "ppp task stack";
+#if CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES > 0
+    } else if (config->task.pipeline.enabled && config->task.pipeline.stack_size > sizeof(static_rx_task_stack[0])) {
+        what = "receive pipeline task stack";
+#endif
+    }
+    if (what) {
+        ESP_LOGE(TAG, "Static allocation: configuration needs %s, see CONFIG_PPP_LINK_STATIC_*", what);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_PPP_SERVER_SUPPORT
+// Next free address of the pool, the pool is shared by all links configured with it.
+static esp_err_t ppp_link_pool_take(ppp_link_addr_pool_t *pool, esp_ip4_addr_t *addr)
+{
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    portENTER_CRITICAL(&links_lock);
+    for (int i = 0; i < MIN(pool->size, PPP_LINK_ADDR_POOL_MAX); i++) {
+        if (!(pool->in_use & (1u << i))) {
+            pool->in_use |= 1u << i;
+            addr->addr = lwip_htonl(lwip_ntohl(pool->first.addr) + i);
+            err = ESP_OK;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&links_lock);
+    return err;
+}
+
+static void ppp_link_pool_give(ppp_link_addr_pool_t *pool, const esp_ip4_addr_t *addr)
+{
+    portENTER_CRITICAL(&links_lock);
+    pool->in_use &= ~(1u << (lwip_ntohl(addr->addr) - lwip_ntohl(pool->first.addr)));
+    portEXIT_CRITICAL(&links_lock);
+}
+#endif
+
+// Everything a link can be refused for, checked before it takes a slot or any memory.
+static esp_err_t ppp_link_config_check(const ppp_link_config_t *config)
+{
     // Tx buffer needs to be able to contain at least 1 full frame.
-    assert(config.buffer.tx_buffer_size >= MAX_PPP_FRAME_SIZE);
+    assert(config->buffer.tx_buffer_size >= MAX_PPP_FRAME_SIZE);
 
-    ESP_ERROR_CHECK(uart_param_config(config.uart, &config.uart_config));
+    if (config->fec.enabled && !ppp_fec_params_valid(config->fec.block_size, config->fec.parity)) {
+        ESP_LOGE(TAG, "Invalid FEC block size %d with parity %d", config->fec.block_size, config->fec.parity);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config->arq.enabled && (config->arq.window < 1 || config->arq.window > PPP_ARQ_MAX_WINDOW)) {
+        ESP_LOGE(TAG, "Invalid retransmission window %d", config->arq.window);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config->ipv4.header_compression && (config->ipv4.contexts < 1 || config->ipv4.contexts > PPP_ROHC_MAX_CONTEXTS)) {
+        ESP_LOGE(TAG, "Invalid number of header compression contexts %d", config->ipv4.contexts);
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    ESP_ERROR_CHECK(uart_set_pin(config.uart, config.io.tx, config.io.rx, config.io.rts, config.io.cts));
+#if !PPP_IPV6_SUPPORT
+    if (config->ipv6.header_compression) {
+        ESP_LOGE(TAG, "IPv6 header compression needs CONFIG_LWIP_PPP_ENABLE_IPV6");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
 
-    ESP_ERROR_CHECK(
-        uart_driver_install(config.uart, config.buffer.rx_buffer_size, config.buffer.tx_buffer_size, config.buffer.rx_queue_size, &uart_event_queue, 0));
+    if (!ppp_link_core_valid(config->task.core) ||
+        (config->task.pipeline.enabled && (!ppp_link_core_valid(config->task.pipeline.core) || config->task.pipeline.frames < 1 ||
+                                           (config->task.pipeline.frames & (config->task.pipeline.frames - 1)) != 0))) {
+        ESP_LOGE(TAG, "Invalid task configuration");
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    ESP_ERROR_CHECK(uart_set_rx_timeout(config.uart, 1));
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    return ppp_link_static_check(config);
+#else
+    return ESP_OK;
+#endif
+}
+
+// Takes a free slot for a link on uart, the slot is given back with ppp_link_discard() if the link can not be set up.
+static esp_err_t ppp_link_new(uart_port_t uart, ppp_link_t **_link)
+{
+    ppp_link_t *link = NULL;
+    esp_err_t err = ESP_ERR_NO_MEM;
+    int index = -1;
+
+    portENTER_CRITICAL(&links_lock);
+    for (int i = 0; i < CONFIG_PPP_LINK_MAX_LINKS; i++) {
+        if (link_slots_taken & (1u << i)) {
+            if (link_slot_uart[i] == uart) {
+                index = -1;
+                err = ESP_ERR_INVALID_STATE;
+                break;
+            }
+        } else if (index < 0) {
+            index = i;
+        }
+    }
+    if (index >= 0) {
+        link_slots_taken |= 1u << index;
+        link_slot_uart[index] = uart;
+    }
+    portEXIT_CRITICAL(&links_lock);
+    if (index < 0) {
+        if (err == ESP_ERR_INVALID_STATE) {
+            ESP_LOGE(TAG, "Uart %d already has a link", uart);
+        } else {
+            ESP_LOGE(TAG, "No room for another link, see CONFIG_PPP_LINK_MAX_LINKS");
+        }
+        return err;
+    }
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    // The slot may have held a link that failed to start
+    link = &static_links[index];
+    memset(link, 0, sizeof(ppp_link_t));
+#else
+    link = calloc(1, sizeof(ppp_link_t));
+    if (!link) {
+        portENTER_CRITICAL(&links_lock);
+        link_slots_taken &= ~(1u << index);
+        portEXIT_CRITICAL(&links_lock);
+        ESP_LOGE(TAG, "No memory for link");
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    link->index = index;
+    link->tx_at_frame_boundary = true;
+    link->current_phase = PPP_PHASE_DEAD;
+    link->ip6_global_index = -1;
+    portMUX_INITIALIZE(&link->uart_intr_lock);
+    snprintf(link->if_key, sizeof(link->if_key), "PPP_%d", index);
+    snprintf(link->if_desc, sizeof(link->if_desc), "ppp%d", index);
+    *_link = link;
+    return ESP_OK;
+}
 
-    ESP_ERROR_CHECK(uart_set_rx_full_threshold(config.uart, 64));
+// Undoes a ppp_link_init() that failed part way: frees what it allocated and gives back the slot.
+static void ppp_link_discard(ppp_link_t *link)
+{
+    if (link->uart_intr) {
+        esp_intr_free(link->uart_intr);
+    }
+    if (link->tx_lock) {
+        vSemaphoreDelete(link->tx_lock);
+    }
+    PPP_LINK_FREE(link->uart_rx_ring.buffer);
+    PPP_LINK_FREE(link->uart_tx_ring.buffer);
+    PPP_LINK_FREE(link->arq.slots[0].frame); // The retransmission window
+    PPP_LINK_FREE(link->tx_frame);
+    PPP_LINK_FREE(link->arq_frame);
+    PPP_LINK_FREE(link->arq_encoded);
+    PPP_LINK_FREE(link->rx_pool.memory);
+    PPP_LINK_FREE(link->rx_ring.buffer);
+    PPP_LINK_FREE(link->rx_ring.lens);
+    PPP_LINK_FREE(link->hc_frame);
+    PPP_LINK_FREE(link->hc_encoded);
 
-    ESP_ERROR_CHECK(esp_event_handler_register(NETIF_PPP_STATUS, ESP_EVENT_ANY_ID, &on_ppp_changed, NULL));
+    portENTER_CRITICAL(&links_lock);
+    link_slots_taken &= ~(1u << link->index);
+    portEXIT_CRITICAL(&links_lock);
+    PPP_LINK_FREE(link);
+}
 
-    BaseType_t ret = xTaskCreate(ppp_task_thread, "ppp_task", config.task.stack_size, NULL, config.task.prio, NULL);
+esp_err_t ppp_link_init(const ppp_link_config_t *_config, ppp_link_t **_link)
+{
+    ppp_link_t *link;
+    esp_err_t err = ppp_link_config_check(_config);
+
+    if (err == ESP_OK) {
+        err = ppp_link_new(_config->uart, &link);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    link->config = *_config;
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+    ESP_LOGI(TAG, "%u bytes statically allocated", PPP_LINK_STATIC_RAM);
+    link->tx_lock = xSemaphoreCreateMutexStatic(&static_tx_lock[link->index]);
+#else
+    link->tx_lock = xSemaphoreCreateMutex();
+#endif
+    assert(link->tx_lock);
+
+    ppp_hdlc_decoder_init(&link->rx_decoder, link->rx_frame, sizeof(link->rx_frame), on_rx_frame, link);
+    ppp_mru_init(&link->mru, &link->config, ppp_link_line_rate(&link->config.uart_config));
+    ppp_lqm_init(&link->lqm, &link->config);
+    if (link->config.fec.enabled) {
+        ppp_fec_encoder_init(&link->fec_encoder, link->config.fec.block_size, link->config.fec.parity);
+        ppp_fec_decoder_init(&link->fec_decoder, ppp_link_fec_output, link);
+    }
+    if (link->config.arq.enabled) {
+        uint8_t *window = PPP_LINK_ALLOC(static_arq_window, link->config.arq.window * MAX_PPP_FRAME_SIZE);
+        link->tx_frame = PPP_LINK_ALLOC(static_tx_frame, MAX_PPP_FRAME_SIZE);
+        link->arq_frame = PPP_LINK_ALLOC(static_arq_frame, PPP_LINK_ARQ_HEADER_LEN + MAX_PPP_FRAME_SIZE);
+        link->arq_encoded = PPP_LINK_ALLOC(static_arq_encoded, PPP_HDLC_ENCODED_MAX(PPP_LINK_ARQ_HEADER_LEN + MAX_PPP_FRAME_SIZE));
+        if (!window || !link->tx_frame || !link->arq_frame || !link->arq_encoded) {
+            ESP_LOGE(TAG, "No memory for retransmission window");
+            PPP_LINK_FREE(window);
+            err = ESP_ERR_NO_MEM;
+            goto fail;
+        }
+        ppp_hdlc_decoder_init(&link->tx_decoder, link->tx_frame, MAX_PPP_FRAME_SIZE, on_tx_frame, link);
+        ppp_arq_init(&link->arq, window, MAX_PPP_FRAME_SIZE, link->config.arq.window, link->config.arq.max_retries);
+    } else {
+        // Still acknowledge numbered frames from a peer that wants them
+        ppp_arq_init(&link->arq, NULL, 0, 0, 0);
+    }
+    if (link->config.rx_pool.frames > 0) {
+        uint8_t *memory = PPP_LINK_ALLOC(static_rx_pool, link->config.rx_pool.frames * PPP_POOL_BUFFER_SIZE(MAX_PPP_FRAME_SIZE));
+        if (!memory) {
+            ESP_LOGE(TAG, "No memory for receive pool");
+            err = ESP_ERR_NO_MEM;
+            goto fail;
+        }
+        ppp_pool_init(&link->rx_pool, memory, link->config.rx_pool.frames, MAX_PPP_FRAME_SIZE);
+    }
+    if (link->config.task.pipeline.enabled) {
+        uint8_t *frames = PPP_LINK_ALLOC(static_pipeline_frames, link->config.task.pipeline.frames * MAX_PPP_FRAME_SIZE);
+        uint16_t *lens = PPP_LINK_ALLOC(static_pipeline_lens, link->config.task.pipeline.frames * sizeof(uint16_t));
+        if (!frames || !lens) {
+            ESP_LOGE(TAG, "No memory for receive pipeline");
+            PPP_LINK_FREE(frames);
+            PPP_LINK_FREE(lens);
+            err = ESP_ERR_NO_MEM;
+            goto fail;
+        }
+        ppp_frame_ring_init(&link->rx_ring, frames, lens, link->config.task.pipeline.frames, MAX_PPP_FRAME_SIZE);
+    }
+    ppp_rohc_init(&link->rohc, link->config.ipv4.contexts);
+    if (link->config.ipv4.header_compression || link->config.ipv6.header_compression) {
+        link->hc_frame = PPP_LINK_ALLOC(static_hc_frame, MAX_PPP_FRAME_SIZE);
+        link->hc_encoded = PPP_LINK_ALLOC(static_hc_encoded, PPP_HDLC_ENCODED_MAX(MAX_PPP_FRAME_SIZE));
+        if (!link->hc_frame || !link->hc_encoded) {
+            ESP_LOGE(TAG, "No memory for header compression");
+            err = ESP_ERR_NO_MEM;
+            goto fail;
+        }
+    }
+
+#ifdef CONFIG_PPP_SERVER_SUPPORT
+    if (link->config.type == PPP_LINK_SERVER && link->config.ppp_server.remote_pool &&
+        ppp_link_pool_take(link->config.ppp_server.remote_pool, &link->config.ppp_server.remoteaddr) != ESP_OK) {
+        ESP_LOGE(TAG, "Address pool exhausted");
+        err = ESP_ERR_NOT_FOUND;
+        goto fail;
+    }
+    const esp_ip6_addr_t *prefix = &link->config.ppp_server.ip6_prefix;
+    if (link->config.type == PPP_LINK_SERVER && (prefix->addr[0] || prefix->addr[1])) {
+        // A /64 per link, so routes to the clients do not overlap
+        memcpy(link->ip6_prefix, prefix->addr, sizeof(link->ip6_prefix));
+        uint16_t subnet = ((link->ip6_prefix[6] << 8) | link->ip6_prefix[7]) + link->index;
+        link->ip6_prefix[6] = subnet >> 8;
+        link->ip6_prefix[7] = subnet;
+        link->ip6_prefix_known = true;
+    }
+#endif
+
+    ESP_ERROR_CHECK(uart_param_config(link->config.uart, &link->config.uart_config));
+
+    ESP_ERROR_CHECK(uart_set_pin(link->config.uart, link->config.io.tx, link->config.io.rx, link->config.io.rts, link->config.io.cts));
+
+    if (link->config.direct.enabled) {
+        err = ppp_link_direct_init(link);
+        if (err != ESP_OK) {
+#ifdef CONFIG_PPP_SERVER_SUPPORT
+            if (link->config.type == PPP_LINK_SERVER && link->config.ppp_server.remote_pool) {
+                ppp_link_pool_give(link->config.ppp_server.remote_pool, &link->config.ppp_server.remoteaddr);
+            }
+#endif
+            goto fail;
+        }
+    } else {
+        ESP_ERROR_CHECK(uart_driver_install(link->config.uart, link->config.buffer.rx_buffer_size, link->config.buffer.tx_buffer_size, link->config.buffer.rx_queue_size,
+                                            &link->uart_event_queue, PPP_LINK_UART_INTR_FLAGS));
+
+        ESP_ERROR_CHECK(uart_set_rx_timeout(link->config.uart, 1));
+
+        ESP_ERROR_CHECK(uart_set_rx_full_threshold(link->config.uart, 64));
+    }
+
+    ESP_ERROR_CHECK(esp_event_handler_register(NETIF_PPP_STATUS, ESP_EVENT_ANY_ID, &on_ppp_changed, link));
+
+#ifdef CONFIG_PPP_LINK_STATIC_ALLOCATION
+#if CONFIG_PPP_LINK_STATIC_PIPELINE_FRAMES > 0
+    if (link->config.task.pipeline.enabled) {
+        link->rx_task = xTaskCreateStaticPinnedToCore(ppp_rx_task_thread, "ppp_rx_task", link->config.task.pipeline.stack_size, link, link->config.task.pipeline.prio,
+                                                      static_rx_task_stack[link->index], &static_rx_task[link->index], link->config.task.pipeline.core);
+        assert(link->rx_task);
+    }
+#endif
+    TaskHandle_t task = xTaskCreateStaticPinnedToCore(ppp_task_thread, "ppp_task", link->config.task.stack_size, link, link->config.task.prio,
+                                                      static_task_stack[link->index], &static_task[link->index], link->config.task.core);
+    assert(task);
+#else
+    BaseType_t ret;
+    if (link->config.task.pipeline.enabled) {
+        ret = xTaskCreatePinnedToCore(ppp_rx_task_thread, "ppp_rx_task", link->config.task.pipeline.stack_size, link, link->config.task.pipeline.prio, &link->rx_task,
+                                      link->config.task.pipeline.core);
+        assert(ret == pdTRUE);
+    }
+    ret = xTaskCreatePinnedToCore(ppp_task_thread, "ppp_task", link->config.task.stack_size, link, link->config.task.prio, NULL, link->config.task.core);
     assert(ret == pdTRUE);
+#endif
+
+    // Published last, the accessors below only see links that are fully set up
+    portENTER_CRITICAL(&links_lock);
+    links[link->index] = link;
+    portEXIT_CRITICAL(&links_lock);
+    if (_link) {
+        *_link = link;
+    }
+    return ESP_OK;
+
+fail:
+    ppp_link_discard(link);
+    return err;
+}
+
+ppp_link_t *ppp_link_get(int index)
+{
+    ppp_link_t *link = NULL;
+
+    if (index >= 0 && index < CONFIG_PPP_LINK_MAX_LINKS) {
+        portENTER_CRITICAL(&links_lock);
+        link = links[index];
+        portEXIT_CRITICAL(&links_lock);
+    }
+    return link;
+}
 
+esp_netif_t *ppp_link_get_netif(ppp_link_t *link)
+{
+    return link ? link->esp_netif : NULL;
+}
+
+esp_err_t ppp_link_get_stats(ppp_link_t *link, ppp_link_stats_t *_stats)
+{
+    if (!link || !_stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *_stats = link->stats;
+    _stats->uart = link->config.uart;
+    _stats->mru = link->mru.current;
+    _stats->mru_changes = link->mru.changes;
+    _stats->goodput_bps = link->mru.goodput_bps;
+    _stats->bit_error_rate = link->mru.bit_error_rate;
+    _stats->fec.tx_active = link->tx_fec;
+    _stats->fec.rx_blocks = link->fec_decoder.stats.blocks;
+    _stats->fec.corrected_blocks = link->fec_decoder.stats.corrected_blocks;
+    _stats->fec.corrected_bytes = link->fec_decoder.stats.corrected_bytes;
+    _stats->fec.uncorrectable_blocks = link->fec_decoder.stats.uncorrectable_blocks;
+    _stats->arq.tx_active = link->tx_arq;
+    _stats->arq.tx_frames = link->arq.stats.tx_frames;
+    _stats->arq.retransmissions = link->arq.stats.retransmissions;
+    _stats->arq.timeouts = link->arq.stats.timeouts;
+    _stats->arq.failed = link->arq.stats.failed;
+    _stats->arq.recovered = link->arq.stats.recovered;
+    _stats->arq.recovery_avg_us = link->arq.stats.recovered ? link->arq.stats.recovery_time_us / link->arq.stats.recovered : 0;
+    _stats->arq.recovery_max_us = link->arq.stats.max_recovery_time_us;
+    _stats->arq.rtt_us = link->arq.srtt_us;
+    _stats->arq.rx_frames = link->arq.stats.rx_frames;
+    _stats->arq.rx_duplicates = link->arq.stats.rx_duplicates;
+    _stats->arq.rx_out_of_order = link->arq.stats.rx_out_of_order;
+    _stats->iphc.tx_active = link->tx_iphc;
+    _stats->rohc.tx_active = atomic_load_explicit(&link->tx_rohc, memory_order_relaxed);
+    _stats->rohc.tx_packets = link->rohc.stats.tx_packets;
+    _stats->rohc.tx_ir = link->rohc.stats.tx_ir;
+    _stats->rohc.tx_evictions = link->rohc.stats.tx_evictions;
+    _stats->rohc.tx_saved_bytes = link->rohc.stats.tx_saved_bytes;
+    _stats->rohc.rx_packets = link->rohc.stats.rx_packets;
+    _stats->rohc.rx_errors = link->rohc.stats.rx_errors;
+    _stats->pipeline.active = link->config.task.pipeline.enabled;
+    _stats->direct.active = link->config.direct.enabled;
+    _stats->rx_alloc_avg_cycles = link->rx_allocs ? link->rx_alloc_cycles / link->rx_allocs : 0;
+    if (link->config.rx_pool.frames > 0) {
+        _stats->rx_pool.size = link->rx_pool.count;
+        _stats->rx_pool.free = link->rx_pool.free_count;
+        _stats->rx_pool.min_free = link->rx_pool.min_free;
+    }
+    return ESP_OK;
+}
+
+esp_err_t ppp_link_get_health(ppp_link_t *link, ppp_link_health_t *health)
+{
+    if (!link || !health) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *health = link->lqm.health;
+    health->link = link;
     return ESP_OK;
 }
@@ -1,12 +1,28 @@
 #ifndef __PPP_LINK_H_
 #define __PPP_LINK_H_
 
+#include "esp_event.h"
 #include "esp_netif.h"
 
 #include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "hal/gpio_types.h"
 
+typedef struct ppp_link_s ppp_link_t;
+
+#ifdef CONFIG_PPP_SERVER_SUPPORT
+#define PPP_LINK_ADDR_POOL_MAX 32
+
+// Consecutive remote addresses handed out to server links, one per link, in order.
+typedef struct {
+    esp_ip4_addr_t first;
+    int size;        // Addresses in the pool, at most PPP_LINK_ADDR_POOL_MAX
+    uint32_t in_use; // Bit i is set when first + i belongs to a link, start with 0
+} ppp_link_addr_pool_t;
+#endif
+
 struct ppp_link_config_s {
     enum {
         PPP_LINK_CLIENT,
@@ -27,19 +43,65 @@ struct ppp_link_config_s {
         int tx_buffer_size;
         int rx_queue_size;
     } buffer;
+    struct {
+        bool enabled; // Own the uart interrupt and pass data through lock free rings instead of the uart driver
+    } direct;
+    struct {
+        int frames; // Full size receive buffers lent to the ip stack, 0 to take every received frame from the heap
+    } rx_pool;
     struct {
         int stack_size;
         int prio;
+        int core; // Core of the task reading the uart, tskNO_AFFINITY to leave it to the scheduler
+        struct {
+            bool enabled;   // Only decode on the uart task and feed the ip stack from a second task
+            int core;       // Core of the second task, best the one the uart task is not on
+            int stack_size;
+            int prio;
+            int frames;     // Decoded frames buffered between the two tasks, a power of two
+        } pipeline;
     } task;
+    struct {
+        bool auto_tune;     // Ask the peer for smaller or larger frames depending on measured FCS error rate
+        int min;
+        int max;
+        int hold_time_s;    // Minimum time between two MRU changes
+        int hysteresis_pct; // Required goodput improvement before changing MRU
+    } mru;
+    struct {
+        bool enabled;   // Offer Reed-Solomon FEC below HDLC framing, used in each direction the peer supports it
+        int block_size; // Data bytes per block
+        int parity;     // Parity bytes per block, up to parity / 2 broken bytes are corrected
+    } fec;
+    struct {
+        bool enabled;    // Number sent frames and repeat the ones the peer did not receive, needs a ppp_link peer
+        int window;      // Frames kept for retransmission, at most 32, each takes a full frame of RAM
+        int max_retries; // Retransmissions before a frame is left to the end to end protocol
+    } arq;
+    struct {
+        bool enabled;    // Exchange link quality reports with a ppp_link peer and post PPP_LINK_EVENT_HEALTH_CHANGED
+        int interval_ms; // Time between two reports
+        int good_score;  // Health at or above this score is good
+        int bad_score;   // Health below this score is bad, anything in between is degraded
+    } lqm;
+    struct {
+        bool header_compression; // Compress IPv4 UDP headers to a ppp_link peer, see ppp_rohc.h
+        int contexts;            // UDP flows compressed at once, at most 16
+    } ipv4;
+    struct {
+        bool header_compression; // Compress IPv6 and UDP headers to a ppp_link peer, needs CONFIG_LWIP_PPP_ENABLE_IPV6
+    } ipv6;
 #ifdef CONFIG_PPP_SERVER_SUPPORT
     struct {
         esp_ip4_addr_t localaddr;
         esp_ip4_addr_t remoteaddr;
+        ppp_link_addr_pool_t *remote_pool; // Take remoteaddr from this pool instead, may be shared by several links
         esp_ip4_addr_t dnsaddr1;
         esp_ip4_addr_t dnsaddr2;
         const char *login;
         const char *password;
         int auth_req;
+        esp_ip6_addr_t ip6_prefix; // Each link gets this /64 with its index added, zero for link-local addresses only
     } ppp_server;
 #endif
 };
@@ -68,15 +130,181 @@ struct ppp_link_config_s {
         .tx_buffer_size = 2048,                     \
         .rx_queue_size = 30,                        \
     },                                              \
+    .direct = {                                     \
+        .enabled = false,                           \
+    },                                              \
+    .rx_pool = {                                    \
+        .frames = 0,                                \
+    },                                              \
     .task = {                                       \
         .stack_size = (3 * 1024),                   \
         .prio = 100,                                \
-    } \
+        .core = tskNO_AFFINITY,                     \
+        .pipeline = {                               \
+            .enabled = false,                       \
+            .core = tskNO_AFFINITY,                 \
+            .stack_size = (3 * 1024),               \
+            .prio = 100,                            \
+            .frames = 8,                            \
+        },                                          \
+    },                                              \
+    .mru = {                                        \
+        .auto_tune = false,                         \
+        .min = 256,                                 \
+        .max = 1500,                                \
+        .hold_time_s = 60,                          \
+        .hysteresis_pct = 10,                       \
+    },                                              \
+    .fec = {                                        \
+        .enabled = false,                           \
+        .block_size = 128,                          \
+        .parity = 8,                                \
+    },                                              \
+    .arq = {                                        \
+        .enabled = false,                           \
+        .window = 8,                                \
+        .max_retries = 4,                           \
+    },                                              \
+    .lqm = {                                        \
+        .enabled = false,                           \
+        .interval_ms = 1000,                        \
+        .good_score = 80,                           \
+        .bad_score = 50,                            \
+    },                                              \
+    .ipv4 = {                                       \
+        .header_compression = false,                \
+        .contexts = 8,                              \
+    },                                              \
+    .ipv6 = {                                       \
+        .header_compression = false,                \
+    }                                               \
 };
 // clang-format on
 
 typedef struct ppp_link_config_s ppp_link_config_t;
 
-esp_err_t ppp_link_init(const ppp_link_config_t *ppp_link_config);
+// Received frames are counted per size bucket, bucket i holds frames shorter than PPP_LINK_FRAME_BUCKET_LIMIT(i).
+// The last bucket holds everything larger.
+#define PPP_LINK_FRAME_BUCKETS 6
+#define PPP_LINK_FRAME_BUCKET_LIMIT(i) (64 << (i))
+
+struct ppp_link_stats_s {
+    uart_port_t uart;
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t tx_frames;
+    uint32_t rx_frames;
+    uint32_t rx_fcs_errors;
+    uint32_t rx_dropped;   // Good frames the ip stack had no room for
+    uint32_t rx_overflows; // Uart FIFO or ring buffer overflows, received data was lost
+    uint32_t rx_alloc_avg_cycles; // CPU cycles to get a pbuf for a received frame
+    uint32_t rx_alloc_max_cycles;
+    struct {
+        uint32_t frames;
+        uint32_t fcs_errors;
+    } rx_size[PPP_LINK_FRAME_BUCKETS];
+    uint16_t mru;          // MRU currently requested from the peer
+    uint32_t mru_changes;
+    uint32_t goodput_bps;  // Estimated TCP payload rate at the current MRU and error rate
+    float bit_error_rate;
+    struct {
+        bool tx_active;                // Sending FEC blocks, the peer has agreed
+        uint32_t tx_blocks;
+        uint32_t rx_blocks;
+        uint32_t corrected_blocks;
+        uint32_t corrected_bytes;
+        uint32_t uncorrectable_blocks; // Each one costs at least one frame
+    } fec;
+    struct {
+        bool tx_active;           // Sending numbered frames, the peer has agreed
+        uint32_t tx_frames;
+        uint32_t retransmissions;
+        uint32_t timeouts;        // Retransmissions after timeout, the rest were triggered by a later acknowledge
+        uint32_t failed;          // Frames given up after max retries
+        uint32_t unprotected;     // Frames sent unnumbered because the window was full
+        uint32_t recovered;       // Frames that arrived after one or more retransmissions
+        uint32_t recovery_avg_us; // Extra latency of recovered frames, from first transmission to acknowledge
+        uint32_t recovery_max_us;
+        uint32_t rtt_us;          // Smoothed link round trip time
+        uint32_t rx_frames;
+        uint32_t rx_duplicates;
+        uint32_t rx_out_of_order;
+    } arq;
+    struct {
+        bool active;
+        uint32_t frames;     // Frames handed from the uart task to the ip stack task
+        uint32_t ring_full;  // Frames dropped because the ip stack task fell behind
+        uint32_t max_queued; // Most frames waiting at once
+    } pipeline;
+    struct {
+        bool active;
+        uint32_t interrupts;
+        uint32_t wakeups;      // Times the ppp task was woken for received data
+        uint32_t rx_max_fill;  // Most bytes waiting for the ppp task
+        uint32_t rx_throttled; // Times the receive ring filled up and flow control held the peer back
+    } direct;
+    struct {
+        uint32_t size;
+        uint32_t free;
+        uint32_t min_free;
+        uint32_t misses; // Frames that found the pool empty and were copied to a heap pbuf
+    } rx_pool;
+    struct {
+        bool tx_active;          // Sending compressed headers, the peer has agreed
+        uint32_t tx_packets;
+        uint32_t tx_saved_bytes; // Header bytes not sent
+        uint32_t rx_packets;
+        uint32_t rx_errors;      // Compressed packets that could not be rebuilt
+    } iphc;
+    struct {
+        bool tx_active;          // Sending compressed headers, the peer has agreed
+        uint32_t tx_packets;     // UDP packets sent with a context, full headers included
+        uint32_t tx_ir;          // Packets that carried the full header to set up or refresh a context
+        uint32_t tx_evictions;   // Flows that took over the context of the least recently used one
+        uint32_t tx_saved_bytes; // Header bytes not sent
+        uint32_t rx_packets;
+        uint32_t rx_errors;      // Packets dropped for an unknown or outdated context
+    } rohc;
+};
+
+typedef struct ppp_link_stats_s ppp_link_stats_t;
+
+ESP_EVENT_DECLARE_BASE(PPP_LINK_EVENT);
+
+typedef enum {
+    PPP_LINK_EVENT_HEALTH_CHANGED, // The health level changed, event data is a ppp_link_health_t
+} ppp_link_event_t;
+
+typedef enum {
+    PPP_LINK_HEALTH_UNKNOWN, // No reports from the peer yet
+    PPP_LINK_HEALTH_GOOD,
+    PPP_LINK_HEALTH_DEGRADED, // Time to back off bulk transfers
+    PPP_LINK_HEALTH_BAD,
+} ppp_link_health_level_t;
+
+struct ppp_link_health_s {
+    ppp_link_t *link;
+    int score; // 0 to 100
+    ppp_link_health_level_t level;
+    uint32_t rtt_us;
+    uint16_t loss_in_permille; // Frames sent by the peer that did not arrive intact
+    uint16_t loss_out_permille;
+    uint16_t errors_in_permille; // Frames that arrived with a broken FCS
+    uint16_t errors_out_permille;
+};
+
+typedef struct ppp_link_health_s ppp_link_health_t;
+
+// Starts a link on its own uart, up to CONFIG_PPP_LINK_MAX_LINKS links run side by side. Link may be NULL.
+esp_err_t ppp_link_init(const ppp_link_config_t *ppp_link_config, ppp_link_t **link);
+
+// Link number index in the order they were started, NULL when there is no such link.
+ppp_link_t *ppp_link_get(int index);
+
+esp_netif_t *ppp_link_get_netif(ppp_link_t *link);
+
+esp_err_t ppp_link_get_stats(ppp_link_t *link, ppp_link_stats_t *stats);
+
+esp_err_t ppp_link_get_health(ppp_link_t *link, ppp_link_health_t *health);
 
 #endif /* __PPP_LINK_H_ */
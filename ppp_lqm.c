@@ -0,0 +1,165 @@
+#include "ppp_lqm.h"
+#include <string.h>
+#include <sys/param.h>
+
+// Missing this many reports in a row means the link is gone, whatever LCP thinks.
+#define PPP_LQM_SILENT_INTERVALS 3
+#define PPP_LQM_HYSTERESIS 5
+// Weight of a new sample in the smoothed loss and error rates
+#define PPP_LQM_ALPHA 0.25f
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void ppp_lqm_init(ppp_lqm_t *lqm, const ppp_link_config_t *config)
+{
+    memset(lqm, 0, sizeof(*lqm));
+    lqm->interval_us = (int64_t)MAX(config->lqm.interval_ms, 100) * 1000;
+    lqm->good_score = config->lqm.good_score;
+    lqm->bad_score = config->lqm.bad_score;
+    ppp_lqm_reset(lqm);
+}
+
+void ppp_lqm_reset(ppp_lqm_t *lqm)
+{
+    lqm->last_tx_us = 0;
+    lqm->last_rx_us = 0;
+    lqm->peer_timestamp_ms = 0;
+    lqm->have_previous = false;
+    lqm->min_rtt_us = 0;
+    lqm->reports = 0;
+    memset(&lqm->health, 0, sizeof(lqm->health));
+    lqm->health.level = PPP_LINK_HEALTH_UNKNOWN;
+}
+
+bool ppp_lqm_report_due(const ppp_lqm_t *lqm, int64_t now_us)
+{
+    return now_us - lqm->last_tx_us >= lqm->interval_us;
+}
+
+void ppp_lqm_build_report(ppp_lqm_t *lqm, int64_t now_us, uint32_t out_frames, uint8_t *out)
+{
+    uint32_t held_ms = lqm->peer_timestamp_ms ? (now_us - lqm->peer_timestamp_rx_us) / 1000 : 0;
+
+    put_u32(&out[0], out_frames);
+    // Zero means no timestamp, so skip it when the clock wraps
+    put_u32(&out[4], MAX((uint32_t)(now_us / 1000), 1));
+    put_u32(&out[8], lqm->peer_timestamp_ms);
+    put_u32(&out[12], held_ms);
+    out[16] = lqm->health.loss_in_permille >> 8;
+    out[17] = lqm->health.loss_in_permille;
+    out[18] = lqm->health.errors_in_permille >> 8;
+    out[19] = lqm->health.errors_in_permille;
+    lqm->last_tx_us = now_us;
+}
+
+static ppp_link_health_level_t ppp_lqm_level(const ppp_lqm_t *lqm, int score)
+{
+    ppp_link_health_level_t level = lqm->health.level;
+    // Moving up a level needs a few points more than moving down, so a score at a threshold does not flap.
+    int margin = level == PPP_LINK_HEALTH_UNKNOWN ? 0 : PPP_LQM_HYSTERESIS;
+
+    if (score >= lqm->good_score + (level == PPP_LINK_HEALTH_GOOD ? 0 : margin)) {
+        return PPP_LINK_HEALTH_GOOD;
+    }
+    if (score >= lqm->bad_score + (level == PPP_LINK_HEALTH_BAD ? margin : 0)) {
+        return PPP_LINK_HEALTH_DEGRADED;
+    }
+    return PPP_LINK_HEALTH_BAD;
+}
+
+static bool ppp_lqm_update(ppp_lqm_t *lqm)
+{
+    ppp_link_health_t *health = &lqm->health;
+    float loss = MAX(health->loss_in_permille, health->loss_out_permille) / 1000.0f;
+
+    // A quarter of the frames lost makes the link useless for anything but keepalives.
+    float score = 100.0f * (1.0f - MIN(loss * 4, 1.0f));
+    if (lqm->min_rtt_us > 0 && health->rtt_us > 2 * lqm->min_rtt_us) {
+        // Queues building up, up to half the score once the round trip is ten times the best seen.
+        float excess = (float)health->rtt_us / lqm->min_rtt_us - 2;
+        score *= 1.0f - MIN(excess / 16, 0.5f);
+    }
+    health->score = score;
+
+    ppp_link_health_level_t level = ppp_lqm_level(lqm, health->score);
+    if (level == health->level) {
+        return false;
+    }
+    health->level = level;
+    return true;
+}
+
+static uint16_t ppp_lqm_smooth(uint16_t permille, float sample, bool first)
+{
+    float value = first ? sample : permille / 1000.0f * (1 - PPP_LQM_ALPHA) + sample * PPP_LQM_ALPHA;
+    return MIN(value, 1.0f) * 1000 + 0.5f;
+}
+
+bool ppp_lqm_on_report(ppp_lqm_t *lqm, const uint8_t *report, size_t len, int64_t now_us, uint32_t in_good, uint32_t in_errors)
+{
+    ppp_link_health_t *health = &lqm->health;
+
+    if (len < PPP_LQM_REPORT_LEN) {
+        return false;
+    }
+    uint32_t peer_out = get_u32(&report[0]);
+    uint32_t echo_ms = get_u32(&report[8]);
+    uint32_t held_ms = get_u32(&report[12]);
+
+    lqm->last_rx_us = now_us;
+    lqm->peer_timestamp_ms = get_u32(&report[4]);
+    lqm->peer_timestamp_rx_us = now_us;
+    lqm->reports++;
+
+    if (echo_ms) {
+        uint32_t rtt_ms = (uint32_t)(now_us / 1000) - echo_ms - held_ms;
+        if (rtt_ms < 60 * 1000) {
+            health->rtt_us = rtt_ms * 1000;
+            if (lqm->min_rtt_us == 0 || health->rtt_us < lqm->min_rtt_us) {
+                lqm->min_rtt_us = MAX(health->rtt_us, 1000);
+            }
+        }
+    }
+
+    // The peer measures what we send
+    health->loss_out_permille = (report[16] << 8) | report[17];
+    health->errors_out_permille = (report[18] << 8) | report[19];
+
+    if (lqm->have_previous && peer_out != lqm->previous_peer_out) {
+        uint32_t sent = peer_out - lqm->previous_peer_out;
+        uint32_t good = in_good - lqm->previous_in_good;
+        uint32_t errors = in_errors - lqm->previous_in_errors;
+        bool first = lqm->reports <= 2;
+
+        health->loss_in_permille = ppp_lqm_smooth(health->loss_in_permille, good < sent ? 1.0f - (float)good / sent : 0, first);
+        health->errors_in_permille = ppp_lqm_smooth(health->errors_in_permille, good + errors ? (float)errors / (good + errors) : 0, first);
+    }
+    lqm->have_previous = true;
+    lqm->previous_peer_out = peer_out;
+    lqm->previous_in_good = in_good;
+    lqm->previous_in_errors = in_errors;
+
+    return ppp_lqm_update(lqm);
+}
+
+bool ppp_lqm_poll(ppp_lqm_t *lqm, int64_t now_us)
+{
+    if (lqm->last_rx_us == 0 || now_us - lqm->last_rx_us < PPP_LQM_SILENT_INTERVALS * lqm->interval_us) {
+        return false;
+    }
+    // Count every missed interval as lost reports until the peer is heard again.
+    lqm->last_rx_us = now_us - (PPP_LQM_SILENT_INTERVALS - 1) * lqm->interval_us;
+    lqm->health.loss_in_permille = ppp_lqm_smooth(lqm->health.loss_in_permille, 1.0f, false);
+    return ppp_lqm_update(lqm);
+}
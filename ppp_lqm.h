@@ -0,0 +1,66 @@
+#ifndef __PPP_LQM_H_
+#define __PPP_LQM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ppp_link.h"
+
+/**
+ * Link quality monitoring in the spirit of RFC 1989.
+ *
+ * Both ends periodically send a report with the number of frames sent so far,
+ * a timestamp, the last timestamp received from the peer with the time it was
+ * held, and the inbound loss and error rate measured by the sender. Comparing
+ * the frames the peer claims to have sent with the frames that arrived gives
+ * the inbound loss, the peer's report gives the outbound loss, and the echoed
+ * timestamp gives the round trip time.
+ *
+ * These are summarised as a health score from 0 to 100 and a level, with a
+ * few points of hysteresis between the levels.
+ */
+
+#define PPP_LQM_REPORT_LEN 20
+
+typedef struct {
+    int64_t interval_us;
+    int good_score;
+    int bad_score;
+
+    int64_t last_tx_us;
+    int64_t last_rx_us;
+    uint32_t peer_timestamp_ms; // Last timestamp from the peer, echoed back in the next report
+    int64_t peer_timestamp_rx_us;
+
+    bool have_previous;
+    uint32_t previous_peer_out;
+    uint32_t previous_in_good;
+    uint32_t previous_in_errors;
+
+    uint32_t min_rtt_us;
+    uint32_t reports;
+    ppp_link_health_t health;
+} ppp_lqm_t;
+
+void ppp_lqm_init(ppp_lqm_t *lqm, const ppp_link_config_t *config);
+
+// Forget the peer, used when the link restarts.
+void ppp_lqm_reset(ppp_lqm_t *lqm);
+
+bool ppp_lqm_report_due(const ppp_lqm_t *lqm, int64_t now_us);
+
+// Write a report to out, which must hold PPP_LQM_REPORT_LEN bytes. out_frames counts frames sent before this one.
+void ppp_lqm_build_report(ppp_lqm_t *lqm, int64_t now_us, uint32_t out_frames, uint8_t *out);
+
+/**
+ * Account a report from the peer, with the number of good and broken frames
+ * received so far including this one. Returns true when the health level has
+ * changed.
+ */
+bool ppp_lqm_on_report(ppp_lqm_t *lqm, const uint8_t *report, size_t len, int64_t now_us, uint32_t in_good, uint32_t in_errors);
+
+// Returns true when the health level has changed because the peer went silent.
+bool ppp_lqm_poll(ppp_lqm_t *lqm, int64_t now_us);
+
+#endif /* __PPP_LQM_H_ */
@@ -0,0 +1,119 @@
+#include "ppp_mru.h"
+#include <math.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define PPP_MRU_EVAL_PERIOD_US (5 * 1000 * 1000)
+#define PPP_MRU_MIN_SAMPLES 50
+#define PPP_MRU_STEP 64
+#define PPP_MRU_LOWEST 128 // PPP_MINMRU, anything smaller is not allowed by LCP
+
+// Flag, address, control, protocol and FCS sent around every frame.
+#define PPP_MRU_FRAME_OVERHEAD 7
+// IPv4 and TCP headers carried in every frame, this is what makes small frames expensive.
+#define PPP_MRU_HEADER_OVERHEAD 40
+
+int ppp_mru_bucket(size_t frame_len)
+{
+    int bucket = 0;
+    while (bucket < PPP_LINK_FRAME_BUCKETS - 1 && frame_len >= PPP_LINK_FRAME_BUCKET_LIMIT(bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void ppp_mru_init(ppp_mru_t *mru, const ppp_link_config_t *config, uint32_t line_rate_bps)
+{
+    memset(mru, 0, sizeof(*mru));
+    mru->auto_tune = config->mru.auto_tune;
+    mru->max = config->mru.max > 0 ? MIN(config->mru.max, 1500) : 1500;
+    mru->min = MIN(MAX(config->mru.min, PPP_MRU_LOWEST), mru->max);
+    mru->current = mru->max;
+    mru->line_rate_bps = line_rate_bps;
+    mru->hold_time_us = (int64_t)config->mru.hold_time_s * 1000 * 1000;
+    mru->hysteresis_pct = config->mru.hysteresis_pct;
+    mru->goodput_bps = line_rate_bps;
+}
+
+void ppp_mru_account(ppp_mru_t *mru, size_t frame_len, bool fcs_ok)
+{
+    ppp_mru_bucket_t *bucket = &mru->window[ppp_mru_bucket(frame_len)];
+
+    bucket->frames++;
+    bucket->bytes += frame_len;
+    if (!fcs_ok) {
+        bucket->errors++;
+    }
+}
+
+// Expected fraction of the line rate carrying TCP payload for a given MRU.
+static float ppp_mru_efficiency(uint16_t mru, float ber)
+{
+    float wire_bits = 8.0f * (mru + PPP_MRU_FRAME_OVERHEAD);
+    float payload = mru - PPP_MRU_HEADER_OVERHEAD;
+
+    return payload * 8.0f / wire_bits * expf(wire_bits * log1pf(-ber));
+}
+
+bool ppp_mru_poll(ppp_mru_t *mru, int64_t now_us)
+{
+    if (now_us - mru->last_eval_us < PPP_MRU_EVAL_PERIOD_US) {
+        return false;
+    }
+    mru->last_eval_us = now_us;
+
+    uint32_t frames = 0;
+    uint32_t errors = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < PPP_LINK_FRAME_BUCKETS; i++) {
+        frames += mru->window[i].frames;
+        errors += mru->window[i].errors;
+        bytes += mru->window[i].bytes;
+    }
+    if (frames < PPP_MRU_MIN_SAMPLES) {
+        return false;
+    }
+
+    // Maximum likelihood estimate from the frame error rate at the average frame size.
+    float frame_error_rate = MIN((float)errors / frames, 0.99f);
+    float bits_per_frame = MAX(8.0f * bytes / frames, 8.0f);
+    mru->bit_error_rate = -expm1f(log1pf(-frame_error_rate) / bits_per_frame);
+
+    // Age the window so the estimate follows changes in line quality.
+    for (int i = 0; i < PPP_LINK_FRAME_BUCKETS; i++) {
+        mru->window[i].frames /= 2;
+        mru->window[i].errors /= 2;
+        mru->window[i].bytes /= 2;
+    }
+
+    float current = ppp_mru_efficiency(mru->current, mru->bit_error_rate);
+    mru->goodput_bps = mru->line_rate_bps * current;
+
+    if (!mru->auto_tune || (mru->changes && now_us - mru->last_change_us < mru->hold_time_us)) {
+        return false;
+    }
+
+    uint16_t best_mru = mru->current;
+    float best = current;
+    for (int candidate = mru->min;; candidate += PPP_MRU_STEP) {
+        candidate = MIN(candidate, mru->max);
+        float efficiency = ppp_mru_efficiency(candidate, mru->bit_error_rate);
+        if (efficiency > best) {
+            best = efficiency;
+            best_mru = candidate;
+        }
+        if (candidate == mru->max) {
+            break;
+        }
+    }
+
+    if (best_mru == mru->current || best * 100 <= current * (100 + mru->hysteresis_pct)) {
+        return false;
+    }
+
+    mru->current = best_mru;
+    mru->goodput_bps = mru->line_rate_bps * best;
+    mru->last_change_us = now_us;
+    mru->changes++;
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef __PPP_MRU_H_
+#define __PPP_MRU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ppp_link.h"
+
+typedef struct {
+    uint32_t frames;
+    uint32_t errors;
+    uint32_t bytes;
+} ppp_mru_bucket_t;
+
+/**
+ * Chooses the MRU that maximises goodput for the measured line quality.
+ *
+ * Received frames are accounted per size bucket. Every evaluation period a
+ * bit error rate is estimated from the buckets and the expected goodput of
+ * each candidate MRU is calculated. A new MRU is only chosen when it beats the
+ * current one by the configured hysteresis, and not more often than the hold
+ * time allows.
+ */
+typedef struct {
+    bool auto_tune;
+    uint16_t min;
+    uint16_t max;
+    uint16_t current;
+    uint32_t line_rate_bps;
+    int64_t hold_time_us;
+    int hysteresis_pct;
+    int64_t last_change_us;
+    int64_t last_eval_us;
+    float bit_error_rate;
+    uint32_t goodput_bps;
+    uint32_t changes;
+    ppp_mru_bucket_t window[PPP_LINK_FRAME_BUCKETS];
+} ppp_mru_t;
+
+void ppp_mru_init(ppp_mru_t *mru, const ppp_link_config_t *config, uint32_t line_rate_bps);
+
+int ppp_mru_bucket(size_t frame_len);
+
+void ppp_mru_account(ppp_mru_t *mru, size_t frame_len, bool fcs_ok);
+
+// Returns true when a new MRU has been chosen and should be announced to the peer.
+bool ppp_mru_poll(ppp_mru_t *mru, int64_t now_us);
+
+#endif /* __PPP_MRU_H_ */
@@ -0,0 +1,395 @@
+#include "ppp_napt.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_log.h"
+#include "esp_netif_net_stack.h"
+
+#include "lwip/def.h"
+#include "lwip/ip4.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/prot/icmp.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/prot/udp.h"
+#include "lwip/sys.h"
+#include "lwip/tcpip.h"
+
+#define PPP_NAPT_FLOWS CONFIG_PPP_NAPT_MAX_FLOWS
+#define PPP_NAPT_NONE 0xffff
+#define PPP_NAPT_TCP_TIMEOUT_MS (CONFIG_PPP_NAPT_TCP_TIMEOUT_S * 1000)
+#define PPP_NAPT_UDP_TIMEOUT_MS (CONFIG_PPP_NAPT_UDP_TIMEOUT_S * 1000)
+#define PPP_NAPT_CLOSED_TIMEOUT_MS (10 * 1000) // TCP after FIN or RST, and ICMP echo
+#define PPP_NAPT_SWEEP_INTERVAL_MS 1000
+
+_Static_assert((PPP_NAPT_FLOWS & (PPP_NAPT_FLOWS - 1)) == 0, "CONFIG_PPP_NAPT_MAX_FLOWS must be a power of two");
+_Static_assert(CONFIG_PPP_NAPT_PORT_BASE + PPP_NAPT_FLOWS <= 0xc000, "Translation ports must stay below the lwip local port range");
+
+static const char *TAG = "ppp_napt";
+
+// Addresses, ports and checksum differences are kept in network order, as they are found in the packet.
+typedef struct {
+    uint32_t inside_addr;
+    uint32_t remote_addr;
+    uint16_t inside_port; // ICMP echo identifier for ICMP
+    uint16_t remote_port; // 0 for ICMP
+    uint8_t proto;        // 0 while the slot is free
+    bool closing;         // TCP FIN or RST seen
+    uint16_t next;        // Next flow in the same hash bucket, or the next free slot
+    uint16_t ip_delta;    // Added to the ip header checksum on the way out
+    uint16_t l4_delta;    // Added to the TCP, UDP or ICMP checksum on the way out
+    uint32_t last_used_ms;
+} ppp_napt_flow_t;
+
+// Only the tcpip thread touches the table, the stats are read from anywhere without a lock.
+static struct {
+    struct netif *uplink;
+    uint32_t outside_addr; // Uplink address the table was built for
+    uint16_t last_out;     // Flow of the last packet out
+    uint16_t free_head;
+    uint32_t last_sweep_ms;
+    uint16_t buckets[PPP_NAPT_FLOWS];
+    ppp_napt_flow_t flows[PPP_NAPT_FLOWS];
+    ppp_napt_stats_t stats;
+} napt;
+
+// One's complement sum of the differences when old is replaced by new, see RFC 1624.
+static uint16_t ppp_napt_csum_delta(uint32_t old_addr, uint32_t new_addr, uint16_t old_port, uint16_t new_port)
+{
+    uint32_t sum = (uint16_t)~old_addr + (uint16_t)~(old_addr >> 16) + (new_addr & 0xffff) + (new_addr >> 16);
+
+    sum += (uint16_t)~old_port + new_port;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static inline uint16_t ppp_napt_csum_adjust(uint16_t csum, uint16_t delta)
+{
+    uint32_t sum = (uint16_t)~csum + (uint32_t)delta;
+
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static inline uint32_t ppp_napt_hash(uint8_t proto, uint32_t inside_addr, uint16_t inside_port, uint32_t remote_addr, uint16_t remote_port)
+{
+    uint32_t h = inside_addr ^ (remote_addr * 31) ^ (((uint32_t)inside_port << 16) | remote_port) ^ proto;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (PPP_NAPT_FLOWS - 1);
+}
+
+static uint32_t ppp_napt_timeout_ms(const ppp_napt_flow_t *flow)
+{
+    if (flow->proto == IP_PROTO_TCP) {
+        return flow->closing ? PPP_NAPT_CLOSED_TIMEOUT_MS : PPP_NAPT_TCP_TIMEOUT_MS;
+    }
+    return flow->proto == IP_PROTO_UDP ? PPP_NAPT_UDP_TIMEOUT_MS : PPP_NAPT_CLOSED_TIMEOUT_MS;
+}
+
+static void ppp_napt_flush(void)
+{
+    napt.free_head = 0;
+    napt.last_out = PPP_NAPT_NONE;
+    for (int i = 0; i < PPP_NAPT_FLOWS; i++) {
+        napt.buckets[i] = PPP_NAPT_NONE;
+        napt.flows[i].proto = 0;
+        napt.flows[i].next = i + 1 < PPP_NAPT_FLOWS ? i + 1 : PPP_NAPT_NONE;
+    }
+    napt.stats.flows_active = 0;
+}
+
+static void ppp_napt_unlink(uint16_t index)
+{
+    ppp_napt_flow_t *flow = &napt.flows[index];
+    uint16_t *link = &napt.buckets[ppp_napt_hash(flow->proto, flow->inside_addr, flow->inside_port, flow->remote_addr, flow->remote_port)];
+
+    while (*link != index) {
+        link = &napt.flows[*link].next;
+    }
+    *link = flow->next;
+}
+
+// Move every idle flow to the free list, at most once per PPP_NAPT_SWEEP_INTERVAL_MS so a full table costs little.
+static void ppp_napt_sweep(uint32_t now)
+{
+    if (now - napt.last_sweep_ms < PPP_NAPT_SWEEP_INTERVAL_MS) {
+        return;
+    }
+    napt.last_sweep_ms = now;
+    for (int i = 0; i < PPP_NAPT_FLOWS; i++) {
+        ppp_napt_flow_t *flow = &napt.flows[i];
+        if (flow->proto && now - flow->last_used_ms > ppp_napt_timeout_ms(flow)) {
+            ppp_napt_unlink(i);
+            flow->proto = 0;
+            flow->next = napt.free_head;
+            napt.free_head = i;
+            napt.stats.flows_active--;
+            napt.stats.flows_expired++;
+            if (napt.last_out == i) {
+                napt.last_out = PPP_NAPT_NONE;
+            }
+        }
+    }
+}
+
+static ppp_napt_flow_t *ppp_napt_find_out(uint8_t proto, uint32_t inside_addr, uint16_t inside_port, uint32_t remote_addr, uint16_t remote_port,
+                                          uint32_t now)
+{
+    ppp_napt_flow_t *flow;
+    uint16_t index = napt.last_out;
+
+#define PPP_NAPT_MATCH(f)                                                                                                                              \
+    ((f)->proto == proto && (f)->inside_addr == inside_addr && (f)->inside_port == inside_port && (f)->remote_addr == remote_addr &&                \
+     (f)->remote_port == remote_port)
+
+    if (index != PPP_NAPT_NONE && PPP_NAPT_MATCH(&napt.flows[index])) {
+        napt.stats.fast_path++;
+        return &napt.flows[index];
+    }
+
+    napt.stats.lookups++;
+    uint32_t bucket = ppp_napt_hash(proto, inside_addr, inside_port, remote_addr, remote_port);
+    for (index = napt.buckets[bucket]; index != PPP_NAPT_NONE; index = napt.flows[index].next) {
+        if (PPP_NAPT_MATCH(&napt.flows[index])) {
+            napt.last_out = index;
+            return &napt.flows[index];
+        }
+    }
+#undef PPP_NAPT_MATCH
+
+    if (napt.free_head == PPP_NAPT_NONE) {
+        ppp_napt_sweep(now);
+        if (napt.free_head == PPP_NAPT_NONE) {
+            napt.stats.table_full++;
+            return NULL;
+        }
+    }
+    index = napt.free_head;
+    flow = &napt.flows[index];
+    napt.free_head = flow->next;
+
+    uint16_t outside_port = lwip_htons(CONFIG_PPP_NAPT_PORT_BASE + index);
+    flow->proto = proto;
+    flow->closing = false;
+    flow->inside_addr = inside_addr;
+    flow->inside_port = inside_port;
+    flow->remote_addr = remote_addr;
+    flow->remote_port = remote_port;
+    flow->ip_delta = ppp_napt_csum_delta(inside_addr, napt.outside_addr, 0, 0);
+    // The ICMP checksum does not cover the pseudo header with the addresses
+    flow->l4_delta = ppp_napt_csum_delta(proto == IP_PROTO_ICMP ? 0 : inside_addr, proto == IP_PROTO_ICMP ? 0 : napt.outside_addr, inside_port, outside_port);
+    flow->next = napt.buckets[bucket];
+    napt.buckets[bucket] = index;
+    napt.last_out = index;
+
+    napt.stats.flows_created++;
+    napt.stats.flows_active++;
+    if (napt.stats.flows_active > napt.stats.flows_max) {
+        napt.stats.flows_max = napt.stats.flows_active;
+    }
+    return flow;
+}
+
+// Offset of the checksum in the transport header, ports or the echo identifier are found by the caller.
+static int ppp_napt_csum_offset(uint8_t proto)
+{
+    switch (proto) {
+    case IP_PROTO_TCP:
+        return offsetof(struct tcp_hdr, chksum);
+    case IP_PROTO_UDP:
+        return offsetof(struct udp_hdr, chksum);
+    default:
+        return offsetof(struct icmp_echo_hdr, chksum);
+    }
+}
+
+static void ppp_napt_rewrite_l4(uint8_t proto, uint8_t *l4, uint16_t delta)
+{
+    uint16_t *csum = (uint16_t *)(l4 + ppp_napt_csum_offset(proto));
+
+    // A zero UDP checksum means none was computed
+    if (proto == IP_PROTO_UDP && *csum == 0) {
+        return;
+    }
+    *csum = ppp_napt_csum_adjust(*csum, delta);
+    if (proto == IP_PROTO_UDP && *csum == 0) {
+        *csum = 0xffff;
+    }
+}
+
+static int ppp_napt_out(struct pbuf *p, struct ip_hdr *iphdr, uint8_t *l4)
+{
+    uint8_t proto = IPH_PROTO(iphdr);
+    uint16_t *ports = (uint16_t *)l4;
+    uint16_t *id = &((struct icmp_echo_hdr *)l4)->id;
+    uint32_t now = sys_now();
+    ppp_napt_flow_t *flow;
+
+    if (proto == IP_PROTO_ICMP) {
+        if (ICMPH_TYPE((struct icmp_echo_hdr *)l4) != ICMP_ECHO) {
+            napt.stats.dropped++;
+            pbuf_free(p);
+            return 1;
+        }
+        flow = ppp_napt_find_out(proto, iphdr->src.addr, *id, iphdr->dest.addr, 0, now);
+    } else {
+        flow = ppp_napt_find_out(proto, iphdr->src.addr, ports[0], iphdr->dest.addr, ports[1], now);
+    }
+    if (!flow) {
+        pbuf_free(p);
+        return 1;
+    }
+
+    uint16_t outside_port = lwip_htons(CONFIG_PPP_NAPT_PORT_BASE + (flow - napt.flows));
+    iphdr->src.addr = napt.outside_addr;
+    IPH_CHKSUM_SET(iphdr, ppp_napt_csum_adjust(IPH_CHKSUM(iphdr), flow->ip_delta));
+    if (proto == IP_PROTO_ICMP) {
+        *id = outside_port;
+    } else {
+        ports[0] = outside_port;
+        if (proto == IP_PROTO_TCP && (TCPH_FLAGS((struct tcp_hdr *)l4) & (TCP_FIN | TCP_RST))) {
+            flow->closing = true;
+        }
+    }
+    ppp_napt_rewrite_l4(proto, l4, flow->l4_delta);
+    flow->last_used_ms = now;
+
+    napt.stats.out_packets++;
+    napt.stats.out_bytes += lwip_ntohs(IPH_LEN(iphdr));
+    return 0;
+}
+
+static int ppp_napt_in(struct pbuf *p, struct ip_hdr *iphdr, uint8_t *l4)
+{
+    uint8_t proto = IPH_PROTO(iphdr);
+    uint16_t *ports = (uint16_t *)l4;
+    uint16_t *id = &((struct icmp_echo_hdr *)l4)->id;
+    uint16_t outside_port;
+    uint16_t remote_port = 0;
+
+    if (proto == IP_PROTO_ICMP) {
+        if (ICMPH_TYPE((struct icmp_echo_hdr *)l4) != ICMP_ER) {
+            return 0;
+        }
+        outside_port = *id;
+    } else {
+        outside_port = ports[1];
+        remote_port = ports[0];
+    }
+
+    // The port is the slot, no lookup needed
+    uint32_t index = (uint16_t)(lwip_ntohs(outside_port) - CONFIG_PPP_NAPT_PORT_BASE);
+    if (index >= PPP_NAPT_FLOWS) {
+        return 0;
+    }
+    ppp_napt_flow_t *flow = &napt.flows[index];
+    if (flow->proto != proto || flow->remote_addr != iphdr->src.addr || flow->remote_port != remote_port) {
+        napt.stats.in_unmatched++;
+        return 0;
+    }
+    napt.stats.fast_path++;
+
+    iphdr->dest.addr = flow->inside_addr;
+    IPH_CHKSUM_SET(iphdr, ppp_napt_csum_adjust(IPH_CHKSUM(iphdr), ~flow->ip_delta));
+    if (proto == IP_PROTO_ICMP) {
+        *id = flow->inside_port;
+    } else {
+        ports[1] = flow->inside_port;
+        if (proto == IP_PROTO_TCP && (TCPH_FLAGS((struct tcp_hdr *)l4) & (TCP_FIN | TCP_RST))) {
+            flow->closing = true;
+        }
+    }
+    ppp_napt_rewrite_l4(proto, l4, ~flow->l4_delta);
+    flow->last_used_ms = sys_now();
+
+    napt.stats.in_packets++;
+    napt.stats.in_bytes += lwip_ntohs(IPH_LEN(iphdr));
+    return 0;
+}
+
+int ppp_napt_input(struct pbuf *p, struct netif *inp)
+{
+    struct netif *uplink = napt.uplink;
+
+    if (!uplink || p->len < IP_HLEN) {
+        return 0;
+    }
+    // Called before lwip has checked the header, anything odd is left to lwip
+    struct ip_hdr *iphdr = (struct ip_hdr *)p->payload;
+    int hlen = IPH_HL_BYTES(iphdr);
+    uint8_t proto = IPH_PROTO(iphdr);
+    if (IPH_V(iphdr) != 4 || hlen < IP_HLEN || p->len < hlen + (proto == IP_PROTO_TCP ? TCP_HLEN : UDP_HLEN)) {
+        return 0;
+    }
+
+    uint32_t outside_addr = ip4_addr_get_u32(netif_ip4_addr(uplink));
+    if (outside_addr == 0) {
+        return 0;
+    }
+    if (outside_addr != napt.outside_addr) {
+        // New uplink address, every flow is gone
+        ESP_LOGI(TAG, "Uplink address changed, flushing %u flows", napt.stats.flows_active);
+        napt.outside_addr = outside_addr;
+        ppp_napt_flush();
+    }
+
+    bool translate = proto == IP_PROTO_TCP || proto == IP_PROTO_UDP || proto == IP_PROTO_ICMP;
+    bool fragment = (lwip_ntohs(IPH_OFFSET(iphdr)) & (IP_MF | IP_OFFMASK)) != 0;
+    if (inp == uplink) {
+        if (!translate || fragment || iphdr->dest.addr != outside_addr) {
+            return 0;
+        }
+        return ppp_napt_in(p, iphdr, (uint8_t *)p->payload + hlen);
+    }
+
+    // lwip names its ppp interfaces "pp"
+    if (inp->name[0] != 'p' || inp->name[1] != 'p') {
+        return 0;
+    }
+    ip4_addr_t dest = {.addr = iphdr->dest.addr};
+    if (dest.addr == outside_addr || ip4_addr_ismulticast(&dest) || ip4_addr_isbroadcast_u32(dest.addr, uplink) || ip4_route(&dest) != uplink) {
+        return 0;
+    }
+    if (!translate || fragment) {
+        napt.stats.dropped++;
+        pbuf_free(p);
+        return 1;
+    }
+    return ppp_napt_out(p, iphdr, (uint8_t *)p->payload + hlen);
+}
+
+static void ppp_napt_set_uplink(void *ctx)
+{
+    napt.uplink = ctx;
+    napt.outside_addr = 0;
+    ppp_napt_flush();
+}
+
+esp_err_t ppp_napt_enable(esp_netif_t *uplink)
+{
+    struct netif *netif = uplink ? esp_netif_get_netif_impl(uplink) : NULL;
+
+    if (!netif) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return tcpip_callback(ppp_napt_set_uplink, netif) == ERR_OK ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t ppp_napt_disable(void)
+{
+    return tcpip_callback(ppp_napt_set_uplink, NULL) == ERR_OK ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t ppp_napt_get_stats(ppp_napt_stats_t *stats)
+{
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *stats = napt.stats;
+    return napt.uplink ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
@@ -0,0 +1,56 @@
+#ifndef __PPP_NAPT_H_
+#define __PPP_NAPT_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_netif.h"
+
+struct pbuf;
+struct netif;
+
+/**
+ * Address and port translation from ppp clients to one uplink interface,
+ * usually the wifi station.
+ *
+ * Runs as the lwip ip4 input hook, see esp-idf-ppp_server.patch. Packets
+ * from a ppp netif that lwip will forward out of the uplink get the uplink
+ * address and a port of their own, replies to that port get the client
+ * address back and are forwarded to the client by lwip.
+ *
+ * Flows live in a table of CONFIG_PPP_NAPT_MAX_FLOWS entries. The outside
+ * port of a flow is CONFIG_PPP_NAPT_PORT_BASE plus its slot, so replies find
+ * their flow without a lookup, and the last outbound flow is checked before
+ * the hash table. Checksums are adjusted with a difference worked out once
+ * per flow, so an established flow costs a compare and a few additions per
+ * packet. Only TCP, UDP and ICMP echo are translated, anything else from a
+ * client towards the uplink is dropped rather than leak a private address.
+ */
+
+typedef struct {
+    uint32_t out_packets; // Client to uplink
+    uint32_t out_bytes;
+    uint32_t in_packets; // Uplink to client
+    uint32_t in_bytes;
+    uint32_t fast_path; // Packets of the last used flow or replies, found without the hash table
+    uint32_t lookups;   // Packets that needed the hash table
+    uint32_t flows_created;
+    uint32_t flows_expired; // Idle flows reclaimed for new ones
+    uint32_t flows_active;
+    uint32_t flows_max;
+    uint32_t table_full;   // New flows dropped because no flow had expired
+    uint32_t in_unmatched; // Packets to a translation port without a flow, left to lwip
+    uint32_t dropped;      // Fragments and protocols that can not be translated
+} ppp_napt_stats_t;
+
+// Translate traffic from all ppp links out of uplink, which may be replaced at any time. Clears the flow table.
+esp_err_t ppp_napt_enable(esp_netif_t *uplink);
+
+esp_err_t ppp_napt_disable(void);
+
+esp_err_t ppp_napt_get_stats(ppp_napt_stats_t *stats);
+
+// lwip ip4 input hook, returns 1 when the packet was dropped.
+int ppp_napt_input(struct pbuf *p, struct netif *inp);
+
+#endif /* __PPP_NAPT_H_ */
@@ -0,0 +1,61 @@
+#include "ppp_pool.h"
+
+static inline ppp_pool_buffer_t *ppp_pool_buffer(ppp_pool_t *pool, int index)
+{
+    return (ppp_pool_buffer_t *)(pool->memory + index * pool->buffer_size);
+}
+
+static void ppp_pool_free(struct pbuf *p)
+{
+    ppp_pool_buffer_t *buffer = (ppp_pool_buffer_t *)p;
+    ppp_pool_t *pool = buffer->pool;
+    int index = ((uint8_t *)buffer - pool->memory) / pool->buffer_size;
+
+    portENTER_CRITICAL(&pool->lock);
+    buffer->next_free = pool->free_head;
+    pool->free_head = index;
+    pool->free_count++;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+void ppp_pool_init(ppp_pool_t *pool, uint8_t *memory, int count, size_t payload_size)
+{
+    pool->buffer_size = PPP_POOL_BUFFER_SIZE(payload_size);
+    pool->payload_size = payload_size;
+    pool->memory = memory;
+    pool->count = count;
+    pool->free_head = -1;
+    pool->free_count = 0;
+    portMUX_INITIALIZE(&pool->lock);
+    for (int i = count - 1; i >= 0; i--) {
+        ppp_pool_buffer_t *buffer = ppp_pool_buffer(pool, i);
+        buffer->pool = pool;
+        buffer->pbuf.custom_free_function = ppp_pool_free;
+        ppp_pool_free(&buffer->pbuf.pbuf);
+    }
+    pool->min_free = count;
+}
+
+struct pbuf *ppp_pool_alloc(ppp_pool_t *pool, size_t len)
+{
+    ppp_pool_buffer_t *buffer = NULL;
+
+    if (len > pool->payload_size) {
+        return NULL;
+    }
+    portENTER_CRITICAL(&pool->lock);
+    if (pool->free_head >= 0) {
+        buffer = ppp_pool_buffer(pool, pool->free_head);
+        pool->free_head = buffer->next_free;
+        pool->free_count--;
+        if (pool->free_count < pool->min_free) {
+            pool->min_free = pool->free_count;
+        }
+    }
+    portEXIT_CRITICAL(&pool->lock);
+
+    if (!buffer) {
+        return NULL;
+    }
+    return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &buffer->pbuf, buffer->payload, pool->payload_size);
+}
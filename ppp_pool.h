@@ -0,0 +1,43 @@
+#ifndef __PPP_POOL_H_
+#define __PPP_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "lwip/pbuf.h"
+
+/**
+ * Fixed set of frame sized receive buffers, allocated once and lent to the
+ * ip stack as custom pbufs. Whoever frees the pbuf, the tcpip thread or an
+ * application task reading a socket, puts the buffer back on the free list,
+ * so received frames never touch the heap while the pool lasts.
+ */
+typedef struct ppp_pool_s {
+    uint8_t *memory;
+    size_t buffer_size; // Bytes per buffer, pbuf header included
+    size_t payload_size;
+    int count;
+    int free_head; // Index of the first free buffer, -1 when empty
+    int free_count;
+    int min_free;
+    portMUX_TYPE lock; // Buffers are freed from any task
+} ppp_pool_t;
+
+typedef struct {
+    struct pbuf_custom pbuf; // Must be first, lwip hands this back on free
+    ppp_pool_t *pool;
+    int next_free;
+    uint8_t payload[];
+} ppp_pool_buffer_t;
+
+// Bytes per buffer, every buffer stays word aligned as lwip expects for payloads
+#define PPP_POOL_BUFFER_SIZE(payload_size) ((sizeof(ppp_pool_buffer_t) + (payload_size) + 3) & ~3)
+
+// Memory must be word aligned and hold count * PPP_POOL_BUFFER_SIZE(payload_size) bytes.
+void ppp_pool_init(ppp_pool_t *pool, uint8_t *memory, int count, size_t payload_size);
+
+// A pbuf of len bytes backed by a pool buffer, or NULL when the pool is empty or len too large.
+struct pbuf *ppp_pool_alloc(ppp_pool_t *pool, size_t len);
+
+#endif /* __PPP_POOL_H_ */
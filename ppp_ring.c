@@ -0,0 +1,134 @@
+#include "ppp_ring.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/param.h>
+
+void ppp_frame_ring_init(ppp_frame_ring_t *ring, uint8_t *buffer, uint16_t *lens, size_t slots, size_t slot_size)
+{
+    assert(slots > 0 && (slots & (slots - 1)) == 0);
+    ring->buffer = buffer;
+    ring->lens = lens;
+    ring->slot_size = slot_size;
+    ring->mask = slots - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+uint8_t *ppp_frame_ring_reserve(ppp_frame_ring_t *ring)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask) {
+        return NULL;
+    }
+    return ring->buffer + (head & ring->mask) * ring->slot_size;
+}
+
+void ppp_frame_ring_commit(ppp_frame_ring_t *ring, size_t len)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->lens[head & ring->mask] = len;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+uint8_t *ppp_frame_ring_peek(ppp_frame_ring_t *ring, size_t *len)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+    *len = ring->lens[tail & ring->mask];
+    return ring->buffer + (tail & ring->mask) * ring->slot_size;
+}
+
+void ppp_frame_ring_release(ppp_frame_ring_t *ring)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+size_t ppp_frame_ring_count(ppp_frame_ring_t *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+void ppp_byte_ring_init(ppp_byte_ring_t *ring, uint8_t *buffer, size_t size)
+{
+    assert(size > 0 && (size & (size - 1)) == 0);
+    ring->buffer = buffer;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+size_t PPP_ISR_ATTR ppp_byte_ring_free(ppp_byte_ring_t *ring)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    return ring->mask + 1 - (head - tail);
+}
+
+PPP_ISR_ATTR uint8_t *ppp_byte_ring_write_ptr(ppp_byte_ring_t *ring, size_t *len)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t offset = head & ring->mask;
+
+    *len = MIN(ppp_byte_ring_free(ring), ring->mask + 1 - offset);
+    return ring->buffer + offset;
+}
+
+void PPP_ISR_ATTR ppp_byte_ring_produce(ppp_byte_ring_t *ring, size_t len)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+size_t ppp_byte_ring_write(ppp_byte_ring_t *ring, const uint8_t *data, size_t len)
+{
+    size_t written = 0;
+
+    // At most two rounds, up to the end of the buffer and from its start
+    while (written < len) {
+        size_t space;
+        uint8_t *out = ppp_byte_ring_write_ptr(ring, &space);
+        if (space == 0) {
+            break;
+        }
+        space = MIN(space, len - written);
+        memcpy(out, data + written, space);
+        ppp_byte_ring_produce(ring, space);
+        written += space;
+    }
+    return written;
+}
+
+size_t PPP_ISR_ATTR ppp_byte_ring_count(ppp_byte_ring_t *ring)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return head - tail;
+}
+
+PPP_ISR_ATTR const uint8_t *ppp_byte_ring_read_ptr(ppp_byte_ring_t *ring, size_t *len)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t offset = tail & ring->mask;
+
+    *len = MIN(ppp_byte_ring_count(ring), ring->mask + 1 - offset);
+    return ring->buffer + offset;
+}
+
+void PPP_ISR_ATTR ppp_byte_ring_consume(ppp_byte_ring_t *ring, size_t len)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
@@ -0,0 +1,97 @@
+#ifndef __PPP_RING_H_
+#define __PPP_RING_H_
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#include "sdkconfig.h"
+#endif
+
+// Functions the uart interrupt calls, kept in IRAM with the fast path whatever the archive of the component is named
+#ifdef CONFIG_PPP_LINK_FAST_PATH_IN_IRAM
+#define PPP_ISR_ATTR IRAM_ATTR
+#else
+#define PPP_ISR_ATTR
+#endif
+
+/**
+ * Lock free ring of frames between exactly one producer and one consumer,
+ * which may run on different cores.
+ *
+ * The producer fills the slot returned by ppp_frame_ring_reserve() and makes
+ * it visible with ppp_frame_ring_commit(), the consumer reads the oldest slot
+ * with ppp_frame_ring_peek() and hands it back with ppp_frame_ring_release().
+ * Head is only written by the producer and tail only by the consumer, the
+ * release/acquire pair on them orders the slot contents.
+ */
+typedef struct {
+    uint8_t *buffer; // slots * slot_size bytes
+    uint16_t *lens;
+    size_t slot_size;
+    uint32_t mask; // slots - 1, slots is a power of two
+    atomic_uint head;
+    atomic_uint tail;
+} ppp_frame_ring_t;
+
+// Slots must be a power of two, buffer holds slots * slot_size bytes and lens slots entries.
+void ppp_frame_ring_init(ppp_frame_ring_t *ring, uint8_t *buffer, uint16_t *lens, size_t slots, size_t slot_size);
+
+// Producer: free slot of slot_size bytes, or NULL when the ring is full.
+uint8_t *ppp_frame_ring_reserve(ppp_frame_ring_t *ring);
+
+// Producer: publish the reserved slot holding len bytes.
+void ppp_frame_ring_commit(ppp_frame_ring_t *ring, size_t len);
+
+// Consumer: oldest frame, or NULL when the ring is empty.
+uint8_t *ppp_frame_ring_peek(ppp_frame_ring_t *ring, size_t *len);
+
+// Consumer: done with the frame returned by ppp_frame_ring_peek().
+void ppp_frame_ring_release(ppp_frame_ring_t *ring);
+
+// Frames waiting, only exact when called from the producer or the consumer.
+size_t ppp_frame_ring_count(ppp_frame_ring_t *ring);
+
+// Keeps the producer and consumer index on separate cache lines, where memory is cached at all.
+#define PPP_RING_CACHE_LINE 64
+
+/**
+ * Lock free ring of bytes between one producer and one consumer, one side
+ * may be an interrupt handler. Both sides get direct access to the
+ * contiguous part of the ring, so the uart FIFO is read straight into it and
+ * the decoder works on the ring without another copy.
+ */
+typedef struct {
+    uint8_t *buffer;
+    uint32_t mask; // size - 1, size is a power of two
+    alignas(PPP_RING_CACHE_LINE) atomic_uint head; // Written by the producer
+    alignas(PPP_RING_CACHE_LINE) atomic_uint tail; // Written by the consumer
+} ppp_byte_ring_t;
+
+// Size must be a power of two.
+void ppp_byte_ring_init(ppp_byte_ring_t *ring, uint8_t *buffer, size_t size);
+
+// Producer: free bytes.
+size_t ppp_byte_ring_free(ppp_byte_ring_t *ring);
+
+// Producer: copy up to len bytes in, returns the number copied.
+size_t ppp_byte_ring_write(ppp_byte_ring_t *ring, const uint8_t *data, size_t len);
+
+// Producer: contiguous free space at the head, fill it and call ppp_byte_ring_produce().
+uint8_t *ppp_byte_ring_write_ptr(ppp_byte_ring_t *ring, size_t *len);
+
+void ppp_byte_ring_produce(ppp_byte_ring_t *ring, size_t len);
+
+// Consumer: bytes waiting.
+size_t ppp_byte_ring_count(ppp_byte_ring_t *ring);
+
+// Consumer: contiguous data at the tail, hand it back with ppp_byte_ring_consume().
+const uint8_t *ppp_byte_ring_read_ptr(ppp_byte_ring_t *ring, size_t *len);
+
+void ppp_byte_ring_consume(ppp_byte_ring_t *ring, size_t len);
+
+#endif /* __PPP_RING_H_ */
@@ -0,0 +1,204 @@
+#include "ppp_rohc.h"
+#include <string.h>
+
+#define ROHC_IP_HEADER_LEN 20
+#define ROHC_IP_PROTO_UDP 17
+
+// Offsets in the IPv4 and UDP header
+#define ROHC_TOS 1
+#define ROHC_TOTAL_LEN 2
+#define ROHC_ID 4
+#define ROHC_FRAG 6
+#define ROHC_TTL 8
+#define ROHC_PROTO 9
+#define ROHC_IP_CHECKSUM 10
+#define ROHC_ADDRS 12 // Addresses and ports, 12 bytes that identify the flow
+#define ROHC_UDP_LEN 24
+#define ROHC_UDP_CHECKSUM 26
+
+enum { ROHC_TYPE_IR = 1, ROHC_TYPE_CO_ID8, ROHC_TYPE_CO_ID16 };
+
+// Identification changes up to this much are sent as the low byte, the rest of the byte covers lost packets
+#define ROHC_ID8_MAX_DELTA 127
+
+static inline uint16_t get_u16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+// CRC-8 of RFC 3095 section 5.9.1, polynomial x^8 + x^2 + x + 1, one nibble at a time
+static uint8_t rohc_crc8(const uint8_t *data, size_t len)
+{
+    static const uint8_t table[16] = {0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d};
+    uint8_t crc = 0xff;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        crc = (crc << 4) ^ table[crc >> 4];
+        crc = (crc << 4) ^ table[crc >> 4];
+    }
+    return crc;
+}
+
+static uint16_t rohc_ip_checksum(const uint8_t *header)
+{
+    uint32_t sum = 0;
+
+    for (int i = 0; i < ROHC_IP_HEADER_LEN; i += 2) {
+        if (i != ROHC_IP_CHECKSUM) {
+            sum += get_u16(&header[i]);
+        }
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+// Fields that stay the same for the whole flow, apart from addresses and ports
+static bool rohc_same_dynamic(const uint8_t *a, const uint8_t *b)
+{
+    return a[ROHC_TOS] == b[ROHC_TOS] && a[ROHC_FRAG] == b[ROHC_FRAG] && a[ROHC_TTL] == b[ROHC_TTL];
+}
+
+void ppp_rohc_init(ppp_rohc_t *rohc, int contexts)
+{
+    memset(rohc, 0, sizeof(*rohc));
+    rohc->contexts = contexts < 1 ? 1 : contexts > PPP_ROHC_MAX_CONTEXTS ? PPP_ROHC_MAX_CONTEXTS : contexts;
+}
+
+void ppp_rohc_reset_tx(ppp_rohc_t *rohc)
+{
+    for (int i = 0; i < PPP_ROHC_MAX_CONTEXTS; i++) {
+        rohc->tx[i].valid = false;
+    }
+}
+
+size_t ppp_rohc_compress(ppp_rohc_t *rohc, const uint8_t *header, size_t header_len, size_t packet_len, uint8_t *out, size_t *consumed)
+{
+    // IPv4 without options, UDP, not a fragment, lengths that agree with the packet
+    if (header_len < PPP_ROHC_HEADER_LEN || header[0] != 0x45 || header[ROHC_PROTO] != ROHC_IP_PROTO_UDP || (get_u16(&header[ROHC_FRAG]) & 0x3fff) != 0 ||
+        get_u16(&header[ROHC_TOTAL_LEN]) != packet_len || get_u16(&header[ROHC_UDP_LEN]) != packet_len - ROHC_IP_HEADER_LEN) {
+        return 0;
+    }
+
+    int cid = -1;
+    int lru = 0;
+    for (int i = 0; i < rohc->contexts; i++) {
+        ppp_rohc_tx_context_t *ctx = &rohc->tx[i];
+        if (ctx->valid && memcmp(&ctx->header[ROHC_ADDRS], &header[ROHC_ADDRS], 12) == 0) {
+            cid = i;
+            break;
+        }
+        if (!ctx->valid || (rohc->tx[lru].valid && (int32_t)(ctx->last_used - rohc->tx[lru].last_used) < 0)) {
+            lru = i;
+        }
+    }
+    if (cid < 0) {
+        cid = lru;
+        if (rohc->tx[cid].valid) {
+            rohc->stats.tx_evictions++;
+        }
+        rohc->tx[cid].valid = false;
+    }
+
+    ppp_rohc_tx_context_t *ctx = &rohc->tx[cid];
+    ctx->last_used = ++rohc->clock;
+    bool ir = !ctx->valid || ctx->irs < PPP_ROHC_IR_REPEAT || ctx->since_ir >= PPP_ROHC_IR_REFRESH || !rohc_same_dynamic(ctx->header, header);
+    size_t len;
+    if (ir) {
+        if (!ctx->valid || !rohc_same_dynamic(ctx->header, header)) {
+            ctx->irs = 0;
+        }
+        out[0] = (ROHC_TYPE_IR << 4) | cid;
+        memcpy(&out[1], header, PPP_ROHC_HEADER_LEN);
+        len = 1 + PPP_ROHC_HEADER_LEN;
+        ctx->irs += ctx->irs < PPP_ROHC_IR_REPEAT;
+        ctx->since_ir = 0;
+        ctx->valid = true;
+        rohc->stats.tx_ir++;
+    } else {
+        uint16_t id = get_u16(&header[ROHC_ID]);
+        uint16_t delta = id - get_u16(&ctx->header[ROHC_ID]);
+        if (delta >= 1 && delta <= ROHC_ID8_MAX_DELTA) {
+            out[0] = (ROHC_TYPE_CO_ID8 << 4) | cid;
+            out[1] = id;
+            len = 2;
+        } else {
+            out[0] = (ROHC_TYPE_CO_ID16 << 4) | cid;
+            put_u16(&out[1], id);
+            len = 3;
+        }
+        out[len++] = rohc_crc8(header, PPP_ROHC_HEADER_LEN);
+        memcpy(&out[len], &header[ROHC_UDP_CHECKSUM], 2);
+        len += 2;
+        ctx->since_ir++;
+        rohc->stats.tx_saved_bytes += PPP_ROHC_HEADER_LEN - len;
+    }
+    memcpy(ctx->header, header, PPP_ROHC_HEADER_LEN);
+    rohc->stats.tx_packets++;
+    *consumed = PPP_ROHC_HEADER_LEN;
+    return len;
+}
+
+size_t ppp_rohc_decompress(ppp_rohc_t *rohc, const uint8_t *data, size_t len, uint8_t *out, size_t *consumed)
+{
+    if (len < 1) {
+        rohc->stats.rx_errors++;
+        return 0;
+    }
+    int type = data[0] >> 4;
+    ppp_rohc_rx_context_t *ctx = &rohc->rx[data[0] & 0x0f];
+
+    if (type == ROHC_TYPE_IR) {
+        if (len < 1 + PPP_ROHC_HEADER_LEN || data[1] != 0x45 || data[1 + ROHC_PROTO] != ROHC_IP_PROTO_UDP) {
+            rohc->stats.rx_errors++;
+            return 0;
+        }
+        memcpy(ctx->header, &data[1], PPP_ROHC_HEADER_LEN);
+        ctx->valid = true;
+        memcpy(out, ctx->header, PPP_ROHC_HEADER_LEN);
+        rohc->stats.rx_packets++;
+        *consumed = 1 + PPP_ROHC_HEADER_LEN;
+        return PPP_ROHC_HEADER_LEN;
+    }
+
+    size_t need = type == ROHC_TYPE_CO_ID8 ? 5 : 6;
+    if ((type != ROHC_TYPE_CO_ID8 && type != ROHC_TYPE_CO_ID16) || len < need || !ctx->valid || len - need > 0xffff - PPP_ROHC_HEADER_LEN) {
+        rohc->stats.rx_errors++;
+        return 0;
+    }
+    const uint8_t *p = &data[1];
+    uint16_t ref = get_u16(&ctx->header[ROHC_ID]);
+    uint16_t id;
+    if (type == ROHC_TYPE_CO_ID8) {
+        // The next identification with this low byte, packets lost in between move it further
+        id = ref + (uint8_t)(*p++ - ref);
+    } else {
+        id = get_u16(p);
+        p += 2;
+    }
+    uint8_t crc = *p++;
+    size_t payload_len = len - need;
+
+    memcpy(out, ctx->header, PPP_ROHC_HEADER_LEN);
+    put_u16(&out[ROHC_ID], id);
+    put_u16(&out[ROHC_TOTAL_LEN], PPP_ROHC_HEADER_LEN + payload_len);
+    put_u16(&out[ROHC_UDP_LEN], PPP_ROHC_HEADER_LEN - ROHC_IP_HEADER_LEN + payload_len);
+    put_u16(&out[ROHC_IP_CHECKSUM], rohc_ip_checksum(out));
+    memcpy(&out[ROHC_UDP_CHECKSUM], p, 2);
+    if (rohc_crc8(out, PPP_ROHC_HEADER_LEN) != crc) {
+        rohc->stats.rx_errors++;
+        return 0;
+    }
+    memcpy(ctx->header, out, PPP_ROHC_HEADER_LEN);
+    rohc->stats.rx_packets++;
+    *consumed = need;
+    return PPP_ROHC_HEADER_LEN;
+}
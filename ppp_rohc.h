@@ -0,0 +1,95 @@
+#ifndef __PPP_ROHC_H_
+#define __PPP_ROHC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compression of IPv4 and UDP headers between two ppp_link peers, after the
+ * UDP profile of ROHC (RFC 3095) in unidirectional mode.
+ *
+ * The sender keeps a context per flow, identified by addresses and ports, in
+ * a table of at most PPP_ROHC_MAX_CONTEXTS entries, the least recently used
+ * flow gives up its context to a new one. The first packets of a flow, and
+ * every PPP_ROHC_IR_REFRESH-th after that, carry the full header (IR) to set
+ * up the context on the other end. Packets in between (CO) carry the context
+ * id, the IP identification or its low byte, the UDP checksum and a CRC over
+ * the header they stand for, 5 bytes instead of 28. Lengths follow from the
+ * frame and the IP checksum is computed again. A CO packet whose context was
+ * lost or is out of date fails the CRC and is dropped, the next IR repairs
+ * the context.
+ *
+ *   IR  u8 0x10 | cid, the 28 header bytes
+ *   CO  u8 0x20 | cid, u8 identification low byte, u8 crc, u16 checksum
+ *       u8 0x30 | cid, u16 identification, u8 crc, u16 checksum
+ *
+ * Packets with IP options or fragments are not compressed.
+ */
+
+#define PPP_ROHC_MAX_CONTEXTS 16
+#define PPP_ROHC_HEADER_LEN 28 // IPv4 without options and UDP
+#define PPP_ROHC_MAX_COMPRESSED (1 + PPP_ROHC_HEADER_LEN)
+#define PPP_ROHC_IR_REPEAT 2   // Full headers sent when a context is set up
+#define PPP_ROHC_IR_REFRESH 64 // Compressed packets between two full headers
+
+typedef struct {
+    uint8_t header[PPP_ROHC_HEADER_LEN]; // Last header sent in the flow
+    uint32_t last_used;
+    uint8_t irs;       // Full headers sent since the context was set up
+    uint8_t since_ir;  // Compressed packets since the last full header
+    bool valid;
+} ppp_rohc_tx_context_t;
+
+typedef struct {
+    uint8_t header[PPP_ROHC_HEADER_LEN]; // Last header rebuilt in the flow
+    bool valid;
+} ppp_rohc_rx_context_t;
+
+typedef struct {
+    uint32_t tx_packets;     // Compressed or full headers sent with a context id
+    uint32_t tx_ir;          // Packets that carried the full header
+    uint32_t tx_evictions;   // Flows that took over the context of another one
+    uint32_t tx_saved_bytes; // Header bytes not sent, full headers cost one byte more and are not counted
+    uint32_t rx_packets;
+    uint32_t rx_errors;      // Unknown context or CRC mismatch, the packet is dropped
+} ppp_rohc_stats_t;
+
+typedef struct {
+    // Compressor
+    ppp_rohc_tx_context_t tx[PPP_ROHC_MAX_CONTEXTS];
+    int contexts; // Contexts the compressor uses, at most PPP_ROHC_MAX_CONTEXTS
+    uint32_t clock;
+
+    // Decompressor, takes every context id the peer may use
+    ppp_rohc_rx_context_t rx[PPP_ROHC_MAX_CONTEXTS];
+
+    ppp_rohc_stats_t stats;
+} ppp_rohc_t;
+
+void ppp_rohc_init(ppp_rohc_t *rohc, int contexts);
+
+// Forget the flows sent so far, the next packet of each flow carries its full header again.
+void ppp_rohc_reset_tx(ppp_rohc_t *rohc);
+
+/**
+ * Compress the headers of an IPv4 packet of packet_len bytes, header holds its
+ * first header_len bytes (at least PPP_ROHC_HEADER_LEN or the whole packet).
+ *
+ * Writes the compressed header to out, which must hold PPP_ROHC_MAX_COMPRESSED
+ * bytes, and returns its length. consumed is set to the number of packet bytes
+ * it replaces, the rest of the packet follows unchanged. Returns 0 for packets
+ * that are not UDP or not compressible.
+ */
+size_t ppp_rohc_compress(ppp_rohc_t *rohc, const uint8_t *header, size_t header_len, size_t packet_len, uint8_t *out, size_t *consumed);
+
+/**
+ * Rebuild the headers from the len bytes following the protocol field of a
+ * compressed frame. Writes them to out, which must hold PPP_ROHC_HEADER_LEN
+ * bytes, and returns their length. consumed is set to the number of compressed
+ * bytes, the rest of the frame is payload. Returns 0 when the packet has to be
+ * dropped.
+ */
+size_t ppp_rohc_decompress(ppp_rohc_t *rohc, const uint8_t *data, size_t len, uint8_t *out, size_t *consumed);
+
+#endif /* __PPP_ROHC_H_ */
@@ -0,0 +1,198 @@
+/* Host stress test of the single producer, single consumer rings
+
+   One thread produces and one consumes, on different cores where the host has
+   them. Every byte and frame carries its position in the stream, so a slot read
+   before its contents were published, a lost or a repeated frame shows up as a
+   mismatch. Small rings make both sides wrap and meet the full and empty
+   conditions all the time.
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ppp_ring.h"
+
+#define FRAME_SLOTS 4
+#define FRAME_SLOT_SIZE 64
+#define FRAMES 1000000
+
+#define BYTE_RING_SIZE 64
+#define BYTES 20000000u
+
+static int failures;
+
+#define CHECK(cond, ...)                 \
+    do {                                 \
+        if (!(cond)) {                   \
+            printf("FAIL: " __VA_ARGS__); \
+            printf("\n");                \
+            failures++;                  \
+            return NULL;                 \
+        }                                \
+    } while (0)
+
+// Cheap generator both threads step the same way, the lengths and chunk sizes vary
+static uint32_t next_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static uint8_t frame_byte(uint32_t frame, size_t i)
+{
+    return (uint8_t)(frame * 31u + i);
+}
+
+static ppp_frame_ring_t frame_ring;
+static uint8_t frame_buffer[FRAME_SLOTS * FRAME_SLOT_SIZE];
+static uint16_t frame_lens[FRAME_SLOTS];
+
+static void *frame_producer(void *arg)
+{
+    (void)arg;
+    uint32_t random = 1;
+
+    for (uint32_t frame = 0; frame < FRAMES; frame++) {
+        size_t len = 4 + next_random(&random) % (FRAME_SLOT_SIZE - 4);
+        uint8_t *slot;
+        while ((slot = ppp_frame_ring_reserve(&frame_ring)) == NULL) {
+            sched_yield();
+        }
+        memcpy(slot, &frame, sizeof(frame));
+        for (size_t i = sizeof(frame); i < len; i++) {
+            slot[i] = frame_byte(frame, i);
+        }
+        ppp_frame_ring_commit(&frame_ring, len);
+    }
+    return NULL;
+}
+
+static void *frame_consumer(void *arg)
+{
+    (void)arg;
+    uint32_t random = 1;
+
+    for (uint32_t frame = 0; frame < FRAMES; frame++) {
+        size_t expected = 4 + next_random(&random) % (FRAME_SLOT_SIZE - 4);
+        size_t len;
+        uint8_t *slot;
+        while ((slot = ppp_frame_ring_peek(&frame_ring, &len)) == NULL) {
+            sched_yield();
+        }
+        uint32_t seq;
+        memcpy(&seq, slot, sizeof(seq));
+        CHECK(seq == frame, "frame %u read as %u", frame, seq);
+        CHECK(len == expected, "frame %u is %zu bytes, not %zu", frame, len, expected);
+        for (size_t i = sizeof(seq); i < len; i++) {
+            CHECK(slot[i] == frame_byte(frame, i), "frame %u byte %zu", frame, i);
+        }
+        CHECK(ppp_frame_ring_count(&frame_ring) <= FRAME_SLOTS, "frame ring holds more than its slots");
+        ppp_frame_ring_release(&frame_ring);
+    }
+    CHECK(ppp_frame_ring_peek(&frame_ring, &(size_t){0}) == NULL, "frames left over");
+    return NULL;
+}
+
+static ppp_byte_ring_t byte_ring;
+static uint8_t byte_buffer[BYTE_RING_SIZE];
+
+static void *byte_producer(void *arg)
+{
+    (void)arg;
+    uint32_t random = 2;
+    uint32_t pos = 0;
+    uint8_t chunk[BYTE_RING_SIZE];
+
+    while (pos < BYTES) {
+        size_t want = 1 + next_random(&random) % BYTE_RING_SIZE;
+        if (want > BYTES - pos) {
+            want = BYTES - pos;
+        }
+        // Alternate between copying in and filling the contiguous space in place, as the uart interrupt does
+        if (want & 1) {
+            for (size_t i = 0; i < want; i++) {
+                chunk[i] = (uint8_t)(pos + i);
+            }
+            size_t done = 0;
+            while (done < want) {
+                size_t written = ppp_byte_ring_write(&byte_ring, chunk + done, want - done);
+                if (written == 0) {
+                    sched_yield();
+                }
+                done += written;
+            }
+            pos += want;
+        } else {
+            size_t space;
+            uint8_t *out;
+            while ((out = ppp_byte_ring_write_ptr(&byte_ring, &space)), space == 0) {
+                sched_yield();
+            }
+            if (space > want) {
+                space = want;
+            }
+            for (size_t i = 0; i < space; i++) {
+                out[i] = (uint8_t)(pos + i);
+            }
+            ppp_byte_ring_produce(&byte_ring, space);
+            pos += space;
+        }
+    }
+    return NULL;
+}
+
+static void *byte_consumer(void *arg)
+{
+    (void)arg;
+    uint32_t random = 3;
+    uint32_t pos = 0;
+
+    while (pos < BYTES) {
+        size_t want = 1 + next_random(&random) % BYTE_RING_SIZE;
+        size_t len;
+        const uint8_t *in;
+        while ((in = ppp_byte_ring_read_ptr(&byte_ring, &len)), len == 0) {
+            sched_yield();
+        }
+        CHECK(ppp_byte_ring_count(&byte_ring) <= BYTE_RING_SIZE, "byte ring holds more than its size");
+        if (len > want) {
+            len = want;
+        }
+        for (size_t i = 0; i < len; i++) {
+            CHECK(in[i] == (uint8_t)(pos + i), "byte %u read as %u", pos + (uint32_t)i, in[i]);
+        }
+        ppp_byte_ring_consume(&byte_ring, len);
+        pos += len;
+    }
+    CHECK(ppp_byte_ring_count(&byte_ring) == 0, "bytes left over");
+    return NULL;
+}
+
+static void run(const char *name, void *(*producer)(void *), void *(*consumer)(void *))
+{
+    pthread_t threads[2];
+    int before = failures;
+
+    pthread_create(&threads[0], NULL, producer, NULL);
+    pthread_create(&threads[1], NULL, consumer, NULL);
+    pthread_join(threads[1], NULL);
+    if (failures != before) {
+        // The producer may wait for space forever once the consumer gave up
+        pthread_cancel(threads[0]);
+    }
+    pthread_join(threads[0], NULL);
+    printf("%s: %s\n", name, failures == before ? "ok" : "FAILED");
+}
+
+int main(void)
+{
+    ppp_frame_ring_init(&frame_ring, frame_buffer, frame_lens, FRAME_SLOTS, FRAME_SLOT_SIZE);
+    run("frame ring", frame_producer, frame_consumer);
+
+    ppp_byte_ring_init(&byte_ring, byte_buffer, sizeof(byte_buffer));
+    run("byte ring", byte_producer, byte_consumer);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}